@@ -38,6 +38,7 @@
 #include "Loader.h"
 #include "GLTFLoader.h"
 #include "Renderer.h"
+#include "Benchmark.h"
 #include "boyTestScene.h"
 #include "ajaxTestScene.h"
 #include "cornellTestScene.h"
@@ -209,6 +210,10 @@ void Update(float secondsElapsed)
         scene->dirty = true;
     }
 
+    // Update gets milliseconds
+    if (scene->renderOptions.playAnimation)
+        scene->AdvanceAnimation(secondsElapsed * 0.001f);
+
     renderer->Update(secondsElapsed);
 }
 
@@ -310,6 +315,7 @@ void MainLoop(void* arg)
         ImGui::Begin("Settings");
 
         ImGui::Text("Samples: %d ", renderer->GetSampleCount());
+        ImGui::Text("Path Trace: %.2f ms", renderer->GetPathTraceTime());
 
         ImGui::BulletText("LMB + drag to rotate");
         ImGui::BulletText("MMB + drag to pan");
@@ -372,6 +378,9 @@ void MainLoop(void* arg)
             reloadShaders |= ImGui::Checkbox("Enable Roughness Mollification", &renderOptions.enableRoughnessMollification);
             optionsChanged |= ImGui::SliderFloat("Roughness Mollification Amount", &renderOptions.roughnessMollificationAmt, 0, 1);
             reloadShaders |= ImGui::Checkbox("Enable Volume MIS", &renderOptions.enableVolumeMIS);
+            reloadShaders |= ImGui::Combo("Path Tracer", (int*)&renderOptions.pathTraceMode, "Fragment\0Persistent Compute\0Wavefront\0");
+            if (!scene->animations.empty())
+                ImGui::Checkbox("Play Animation", &renderOptions.playAnimation);
         }
 
         if (ImGui::CollapsingHeader("Environment"))
@@ -520,6 +529,13 @@ void MainLoop(void* arg)
 
             if (objectPropChanged)
                 scene->RebuildInstances();
+
+            // Splitting a merged instance out rebuilt the scene buffers
+            if (scene->geometryModified)
+            {
+                scene->geometryModified = false;
+                InitRenderer();
+            }
         }
 
         scene->renderOptions = renderOptions;
@@ -556,6 +572,7 @@ int main(int argc, char** argv)
     srand((unsigned int)time(0));
 
     std::string sceneFile;
+    std::string benchmarkName;
 
     for (int i = 1; i < argc; ++i)
     {
@@ -564,6 +581,10 @@ int main(int argc, char** argv)
         {
             sceneFile = argv[++i];
         }
+        else if (arg == "-b" || arg == "--benchmark")
+        {
+            benchmarkName = argv[++i];
+        }
         else if (arg[0] == '-')
         {
             printf("Unknown option %s \n'", arg.c_str());
@@ -584,6 +605,14 @@ int main(int argc, char** argv)
         LoadScene(sceneFiles[sampleSceneIdx]);
     }
 
+    if (!benchmarkName.empty() && !IsGpuBenchmark(benchmarkName))
+    {
+        if (!RunBenchmark(benchmarkName, scene))
+            printf("Unknown benchmark %s\n", benchmarkName.c_str());
+        delete scene;
+        return 0;
+    }
+
     // Setup SDL
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_GAMECONTROLLER) != 0)
     {
@@ -660,12 +689,18 @@ int main(int argc, char** argv)
     ImGui_ImplOpenGL3_Init(glsl_version);
 
     ImGui::StyleColorsDark();
-    if (!InitRenderer())
-        return 1;
 
-    while (!done)
+    if (!benchmarkName.empty())
+        RunGpuBenchmark(benchmarkName, scene, shadersDir);
+    else
     {
-        MainLoop(&loopdata);
+        if (!InitRenderer())
+            return 1;
+
+        while (!done)
+        {
+            MainLoop(&loopdata);
+        }
     }
 
     delete renderer;
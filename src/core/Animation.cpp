@@ -0,0 +1,204 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cmath>
+#include <algorithm>
+#include "Animation.h"
+
+namespace GLSLPT
+{
+    // Shortest arc interpolation of unit quaternions
+    static void Slerp(const float* a, const float* b, float t, float* out)
+    {
+        float cosTheta = a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3];
+        float sign = 1.0f;
+        if (cosTheta < 0.0f)
+        {
+            cosTheta = -cosTheta;
+            sign = -1.0f;
+        }
+
+        float wa = 1.0f - t;
+        float wb = t;
+        // Nearly parallel, a normalized lerp is just as good and stable
+        if (cosTheta < 0.9995f)
+        {
+            float theta = acosf(cosTheta);
+            float sinTheta = sinf(theta);
+            wa = sinf((1.0f - t) * theta) / sinTheta;
+            wb = sinf(t * theta) / sinTheta;
+        }
+
+        float length = 0.0f;
+        for (int i = 0; i < 4; i++)
+        {
+            out[i] = wa * a[i] + sign * wb * b[i];
+            length += out[i] * out[i];
+        }
+
+        length = sqrtf(length);
+        for (int i = 0; i < 4; i++)
+            out[i] /= length;
+    }
+
+    void Animation::sampleChannel(const Channel& channel, float time, float* out) const
+    {
+        const std::vector<float>& times = channel.times;
+        int n = channel.components;
+        // Cubic splines store an in tangent, the value and an out tangent per keyframe
+        int stride = channel.interpolation == Interpolation::CubicSpline ? 3 * n : n;
+        int valueOffset = channel.interpolation == Interpolation::CubicSpline ? n : 0;
+
+        int next = (int)(std::upper_bound(times.begin(), times.end(), time) - times.begin());
+        if (next == 0 || next == times.size())
+        {
+            int key = next == 0 ? 0 : (int)times.size() - 1;
+            for (int i = 0; i < n; i++)
+                out[i] = channel.values[key * stride + valueOffset + i];
+            return;
+        }
+
+        int prev = next - 1;
+        float dt = times[next] - times[prev];
+        float t = dt > 0.0f ? (time - times[prev]) / dt : 0.0f;
+        const float* v0 = &channel.values[prev * stride + valueOffset];
+        const float* v1 = &channel.values[next * stride + valueOffset];
+
+        switch (channel.interpolation)
+        {
+        case Interpolation::Step:
+            for (int i = 0; i < n; i++)
+                out[i] = v0[i];
+            break;
+
+        case Interpolation::Linear:
+            if (channel.path == Path::Rotation)
+                Slerp(v0, v1, t, out);
+            else
+            {
+                for (int i = 0; i < n; i++)
+                    out[i] = v0[i] + (v1[i] - v0[i]) * t;
+            }
+            break;
+
+        case Interpolation::CubicSpline:
+        {
+            const float* outTangent = &channel.values[prev * stride + 2 * n];
+            const float* inTangent = &channel.values[next * stride];
+            float t2 = t * t;
+            float t3 = t2 * t;
+            for (int i = 0; i < n; i++)
+                out[i] = (2.0f * t3 - 3.0f * t2 + 1.0f) * v0[i] + (t3 - 2.0f * t2 + t) * dt * outTangent[i] + (-2.0f * t3 + 3.0f * t2) * v1[i] + (t3 - t2) * dt * inTangent[i];
+
+            if (channel.path == Path::Rotation)
+            {
+                float length = sqrtf(out[0] * out[0] + out[1] * out[1] + out[2] * out[2] + out[3] * out[3]);
+                for (int i = 0; i < 4; i++)
+                    out[i] /= length;
+            }
+            break;
+        }
+        }
+    }
+
+    const Mat4& Animation::globalTransform(int node, std::vector<bool>& done)
+    {
+        if (done[node])
+            return globalTransforms[node];
+
+        const Node& posed = pose[node];
+        Mat4 local = posed.matrix;
+        if (!posed.hasMatrix)
+            local = Mat4::Scale(posed.scale) * Mat4::QuatToMatrix(posed.rotation.x, posed.rotation.y, posed.rotation.z, posed.rotation.w) * Mat4::Translate(posed.translation);
+
+        // Row vectors, the local transform is applied first
+        globalTransforms[node] = posed.parent < 0 ? local : local * globalTransform(posed.parent, done);
+        done[node] = true;
+        return globalTransforms[node];
+    }
+
+    void Animation::Evaluate(float time)
+    {
+        if (duration > 0.0f)
+            time = fmodf(time, duration);
+
+        pose = nodes;
+        for (const Channel& channel : channels)
+        {
+            Node& node = pose[channel.node];
+            switch (channel.path)
+            {
+            case Path::Translation:
+                sampleChannel(channel, time, &node.translation.x);
+                break;
+            case Path::Rotation:
+            {
+                float rotation[4];
+                sampleChannel(channel, time, rotation);
+                node.rotation = Vec4(rotation[0], rotation[1], rotation[2], rotation[3]);
+                break;
+            }
+            case Path::Scale:
+                sampleChannel(channel, time, &node.scale.x);
+                break;
+            case Path::Weights:
+                node.weights.resize(channel.components);
+                sampleChannel(channel, time, &node.weights[0]);
+                break;
+            }
+        }
+
+        globalTransforms.resize(nodes.size());
+        std::vector<bool> done(nodes.size(), false);
+        for (int i = 0; i < nodes.size(); i++)
+            globalTransform(i, done);
+    }
+
+    void Animation::GetJointMatrices(int skin, std::vector<Mat4>& matrices) const
+    {
+        const Skin& jointSkin = skins[skin];
+        matrices.resize(jointSkin.joints.size());
+        for (int i = 0; i < jointSkin.joints.size(); i++)
+        {
+            Mat4 inverseBind = i < jointSkin.inverseBindMatrices.size() ? jointSkin.inverseBindMatrices[i] : Mat4();
+            matrices[i] = inverseBind * globalTransforms[jointSkin.joints[i]];
+        }
+    }
+
+    void Animation::GetMorphWeights(const DeformedMesh& mesh, int numTargets, std::vector<float>& weights) const
+    {
+        const std::vector<float>& posed = pose[mesh.node].weights.empty() ? mesh.weights : pose[mesh.node].weights;
+        weights.assign(numTargets, 0.0f);
+        for (int i = 0; i < std::min(numTargets, (int)posed.size()); i++)
+            weights[i] = posed[i];
+    }
+
+    Mat4 Animation::GetInstanceTransform(const AnimatedInstance& instance) const
+    {
+        // Joint matrices already place skinned vertices in glTF scene space
+        if (instance.skinned)
+            return rootTransform;
+        return globalTransforms[instance.node] * rootTransform;
+    }
+}
@@ -0,0 +1,132 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <vector>
+#include "Mat4.h"
+#include "Vec4.h"
+
+namespace GLSLPT
+{
+    // Node hierarchy, skins and the first animation of a glTF file. The nodes are
+    // posed on the CPU every frame, which gives the transforms of the instances
+    // they place, the joint matrices of the skins and the morph weights. The
+    // vertices themselves are only posed on the GPU, see GpuDeformer
+    class Animation
+    {
+    public:
+        struct Node
+        {
+            int parent = -1;
+            // A node either has a fixed matrix or is animated through its TRS
+            bool hasMatrix = false;
+            Mat4 matrix;
+            Vec3 translation;
+            Vec4 rotation = Vec4(0.0f, 0.0f, 0.0f, 1.0f);
+            Vec3 scale = Vec3(1.0f, 1.0f, 1.0f);
+            // Morph weights of the node's mesh, empty to use the mesh defaults
+            std::vector<float> weights;
+        };
+
+        enum class Path
+        {
+            Translation,
+            Rotation,
+            Scale,
+            Weights
+        };
+
+        enum class Interpolation
+        {
+            Step,
+            Linear,
+            CubicSpline
+        };
+
+        // Keyframes of one node property. values holds components floats per
+        // keyframe, three times that for cubic splines (in tangent, value, out tangent)
+        struct Channel
+        {
+            int node;
+            Path path;
+            Interpolation interpolation;
+            int components;
+            std::vector<float> times;
+            std::vector<float> values;
+        };
+
+        struct Skin
+        {
+            // Nodes of the joints, skinJoints of a mesh index this list
+            std::vector<int> joints;
+            std::vector<Mat4> inverseBindMatrices;
+        };
+
+        // Scene mesh posed by a node, with skin -1 if it only has morph targets.
+        // weights are the defaults of its glTF mesh
+        struct DeformedMesh
+        {
+            int mesh;
+            int node;
+            int skin;
+            std::vector<float> weights;
+        };
+
+        // Scene instance placed by a node, skinned ones ignore the node transform
+        struct AnimatedInstance
+        {
+            int instance;
+            int node;
+            bool skinned;
+        };
+
+        std::vector<Node> nodes;
+        std::vector<Channel> channels;
+        std::vector<Skin> skins;
+        std::vector<DeformedMesh> meshes;
+        std::vector<AnimatedInstance> instances;
+        // Transform the glTF file was loaded with
+        Mat4 rootTransform;
+        // Time of the last keyframe, in seconds
+        float duration = 0.0f;
+
+        // Pose every node at time seconds, looping over duration
+        void Evaluate(float time);
+        // Matrices taking the vertices of a skinned mesh from its bind pose to
+        // glTF scene space, one per joint of skin
+        void GetJointMatrices(int skin, std::vector<Mat4>& matrices) const;
+        // Current morph weights of a deformed mesh, numTargets of them
+        void GetMorphWeights(const DeformedMesh& mesh, int numTargets, std::vector<float>& weights) const;
+        Mat4 GetInstanceTransform(const AnimatedInstance& instance) const;
+
+    private:
+        // Nodes with the channels applied and the resulting global transforms
+        std::vector<Node> pose;
+        std::vector<Mat4> globalTransforms;
+
+        void sampleChannel(const Channel& channel, float time, float* out) const;
+        const Mat4& globalTransform(int node, std::vector<bool>& done);
+    };
+}
@@ -0,0 +1,1497 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <chrono>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "Benchmark.h"
+#include "Scene.h"
+#include "Renderer.h"
+#include "GpuTlasBuilder.h"
+#include "GpuDeformer.h"
+#include "PersistentTracer.h"
+#include "WavefrontTracer.h"
+#include "VisibilityPass.h"
+#include "split_bvh.h"
+#include "lbvh.h"
+#include "bvh_optimizer.h"
+
+namespace GLSLPT
+{
+    static const int benchmarkRuns = 3;
+    static const int syntheticTriCount = 1000000;
+    static const int lbvhSyntheticTriCount = 10000000;
+    // The LBVH is meant to rebuild the synthetic soup within this
+    static const double lbvhTargetMs = 1000.0;
+    static const int tlasInstanceCount = 50000;
+    static const int tlasDragFrames = 100;
+    static const int gpuWarmupFrames = 8;
+    static const int gpuBenchmarkFrames = 32;
+    // Sampled rays for the RDH benchmark when the scene doesn't set any
+    static const int rdhSampleRays = 1 << 16;
+    static const int gpuTlasInstanceCount = 100000;
+    static const int gpuTlasFrames = 16;
+    static const int deformFrames = 32;
+    static const int nestedAssemblies = 500;
+    static const int nestedParts = 40;
+    static const int benchmarkLightCount = 1000;
+    // Frames are large, fewer of them are timed
+    static const int rasterWarmupFrames = 4;
+    static const int rasterFrames = 8;
+    static const iVec2 rasterResolutions[] = { iVec2(1920, 1080), iVec2(3840, 2160) };
+
+    static double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+    // Random small triangles in a unit cube, seeded so every run sees the same input
+    static void GetSyntheticBounds(int numTris, std::vector<RadeonRays::bbox>& bounds)
+    {
+        std::mt19937 rng(1234);
+        std::uniform_real_distribution<float> pos(0.0f, 1.0f);
+        std::uniform_real_distribution<float> offset(-0.002f, 0.002f);
+        bounds.resize(numTris);
+
+        for (int i = 0; i < numTris; ++i)
+        {
+            Vec3 p(pos(rng), pos(rng), pos(rng));
+            bounds[i] = RadeonRays::bbox(p);
+            for (int j = 0; j < 2; ++j)
+                bounds[i].grow(p + Vec3(offset(rng), offset(rng), offset(rng)));
+        }
+    }
+
+    static void SetThreadCount(int numThreads)
+    {
+#ifdef _OPENMP
+        omp_set_num_threads(numThreads);
+#endif
+    }
+
+    static void BenchmarkBvhBuild(const char* label, const std::vector<RadeonRays::bbox>& bounds)
+    {
+        const int numTris = bounds.size();
+        printf("\n%s: %d triangles\n", label, numTris);
+        printf("%8s %12s %10s %10s\n", "threads", "build (ms)", "speedup", "identical");
+
+        SetThreadCount(1);
+        RadeonRays::Bvh reference(2.0f, 64, true);
+        reference.Build(&bounds[0], numTris);
+
+#ifdef _OPENMP
+        const int maxThreads = omp_get_num_procs();
+#else
+        const int maxThreads = 1;
+#endif
+        std::vector<int> threadCounts;
+        for (int t = 1; t < maxThreads; t *= 2)
+            threadCounts.push_back(t);
+        threadCounts.push_back(maxThreads);
+
+        double serialMs = 0.0;
+        for (int numThreads : threadCounts)
+        {
+            SetThreadCount(numThreads);
+
+            double bestMs = 0.0;
+            bool identical = true;
+            for (int run = 0; run < benchmarkRuns; ++run)
+            {
+                RadeonRays::Bvh bvh(2.0f, 64, true);
+                auto start = std::chrono::high_resolution_clock::now();
+                bvh.Build(&bounds[0], numTris);
+                double ms = ElapsedMs(start);
+
+                bestMs = run == 0 ? ms : std::min(bestMs, ms);
+                identical = identical && bvh.IsSameTree(reference);
+            }
+
+            if (numThreads == 1)
+                serialMs = bestMs;
+
+            printf("%8d %12.2f %9.2fx %10s\n", numThreads, bestMs, serialMs / bestMs, identical ? "yes" : "NO");
+        }
+
+        SetThreadCount(maxThreads);
+    }
+
+    void BenchmarkBvhBuild(Scene* scene)
+    {
+#ifndef _OPENMP
+        printf("Built without OpenMP, only the single threaded path is measured\n");
+#endif
+        std::vector<RadeonRays::bbox> bounds;
+
+        // Largest mesh of the scene
+        const Mesh* largest = nullptr;
+        for (const Mesh* mesh : scene->meshes)
+        {
+            if (!largest || mesh->verticesUVX.size() > largest->verticesUVX.size())
+                largest = mesh;
+        }
+
+        if (largest && !largest->verticesUVX.empty())
+        {
+            largest->GetTriangleBounds(bounds);
+            BenchmarkBvhBuild(largest->name.c_str(), bounds);
+        }
+
+        GetSyntheticBounds(syntheticTriCount, bounds);
+        BenchmarkBvhBuild("Synthetic triangle soup", bounds);
+    }
+
+    void BenchmarkSplitBvh(Scene* scene)
+    {
+        const RenderOptions& options = scene->renderOptions;
+        printf("Split depth %d, min overlap %g, ref budget %g\n", options.sbvhMaxSplitDepth, options.sbvhMinOverlap, options.sbvhRefBudget);
+        printf("%-24s %10s %10s %10s %9s %9s %9s %10s %10s %10s %10s %10s\n", "mesh", "triangles", "SAH obj", "SAH split", "gain", "refs", "nodes", "extra (KB)", "obj (ms)", "split (ms)", "SAH lbvh", "lbvh (ms)");
+
+        std::vector<RadeonRays::bbox> bounds;
+        for (const Mesh* mesh : scene->meshes)
+        {
+            mesh->GetTriangleBounds(bounds);
+            const int numTris = bounds.size();
+            if (numTris == 0)
+                continue;
+
+            RadeonRays::SplitBvh objectBvh(2.0f, 64, 0, options.sbvhMinOverlap, 0.0f);
+            auto start = std::chrono::high_resolution_clock::now();
+            objectBvh.Build(&bounds[0], numTris);
+            double objectMs = ElapsedMs(start);
+
+            RadeonRays::SplitBvh splitBvh(2.0f, 64, options.sbvhMaxSplitDepth, options.sbvhMinOverlap, options.sbvhRefBudget);
+            start = std::chrono::high_resolution_clock::now();
+            splitBvh.Build(&bounds[0], numTris);
+            double splitMs = ElapsedMs(start);
+
+            RadeonRays::Lbvh linearBvh(2.0f);
+            start = std::chrono::high_resolution_clock::now();
+            linearBvh.Build(&bounds[0], numTris);
+            double linearMs = ElapsedMs(start);
+
+            float objectCost = objectBvh.GetSahCost();
+            float splitCost = splitBvh.GetSahCost();
+
+            // What the duplicated refs and added nodes cost in the GPU buffers
+            int extraRefs = (int)splitBvh.GetNumIndices() - (int)objectBvh.GetNumIndices();
+            int extraNodes = splitBvh.GetNumNodes() - objectBvh.GetNumNodes();
+            int extraBytes = extraNodes * sizeof(RadeonRays::BvhTranslator::Node) + extraRefs * sizeof(Indices);
+
+            printf("%-24.24s %10d %10.2f %10.2f %8.1f%% %+8.1f%% %+8.1f%% %+10.1f %10.2f %10.2f %10.2f %10.2f\n", mesh->name.c_str(), numTris,
+                objectCost, splitCost, 100.0f * (objectCost - splitCost) / objectCost,
+                100.0f * ((float)splitBvh.GetNumIndices() / objectBvh.GetNumIndices() - 1.0f),
+                100.0f * ((float)splitBvh.GetNumNodes() / objectBvh.GetNumNodes() - 1.0f),
+                extraBytes / 1024.0f, objectMs, splitMs, linearBvh.GetSahCost(), linearMs);
+        }
+    }
+
+    // Returns the best build time over all thread counts and the thread count it was measured with
+    static double BenchmarkLbvh(const char* label, const std::vector<RadeonRays::bbox>& bounds, int& bestThreads)
+    {
+        const int numTris = bounds.size();
+        printf("\n%s: %d triangles\n", label, numTris);
+        printf("%8s %12s %10s %10s %10s %10s\n", "threads", "build (ms)", "Mprims/s", "speedup", "SAH", "identical");
+
+        SetThreadCount(1);
+        RadeonRays::Lbvh reference(2.0f);
+        reference.Build(&bounds[0], numTris);
+
+#ifdef _OPENMP
+        const int maxThreads = omp_get_num_procs();
+#else
+        const int maxThreads = 1;
+#endif
+        std::vector<int> threadCounts;
+        for (int t = 1; t < maxThreads; t *= 2)
+            threadCounts.push_back(t);
+        threadCounts.push_back(maxThreads);
+
+        double serialMs = 0.0;
+        double fastestMs = 0.0;
+        for (int numThreads : threadCounts)
+        {
+            SetThreadCount(numThreads);
+
+            double bestMs = 0.0;
+            float sahCost = 0.0f;
+            bool identical = true;
+            for (int run = 0; run < benchmarkRuns; ++run)
+            {
+                RadeonRays::Lbvh bvh(2.0f);
+                auto start = std::chrono::high_resolution_clock::now();
+                bvh.Build(&bounds[0], numTris);
+                double ms = ElapsedMs(start);
+
+                bestMs = run == 0 ? ms : std::min(bestMs, ms);
+                sahCost = bvh.GetSahCost();
+                identical = identical && bvh.IsSameTree(reference);
+            }
+
+            if (numThreads == 1)
+                serialMs = bestMs;
+            if (numThreads == 1 || bestMs < fastestMs)
+            {
+                fastestMs = bestMs;
+                bestThreads = numThreads;
+            }
+
+            printf("%8d %12.2f %10.2f %9.2fx %10.2f %10s\n", numThreads, bestMs, numTris / (bestMs * 1000.0), serialMs / bestMs, sahCost, identical ? "yes" : "NO");
+        }
+
+        SetThreadCount(maxThreads);
+        return fastestMs;
+    }
+
+    void BenchmarkLbvh(Scene* scene)
+    {
+#ifndef _OPENMP
+        printf("Built without OpenMP, only the single threaded path is measured\n");
+#endif
+        int bestThreads = 1;
+        std::vector<RadeonRays::bbox> bounds;
+        for (const Mesh* mesh : scene->meshes)
+        {
+            mesh->GetTriangleBounds(bounds);
+            if (!bounds.empty())
+                BenchmarkLbvh(mesh->name.c_str(), bounds, bestThreads);
+        }
+
+        GetSyntheticBounds(lbvhSyntheticTriCount, bounds);
+        double bestMs = BenchmarkLbvh("Synthetic triangle soup", bounds, bestThreads);
+
+        if (bestMs <= lbvhTargetMs)
+            printf("\nTarget of %.0f ms for %d triangles met: %.0f ms with %d threads\n", lbvhTargetMs, lbvhSyntheticTriCount, bestMs, bestThreads);
+        else
+            printf("\nTarget of %.0f ms for %d triangles NOT met on this machine: best %.0f ms with %d threads, needs %.1fx more\n",
+                lbvhTargetMs, lbvhSyntheticTriCount, bestMs, bestThreads, bestMs / lbvhTargetMs);
+    }
+
+    // Drags numMoved instances across the scene over tlasDragFrames frames,
+    // refitting every frame, then compares against rebuilding from scratch
+    static void BenchmarkTlasRefit(int numMoved, std::vector<RadeonRays::bbox> bounds)
+    {
+        const int numInstances = bounds.size();
+
+        RadeonRays::Bvh bvh(10.0f, 64, false);
+        bvh.Build(&bounds[0], numInstances);
+        float buildCost = bvh.GetSahCost();
+
+        std::vector<int> moved(numMoved);
+        for (int i = 0; i < numMoved; ++i)
+            moved[i] = (int)((long long)i * numInstances / numMoved);
+
+        std::vector<int> refitted;
+        double refitMs = 0.0;
+        for (int frame = 0; frame < tlasDragFrames; ++frame)
+        {
+            Vec3 step(0.5f / tlasDragFrames, 0.0f, 0.0f);
+            for (int i : moved)
+                bounds[i] = RadeonRays::bbox(bounds[i].pmin + step, bounds[i].pmax + step);
+
+            refitted.clear();
+            auto start = std::chrono::high_resolution_clock::now();
+            bvh.Refit(&bounds[0], &moved[0], numMoved, refitted);
+            refitMs += ElapsedMs(start);
+        }
+        float refitCost = bvh.GetSahCost();
+
+        RadeonRays::Bvh rebuilt(10.0f, 64, false);
+        auto start = std::chrono::high_resolution_clock::now();
+        rebuilt.Build(&bounds[0], numInstances);
+        double buildMs = ElapsedMs(start);
+
+        printf("%10d %12.4f %10d %12.2f %10.2f %10.2f %10.2f\n", numMoved, refitMs / tlasDragFrames, (int)refitted.size(),
+            buildMs, buildCost, refitCost, rebuilt.GetSahCost());
+    }
+
+    void BenchmarkTlasRefit()
+    {
+        std::vector<RadeonRays::bbox> bounds;
+        GetSyntheticBounds(tlasInstanceCount, bounds);
+
+        printf("%d instances, %d frames of dragging\n", tlasInstanceCount, tlasDragFrames);
+        printf("%10s %12s %10s %12s %10s %10s %10s\n", "moved", "refit (ms)", "nodes", "build (ms)", "SAH build", "SAH refit", "SAH new");
+
+        for (int numMoved : { 1, 100, tlasInstanceCount / 10 })
+            BenchmarkTlasRefit(numMoved, bounds);
+    }
+
+    static void BenchmarkTreelets(const char* label, const char* builder, RadeonRays::Bvh& bvh, const std::vector<RadeonRays::bbox>& bounds)
+    {
+        bvh.Build(&bounds[0], bounds.size());
+
+        RadeonRays::BvhOptimizer optimizer;
+        float sahBefore = bvh.GetSahCost();
+        RadeonRays::BvhOptimizer::RayCost before = RadeonRays::BvhOptimizer::MeasureTraversalCost(bvh, &bounds[0]);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        optimizer.Optimize(bvh);
+        double ms = ElapsedMs(start);
+
+        float sahAfter = bvh.GetSahCost();
+        RadeonRays::BvhOptimizer::RayCost after = RadeonRays::BvhOptimizer::MeasureTraversalCost(bvh, &bounds[0]);
+
+        printf("%-24.24s %-8s %10.2f %10.2f %8.1f%% %8.1f %8.1f %8.1f %8.1f %10.2f\n", label, builder, sahBefore, sahAfter,
+            100.0f * (sahBefore - sahAfter) / sahBefore, before.nodetests, after.nodetests, before.primtests, after.primtests, ms);
+    }
+
+    static void BenchmarkTreelets(const char* label, const std::vector<RadeonRays::bbox>& bounds, const RenderOptions& options)
+    {
+        {
+            RadeonRays::Bvh bvh(2.0f, 64, true);
+            BenchmarkTreelets(label, "sah", bvh, bounds);
+        }
+        {
+            RadeonRays::Lbvh bvh(2.0f);
+            BenchmarkTreelets(label, "lbvh", bvh, bounds);
+        }
+        {
+            RadeonRays::SplitBvh bvh(2.0f, 64, options.sbvhMaxSplitDepth, options.sbvhMinOverlap, options.sbvhRefBudget);
+            BenchmarkTreelets(label, "sbvh", bvh, bounds);
+        }
+    }
+
+    void BenchmarkTreelets(Scene* scene)
+    {
+        printf("Node and prim tests are averaged over a fixed set of rays\n");
+        printf("%-24s %-8s %10s %10s %9s %8s %8s %8s %8s %10s\n", "mesh", "builder", "SAH", "SAH opt", "gain", "nodes", "opt", "prims", "opt", "opt (ms)");
+
+        std::vector<RadeonRays::bbox> bounds;
+        for (const Mesh* mesh : scene->meshes)
+        {
+            mesh->GetTriangleBounds(bounds);
+            if (!bounds.empty())
+                BenchmarkTreelets(mesh->name.c_str(), bounds, scene->renderOptions);
+        }
+
+        GetSyntheticBounds(syntheticTriCount, bounds);
+        BenchmarkTreelets("Synthetic triangle soup", bounds, scene->renderOptions);
+    }
+
+    static void BenchmarkSahKernels(const char* label, const std::vector<RadeonRays::bbox>& bounds)
+    {
+        const int numTris = bounds.size();
+        printf("\n%s: %d triangles\n", label, numTris);
+        printf("%8s %12s %10s %10s\n", "kernel", "build (ms)", "Mprims/s", "identical");
+
+        RadeonRays::Bvh reference(2.0f, 64, true);
+        reference.SetSahKernel(RadeonRays::SahKernel::kLegacy);
+        reference.Build(&bounds[0], numTris);
+
+        const RadeonRays::SahKernel kernels[] = { RadeonRays::SahKernel::kLegacy, RadeonRays::SahKernel::kScalar, RadeonRays::SahKernel::kSse, RadeonRays::SahKernel::kAvx };
+        for (RadeonRays::SahKernel kernel : kernels)
+        {
+            if (!RadeonRays::IsSahKernelSupported(kernel))
+                continue;
+
+            double bestMs = 0.0;
+            bool identical = true;
+            for (int run = 0; run < benchmarkRuns; ++run)
+            {
+                RadeonRays::Bvh bvh(2.0f, 64, true);
+                bvh.SetSahKernel(kernel);
+                auto start = std::chrono::high_resolution_clock::now();
+                bvh.Build(&bounds[0], numTris);
+                double ms = ElapsedMs(start);
+
+                bestMs = run == 0 ? ms : std::min(bestMs, ms);
+                identical = identical && bvh.IsSameTree(reference);
+            }
+
+            printf("%8s %12.2f %10.2f %10s\n", RadeonRays::GetSahKernelName(kernel), bestMs, numTris / (bestMs * 1000.0), identical ? "yes" : "NO");
+        }
+    }
+
+    void BenchmarkSahKernels(Scene* scene)
+    {
+        std::vector<RadeonRays::bbox> bounds;
+
+        for (const Mesh* mesh : scene->meshes)
+        {
+            mesh->GetTriangleBounds(bounds);
+            if (!bounds.empty())
+                BenchmarkSahKernels(mesh->name.c_str(), bounds);
+        }
+
+        GetSyntheticBounds(syntheticTriCount, bounds);
+        BenchmarkSahKernels("Synthetic triangle soup", bounds);
+    }
+
+    // Mesh::GetTriangleBounds before it moved to RadeonRays::triangle_bounds
+    static void GetTriangleBoundsScalar(const Mesh* mesh, std::vector<RadeonRays::bbox>& bounds)
+    {
+        const int numTris = mesh->verticesUVX.size() / 3;
+        bounds.assign(numTris, RadeonRays::bbox());
+
+#pragma omp parallel for
+        for (int i = 0; i < numTris; ++i)
+        {
+            bounds[i].grow(Vec3(mesh->verticesUVX[i * 3 + 0]));
+            bounds[i].grow(Vec3(mesh->verticesUVX[i * 3 + 1]));
+            bounds[i].grow(Vec3(mesh->verticesUVX[i * 3 + 2]));
+        }
+    }
+
+    template <typename Func>
+    static double BestOfRuns(Func func)
+    {
+        double bestMs = 0.0;
+        for (int run = 0; run < benchmarkRuns; ++run)
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            func();
+            double ms = ElapsedMs(start);
+            bestMs = run == 0 ? ms : std::min(bestMs, ms);
+        }
+        return bestMs;
+    }
+
+    void BenchmarkSimd(Scene* scene)
+    {
+        const RenderOptions& options = scene->renderOptions;
+        const RadeonRays::SahKernel simdKernel = RadeonRays::GetBestSahKernel();
+        printf("SAH kernel %s, split depth %d, min overlap %g, ref budget %g\n", RadeonRays::GetSahKernelName(simdKernel),
+            options.sbvhMaxSplitDepth, options.sbvhMinOverlap, options.sbvhRefBudget);
+        printf("%-24s %10s %12s %12s %12s %12s %12s %12s %10s\n", "mesh", "triangles", "bounds (ms)", "SSE (ms)",
+            "centers (ms)", "SSE (ms)", "sbvh (ms)", "SSE (ms)", "identical");
+
+        double total[6] = {};
+        std::vector<RadeonRays::bbox> scalarBounds, bounds;
+        std::vector<Vec3> scalarCenters, centers;
+
+        for (const Mesh* mesh : scene->meshes)
+        {
+            const int numTris = mesh->verticesUVX.size() / 3;
+            if (numTris == 0)
+                continue;
+
+            double ms[6];
+            ms[0] = BestOfRuns([&]() { GetTriangleBoundsScalar(mesh, scalarBounds); });
+            ms[1] = BestOfRuns([&]() { mesh->GetTriangleBounds(bounds); });
+            bool identical = memcmp(&scalarBounds[0], &bounds[0], sizeof(RadeonRays::bbox) * numTris) == 0;
+
+            scalarCenters.resize(numTris);
+            centers.resize(numTris);
+            ms[2] = BestOfRuns([&]()
+            {
+                RadeonRays::bbox centerBounds;
+                for (int i = 0; i < numTris; ++i)
+                {
+                    scalarCenters[i] = bounds[i].center();
+                    centerBounds.grow(scalarCenters[i]);
+                }
+            });
+            ms[3] = BestOfRuns([&]()
+            {
+                RadeonRays::bbox centerBounds;
+                RadeonRays::centers(&bounds[0], numTris, &centers[0], centerBounds);
+            });
+            identical = identical && memcmp(&scalarCenters[0], &centers[0], sizeof(Vec3) * numTris) == 0;
+
+            RadeonRays::SplitBvh scalarBvh(2.0f, 64, options.sbvhMaxSplitDepth, options.sbvhMinOverlap, options.sbvhRefBudget);
+            scalarBvh.SetSahKernel(RadeonRays::SahKernel::kScalar);
+            ms[4] = BestOfRuns([&]() { scalarBvh.Build(&bounds[0], numTris); });
+
+            RadeonRays::SplitBvh simdBvh(2.0f, 64, options.sbvhMaxSplitDepth, options.sbvhMinOverlap, options.sbvhRefBudget);
+            simdBvh.SetSahKernel(simdKernel);
+            ms[5] = BestOfRuns([&]() { simdBvh.Build(&bounds[0], numTris); });
+            identical = identical && simdBvh.IsSameTree(scalarBvh);
+
+            printf("%-24.24s %10d %12.2f %12.2f %12.2f %12.2f %12.2f %12.2f %10s\n", mesh->name.c_str(), numTris,
+                ms[0], ms[1], ms[2], ms[3], ms[4], ms[5], identical ? "yes" : "NO");
+
+            for (int i = 0; i < 6; ++i)
+                total[i] += ms[i];
+        }
+
+        printf("%-24s %10s %12.2f %12.2f %12.2f %12.2f %12.2f %12.2f\n", "total", "", total[0], total[1], total[2], total[3], total[4], total[5]);
+        if (total[1] > 0.0 && total[3] > 0.0 && total[5] > 0.0)
+            printf("Speedup: bounds %.2fx, centers %.2fx, spatial split BVH %.2fx\n", total[0] / total[1], total[2] / total[3], total[4] / total[5]);
+    }
+
+    static double RenderFrames(Renderer* renderer, int numFrames)
+    {
+        glFinish();
+        auto start = std::chrono::high_resolution_clock::now();
+
+        for (int i = 0; i < numFrames; ++i)
+        {
+            renderer->Update(0.0f);
+            renderer->Render();
+        }
+
+        glFinish();
+        return ElapsedMs(start);
+    }
+
+    // Rays are counted in a separate run since the counter itself costs time,
+    // both runs render the same frames. dataBytes is the size of the data the
+    // compared layouts differ in. Returns Mrays/s
+    static double BenchmarkRenderer(const char* label, size_t dataBytes, Scene* scene, const std::string& shadersDirectory)
+    {
+        scene->renderOptions.enableRayStats = true;
+        Renderer* renderer = new Renderer(scene, shadersDirectory);
+        RenderFrames(renderer, gpuWarmupFrames);
+        renderer->ResetRayCount();
+        RenderFrames(renderer, gpuBenchmarkFrames);
+        double numRays = renderer->GetRayCount();
+        delete renderer;
+
+        scene->renderOptions.enableRayStats = false;
+        renderer = new Renderer(scene, shadersDirectory);
+        RenderFrames(renderer, gpuWarmupFrames);
+        double ms = RenderFrames(renderer, gpuBenchmarkFrames);
+        delete renderer;
+
+        printf("%-8s %12.1f %12.0f %10.2f %10.1f\n", label, dataBytes / 1024.0, numRays / gpuBenchmarkFrames,
+            ms / gpuBenchmarkFrames, numRays / (ms * 1000.0));
+        return numRays / (ms * 1000.0);
+    }
+
+    static void RenderImage(Scene* scene, const std::string& shadersDirectory, std::vector<unsigned char>& image)
+    {
+        Renderer* renderer = new Renderer(scene, shadersDirectory);
+        renderer->Update(0.0f);
+        renderer->Render();
+
+        unsigned char* data = nullptr;
+        int w = 0, h = 0;
+        renderer->GetOutputBuffer(&data, w, h);
+        image.assign(data, data + w * h * 4);
+        delete[] data;
+        delete renderer;
+    }
+
+    static void PrintImageDifference(const char* label, const std::vector<unsigned char>& a, const std::vector<unsigned char>& b)
+    {
+        int numPixels = a.size() / 4;
+        int numDiffering = 0;
+        int maxDifference = 0;
+        for (int i = 0; i < numPixels; i++)
+        {
+            int difference = 0;
+            for (int c = 0; c < 3; c++)
+                difference = std::max(difference, std::abs(a[i * 4 + c] - b[i * 4 + c]));
+            if (difference > 1)
+                numDiffering++;
+            maxDifference = std::max(maxDifference, difference);
+        }
+        printf("%s images: %d of %d pixels differ by more than 1/255, at most %d/255\n", label, numDiffering, numPixels, maxDifference);
+    }
+
+    static size_t GetBvhBytes(Scene* scene)
+    {
+        return scene->bvhTranslator.GetNodeSize() * scene->bvhTranslator.GetNodeCount();
+    }
+
+    void BenchmarkBvhWidth(Scene* scene, const std::string& shadersDirectory)
+    {
+        const RenderOptions& options = scene->renderOptions;
+        printf("%dx%d, max depth %d, %d frames\n", options.renderResolution.x, options.renderResolution.y, options.maxDepth, gpuBenchmarkFrames);
+        printf("%-8s %12s %12s %10s %10s\n", "layout", "BVH (KB)", "rays/frame", "ms/frame", "Mrays/s");
+
+        int sceneWidth = scene->renderOptions.bvhWidth;
+        bool sceneQuantize = scene->renderOptions.quantizeBvh;
+        std::vector<std::string> labels;
+        std::vector<std::vector<unsigned char>> images;
+        for (bool quantize : { false, true })
+        {
+            for (int width : { 2, 4, 8 })
+            {
+                scene->renderOptions.bvhWidth = width;
+                scene->renderOptions.quantizeBvh = quantize;
+                scene->FlattenBVH();
+                labels.push_back("BVH" + std::to_string(width) + (quantize ? "q" : ""));
+                BenchmarkRenderer(labels.back().c_str(), GetBvhBytes(scene), scene, shadersDirectory);
+
+                images.emplace_back();
+                RenderImage(scene, shadersDirectory, images.back());
+            }
+        }
+
+        // Every width traverses the same triangles, so the images should match BVH2.
+        // Quantized boxes only ever grow, so they should match the float nodes of their width
+        for (size_t i = 1; i < 3; i++)
+            PrintImageDifference((labels[i] + " vs BVH2").c_str(), images[0], images[i]);
+        for (size_t i = 3; i < images.size(); i++)
+            PrintImageDifference((labels[i] + " vs " + labels[i - 3]).c_str(), images[i - 3], images[i]);
+
+        scene->renderOptions.bvhWidth = sceneWidth;
+        scene->renderOptions.quantizeBvh = sceneQuantize;
+        scene->FlattenBVH();
+    }
+
+    void BenchmarkNodeLayout(Scene* scene, const std::string& shadersDirectory)
+    {
+        const RenderOptions& options = scene->renderOptions;
+        printf("%dx%d, max depth %d, %d frames\n", options.renderResolution.x, options.renderResolution.y, options.maxDepth, gpuBenchmarkFrames);
+        printf("%-8s %12s %12s %10s %10s\n", "layout", "BVH (KB)", "rays/frame", "ms/frame", "Mrays/s");
+
+        RenderOptions sceneOptions = scene->renderOptions;
+        scene->renderOptions.bvhWidth = 2;
+        scene->renderOptions.quantizeBvh = false;
+
+        using NodeLayout = RadeonRays::BvhTranslator::NodeLayout;
+        std::vector<NodeLayout> layouts = { NodeLayout::kDepthFirst, NodeLayout::kLargerChildFirst, NodeLayout::kVanEmdeBoas, NodeLayout::kVisitFrequency };
+        std::vector<std::vector<unsigned char>> images(layouts.size());
+        for (size_t i = 0; i < layouts.size(); i++)
+        {
+            scene->renderOptions.bvhLayout = (int)layouts[i];
+            scene->FlattenBVH();
+            BenchmarkRenderer(RadeonRays::BvhTranslator::GetNodeLayoutName(layouts[i]), GetBvhBytes(scene), scene, shadersDirectory);
+            RenderImage(scene, shadersDirectory, images[i]);
+        }
+
+        // Layouts only move nodes around, the images should match depth first order
+        for (size_t i = 1; i < layouts.size(); i++)
+        {
+            std::string label = std::string(RadeonRays::BvhTranslator::GetNodeLayoutName(layouts[i])) + " vs " + RadeonRays::BvhTranslator::GetNodeLayoutName(layouts[0]);
+            PrintImageDifference(label.c_str(), images[0], images[i]);
+        }
+
+        scene->renderOptions = sceneOptions;
+        scene->FlattenBVH();
+    }
+
+    void BenchmarkTriangleLayout(Scene* scene, const std::string& shadersDirectory)
+    {
+        const RenderOptions& options = scene->renderOptions;
+        printf("%dx%d, max depth %d, %d frames\n", options.renderResolution.x, options.renderResolution.y, options.maxDepth, gpuBenchmarkFrames);
+        printf("%-8s %12s %12s %10s %10s\n", "layout", "tris (KB)", "rays/frame", "ms/frame", "Mrays/s");
+
+        if (scene->leafTriangles.empty())
+            scene->BuildLeafTriangles();
+
+        // Indexed triangles need the indices and vertices during traversal, packed
+        // ones keep both around for shading on top of their own buffer
+        size_t indexedBytes = sizeof(Indices) * scene->vertIndices.size() + sizeof(Vec4) * scene->verticesUVX.size();
+        size_t packedBytes = indexedBytes + sizeof(Vec4) * scene->leafTriangles.size();
+
+        bool scenePack = scene->renderOptions.packTriangles;
+        scene->renderOptions.packTriangles = false;
+        BenchmarkRenderer("indexed", indexedBytes, scene, shadersDirectory);
+        scene->renderOptions.packTriangles = true;
+        BenchmarkRenderer("packed", packedBytes, scene, shadersDirectory);
+        scene->renderOptions.packTriangles = scenePack;
+    }
+
+    void BenchmarkTlasBraiding(Scene* scene, const std::string& shadersDirectory)
+    {
+        const RenderOptions& options = scene->renderOptions;
+        printf("%dx%d, max depth %d, %d frames\n", options.renderResolution.x, options.renderResolution.y, options.maxDepth, gpuBenchmarkFrames);
+        printf("%-8s %12s %12s %10s %10s\n", "braid", "BVH (KB)", "rays/frame", "ms/frame", "Mrays/s");
+
+        float sceneFactor = scene->renderOptions.tlasBraidFactor;
+        for (float factor : { 1.0f, 2.0f, 4.0f, 8.0f })
+        {
+            scene->renderOptions.tlasBraidFactor = factor;
+            scene->FlattenBVH();
+            BenchmarkRenderer(("x" + std::to_string((int)factor)).c_str(), GetBvhBytes(scene), scene, shadersDirectory);
+        }
+
+        scene->renderOptions.tlasBraidFactor = sceneFactor;
+        scene->FlattenBVH();
+    }
+
+    void BenchmarkRayDistribution(Scene* scene, const std::string& shadersDirectory)
+    {
+        const RenderOptions& options = scene->renderOptions;
+        printf("%dx%d, max depth %d, %d frames\n", options.renderResolution.x, options.renderResolution.y, options.maxDepth, gpuBenchmarkFrames);
+        printf("%-8s %12s %12s %10s %10s\n", "build", "BVH (KB)", "rays/frame", "ms/frame", "Mrays/s");
+
+        int sceneRays = scene->renderOptions.rdhSampleRays;
+
+        scene->renderOptions.rdhSampleRays = 0;
+        scene->BuildBVH();
+        double sahMrays = BenchmarkRenderer("SAH", GetBvhBytes(scene), scene, shadersDirectory);
+
+        scene->renderOptions.rdhSampleRays = sceneRays > 0 ? sceneRays : rdhSampleRays;
+        scene->BuildBVH();
+        double rdhMrays = BenchmarkRenderer("RDH", GetBvhBytes(scene), scene, shadersDirectory);
+
+        printf("RDH with %d sampled rays: %+.1f%% Mrays/s\n", scene->renderOptions.rdhSampleRays, 100.0 * (rdhMrays / sahMrays - 1.0));
+
+        scene->renderOptions.rdhSampleRays = sceneRays;
+        scene->BuildBVH();
+    }
+
+    // Copies of the scene's instances offset in a 100 unit cube until there are count of them
+    static void ScatterInstances(Scene* scene, int count)
+    {
+        int numInstances = scene->meshInstances.size();
+        if (numInstances == 0)
+            return;
+
+        std::mt19937 rng(1234);
+        std::uniform_real_distribution<float> offset(-50.0f, 50.0f);
+        for (int i = numInstances; i < count; ++i)
+        {
+            MeshInstance instance = scene->meshInstances[i % numInstances];
+            instance.transform = instance.transform * Mat4::Translate(Vec3(offset(rng), offset(rng), offset(rng)));
+            scene->AddMeshInstance(instance);
+        }
+    }
+
+    // Moves every instance a little each frame and times the TLAS update
+    // through RebuildInstances and Renderer::Update. Returns ms per frame
+    static double MoveInstances(Scene* scene, Renderer* renderer, const std::vector<Vec3>& velocities)
+    {
+        glFinish();
+        auto start = std::chrono::high_resolution_clock::now();
+
+        for (int frame = 0; frame < gpuTlasFrames; ++frame)
+        {
+            for (int i = 0; i < scene->meshInstances.size(); ++i)
+            {
+                Mat4& transform = scene->meshInstances[i].transform;
+                transform[3][0] += velocities[i].x;
+                transform[3][1] += velocities[i].y;
+                transform[3][2] += velocities[i].z;
+            }
+
+            scene->RebuildInstances();
+            renderer->Update(0.0f);
+        }
+
+        glFinish();
+        return ElapsedMs(start) / gpuTlasFrames;
+    }
+
+    // Builds the TLAS for the current transforms on the GPU and compares it
+    // with a linear BVH over the same world bounds built on the CPU. The trees
+    // share the node order, so every node has to match exactly. Returns the
+    // number of nodes that differ
+    static int ValidateGpuTlas(Scene* scene, const std::string& shadersDirectory)
+    {
+        const RadeonRays::BvhTranslator& bvhTranslator = scene->bvhTranslator;
+        int numEntries = bvhTranslator.topLevelEntries.size();
+        int numNodes = 2 * numEntries - 1;
+        int topLevelIndex = bvhTranslator.topLevelIndex;
+        size_t nodeSize = bvhTranslator.GetNodeSize();
+
+        // The entry bounds are read from the BLAS nodes through the BVH texture
+        GLuint nodesBuffer, nodesTex;
+        glGenBuffers(1, &nodesBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, nodesBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, nodeSize * (topLevelIndex + numNodes), nullptr, GL_DYNAMIC_READ);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, nodeSize * topLevelIndex, bvhTranslator.GetNodeData(0));
+        glGenTextures(1, &nodesTex);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_BUFFER, nodesTex);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, nodesBuffer);
+        glActiveTexture(GL_TEXTURE0);
+
+        std::vector<RadeonRays::BvhTranslator::Node> gpuNodes(numNodes);
+        {
+            GpuTlasBuilder builder(scene, shadersDirectory, nodesBuffer, 0);
+            builder.Build();
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, nodesBuffer);
+            glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, nodeSize * topLevelIndex, nodeSize * numNodes, &gpuNodes[0]);
+        }
+        glDeleteTextures(1, &nodesTex);
+        glDeleteBuffers(1, &nodesBuffer);
+
+        std::vector<RadeonRays::bbox> bounds(numEntries);
+        for (int i = 0; i < numEntries; ++i)
+        {
+            const RadeonRays::BvhTranslator::InstanceEntry& entry = bvhTranslator.topLevelEntries[i];
+            bounds[i] = RadeonRays::transform(entry.bounds, scene->transforms[entry.instance]);
+        }
+
+        RadeonRays::Lbvh lbvh(10.0f);
+        lbvh.Build(&bounds[0], numEntries);
+
+        auto same = [](const Vec3& a, const Vec3& b) { return a.x == b.x && a.y == b.y && a.z == b.z; };
+
+        int mismatches = 0;
+        for (int i = 0; i < numNodes; ++i)
+        {
+            // Internal nodes come first, leaves follow in code order
+            const RadeonRays::Bvh::Node* node = lbvh.GetNode(i);
+            Vec3 LRLeaf;
+            if (i < numEntries - 1)
+            {
+                LRLeaf = Vec3(topLevelIndex + node->lc, topLevelIndex + node->rc, 0);
+            }
+            else
+            {
+                int entryIndex, materialID, instanceIndex;
+                bvhTranslator.GetTopLevelLeaf(lbvh.GetIndices()[node->startidx], entryIndex, materialID, instanceIndex);
+                LRLeaf = Vec3(entryIndex, materialID, -instanceIndex - 1);
+            }
+
+            const RadeonRays::BvhTranslator::Node& gpuNode = gpuNodes[i];
+            if (!same(gpuNode.bboxmin, node->bounds.pmin) || !same(gpuNode.bboxmax, node->bounds.pmax) || !same(gpuNode.LRLeaf, LRLeaf))
+                mismatches++;
+        }
+
+        return mismatches;
+    }
+
+    void BenchmarkGpuTlasBuild(Scene* scene, const std::string& shadersDirectory)
+    {
+        // The GPU builds binary float nodes only
+        RenderOptions sceneOptions = scene->renderOptions;
+        scene->renderOptions.bvhWidth = 2;
+        scene->renderOptions.quantizeBvh = false;
+        scene->FlattenBVH();
+
+        printf("%d TLAS entries, every instance moving for %d frames\n", (int)scene->bvhTranslator.topLevelEntries.size(), gpuTlasFrames);
+        printf("%-8s %12s\n", "build", "ms/frame");
+
+        std::vector<Mat4> startTransforms;
+        std::vector<Vec3> velocities;
+        std::mt19937 rng(1234);
+        std::uniform_real_distribution<float> velocity(-0.05f, 0.05f);
+        for (const MeshInstance& instance : scene->meshInstances)
+        {
+            startTransforms.push_back(instance.transform);
+            velocities.push_back(Vec3(velocity(rng), velocity(rng), velocity(rng)));
+        }
+
+        double ms[2];
+        for (bool gpu : { false, true })
+        {
+            scene->renderOptions.gpuTlasBuild = gpu;
+            for (int i = 0; i < scene->meshInstances.size(); ++i)
+                scene->meshInstances[i].transform = startTransforms[i];
+            scene->RebuildInstances();
+
+            Renderer* renderer = new Renderer(scene, shadersDirectory);
+            renderer->Update(0.0f);
+            ms[gpu] = MoveInstances(scene, renderer, velocities);
+            delete renderer;
+
+            printf("%-8s %12.2f\n", gpu ? "GPU" : "CPU", ms[gpu]);
+        }
+        printf("Speedup: %.2fx\n", ms[0] / ms[1]);
+
+        int mismatches = ValidateGpuTlas(scene, shadersDirectory);
+        printf("GPU TLAS against CPU linear BVH: %d of %d nodes differ\n", mismatches, (int)(2 * scene->bvhTranslator.topLevelEntries.size() - 1));
+
+        for (int i = 0; i < scene->meshInstances.size(); ++i)
+            scene->meshInstances[i].transform = startTransforms[i];
+        scene->renderOptions = sceneOptions;
+        scene->RebuildInstances();
+        scene->FlattenBVH();
+    }
+
+    // Bind pose of a deformed mesh to the current pose of its animation, the
+    // CPU reference for GpuDeformer
+    static void PoseMesh(const Animation* animation, const Animation::DeformedMesh& deformedMesh, const Mesh* mesh, std::vector<Vec4>& positions)
+    {
+        std::vector<Mat4> joints;
+        if (deformedMesh.skin >= 0)
+            animation->GetJointMatrices(deformedMesh.skin, joints);
+        std::vector<float> weights;
+        animation->GetMorphWeights(deformedMesh, mesh->numMorphTargets, weights);
+
+        int numVertices = (int)mesh->verticesUVX.size();
+        positions.resize(numVertices);
+        for (int v = 0; v < numVertices; ++v)
+        {
+            const Vec4& rest = mesh->verticesUVX[v];
+            Vec3 p(rest.x, rest.y, rest.z);
+            for (int t = 0; t < mesh->numMorphTargets; ++t)
+            {
+                const Vec4& offset = mesh->morphPositions[t * numVertices + v];
+                p = p + Vec3(offset.x, offset.y, offset.z) * weights[t];
+            }
+
+            if (deformedMesh.skin >= 0)
+            {
+                const Vec4& j = mesh->skinJoints[v];
+                const Vec4& w = mesh->skinWeights[v];
+                Vec3 skinned;
+                for (int k = 0; k < 4; ++k)
+                {
+                    const Mat4& m = joints[(int)j[k]];
+                    Vec3 q = Vec3(m.data[0][0], m.data[0][1], m.data[0][2]) * p.x + Vec3(m.data[1][0], m.data[1][1], m.data[1][2]) * p.y
+                        + Vec3(m.data[2][0], m.data[2][1], m.data[2][2]) * p.z + Vec3(m.data[3][0], m.data[3][1], m.data[3][2]);
+                    skinned = skinned + q * w[k];
+                }
+                p = skinned;
+            }
+
+            positions[v] = Vec4(p.x, p.y, p.z, rest.w);
+        }
+    }
+
+    // Poses the deformed meshes with GpuDeformer into copies of the scene
+    // buffers and checks the vertices against PoseMesh and every refitted node
+    // against its triangles or children, which have to match exactly
+    static void ValidateGpuDeformation(Scene* scene, const std::string& shadersDirectory, int& vertexMismatches, int& nodeMismatches)
+    {
+        const RadeonRays::BvhTranslator& bvhTranslator = scene->bvhTranslator;
+        size_t nodeSize = bvhTranslator.GetNodeSize();
+        size_t numNodes = bvhTranslator.GetNodeCount();
+
+        GLuint buffers[5] = {};
+        glGenBuffers(scene->renderOptions.packTriangles ? 5 : 4, buffers);
+        const void* data[5] = { &scene->verticesUVX[0], &scene->normalsUVY[0], &scene->vertIndices[0], bvhTranslator.GetNodeData(0),
+            scene->leafTriangles.empty() ? nullptr : &scene->leafTriangles[0] };
+        size_t sizes[5] = { sizeof(Vec4) * scene->verticesUVX.size(), sizeof(Vec4) * scene->normalsUVY.size(), sizeof(Indices) * scene->vertIndices.size(),
+            nodeSize * numNodes, sizeof(Vec4) * scene->leafTriangles.size() };
+        for (int i = 0; i < 5 && buffers[i]; ++i)
+        {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[i]);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, sizes[i], data[i], GL_DYNAMIC_READ);
+        }
+
+        std::vector<Vec4> vertices(scene->verticesUVX.size());
+        std::vector<RadeonRays::BvhTranslator::Node> nodes(numNodes);
+        {
+            GpuDeformer deformer(scene, shadersDirectory, buffers[0], buffers[1], buffers[2], buffers[3], buffers[4]);
+            deformer.Deform();
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[0]);
+            glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizes[0], &vertices[0]);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[3]);
+            glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizes[3], &nodes[0]);
+        }
+        glDeleteBuffers(scene->renderOptions.packTriangles ? 5 : 4, buffers);
+
+        const std::vector<int>& meshVertices = scene->meshVertexOffsets;
+
+        auto same = [](const Vec3& a, const Vec3& b) { return a.x == b.x && a.y == b.y && a.z == b.z; };
+
+        vertexMismatches = 0;
+        nodeMismatches = 0;
+        for (const Animation* animation : scene->animations)
+        {
+            for (const Animation::DeformedMesh& deformedMesh : animation->meshes)
+            {
+                const Mesh* mesh = scene->meshes[deformedMesh.mesh];
+                std::vector<Vec4> posed;
+                PoseMesh(animation, deformedMesh, mesh, posed);
+
+                RadeonRays::bbox meshBounds;
+                for (const Vec4& v : posed)
+                    meshBounds.grow(Vec3(v.x, v.y, v.z));
+                float tolerance = 1e-5f * std::max(Vec3::Length(meshBounds.extents()), 1.0f);
+
+                for (int v = 0; v < posed.size(); ++v)
+                {
+                    const Vec4& gpu = vertices[meshVertices[deformedMesh.mesh] + v];
+                    if (fabsf(gpu.x - posed[v].x) > tolerance || fabsf(gpu.y - posed[v].y) > tolerance || fabsf(gpu.z - posed[v].z) > tolerance || gpu.w != posed[v].w)
+                        vertexMismatches++;
+                }
+
+                int first, count;
+                bvhTranslator.GetBLASNodeRange(deformedMesh.mesh, first, count);
+                for (int n = first; n < first + count; ++n)
+                {
+                    const RadeonRays::BvhTranslator::Node& node = nodes[n];
+                    RadeonRays::bbox expected;
+                    if (node.LRLeaf.z == 1)
+                    {
+                        for (int t = (int)node.LRLeaf.x; t < (int)(node.LRLeaf.x + node.LRLeaf.y); ++t)
+                        {
+                            for (int corner : { scene->vertIndices[t].x, scene->vertIndices[t].y, scene->vertIndices[t].z })
+                                expected.grow(Vec3(vertices[corner].x, vertices[corner].y, vertices[corner].z));
+                        }
+                    }
+                    else
+                    {
+                        for (float child : { node.LRLeaf.x, node.LRLeaf.y })
+                        {
+                            expected.grow(nodes[(int)child].bboxmin);
+                            expected.grow(nodes[(int)child].bboxmax);
+                        }
+                    }
+
+                    if (!same(node.bboxmin, expected.pmin) || !same(node.bboxmax, expected.pmax))
+                        nodeMismatches++;
+                }
+            }
+        }
+    }
+
+    void BenchmarkDeformation(Scene* scene, const std::string& shadersDirectory)
+    {
+        if (!scene->HasDeformingMeshes())
+        {
+            printf("The scene has no skinned or morphed meshes\n");
+            return;
+        }
+
+        // The GPU refits binary float nodes only
+        RenderOptions sceneOptions = scene->renderOptions;
+        scene->renderOptions.bvhWidth = 2;
+        scene->renderOptions.quantizeBvh = false;
+        scene->FlattenBVH();
+
+        int numVertices = 0;
+        for (const Animation* animation : scene->animations)
+        {
+            for (const Animation::DeformedMesh& deformedMesh : animation->meshes)
+                numVertices += (int)scene->meshes[deformedMesh.mesh]->verticesUVX.size();
+        }
+        printf("%d deformed vertices, animated for %d frames\n", numVertices, deformFrames);
+        printf("%-24s %12s\n", "update", "ms/frame");
+
+        // Pose the meshes on the CPU and build their BVHs again, what animating them takes without GpuDeformer
+        double cpuMs = 0.0;
+        for (int frame = 0; frame < deformFrames; ++frame)
+        {
+            float time = frame / 30.0f;
+            auto start = std::chrono::high_resolution_clock::now();
+            for (Animation* animation : scene->animations)
+            {
+                animation->Evaluate(time);
+                for (const Animation::DeformedMesh& deformedMesh : animation->meshes)
+                {
+                    Mesh posed;
+                    PoseMesh(animation, deformedMesh, scene->meshes[deformedMesh.mesh], posed.verticesUVX);
+                    posed.BuildBVH();
+                }
+            }
+            cpuMs += ElapsedMs(start);
+        }
+        printf("%-24s %12.2f\n", "CPU pose and rebuild", cpuMs / deformFrames);
+
+        Renderer* renderer = new Renderer(scene, shadersDirectory);
+        scene->animationTime = 0.0f;
+        scene->AdvanceAnimation(0.0f);
+        renderer->Update(0.0f);
+
+        glFinish();
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int frame = 0; frame < deformFrames; ++frame)
+        {
+            scene->AdvanceAnimation(1.0f / 30.0f);
+            renderer->Update(0.0f);
+        }
+        glFinish();
+        double gpuMs = ElapsedMs(start) / deformFrames;
+        delete renderer;
+        printf("%-24s %12.2f\n", "GPU deform and refit", gpuMs);
+        printf("Speedup: %.2fx\n", cpuMs / deformFrames / gpuMs);
+
+        int vertexMismatches, nodeMismatches;
+        ValidateGpuDeformation(scene, shadersDirectory, vertexMismatches, nodeMismatches);
+        printf("GPU pose against CPU: %d of %d vertices differ\n", vertexMismatches, numVertices);
+        printf("Refitted BLAS nodes not fitting their triangles or children: %d\n", nodeMismatches);
+
+        scene->renderOptions = sceneOptions;
+        scene->FlattenBVH();
+    }
+
+    // GPU data that grows with the number of placed parts: TLAS nodes, group BVH nodes and transforms
+    struct InstancingBytes
+    {
+        int tlasNodes;
+        size_t tlas;
+        size_t groups;
+        size_t transforms;
+
+        size_t Total() const { return tlas + groups + transforms; }
+    };
+
+    static InstancingBytes GetInstancingBytes(Scene* scene)
+    {
+        const RadeonRays::BvhTranslator& bvhTranslator = scene->bvhTranslator;
+
+        InstancingBytes bytes;
+        bytes.tlasNodes = (int)bvhTranslator.GetNodeCount() - bvhTranslator.topLevelIndex;
+        bytes.tlas = bytes.tlasNodes * bvhTranslator.GetNodeSize();
+        bytes.groups = 0;
+        for (int i = 0; i < scene->meshes.size(); ++i)
+        {
+            if (!scene->meshes[i]->IsGroup())
+                continue;
+
+            int first, count;
+            bvhTranslator.GetBLASNodeRange(i, first, count);
+            bytes.groups += count * bvhTranslator.GetNodeSize();
+        }
+        bytes.transforms = scene->transforms.size() * sizeof(Mat4);
+        return bytes;
+    }
+
+    // Renders the processed scene unless its transforms don't fit the width of
+    // the transforms texture
+    static void BenchmarkInstancedRenderer(const char* label, size_t dataBytes, Scene* scene, const std::string& shadersDirectory)
+    {
+        GLint maxWidth = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxWidth);
+
+        int width = (int)(scene->transforms.size() * (sizeof(Mat4) / sizeof(Vec4)));
+        if (width > maxWidth)
+            printf("%-8s %12.1f   %d transforms need a %d texel transforms texture, the limit is %d\n", label, dataBytes / 1024.0,
+                (int)scene->transforms.size(), width, maxWidth);
+        else
+            BenchmarkRenderer(label, dataBytes, scene, shadersDirectory);
+    }
+
+    void BenchmarkNestedInstancing(Scene* scene, const std::string& shadersDirectory)
+    {
+        if (scene->initialized || scene->meshInstances.empty() || scene->HasInstanceGroups())
+        {
+            printf("Nested instancing needs an unprocessed scene with instances and no groups\n");
+            return;
+        }
+
+        // The scene's instances are the parts of an assembly laid out on an 8x5
+        // grid, assemblies are laid out on a 25x20 facade
+        std::vector<MeshInstance> parts;
+        RadeonRays::bbox partBounds;
+        for (const MeshInstance& instance : scene->meshInstances)
+        {
+            RadeonRays::bbox meshBounds;
+            for (const Vec4& vertex : scene->meshes[instance.meshID]->verticesUVX)
+                meshBounds.grow(Vec3(vertex));
+            partBounds.grow(RadeonRays::transform(meshBounds, instance.transform));
+        }
+
+        Vec3 partSize = partBounds.extents() * 1.1f;
+        for (int i = 0; i < nestedParts; ++i)
+        {
+            MeshInstance part = scene->meshInstances[i % scene->meshInstances.size()];
+            part.transform = part.transform * Mat4::Translate(Vec3((i % 8) * partSize.x, (i / 8) * partSize.y, 0.0f) - partBounds.pmin);
+            parts.push_back(part);
+        }
+
+        Vec3 assemblySize = Vec3(8.0f * partSize.x, 5.0f * partSize.y, partSize.z) * 1.1f;
+        std::vector<Mat4> assemblies;
+        for (int i = 0; i < nestedAssemblies; ++i)
+            assemblies.push_back(Mat4::Translate(Vec3((i % 25) * assemblySize.x, (i / 25) * assemblySize.y, 0.0f)));
+
+        // Looking at the whole facade
+        Vec3 facadeSize = Vec3(25.0f * assemblySize.x, ((nestedAssemblies + 24) / 25) * assemblySize.y, assemblySize.z);
+        Vec3 center = facadeSize * 0.5f;
+        scene->AddCamera(center + Vec3(0.0f, 0.0f, std::max(facadeSize.x, facadeSize.y) * 1.3f), center, 45.0f);
+
+        // Groups need the binary float layout, and a merged mesh would follow the
+        // group in the meshes and move it when it is merged again
+        RenderOptions sceneOptions = scene->renderOptions;
+        scene->renderOptions.bvhWidth = 2;
+        scene->renderOptions.quantizeBvh = false;
+        scene->renderOptions.mergeMeshTriangles = 0;
+
+        const RenderOptions& options = scene->renderOptions;
+        printf("%d assemblies of %d parts\n", nestedAssemblies, nestedParts);
+        printf("%dx%d, max depth %d, %d frames\n", options.renderResolution.x, options.renderResolution.y, options.maxDepth, gpuBenchmarkFrames);
+        printf("%-8s %12s %12s %10s %10s\n", "scene", "inst (KB)", "rays/frame", "ms/frame", "Mrays/s");
+
+        // Every part placed on its own with the transforms composed
+        scene->meshInstances.clear();
+        for (const Mat4& assembly : assemblies)
+        {
+            for (MeshInstance part : parts)
+            {
+                part.transform = part.transform * assembly;
+                scene->AddMeshInstance(part);
+            }
+        }
+        scene->ProcessScene();
+        InstancingBytes flat = GetInstancingBytes(scene);
+        BenchmarkInstancedRenderer("flat", flat.Total(), scene, shadersDirectory);
+
+        // One group of the parts placed once per assembly
+        int group = scene->AddInstanceGroup("assembly", parts);
+        scene->meshInstances.clear();
+        for (int i = 0; i < nestedAssemblies; ++i)
+            scene->AddMeshInstance(MeshInstance("assembly " + std::to_string(i), group, assemblies[i], parts[0].materialID));
+        scene->ProcessScene();
+        InstancingBytes nested = GetInstancingBytes(scene);
+        BenchmarkInstancedRenderer("nested", nested.Total(), scene, shadersDirectory);
+
+        printf("%-8s %10s %12s %12s %16s %12s\n", "scene", "TLAS nodes", "TLAS (KB)", "groups (KB)", "transforms (KB)", "total (KB)");
+        for (const InstancingBytes* bytes : { &flat, &nested })
+        {
+            printf("%-8s %10d %12.1f %12.1f %16.1f %12.1f\n", bytes == &flat ? "flat" : "nested", bytes->tlasNodes, bytes->tlas / 1024.0,
+                bytes->groups / 1024.0, bytes->transforms / 1024.0, bytes->Total() / 1024.0);
+        }
+        printf("Nested instancing: %.1fx less TLAS, group and transform memory\n", (double)flat.Total() / nested.Total());
+
+        scene->renderOptions = sceneOptions;
+    }
+
+    static const char* pathTraceModeNames[] = { "fragment", "persist", "wave" };
+
+    // Average GPU time of the path tracing pass from the renderer's timer queries,
+    // which lag two frames behind
+    static double PathTraceQueryMs(Scene* scene, const std::string& shadersDirectory)
+    {
+        Renderer* renderer = new Renderer(scene, shadersDirectory);
+        RenderFrames(renderer, gpuWarmupFrames);
+
+        double ms = 0.0;
+        for (int i = 0; i < gpuBenchmarkFrames; i++)
+        {
+            renderer->Update(0.0f);
+            renderer->Render();
+            ms += renderer->GetPathTraceTime();
+        }
+        delete renderer;
+        return ms / gpuBenchmarkFrames;
+    }
+
+    // One frame with the fragment shader and with mode. All draw the same random
+    // numbers for a pixel, rounding sets them apart, mostly in the camera rays the
+    // fragment shader gets from interpolated texture coordinates
+    static void CompareTracerImages(PathTraceMode mode, Scene* scene, const std::string& shadersDirectory)
+    {
+        std::vector<unsigned char> images[2];
+        for (int i = 0; i < 2; i++)
+        {
+            scene->renderOptions.pathTraceMode = i == 0 ? FragmentPathTrace : mode;
+            RenderImage(scene, shadersDirectory, images[i]);
+        }
+        PrintImageDifference(pathTraceModeNames[mode], images[0], images[1]);
+    }
+
+    void BenchmarkPathTracers(Scene* scene, const std::string& shadersDirectory)
+    {
+        const RenderOptions& options = scene->renderOptions;
+        printf("%dx%d, max depth %d, %d frames, %d persistent groups\n", options.renderResolution.x, options.renderResolution.y,
+            options.maxDepth, gpuBenchmarkFrames, options.persistentGroups);
+        printf("%-8s %12s %12s %10s %10s\n", "tracer", "buffers (KB)", "rays/frame", "ms/frame", "Mrays/s");
+
+        PathTraceMode sceneMode = scene->renderOptions.pathTraceMode;
+        size_t bufferBytes[] = { 0, PersistentTracer::GetBufferBytes(options.renderResolution),
+            WavefrontTracer::GetBufferBytes(options.renderResolution) };
+
+        // Shadow rays of samples the BSDF gives no weight are only traced by the
+        // megakernels, compare the time per frame rather than the ray rates
+        double queryMs[3];
+        for (PathTraceMode mode : { FragmentPathTrace, PersistentPathTrace, WavefrontPathTrace })
+        {
+            scene->renderOptions.pathTraceMode = mode;
+            BenchmarkRenderer(pathTraceModeNames[mode], bufferBytes[mode], scene, shadersDirectory);
+            queryMs[mode] = PathTraceQueryMs(scene, shadersDirectory);
+        }
+
+        printf("%-8s %14s\n", "tracer", "query ms/frame");
+        for (PathTraceMode mode : { FragmentPathTrace, PersistentPathTrace, WavefrontPathTrace })
+            printf("%-8s %14.2f\n", pathTraceModeNames[mode], queryMs[mode]);
+
+        CompareTracerImages(PersistentPathTrace, scene, shadersDirectory);
+        CompareTracerImages(WavefrontPathTrace, scene, shadersDirectory);
+        scene->renderOptions.pathTraceMode = sceneMode;
+    }
+
+    void BenchmarkStacklessTraversal(Scene* scene, const std::string& shadersDirectory)
+    {
+        const RenderOptions& options = scene->renderOptions;
+        printf("%dx%d, max depth %d, %d frames\n", options.renderResolution.x, options.renderResolution.y, options.maxDepth, gpuBenchmarkFrames);
+        printf("%-8s %12s %12s %10s %10s\n", "traverse", "links (KB)", "rays/frame", "ms/frame", "Mrays/s");
+
+        RenderOptions sceneOptions = scene->renderOptions;
+        scene->renderOptions.bvhWidth = 2;
+        scene->renderOptions.quantizeBvh = false;
+
+        std::vector<unsigned char> images[2];
+        double mrays[2];
+        for (int i = 0; i < 2; i++)
+        {
+            scene->renderOptions.stacklessTraversal = i == 1;
+            scene->FlattenBVH();
+            mrays[i] = BenchmarkRenderer(i == 0 ? "stack" : "links", sizeof(int) * scene->bvhTranslator.links.size(), scene, shadersDirectory);
+            RenderImage(scene, shadersDirectory, images[i]);
+        }
+
+        // GL has no occupancy query, the registers a ray keeps for traversal are
+        // what sets it. The stack version has its 64 entry stack and pointer, the
+        // stackless one a leaf and an entry node for each instance level
+        int levels = std::max(scene->GetInstanceLevels(), 1);
+        printf("Traversal state per ray: stack %d bytes, links %d bytes\n", (int)sizeof(int) * 65, (int)sizeof(int) * 2 * levels);
+        printf("Stackless: %.2fx the Mrays/s of the stack\n", mrays[1] / mrays[0]);
+        PrintImageDifference("Stackless", images[0], images[1]);
+
+        scene->renderOptions = sceneOptions;
+        scene->FlattenBVH();
+    }
+
+    void BenchmarkLightBvh(Scene* scene, const std::string& shadersDirectory)
+    {
+        // A 40x25 grid of small quads facing down just under the top of the scene,
+        // on top of the scene's own lights
+        int sceneLights = scene->lights.size();
+        RadeonRays::bbox bounds = scene->sceneBounds;
+        Vec3 extents = bounds.extents();
+        for (int i = sceneLights; i < benchmarkLightCount; i++)
+        {
+            int cell = i - sceneLights;
+            Vec3 cellSize = Vec3(extents.x / 40.0f, 0.0f, extents.z / 25.0f);
+
+            Light light;
+            light.type = LightType::RectLight;
+            light.position = bounds.pmin + Vec3((cell % 40 + 0.25f) * cellSize.x, extents.y * 0.99f, (cell / 40 % 25 + 0.25f) * cellSize.z);
+            light.u = Vec3(cellSize.x * 0.5f, 0.0f, 0.0f);
+            light.v = Vec3(0.0f, 0.0f, cellSize.z * 0.5f);
+            light.area = Vec3::Length(Vec3::Cross(light.u, light.v));
+            light.emission = Vec3(5.0f, 5.0f, 5.0f);
+            light.radius = 0.0f;
+            scene->AddLight(light);
+        }
+        scene->BuildLightBVH();
+
+        const RenderOptions& options = scene->renderOptions;
+        printf("%dx%d, max depth %d, %d frames, %d lights\n", options.renderResolution.x, options.renderResolution.y, options.maxDepth,
+            gpuBenchmarkFrames, (int)scene->lights.size());
+        printf("%-8s %12s %12s %10s %10s\n", "lights", "BVH (KB)", "rays/frame", "ms/frame", "Mrays/s");
+
+        bool sceneLightBvh = scene->renderOptions.lightBvh;
+        std::vector<unsigned char> images[2];
+        double mrays[2];
+        for (int i = 0; i < 2; i++)
+        {
+            scene->renderOptions.lightBvh = i == 1;
+            size_t bvhBytes = i == 1 ? sizeof(RadeonRays::BvhTranslator::Node) * scene->lightBvhNodes.size() : 0;
+            mrays[i] = BenchmarkRenderer(i == 0 ? "loop" : "BVH", bvhBytes, scene, shadersDirectory);
+            RenderImage(scene, shadersDirectory, images[i]);
+        }
+        printf("Light BVH: %.2fx the Mrays/s of the loop\n", mrays[1] / mrays[0]);
+        PrintImageDifference("Light BVH", images[0], images[1]);
+
+        scene->renderOptions.lightBvh = sceneLightBvh;
+        scene->lights.resize(sceneLights);
+        scene->BuildLightBVH();
+    }
+
+    void BenchmarkRasterPrimary(Scene* scene, const std::string& shadersDirectory)
+    {
+        RenderOptions sceneOptions = scene->renderOptions;
+        scene->renderOptions.pathTraceMode = FragmentPathTrace;
+        scene->renderOptions.enableRayStats = false;
+        scene->renderOptions.enableDenoiser = false;
+
+        printf("max depth %d, %d frames\n", scene->renderOptions.maxDepth, rasterFrames);
+        printf("%-10s %-8s %12s %10s %14s\n", "size", "primary", "buffers (KB)", "ms/frame", "query ms/frame");
+
+        for (iVec2 resolution : rasterResolutions)
+        {
+            scene->renderOptions.renderResolution = resolution;
+            scene->renderOptions.windowResolution = resolution;
+            std::string size = std::to_string(resolution.x) + "x" + std::to_string(resolution.y);
+
+            // Query times lag two frames behind, the warmup frames fill them
+            double ms[2];
+            double queryMs[2];
+            for (int i = 0; i < 2; i++)
+            {
+                scene->renderOptions.rasterPrimary = i == 1;
+                Renderer* renderer = new Renderer(scene, shadersDirectory);
+                RenderFrames(renderer, rasterWarmupFrames);
+
+                ms[i] = 0.0;
+                queryMs[i] = 0.0;
+                for (int frame = 0; frame < rasterFrames; frame++)
+                {
+                    ms[i] += RenderFrames(renderer, 1);
+                    queryMs[i] += renderer->GetPathTraceTime();
+                }
+                ms[i] /= rasterFrames;
+                queryMs[i] /= rasterFrames;
+                delete renderer;
+
+                size_t bufferBytes = i == 1 ? VisibilityPass::GetBufferBytes(resolution) : 0;
+                printf("%-10s %-8s %12.1f %10.2f %14.2f\n", size.c_str(), i == 0 ? "traced" : "raster", bufferBytes / 1024.0, ms[i], queryMs[i]);
+            }
+            printf("%s: rasterized primary visibility saves %.2f ms/frame (%.1f%%)\n", size.c_str(), ms[0] - ms[1], (ms[0] - ms[1]) * 100.0 / ms[0]);
+        }
+
+        scene->renderOptions = sceneOptions;
+    }
+
+    bool IsGpuBenchmark(const std::string& name)
+    {
+        return name == "bvhwidth" || name == "layout" || name == "triangles" || name == "braid" || name == "rdh" || name == "gputlas"
+            || name == "deform" || name == "nested" || name == "tracers" || name == "stackless" || name == "lights" || name == "raster";
+    }
+
+    bool RunGpuBenchmark(const std::string& name, Scene* scene, const std::string& shadersDirectory)
+    {
+        // Scatter scenes are made before the scene is processed
+        if (name == "gputlas" && !scene->initialized)
+            ScatterInstances(scene, gpuTlasInstanceCount);
+
+        // Processes its flat and nested scenes itself
+        if (name == "nested")
+        {
+            BenchmarkNestedInstancing(scene, shadersDirectory);
+            return true;
+        }
+
+        if (!scene->initialized)
+            scene->ProcessScene();
+
+        if (name == "bvhwidth")
+            BenchmarkBvhWidth(scene, shadersDirectory);
+        else if (name == "layout")
+            BenchmarkNodeLayout(scene, shadersDirectory);
+        else if (name == "triangles")
+            BenchmarkTriangleLayout(scene, shadersDirectory);
+        else if (name == "braid")
+            BenchmarkTlasBraiding(scene, shadersDirectory);
+        else if (name == "rdh")
+            BenchmarkRayDistribution(scene, shadersDirectory);
+        else if (name == "gputlas")
+            BenchmarkGpuTlasBuild(scene, shadersDirectory);
+        else if (name == "deform")
+            BenchmarkDeformation(scene, shadersDirectory);
+        else if (name == "tracers")
+            BenchmarkPathTracers(scene, shadersDirectory);
+        else if (name == "stackless")
+            BenchmarkStacklessTraversal(scene, shadersDirectory);
+        else if (name == "lights")
+            BenchmarkLightBvh(scene, shadersDirectory);
+        else if (name == "raster")
+            BenchmarkRasterPrimary(scene, shadersDirectory);
+        else
+            return false;
+
+        return true;
+    }
+
+    bool RunBenchmark(const std::string& name, Scene* scene)
+    {
+        if (name == "build")
+            BenchmarkBvhBuild(scene);
+        else if (name == "sbvh")
+            BenchmarkSplitBvh(scene);
+        else if (name == "sah")
+            BenchmarkSahKernels(scene);
+        else if (name == "simd")
+            BenchmarkSimd(scene);
+        else if (name == "lbvh")
+            BenchmarkLbvh(scene);
+        else if (name == "tlas")
+            BenchmarkTlasRefit();
+        else if (name == "treelet")
+            BenchmarkTreelets(scene);
+        else
+            return false;
+
+        return true;
+    }
+}
@@ -0,0 +1,121 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <string>
+
+namespace GLSLPT
+{
+    class Scene;
+
+    // Command line benchmarks, selected with -b <name>. They run on the loaded
+    // scene before any window is created and print their results to stdout.
+    // Returns false if the benchmark name is unknown
+    bool RunBenchmark(const std::string& name, Scene* scene);
+
+    // Times RadeonRays::Bvh builds over a range of thread counts and checks
+    // every result against the single threaded tree
+    void BenchmarkBvhBuild(Scene* scene);
+
+    // Compares the spatial split BVH configured in the scene's render options
+    // with a plain object split build and a linear BVH of every mesh
+    void BenchmarkSplitBvh(Scene* scene);
+
+    // Linear BVH build time on the scene meshes and a 10M triangle soup
+    void BenchmarkLbvh(Scene* scene);
+
+    // Top level BVH refit against a full rebuild while synthetic instances are dragged
+    void BenchmarkTlasRefit();
+
+    // Treelet restructuring gains on top of each builder
+    void BenchmarkTreelets(Scene* scene);
+
+    // Build throughput of every SAH kernel the CPU supports against the
+    // original allocating path
+    void BenchmarkSahKernels(Scene* scene);
+
+    // Scalar geometry processing against the SSE types of Simd.h: triangle
+    // bounds, box centers and the spatial split BVH build of every mesh
+    void BenchmarkSimd(Scene* scene);
+
+    // GPU benchmarks render with the path tracing shader, so they run once a
+    // GL context exists, in place of the interactive loop
+    bool IsGpuBenchmark(const std::string& name);
+    bool RunGpuBenchmark(const std::string& name, Scene* scene, const std::string& shadersDirectory);
+
+    // Path tracing throughput and BVH size with binary, 4 wide and 8 wide
+    // BVH layouts, each with float and quantized nodes
+    void BenchmarkBvhWidth(Scene* scene, const std::string& shadersDirectory);
+
+    // Path tracing throughput of the binary BVH with every node layout, the
+    // texture cache hit rate is what differs between them
+    void BenchmarkNodeLayout(Scene* scene, const std::string& shadersDirectory);
+
+    // Path tracing throughput and triangle memory with indexed vertices
+    // against precomputed triangles in leaf order
+    void BenchmarkTriangleLayout(Scene* scene, const std::string& shadersDirectory);
+
+    // Path tracing throughput with the TLAS re-braided at 1 (off), 2, 4 and 8
+    // entries per instance
+    void BenchmarkTlasBraiding(Scene* scene, const std::string& shadersDirectory);
+
+    // Path tracing throughput with plain SAH BVHs against BVHs built with the
+    // ray distribution heuristic for the scene's camera
+    void BenchmarkRayDistribution(Scene* scene, const std::string& shadersDirectory);
+
+    // TLAS update time with every instance moving each frame, CPU refit and
+    // upload against GpuTlasBuilder, and a node by node check of the GPU tree
+    // against a RadeonRays::Lbvh built on the CPU. Unprocessed scenes are first
+    // scattered to 100k instances
+    void BenchmarkGpuTlasBuild(Scene* scene, const std::string& shadersDirectory);
+
+    // Animation update time of the skinned and morphed meshes, posing them on
+    // the CPU and rebuilding their BVHs against GpuDeformer, and a check of the
+    // posed vertices and refitted BLAS nodes read back from the GPU
+    void BenchmarkDeformation(Scene* scene, const std::string& shadersDirectory);
+
+    // TLAS, group BVH and transform memory and path tracing throughput of an
+    // unprocessed scene's instances copied into 500 assemblies of 40 parts,
+    // every part a TLAS instance against one instance group per assembly
+    void BenchmarkNestedInstancing(Scene* scene, const std::string& shadersDirectory);
+
+    // Path tracing throughput, time per frame and timer query time of the
+    // preview.glsl fragment shader, PersistentTracer and WavefrontTracer, and
+    // how far the compute tracers' images are from the fragment shader's
+    void BenchmarkPathTracers(Scene* scene, const std::string& shadersDirectory);
+
+    // Path tracing throughput and per ray traversal state of the binary BVH
+    // traversed with a stack against parent links, and how far the images differ
+    void BenchmarkStacklessTraversal(Scene* scene, const std::string& shadersDirectory);
+
+    // Path tracing throughput with 1000 quad lights, found by looping over all
+    // of them and through the light BVH, and how far the images differ
+    void BenchmarkLightBvh(Scene* scene, const std::string& shadersDirectory);
+
+    // Time per frame and timer query time of the fragment shader at 1080p and
+    // 4K with camera rays traced against drawn into a VisibilityPass buffer
+    void BenchmarkRasterPrimary(Scene* scene, const std::string& shadersDirectory);
+}
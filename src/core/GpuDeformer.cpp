@@ -0,0 +1,300 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <vector>
+#include <climits>
+#include <algorithm>
+#include "GpuDeformer.h"
+#include "Renderer.h"
+#include "Scene.h"
+
+namespace GLSLPT
+{
+    static const int blockSize = 256;
+
+    GpuDeformer::GpuDeformer(Scene* scene, const std::string& shadersDirectory, GLuint verticesBuffer, GLuint normalsBuffer,
+        GLuint vertexIndicesBuffer, GLuint bvhBuffer, GLuint trianglesBuffer)
+        : scene(scene)
+        , numJoints(0)
+        , numMorphWeights(0)
+        , packTriangles(trianglesBuffer != 0)
+    {
+        const RadeonRays::BvhTranslator& bvhTranslator = scene->bvhTranslator;
+
+        // First scene vertex of every mesh, deformed meshes are never merged
+        const std::vector<int>& meshVertices = scene->meshVertexOffsets;
+
+        std::vector<DeformVertex> deformVertices;
+        std::vector<int> deformMeshes;
+        std::vector<Vec4> morphOffsets;
+        std::vector<int> refitNodes;
+
+        int firstVertex = INT_MAX, endVertex = 0;
+        int firstNode = INT_MAX, endNode = 0;
+        int firstTriangle = INT_MAX, endTriangle = 0;
+
+        for (const Animation* animation : scene->animations)
+        {
+            for (const Animation::DeformedMesh& deformedMesh : animation->meshes)
+            {
+                const Mesh* mesh = scene->meshes[deformedMesh.mesh];
+                int meshIndex = (int)deformMeshes.size() / 4;
+                int meshVertexCount = (int)mesh->verticesUVX.size();
+                int firstMorphOffset = (int)morphOffsets.size() / 2;
+                bool skinned = deformedMesh.skin >= 0;
+
+                deformMeshes.insert(deformMeshes.end(), { skinned ? numJoints : -1, mesh->numMorphTargets, numMorphWeights, meshVertexCount });
+                if (skinned)
+                    numJoints += (int)animation->skins[deformedMesh.skin].joints.size();
+                numMorphWeights += mesh->numMorphTargets;
+
+                for (int v = 0; v < meshVertexCount; v++)
+                {
+                    const Vec4& position = mesh->verticesUVX[v];
+                    const Vec4& normal = mesh->normalsUVY[v];
+                    Vec4 joints = skinned ? mesh->skinJoints[v] : Vec4();
+                    Vec4 weights = skinned ? mesh->skinWeights[v] : Vec4();
+
+                    deformVertices.push_back({
+                        { position.x, position.y, position.z, position.w },
+                        { normal.x, normal.y, normal.z, normal.w },
+                        { (int)joints.x, (int)joints.y, (int)joints.z, (int)joints.w },
+                        { weights.x, weights.y, weights.z, weights.w },
+                        { meshVertices[deformedMesh.mesh] + v, meshIndex, firstMorphOffset + v, 0 } });
+                }
+
+                for (int i = 0; i < mesh->numMorphTargets * meshVertexCount; i++)
+                {
+                    morphOffsets.push_back(mesh->morphPositions[i]);
+                    morphOffsets.push_back(mesh->morphNormals[i]);
+                }
+
+                firstVertex = std::min(firstVertex, meshVertices[deformedMesh.mesh]);
+                endVertex = std::max(endVertex, meshVertices[deformedMesh.mesh + 1]);
+
+                // Parents of the BLAS nodes, as indices into refitNodes
+                int first, count;
+                bvhTranslator.GetBLASNodeRange(deformedMesh.mesh, first, count);
+                int refitBase = (int)refitNodes.size() / 4;
+                std::vector<int> parents(count, -1);
+                for (int n = first; n < first + count; n++)
+                {
+                    const RadeonRays::BvhTranslator::Node& node = bvhTranslator.nodes[n];
+                    if (node.LRLeaf.z == 0)
+                    {
+                        parents[(int)node.LRLeaf.x - first] = refitBase + n - first;
+                        parents[(int)node.LRLeaf.y - first] = refitBase + n - first;
+                    }
+                }
+
+                for (int n = first; n < first + count; n++)
+                {
+                    const RadeonRays::BvhTranslator::Node& node = bvhTranslator.nodes[n];
+                    bool leaf = node.LRLeaf.z == 1;
+                    refitNodes.insert(refitNodes.end(), { n, parents[n - first], leaf ? 1 : 0, 0 });
+
+                    if (leaf)
+                    {
+                        firstTriangle = std::min(firstTriangle, (int)node.LRLeaf.x);
+                        endTriangle = std::max(endTriangle, (int)(node.LRLeaf.x + node.LRLeaf.y));
+                    }
+                }
+
+                firstNode = std::min(firstNode, first);
+                endNode = std::max(endNode, first + count);
+            }
+        }
+
+        numVertices = (int)deformVertices.size();
+        numRefitNodes = (int)refitNodes.size() / 4;
+
+        vertices = MakeRange(verticesBuffer, sizeof(Vec4), sizeof(Vec4), firstVertex, endVertex - firstVertex);
+        normals = MakeRange(normalsBuffer, sizeof(Vec4), sizeof(Vec4), firstVertex, endVertex - firstVertex);
+        vertexIndices = MakeRange(vertexIndicesBuffer, sizeof(Indices), sizeof(int), firstTriangle, endTriangle - firstTriangle);
+        nodes = MakeRange(bvhBuffer, bvhTranslator.GetNodeSize(), sizeof(float), firstNode, endNode - firstNode);
+        if (packTriangles)
+            triangles = MakeRange(trianglesBuffer, sizeof(Vec4) * 3, sizeof(Vec4), firstTriangle, endTriangle - firstTriangle);
+
+        glGenBuffers(1, &deformVerticesBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, deformVerticesBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(DeformVertex) * numVertices, &deformVertices[0], GL_STATIC_DRAW);
+
+        glGenBuffers(1, &deformMeshesBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, deformMeshesBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(int) * deformMeshes.size(), &deformMeshes[0], GL_STATIC_DRAW);
+
+        // Meshes can do without a skin or morph targets, the buffers never go empty
+        glGenBuffers(1, &jointMatricesBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, jointMatricesBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(Mat4) * std::max(numJoints, 1), nullptr, GL_DYNAMIC_DRAW);
+
+        glGenBuffers(1, &morphWeightsBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, morphWeightsBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(float) * std::max(numMorphWeights, 1), nullptr, GL_DYNAMIC_DRAW);
+
+        glGenBuffers(1, &morphOffsetsBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, morphOffsetsBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(Vec4) * std::max((int)morphOffsets.size(), 2), morphOffsets.empty() ? nullptr : &morphOffsets[0], GL_STATIC_DRAW);
+
+        glGenBuffers(1, &refitNodesBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, refitNodesBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(int) * refitNodes.size(), &refitNodes[0], GL_STATIC_DRAW);
+
+        glGenBuffers(1, &visitsBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, visitsBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLint) * numRefitNodes, nullptr, GL_DYNAMIC_COPY);
+
+        skinShader = LoadKernel(shadersDirectory, "#define KERNEL_SKIN\n");
+        skinShader->Use();
+        GLuint shaderObject = skinShader->getObject();
+        glUniform1i(glGetUniformLocation(shaderObject, "numVertices"), numVertices);
+        glUniform1i(glGetUniformLocation(shaderObject, "vertexBase"), vertices.base);
+        skinShader->StopUsing();
+
+        refitShader = LoadKernel(shadersDirectory, packTriangles ? "#define KERNEL_REFIT\n#define PACK_TRIANGLES\n" : "#define KERNEL_REFIT\n");
+        refitShader->Use();
+        shaderObject = refitShader->getObject();
+        glUniform1i(glGetUniformLocation(shaderObject, "numRefitNodes"), numRefitNodes);
+        glUniform1i(glGetUniformLocation(shaderObject, "nodeBase"), nodes.base);
+        glUniform1i(glGetUniformLocation(shaderObject, "indexBase"), vertexIndices.base);
+        glUniform1i(glGetUniformLocation(shaderObject, "vertexBase"), vertices.base);
+        glUniform1i(glGetUniformLocation(shaderObject, "triangleBase"), packTriangles ? triangles.base : 0);
+        refitShader->StopUsing();
+
+        printf("GPU deformation of %d vertices, refitting %d BLAS nodes\n", numVertices, numRefitNodes);
+    }
+
+    GpuDeformer::~GpuDeformer()
+    {
+        glDeleteBuffers(1, &deformVerticesBuffer);
+        glDeleteBuffers(1, &deformMeshesBuffer);
+        glDeleteBuffers(1, &jointMatricesBuffer);
+        glDeleteBuffers(1, &morphWeightsBuffer);
+        glDeleteBuffers(1, &morphOffsetsBuffer);
+        glDeleteBuffers(1, &refitNodesBuffer);
+        glDeleteBuffers(1, &visitsBuffer);
+
+        delete skinShader;
+        delete refitShader;
+    }
+
+    GpuDeformer::BufferRange GpuDeformer::MakeRange(GLuint buffer, size_t elementSize, size_t unitSize, int first, int count)
+    {
+        GLint alignment = 1;
+        glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+
+        BufferRange range;
+        range.buffer = buffer;
+        GLintptr offset = (GLintptr)elementSize * first;
+        range.offset = offset / alignment * alignment;
+        range.size = offset - range.offset + (GLsizeiptr)elementSize * count;
+        range.base = (int)((offset - range.offset) / unitSize) - first * (int)(elementSize / unitSize);
+
+        GLint maxBlockSize = 0;
+        glGetIntegerv(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxBlockSize);
+        if (range.size > maxBlockSize)
+            printf("GPU deformation needs %td bytes of a buffer, storage blocks are limited to %d\n", range.size, maxBlockSize);
+
+        return range;
+    }
+
+    Program* GpuDeformer::LoadKernel(const std::string& shadersDirectory, const std::string& defines)
+    {
+        ShaderInclude::ShaderSource kernelSrcObj = ShaderInclude::load(shadersDirectory + "deform.glsl");
+
+        size_t idx = kernelSrcObj.src.find("#version");
+        if (idx != -1)
+            idx = kernelSrcObj.src.find("\n", idx);
+        else
+            idx = 0;
+        kernelSrcObj.src.insert(idx + 1, defines);
+
+        return LoadComputeShader(kernelSrcObj);
+    }
+
+    void GpuDeformer::Deform()
+    {
+        // Only the pose comes from the CPU
+        std::vector<Mat4> jointMatrices;
+        std::vector<float> morphWeights;
+        for (const Animation* animation : scene->animations)
+        {
+            for (const Animation::DeformedMesh& deformedMesh : animation->meshes)
+            {
+                std::vector<Mat4> matrices;
+                if (deformedMesh.skin >= 0)
+                {
+                    animation->GetJointMatrices(deformedMesh.skin, matrices);
+                    jointMatrices.insert(jointMatrices.end(), matrices.begin(), matrices.end());
+                }
+
+                std::vector<float> weights;
+                animation->GetMorphWeights(deformedMesh, scene->meshes[deformedMesh.mesh]->numMorphTargets, weights);
+                morphWeights.insert(morphWeights.end(), weights.begin(), weights.end());
+            }
+        }
+
+        if (!jointMatrices.empty())
+        {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, jointMatricesBuffer);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(Mat4) * jointMatrices.size(), &jointMatrices[0]);
+        }
+
+        if (!morphWeights.empty())
+        {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, morphWeightsBuffer);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(float) * morphWeights.size(), &morphWeights[0]);
+        }
+
+        // Unvisited nodes
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, visitsBuffer);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32I, GL_RED_INTEGER, GL_INT, nullptr);
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, deformVerticesBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, deformMeshesBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, jointMatricesBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, morphWeightsBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, morphOffsetsBuffer);
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 6, vertices.buffer, vertices.offset, vertices.size);
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 7, normals.buffer, normals.offset, normals.size);
+
+        skinShader->Use();
+        glDispatchCompute((numVertices + blockSize - 1) / blockSize, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, refitNodesBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, visitsBuffer);
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 3, vertexIndices.buffer, vertexIndices.offset, vertexIndices.size);
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 4, vertices.buffer, vertices.offset, vertices.size);
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 5, nodes.buffer, nodes.offset, nodes.size);
+        if (packTriangles)
+            glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 6, triangles.buffer, triangles.offset, triangles.size);
+
+        refitShader->Use();
+        glDispatchCompute((numRefitNodes + blockSize - 1) / blockSize, 1, 1);
+        refitShader->StopUsing();
+
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+    }
+}
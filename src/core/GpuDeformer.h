@@ -0,0 +1,104 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include "Config.h"
+
+namespace GLSLPT
+{
+    class Program;
+    class Scene;
+
+    // Poses the skinned and morphed meshes of the scene's animations with compute
+    // shaders, writing straight into the scene vertex and normal buffers, and
+    // refits their BLAS bottom up in the BVH buffer. The topology of each BLAS
+    // stays the one built on load and only the nodes of deformed meshes are
+    // touched, the TLAS is built over them afterwards by GpuTlasBuilder. The CPU
+    // only sends joint matrices and morph weights, see deform.glsl
+    class GpuDeformer
+    {
+    public:
+        // Uploads the bind poses of the deformed meshes, the scene has to be
+        // flattened in the binary float layout. trianglesBuffer is 0 unless
+        // renderOptions.packTriangles is set
+        GpuDeformer(Scene* scene, const std::string& shadersDirectory, GLuint verticesBuffer, GLuint normalsBuffer,
+            GLuint vertexIndicesBuffer, GLuint bvhBuffer, GLuint trianglesBuffer);
+        ~GpuDeformer();
+
+        // Pose the meshes as the animations were last evaluated and refit their
+        // BLAS, texture fetches issued afterwards see the new vertices and nodes
+        void Deform();
+
+    private:
+        // Layout of a vertex in the DeformVertices buffer of the kernels
+        struct DeformVertex
+        {
+            float position[4];
+            float normal[4];
+            int joints[4];
+            float weights[4];
+            int info[4];
+        };
+
+        // Part of a scene buffer the kernels bind, base turns a scene index into
+        // an index of the bound range
+        struct BufferRange
+        {
+            GLuint buffer;
+            GLintptr offset;
+            GLsizeiptr size;
+            int base;
+        };
+
+        Scene* scene;
+        int numVertices;
+        int numRefitNodes;
+        int numJoints;
+        int numMorphWeights;
+        bool packTriangles;
+
+        BufferRange vertices;
+        BufferRange normals;
+        BufferRange vertexIndices;
+        BufferRange nodes;
+        BufferRange triangles;
+
+        GLuint deformVerticesBuffer;
+        GLuint deformMeshesBuffer;
+        GLuint jointMatricesBuffer;
+        GLuint morphWeightsBuffer;
+        GLuint morphOffsetsBuffer;
+        GLuint refitNodesBuffer;
+        GLuint visitsBuffer;
+
+        Program* skinShader;
+        Program* refitShader;
+
+        // Range of count elements from first, indexed in units of unitSize bytes by the kernels
+        static BufferRange MakeRange(GLuint buffer, size_t elementSize, size_t unitSize, int first, int count);
+        Program* LoadKernel(const std::string& shadersDirectory, const std::string& defines);
+    };
+}
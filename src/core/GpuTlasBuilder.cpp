@@ -0,0 +1,211 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <vector>
+#include <algorithm>
+#include "GpuTlasBuilder.h"
+#include "Renderer.h"
+#include "Scene.h"
+
+namespace GLSLPT
+{
+    static const int blockSize = 256;
+    static const int radixPasses = 4;
+    static const int radixBits = 8;
+    static const int radixSize = 1 << radixBits;
+
+    GpuTlasBuilder::GpuTlasBuilder(Scene* scene, const std::string& shadersDirectory, GLuint bvhBuffer, GLuint linksBuffer)
+        : scene(scene)
+        , bvhBuffer(bvhBuffer)
+        , linksBuffer(linksBuffer)
+    {
+        const RadeonRays::BvhTranslator& bvhTranslator = scene->bvhTranslator;
+        numEntries = (int)bvhTranslator.topLevelEntries.size();
+        numBlocks = (numEntries + blockSize - 1) / blockSize;
+
+        // Static part of the leaves, only the transforms change between builds
+        std::vector<Entry> entries(numEntries);
+        for (int i = 0; i < numEntries; i++)
+        {
+            entries[i] = { { 0, 0, 0, 0 } };
+            bvhTranslator.GetTopLevelLeaf(i, entries[i].leaf[0], entries[i].leaf[1], entries[i].leaf[2]);
+        }
+
+        // The kernels address the TLAS from an offset the buffer can be bound at
+        GLint alignment = 1;
+        glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        GLintptr tlasOffset = (GLintptr)bvhTranslator.GetNodeSize() * bvhTranslator.topLevelIndex;
+        nodesOffset = tlasOffset / alignment * alignment;
+        nodesSize = tlasOffset - nodesOffset + (GLsizeiptr)bvhTranslator.GetNodeSize() * (2 * numEntries - 1);
+
+        GLintptr tlasLinksOffset = (GLintptr)sizeof(GLint) * bvhTranslator.topLevelIndex;
+        linksOffset = tlasLinksOffset / alignment * alignment;
+        linksSize = tlasLinksOffset - linksOffset + (GLsizeiptr)sizeof(GLint) * (2 * numEntries - 1);
+
+        GLint maxBlockSize = 0;
+        glGetIntegerv(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxBlockSize);
+        if (nodesSize > maxBlockSize)
+            printf("GPU TLAS build needs %td bytes of nodes, storage blocks are limited to %d\n", nodesSize, maxBlockSize);
+
+        glGenBuffers(1, &entriesBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, entriesBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(Entry) * numEntries, &entries[0], GL_STATIC_DRAW);
+
+        glGenBuffers(1, &transformsBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, transformsBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(Mat4) * scene->transforms.size(), nullptr, GL_DYNAMIC_DRAW);
+
+        glGenBuffers(1, &worldBoundsBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, worldBoundsBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(Vec4) * 2 * numEntries, nullptr, GL_DYNAMIC_COPY);
+
+        // Codes and entry indices, twice
+        glGenBuffers(1, &sortKeysBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, sortKeysBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * 4 * numEntries, nullptr, GL_DYNAMIC_COPY);
+
+        // Centroid bounds and the digit counts of every block
+        glGenBuffers(1, &countsBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, countsBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * (6 + radixSize * numBlocks), nullptr, GL_DYNAMIC_COPY);
+
+        // Parents of all nodes and visit counters of the internal ones
+        glGenBuffers(1, &hierarchyBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, hierarchyBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLint) * (3 * numEntries - 1), nullptr, GL_DYNAMIC_COPY);
+
+        GLuint nodeOffset = (GLuint)((tlasOffset - nodesOffset) / sizeof(float));
+        GLuint linkOffset = (GLuint)((tlasLinksOffset - linksOffset) / sizeof(GLint));
+        worldBoundsShader = LoadKernel(shadersDirectory, "KERNEL_WORLD_BOUNDS", nodeOffset, linkOffset);
+        mortonShader = LoadKernel(shadersDirectory, "KERNEL_MORTON", nodeOffset, linkOffset);
+        radixCountShader = LoadKernel(shadersDirectory, "KERNEL_RADIX_COUNT", nodeOffset, linkOffset);
+        radixScanShader = LoadKernel(shadersDirectory, "KERNEL_RADIX_SCAN", nodeOffset, linkOffset);
+        radixScatterShader = LoadKernel(shadersDirectory, "KERNEL_RADIX_SCATTER", nodeOffset, linkOffset);
+        hierarchyShader = LoadKernel(shadersDirectory, "KERNEL_HIERARCHY", nodeOffset, linkOffset);
+        nodesShader = LoadKernel(shadersDirectory, "KERNEL_NODES", nodeOffset, linkOffset);
+    }
+
+    GpuTlasBuilder::~GpuTlasBuilder()
+    {
+        glDeleteBuffers(1, &entriesBuffer);
+        glDeleteBuffers(1, &transformsBuffer);
+        glDeleteBuffers(1, &worldBoundsBuffer);
+        glDeleteBuffers(1, &sortKeysBuffer);
+        glDeleteBuffers(1, &countsBuffer);
+        glDeleteBuffers(1, &hierarchyBuffer);
+
+        delete worldBoundsShader;
+        delete mortonShader;
+        delete radixCountShader;
+        delete radixScanShader;
+        delete radixScatterShader;
+        delete hierarchyShader;
+        delete nodesShader;
+    }
+
+    Program* GpuTlasBuilder::LoadKernel(const std::string& shadersDirectory, const std::string& kernel, GLuint nodeOffset, GLuint linkOffset)
+    {
+        ShaderInclude::ShaderSource kernelSrcObj = ShaderInclude::load(shadersDirectory + "tlas_build.glsl");
+
+        size_t idx = kernelSrcObj.src.find("#version");
+        if (idx != -1)
+            idx = kernelSrcObj.src.find("\n", idx);
+        else
+            idx = 0;
+        std::string defines = "#define " + kernel + "\n";
+        if (linksBuffer)
+            defines += "#define OPT_BVH_LINKS\n";
+        kernelSrcObj.src.insert(idx + 1, defines);
+
+        Program* shader = LoadComputeShader(kernelSrcObj);
+
+        // Everything but the radix pass stays the same between builds
+        shader->Use();
+        GLuint shaderObject = shader->getObject();
+        glUniform1ui(glGetUniformLocation(shaderObject, "numEntries"), numEntries);
+        glUniform1ui(glGetUniformLocation(shaderObject, "numBlocks"), numBlocks);
+        glUniform1i(glGetUniformLocation(shaderObject, "topLevelIndex"), scene->bvhTranslator.topLevelIndex);
+        glUniform1ui(glGetUniformLocation(shaderObject, "nodeOffset"), nodeOffset);
+        glUniform1ui(glGetUniformLocation(shaderObject, "linkOffset"), linkOffset);
+        glUniform1i(glGetUniformLocation(shaderObject, "BVH"), 1);
+        shader->StopUsing();
+
+        return shader;
+    }
+
+    void GpuTlasBuilder::Dispatch(Program* shader, int numGroups)
+    {
+        shader->Use();
+        if (numGroups > 0)
+            glDispatchCompute(numGroups, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    void GpuTlasBuilder::Build()
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, transformsBuffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(Mat4) * scene->transforms.size(), &scene->transforms[0]);
+
+        // Empty centroid bounds and unvisited nodes
+        const GLuint emptyBounds[6] = { 0xffffffffu, 0xffffffffu, 0xffffffffu, 0, 0, 0 };
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, countsBuffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(emptyBounds), emptyBounds);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, hierarchyBuffer);
+        glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32I, sizeof(GLint) * (2 * numEntries - 1), sizeof(GLint) * numEntries, GL_RED_INTEGER, GL_INT, nullptr);
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, entriesBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, transformsBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, worldBoundsBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, sortKeysBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, countsBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, hierarchyBuffer);
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 7, bvhBuffer, nodesOffset, nodesSize);
+        if (linksBuffer)
+            glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 8, linksBuffer, linksOffset, linksSize);
+
+        Dispatch(worldBoundsShader, numBlocks);
+        Dispatch(mortonShader, numBlocks);
+
+        // 30 bit codes in 8 bit digits, an even number of passes leaves them in the first half
+        for (int pass = 0; pass < radixPasses; pass++)
+        {
+            for (Program* shader : { radixCountShader, radixScatterShader })
+            {
+                shader->Use();
+                glUniform1ui(glGetUniformLocation(shader->getObject(), "radixShift"), pass * radixBits);
+                glUniform1ui(glGetUniformLocation(shader->getObject(), "sortInput"), pass & 1);
+            }
+
+            Dispatch(radixCountShader, numBlocks);
+            Dispatch(radixScanShader, 1);
+            Dispatch(radixScatterShader, numBlocks);
+        }
+
+        Dispatch(hierarchyShader, (numEntries - 1 + blockSize - 1) / blockSize);
+        Dispatch(nodesShader, numBlocks);
+        nodesShader->StopUsing();
+
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+    }
+}
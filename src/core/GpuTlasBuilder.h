@@ -0,0 +1,96 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include "Config.h"
+
+namespace GLSLPT
+{
+    class Program;
+    class Scene;
+
+    // Builds the TLAS with compute shaders, for scenes whose instances all move
+    // every frame: world bounds of the top level entries, their Morton codes, a
+    // radix sort and a linear BVH written straight into the binary float nodes
+    // of the BVH buffer, with only the transforms sent from the CPU. The tree
+    // is the one RadeonRays::Lbvh builds over the same bounds, see tlas_build.glsl
+    class GpuTlasBuilder
+    {
+    public:
+        // TLAS entries past this need 63 bit Morton codes, which the kernels don't do
+        static const int maxEntries = 1 << 20;
+
+        // Uploads the entries of scene->bvhTranslator, which has to be flattened
+        // in the binary float layout. bvhBuffer holds the nodes it flattened,
+        // the kernels also read them through the BVH texture on unit 1.
+        // linksBuffer holds its parent links when it keeps them, 0 otherwise
+        GpuTlasBuilder(Scene* scene, const std::string& shadersDirectory, GLuint bvhBuffer, GLuint linksBuffer);
+        ~GpuTlasBuilder();
+
+        // Rebuild the TLAS from scene->transforms, texture fetches issued
+        // afterwards see the new nodes
+        void Build();
+
+    private:
+        // Layout of an entry in the Entries buffer of the kernels, its bounds
+        // are read from the BLAS node in the BVH texture
+        struct Entry
+        {
+            int leaf[4];
+        };
+
+        Scene* scene;
+        GLuint bvhBuffer;
+        GLuint linksBuffer;
+        int numEntries;
+        int numBlocks;
+
+        // Range of bvhBuffer the TLAS nodes are in, bound for the kernels
+        GLintptr nodesOffset;
+        GLsizeiptr nodesSize;
+        // Same for the links of the TLAS nodes in linksBuffer
+        GLintptr linksOffset;
+        GLsizeiptr linksSize;
+
+        GLuint entriesBuffer;
+        GLuint transformsBuffer;
+        GLuint worldBoundsBuffer;
+        GLuint sortKeysBuffer;
+        GLuint countsBuffer;
+        GLuint hierarchyBuffer;
+
+        Program* worldBoundsShader;
+        Program* mortonShader;
+        Program* radixCountShader;
+        Program* radixScanShader;
+        Program* radixScatterShader;
+        Program* hierarchyShader;
+        Program* nodesShader;
+
+        Program* LoadKernel(const std::string& shadersDirectory, const std::string& kernel, GLuint nodeOffset, GLuint linkOffset);
+        void Dispatch(Program* shader, int numGroups);
+    };
+}
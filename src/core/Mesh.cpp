@@ -24,6 +24,7 @@
 
 #define TINYOBJLOADER_IMPLEMENTATION
 
+#include <algorithm>
 #include <iostream>
 #include "tiny_obj_loader.h"
 #include "Mesh.h"
@@ -120,21 +121,20 @@ namespace GLSLPT
 
     void Mesh::BuildBVH()
     {
-        const int numTris = verticesUVX.size() / 3;
-        std::vector<RadeonRays::bbox> bounds(numTris);
+        std::vector<RadeonRays::bbox> bounds;
+        GetTriangleBounds(bounds);
 
-#pragma omp parallel for
-        for (int i = 0; i < numTris; ++i)
-        {
-            const Vec3 v1 = Vec3(verticesUVX[i * 3 + 0]);
-            const Vec3 v2 = Vec3(verticesUVX[i * 3 + 1]);
-            const Vec3 v3 = Vec3(verticesUVX[i * 3 + 2]);
+        bvh->Build(&bounds[0], bounds.size());
+    }
 
-            bounds[i].grow(v1);
-            bounds[i].grow(v2);
-            bounds[i].grow(v3);
-        }
+    void Mesh::GetTriangleBounds(std::vector<RadeonRays::bbox>& bounds) const
+    {
+        const int numTris = verticesUVX.size() / 3;
+        const int blockSize = 4096;
+        bounds.resize(numTris);
 
-        bvh->Build(&bounds[0], numTris);
+#pragma omp parallel for
+        for (int first = 0; first < numTris; first += blockSize)
+            RadeonRays::triangle_bounds(&verticesUVX[first * 3], std::min(blockSize, numTris - first), &bounds[first]);
     }
 }
\ No newline at end of file
@@ -29,11 +29,39 @@
 
 namespace GLSLPT
 {
+    // BVH builder used for a mesh, set per mesh with the "bvh" key of a mesh block
+    enum BvhBuilder
+    {
+        SpatialSplit, // SplitBvh, best quality
+        BinnedSah,    // Bvh with binned SAH
+        Linear        // Lbvh, fastest build for huge or often rebuilt meshes
+    };
+
+    class MeshInstance
+    {
+
+    public:
+        MeshInstance(std::string name, int meshId, Mat4 xform, int matId)
+            : name(name)
+            , meshID(meshId)
+            , transform(xform)
+            , materialID(matId)
+        {
+        }
+        ~MeshInstance() {}
+
+        Mat4 transform;
+        std::string name;
+
+        int materialID;
+        int meshID;
+    };
+
     class Mesh
     {
     public:
         //ÿMeshڹʱжһBvhָ
-        Mesh()
+        Mesh() : bvhBuilder(SpatialSplit)
         {
             bvh = new RadeonRays::SplitBvh(2.0f, 64, 0, 0.001f, 0);
             //bvh = new RadeonRays::Bvh(2.0f, 64, false);
@@ -41,6 +69,8 @@ namespace GLSLPT
         ~Mesh() { delete bvh; }
         //ΪMeshÿһιһbboxȻεbboxMeshBVH
         void BuildBVH();
+        // Bounding box of every triangle, in the order the BVH indexes them
+        void GetTriangleBounds(std::vector<RadeonRays::bbox>& bounds) const;
         //ʹtinyobjloaderضԡmesh
         //ջȡMeshеverticesUVXnormalsUVY
         bool LoadFromFile(const std::string& filename);
@@ -48,27 +78,30 @@ namespace GLSLPT
         std::vector<Vec4> verticesUVX; // Vertex + texture Coord (u/s),uv.x
         std::vector<Vec4> normalsUVY;  // Normal + texture Coord (v/t),uv.y
 
+        // nullptr while every instance of the mesh is baked into the merged mesh,
+        // such a mesh has no BLAS and nothing of it is uploaded
         RadeonRays::Bvh* bvh;
+        BvhBuilder bvhBuilder;
+        // Split cost weight of every triangle from the ray distribution heuristic, empty for plain SAH
+        std::vector<float> triangleWeights;
         std::string name;
-    };
 
-    class MeshInstance
-    {
+        // Skinned or morphed glTF primitive, posed every frame by GpuDeformer from
+        // the bind pose in verticesUVX and normalsUVY. Per vertex like them: four
+        // joints into the skin's joint list and their weights, empty without a skin
+        std::vector<Vec4> skinJoints;
+        std::vector<Vec4> skinWeights;
+        // Position and normal offset of every vertex, one morph target after the other
+        std::vector<Vec4> morphPositions;
+        std::vector<Vec4> morphNormals;
+        int numMorphTargets = 0;
 
-    public:
-        MeshInstance(std::string name, int meshId, Mat4 xform, int matId)
-            : name(name)
-            , meshID(meshId)
-            , transform(xform)
-            , materialID(matId)
-        {
-        }
-        ~MeshInstance() {}
+        bool IsDeforming() const { return !skinJoints.empty() || numMorphTargets > 0; }
 
-        Mat4 transform;
-        std::string name;
+        // Instance group, see Scene::AddInstanceGroup: no triangles of its own, its
+        // BVH is built over these instances of other meshes, placed relative to the group
+        std::vector<MeshInstance> groupInstances;
 
-        int materialID;
-        int meshID;
+        bool IsGroup() const { return !groupInstances.empty(); }
     };
 }
@@ -0,0 +1,123 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include "PersistentTracer.h"
+#include "Renderer.h"
+
+namespace GLSLPT
+{
+    // Interleaves the bits of x and y, x in the even bits
+    static unsigned int MortonCode(unsigned int x, unsigned int y)
+    {
+        unsigned int code = 0;
+        for (int bit = 0; bit < 16; bit++)
+            code |= ((x >> bit) & 1u) << (2 * bit) | ((y >> bit) & 1u) << (2 * bit + 1);
+        return code;
+    }
+
+    PersistentTracer::PersistentTracer(const std::string& shadersDirectory, const std::string& defines, iVec2 renderSize, int numGroups)
+    {
+        int tilesX = (renderSize.x + tileSize - 1) / tileSize;
+        int tilesY = (renderSize.y + tileSize - 1) / tileSize;
+        numTiles = GetNumTiles(renderSize);
+        this->numGroups = numGroups > 0 ? std::min(numGroups, numTiles) : numTiles;
+
+        // Tiles of an image that isn't a power of two square just leave gaps in the codes
+        std::vector<unsigned int> tiles(numTiles);
+        for (int y = 0; y < tilesY; y++)
+            for (int x = 0; x < tilesX; x++)
+                tiles[y * tilesX + x] = (unsigned int)x | (unsigned int)y << 16;
+        std::sort(tiles.begin(), tiles.end(), [](unsigned int a, unsigned int b)
+        {
+            return MortonCode(a & 0xffffu, a >> 16) < MortonCode(b & 0xffffu, b >> 16);
+        });
+
+        glGenBuffers(1, &tilesBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, tilesBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * numTiles, &tiles[0], GL_STATIC_DRAW);
+
+        glGenBuffers(1, &tileCounterBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, tileCounterBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+
+        ShaderInclude::ShaderSource shaderSrcObj = ShaderInclude::load(shadersDirectory + "persistent.glsl");
+
+        size_t idx = shaderSrcObj.src.find("#version");
+        if (idx != -1)
+            idx = shaderSrcObj.src.find("\n", idx);
+        else
+            idx = 0;
+        shaderSrcObj.src.insert(idx + 1, defines);
+
+        shader = LoadComputeShader(shaderSrcObj);
+
+        shader->Use();
+        glUniform1ui(glGetUniformLocation(shader->getObject(), "numTiles"), numTiles);
+        shader->StopUsing();
+    }
+
+    PersistentTracer::~PersistentTracer()
+    {
+        glDeleteBuffers(1, &tilesBuffer);
+        glDeleteBuffers(1, &tileCounterBuffer);
+
+        delete shader;
+    }
+
+    int PersistentTracer::GetNumTiles(iVec2 renderSize)
+    {
+        return ((renderSize.x + tileSize - 1) / tileSize) * ((renderSize.y + tileSize - 1) / tileSize);
+    }
+
+    size_t PersistentTracer::GetBufferBytes(iVec2 renderSize)
+    {
+        return sizeof(GLuint) * (GetNumTiles(renderSize) + 1);
+    }
+
+    Program* PersistentTracer::GetProgram()
+    {
+        return shader;
+    }
+
+    void PersistentTracer::Trace(GLuint colorTexture, GLuint normalTexture, GLuint positionTexture)
+    {
+        GLuint firstTile = 0;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, tileCounterBuffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &firstTile);
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, tilesBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, tileCounterBuffer);
+
+        glBindImageTexture(0, colorTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+        glBindImageTexture(1, normalTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+        glBindImageTexture(2, positionTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+
+        shader->Use();
+        glDispatchCompute(numGroups, 1, 1);
+        shader->StopUsing();
+
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT);
+    }
+}
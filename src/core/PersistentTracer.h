@@ -0,0 +1,73 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "Config.h"
+#include "Vec2.h"
+
+namespace GLSLPT
+{
+    class Program;
+
+    // Compute shader version of the preview.glsl megakernel with persistent
+    // workgroups: a fixed number of groups take 8x8 pixel tiles in Morton order
+    // from an atomic counter until the frame is done, see persistent.glsl. It
+    // renders to the same textures as the fragment shader
+    class PersistentTracer
+    {
+    public:
+        static const int tileSize = 8;
+
+        // defines are the preprocessor defines of the path tracing shader.
+        // numGroups is the number of workgroups kept running, 0 dispatches one
+        // per tile
+        PersistentTracer(const std::string& shadersDirectory, const std::string& defines, iVec2 renderSize, int numGroups);
+        ~PersistentTracer();
+
+        // The kernel reads the path tracing uniforms and scene textures, the
+        // renderer sets those on it like on the fragment shader
+        Program* GetProgram();
+
+        // Render a sample of every pixel into the RGBA32F color, normal and
+        // position textures, texture fetches issued afterwards see the result
+        void Trace(GLuint colorTexture, GLuint normalTexture, GLuint positionTexture);
+
+        // Size of the tile list and counter for a render size
+        static size_t GetBufferBytes(iVec2 renderSize);
+
+    private:
+        static int GetNumTiles(iVec2 renderSize);
+
+        int numTiles;
+        int numGroups;
+
+        GLuint tilesBuffer;
+        GLuint tileCounterBuffer;
+
+        Program* shader;
+    };
+}
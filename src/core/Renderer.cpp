@@ -24,6 +24,11 @@
 
 #include "Config.h"
 #include "Renderer.h"
+#include "GpuTlasBuilder.h"
+#include "GpuDeformer.h"
+#include "PersistentTracer.h"
+#include "WavefrontTracer.h"
+#include "VisibilityPass.h"
 #include "ShaderIncludes.h"
 #include "Scene.h"
 #include "OpenImageDenoise/oidn.hpp"
@@ -38,22 +43,46 @@ namespace GLSLPT
         return new Program(shaders);
     }
 
+    Program* LoadComputeShader(const ShaderInclude::ShaderSource& computeShaderObj)
+    {
+        std::vector<Shader> shaders;
+        shaders.push_back(Shader(computeShaderObj, GL_COMPUTE_SHADER));
+        return new Program(shaders);
+    }
+
     Renderer::Renderer(Scene* scene, const std::string& shadersDirectory)//ָSceneRenderer
         : scene(scene)
         , BVHBuffer(0)
         , BVHTex(0)
+        , BVHLinksBuffer(0)
+        , BVHLinksTex(0)
         , vertexIndicesBuffer(0)
         , vertexIndicesTex(0)
         , verticesBuffer(0)
         , verticesTex(0)
         , normalsBuffer(0)
         , normalsTex(0)
+        , trianglesBuffer(0)
+        , trianglesTex(0)
+        , triangleMaterialsBuffer(0)
+        , triangleMaterialsTex(0)
         , materialsTex(0)
         , transformsTex(0)
         , lightsTex(0)
+        , lightBVHBuffer(0)
+        , lightBVHTex(0)
         , textureMapsArrayTex(0)
         , envMapTex(0)
         , envMapCDFTex(0)
+        , rayStatsBuffer(0)
+        , gpuTlasBuilder(nullptr)
+        , gpuDeformer(nullptr)
+        , persistentTracer(nullptr)
+        , wavefrontTracer(nullptr)
+        , visibilityPass(nullptr)
+        , pathTraceQueries{0,0}
+        , numPathTraceQueries(0)
+        , pathTraceTime(0.0f)
         , pathTraceTexture{0,0}
         , gNormalTexture(0)
         , gPositionTexture(0)
@@ -79,6 +108,7 @@ namespace GLSLPT
 
         InitGPUDataBuffers();
         quad = new Quad();
+        glGenQueries(2, pathTraceQueries);
 
         InitFBOs();
         InitShaders();
@@ -90,12 +120,16 @@ namespace GLSLPT
 
         // Delete textures
         glDeleteTextures(1, &BVHTex);
+        glDeleteTextures(1, &BVHLinksTex);
         glDeleteTextures(1, &vertexIndicesTex);
         glDeleteTextures(1, &verticesTex);
         glDeleteTextures(1, &normalsTex);
+        glDeleteTextures(1, &trianglesTex);
+        glDeleteTextures(1, &triangleMaterialsTex);
         glDeleteTextures(1, &materialsTex);
         glDeleteTextures(1, &transformsTex);
         glDeleteTextures(1, &lightsTex);
+        glDeleteTextures(1, &lightBVHTex);
         glDeleteTextures(1, &textureMapsArrayTex);
         glDeleteTextures(1, &envMapTex);
         glDeleteTextures(1, &envMapCDFTex);
@@ -107,9 +141,21 @@ namespace GLSLPT
 
         // Delete buffers
         glDeleteBuffers(1, &BVHBuffer);
+        glDeleteBuffers(1, &BVHLinksBuffer);
         glDeleteBuffers(1, &vertexIndicesBuffer);
         glDeleteBuffers(1, &verticesBuffer);
         glDeleteBuffers(1, &normalsBuffer);
+        glDeleteBuffers(1, &trianglesBuffer);
+        glDeleteBuffers(1, &triangleMaterialsBuffer);
+        glDeleteBuffers(1, &lightBVHBuffer);
+        glDeleteBuffers(1, &rayStatsBuffer);
+
+        delete gpuTlasBuilder;
+        delete gpuDeformer;
+        delete persistentTracer;
+        delete wavefrontTracer;
+        delete visibilityPass;
+        glDeleteQueries(2, pathTraceQueries);
 
         // Delete FBOs
         glDeleteFramebuffers(1, &pathTraceFBO);
@@ -129,12 +175,30 @@ namespace GLSLPT
         glPixelStorei(GL_PACK_ALIGNMENT, 1);
 
         // Create buffer and texture for BVH
+        const RadeonRays::BvhTranslator& bvhTranslator = scene->bvhTranslator;
+        GLint maxTexels = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+        size_t bvhTexels = bvhTranslator.GetNodeCount() * (bvhTranslator.quantized ? 1 : 3);
+        if (bvhTexels > (size_t)maxTexels)
+            printf("BVH needs %zu texels, texture buffers are limited to %d\n", bvhTexels, maxTexels);
+
         glGenBuffers(1, &BVHBuffer);
         glBindBuffer(GL_TEXTURE_BUFFER, BVHBuffer);
-        glBufferData(GL_TEXTURE_BUFFER, sizeof(RadeonRays::BvhTranslator::Node) * scene->bvhTranslator.nodes.size(), &scene->bvhTranslator.nodes[0], GL_STATIC_DRAW);
+        glBufferData(GL_TEXTURE_BUFFER, bvhTranslator.GetNodeSize() * bvhTranslator.GetNodeCount(), bvhTranslator.GetNodeData(0), GL_STATIC_DRAW);
         glGenTextures(1, &BVHTex);
         glBindTexture(GL_TEXTURE_BUFFER, BVHTex);
-        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, BVHBuffer);
+        glTexBuffer(GL_TEXTURE_BUFFER, bvhTranslator.quantized ? GL_RGBA32UI : GL_RGB32F, BVHBuffer);
+
+        // Create buffer and texture for the parent links of stackless traversal
+        if (bvhTranslator.parentLinks)
+        {
+            glGenBuffers(1, &BVHLinksBuffer);
+            glBindBuffer(GL_TEXTURE_BUFFER, BVHLinksBuffer);
+            glBufferData(GL_TEXTURE_BUFFER, sizeof(int) * bvhTranslator.links.size(), &bvhTranslator.links[0], GL_STATIC_DRAW);
+            glGenTextures(1, &BVHLinksTex);
+            glBindTexture(GL_TEXTURE_BUFFER, BVHLinksTex);
+            glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, BVHLinksBuffer);
+        }
 
         // Create buffer and texture for vertex indices
         glGenBuffers(1, &vertexIndicesBuffer);
@@ -160,6 +224,28 @@ namespace GLSLPT
         glBindTexture(GL_TEXTURE_BUFFER, normalsTex);
         glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, normalsBuffer);
 
+        // Create buffer and texture for triangles in leaf order
+        if (scene->renderOptions.packTriangles)
+        {
+            glGenBuffers(1, &trianglesBuffer);
+            glBindBuffer(GL_TEXTURE_BUFFER, trianglesBuffer);
+            glBufferData(GL_TEXTURE_BUFFER, sizeof(Vec4) * scene->leafTriangles.size(), &scene->leafTriangles[0], GL_STATIC_DRAW);
+            glGenTextures(1, &trianglesTex);
+            glBindTexture(GL_TEXTURE_BUFFER, trianglesTex);
+            glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, trianglesBuffer);
+        }
+
+        // Create buffer and texture for the materials of merged triangles
+        if (scene->HasMergedMeshes())
+        {
+            glGenBuffers(1, &triangleMaterialsBuffer);
+            glBindBuffer(GL_TEXTURE_BUFFER, triangleMaterialsBuffer);
+            glBufferData(GL_TEXTURE_BUFFER, sizeof(int) * scene->triangleMaterials.size(), &scene->triangleMaterials[0], GL_STATIC_DRAW);
+            glGenTextures(1, &triangleMaterialsTex);
+            glBindTexture(GL_TEXTURE_BUFFER, triangleMaterialsTex);
+            glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, triangleMaterialsBuffer);
+        }
+
         // Create texture for materials
         glGenTextures(1, &materialsTex);
         glBindTexture(GL_TEXTURE_2D, materialsTex);
@@ -188,6 +274,17 @@ namespace GLSLPT
             glBindTexture(GL_TEXTURE_2D, 0);
         }
 
+        // Create buffer and texture for the BVH over the lights
+        if (scene->UsesLightBVH())
+        {
+            glGenBuffers(1, &lightBVHBuffer);
+            glBindBuffer(GL_TEXTURE_BUFFER, lightBVHBuffer);
+            glBufferData(GL_TEXTURE_BUFFER, sizeof(RadeonRays::BvhTranslator::Node) * scene->lightBvhNodes.size(), &scene->lightBvhNodes[0], GL_STATIC_DRAW);
+            glGenTextures(1, &lightBVHTex);
+            glBindTexture(GL_TEXTURE_BUFFER, lightBVHTex);
+            glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, lightBVHBuffer);
+        }
+
         // Create texture for scene textures
         if (!scene->textures.empty())
         {
@@ -217,6 +314,13 @@ namespace GLSLPT
             glBindTexture(GL_TEXTURE_2D, 0);
         }
 
+        // Create counter for traced rays
+        GLuint zero = 0;
+        glGenBuffers(1, &rayStatsBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, rayStatsBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), &zero, GL_DYNAMIC_READ);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, rayStatsBuffer);
+
         // Bind textures to texture slots as they will not change slots during the lifespan of the renderer
         glActiveTexture(GL_TEXTURE1);
         glBindTexture(GL_TEXTURE_BUFFER, BVHTex);
@@ -238,6 +342,14 @@ namespace GLSLPT
         glBindTexture(GL_TEXTURE_2D, envMapTex);
         glActiveTexture(GL_TEXTURE10);
         glBindTexture(GL_TEXTURE_2D, envMapCDFTex);
+        glActiveTexture(GL_TEXTURE11);
+        glBindTexture(GL_TEXTURE_BUFFER, trianglesTex);
+        glActiveTexture(GL_TEXTURE12);
+        glBindTexture(GL_TEXTURE_BUFFER, triangleMaterialsTex);
+        glActiveTexture(GL_TEXTURE13);
+        glBindTexture(GL_TEXTURE_BUFFER, BVHLinksTex);
+        glActiveTexture(GL_TEXTURE14);
+        glBindTexture(GL_TEXTURE_BUFFER, lightBVHTex);
     }
 
     void Renderer::ResizeRenderer()
@@ -261,6 +373,9 @@ namespace GLSLPT
         delete denoiseShader;
         delete tonemapShader;
         delete copyShader;
+        delete persistentTracer;
+        delete wavefrontTracer;
+        delete visibilityPass;
 
         InitFBOs();
         InitShaders();
@@ -378,6 +493,9 @@ namespace GLSLPT
         delete denoiseShader;
         delete tonemapShader;
         delete copyShader;
+        delete persistentTracer;
+        delete wavefrontTracer;
+        delete visibilityPass;
 
         InitShaders();
     }
@@ -400,6 +518,9 @@ namespace GLSLPT
         if (!scene->lights.empty())
             pathtraceDefines += "#define OPT_LIGHTS\n";
 
+        if (scene->UsesLightBVH())
+            pathtraceDefines += "#define OPT_LIGHT_BVH\n";
+
         if (scene->renderOptions.enableRR)
         {
             pathtraceDefines += "#define OPT_RR\n";
@@ -451,6 +572,39 @@ namespace GLSLPT
         if (scene->renderOptions.enableVolumeMIS)
             pathtraceDefines += "#define OPT_VOL_MIS\n";
 
+        if (scene->bvhTranslator.width > 2)
+            pathtraceDefines += "#define OPT_BVH_WIDTH " + std::to_string(scene->bvhTranslator.width) + "\n";
+
+        if (scene->bvhTranslator.quantized)
+            pathtraceDefines += "#define OPT_BVH_QUANTIZED\n";
+
+        if (scene->renderOptions.packTriangles)
+            pathtraceDefines += "#define OPT_PACKED_TRIANGLES\n";
+
+        if (scene->bvhTranslator.parentLinks)
+            pathtraceDefines += "#define OPT_STACKLESS\n";
+
+        if (scene->HasMergedMeshes())
+            pathtraceDefines += "#define OPT_MERGED_MESHES\n";
+
+        // Groups nest instances, traversal keeps a transform per level
+        if (scene->GetInstanceLevels() > 1)
+            pathtraceDefines += "#define OPT_NESTED_INSTANCES " + std::to_string(scene->GetInstanceLevels()) + "\n";
+
+        if (scene->renderOptions.enableRayStats)
+            pathtraceDefines += "#define OPT_RAY_STATS\n";
+
+        // The visibility buffer stands in for the camera rays of the fragment shader
+        bool rasterPrimary = scene->renderOptions.rasterPrimary;
+        if (rasterPrimary && scene->renderOptions.pathTraceMode != FragmentPathTrace)
+        {
+            printf("Rasterized primary visibility needs the fragment path tracer, tracing camera rays\n");
+            rasterPrimary = false;
+        }
+
+        if (rasterPrimary)
+            pathtraceDefines += "#define OPT_RASTER_PRIMARY\n";
+
         if (pathtraceDefines.size() > 0)
         {
             size_t idx = /*pathTraceShaderSrcObj.src.find("#version");
@@ -483,6 +637,15 @@ namespace GLSLPT
         tonemapShader = LoadShaders(vertexShaderSrcObj, tonemapShaderSrcObj);
         copyShader = LoadShaders(vertexShaderSrcObj, copyShaderSrcObj);
 
+        persistentTracer = nullptr;
+        wavefrontTracer = nullptr;
+        if (scene->renderOptions.pathTraceMode == PersistentPathTrace)
+            persistentTracer = new PersistentTracer(shadersDirectory, pathtraceDefines, renderSize, scene->renderOptions.persistentGroups);
+        else if (scene->renderOptions.pathTraceMode == WavefrontPathTrace)
+            wavefrontTracer = new WavefrontTracer(scene, shadersDirectory, pathtraceDefines, renderSize);
+
+        visibilityPass = rasterPrimary ? new VisibilityPass(scene, shadersDirectory, renderSize) : nullptr;
+
         // Setup shader uniforms
         GLuint shaderObject;
         denoiseShader->Use();
@@ -501,37 +664,91 @@ namespace GLSLPT
         glUniform2f(glGetUniformLocation(shaderObject, "resolution"), float(renderSize.x), float(renderSize.y));
         copyShader->StopUsing();
 
-        pathTraceShader->Use();
-        shaderObject = pathTraceShader->getObject();
+        for (Program* shader : GetPathTracePrograms())
+        {
+            shader->Use();
+            shaderObject = shader->getObject();
+
+            if (scene->envMap)
+            {
+                glUniform2f(glGetUniformLocation(shaderObject, "envMapRes"), (float)scene->envMap->width, (float)scene->envMap->height);
+                glUniform1f(glGetUniformLocation(shaderObject, "envMapTotalSum"), scene->envMap->totalSum);
+            }
+            glUniform1i(glGetUniformLocation(shaderObject, "topBVHIndex"), scene->bvhTranslator.topLevelIndex);
+            glUniform2f(glGetUniformLocation(shaderObject, "resolution"), float(renderSize.x), float(renderSize.y));
+            glUniform1i(glGetUniformLocation(shaderObject, "numOfLights"), scene->lights.size());
+            glUniform1i(glGetUniformLocation(shaderObject, "accumTexture"), 0);
+            glUniform1i(glGetUniformLocation(shaderObject, "BVH"), 1);
+            glUniform1i(glGetUniformLocation(shaderObject, "vertexIndicesTex"), 2);
+            glUniform1i(glGetUniformLocation(shaderObject, "verticesTex"), 3);
+            glUniform1i(glGetUniformLocation(shaderObject, "normalsTex"), 4);
+            glUniform1i(glGetUniformLocation(shaderObject, "materialsTex"), 5);
+            glUniform1i(glGetUniformLocation(shaderObject, "transformsTex"), 6);
+            glUniform1i(glGetUniformLocation(shaderObject, "lightsTex"), 7);
+            glUniform1i(glGetUniformLocation(shaderObject, "textureMapsArrayTex"), 8);
+            glUniform1i(glGetUniformLocation(shaderObject, "envMapTex"), 9);
+            glUniform1i(glGetUniformLocation(shaderObject, "envMapCDFTex"), 10);
+            glUniform1i(glGetUniformLocation(shaderObject, "trianglesTex"), 11);
+            glUniform1i(glGetUniformLocation(shaderObject, "triangleMaterialsTex"), 12);
+            glUniform1i(glGetUniformLocation(shaderObject, "bvhLinksTex"), 13);
+            glUniform1i(glGetUniformLocation(shaderObject, "lightBVHTex"), 14);
+            glUniform1i(glGetUniformLocation(shaderObject, "visibilityTex"), 15);
+            shader->StopUsing();
+        }
+    }
 
-        if (scene->envMap)
+    std::vector<Program*> Renderer::GetPathTracePrograms()
+    {
+        std::vector<Program*> programs = { pathTraceShader };
+        if (persistentTracer)
+            programs.push_back(persistentTracer->GetProgram());
+        if (wavefrontTracer)
         {
-            glUniform2f(glGetUniformLocation(shaderObject, "envMapRes"), (float)scene->envMap->width, (float)scene->envMap->height);
-            glUniform1f(glGetUniformLocation(shaderObject, "envMapTotalSum"), scene->envMap->totalSum);
+            std::vector<Program*> kernels = wavefrontTracer->GetPathTracePrograms();
+            programs.insert(programs.end(), kernels.begin(), kernels.end());
         }
-        glUniform1i(glGetUniformLocation(shaderObject, "topBVHIndex"), scene->bvhTranslator.topLevelIndex);
-        glUniform2f(glGetUniformLocation(shaderObject, "resolution"), float(renderSize.x), float(renderSize.y));
-        glUniform1i(glGetUniformLocation(shaderObject, "numOfLights"), scene->lights.size());
-        glUniform1i(glGetUniformLocation(shaderObject, "accumTexture"), 0);
-        glUniform1i(glGetUniformLocation(shaderObject, "BVH"), 1);
-        glUniform1i(glGetUniformLocation(shaderObject, "vertexIndicesTex"), 2);
-        glUniform1i(glGetUniformLocation(shaderObject, "verticesTex"), 3);
-        glUniform1i(glGetUniformLocation(shaderObject, "normalsTex"), 4);
-        glUniform1i(glGetUniformLocation(shaderObject, "materialsTex"), 5);
-        glUniform1i(glGetUniformLocation(shaderObject, "transformsTex"), 6);
-        glUniform1i(glGetUniformLocation(shaderObject, "lightsTex"), 7);
-        glUniform1i(glGetUniformLocation(shaderObject, "textureMapsArrayTex"), 8);
-        glUniform1i(glGetUniformLocation(shaderObject, "envMapTex"), 9);
-        glUniform1i(glGetUniformLocation(shaderObject, "envMapCDFTex"), 10);
-        pathTraceShader->StopUsing();
+        return programs;
     }
 
     void Renderer::Render()
     {
+        GLuint query = pathTraceQueries[numPathTraceQueries & 1];
+        if (numPathTraceQueries >= 2)
+        {
+            GLuint64 elapsed = 0;
+            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+            pathTraceTime = elapsed * 1e-6f;
+        }
+        glBeginQuery(GL_TIME_ELAPSED, query);
+
+        // The camera ray hits are drawn first and timed with the path tracing
+        if (visibilityPass)
+        {
+            visibilityPass->Draw();
+
+            glActiveTexture(GL_TEXTURE15);
+            glBindTexture(GL_TEXTURE_2D, visibilityPass->GetVisibilityTexture());
+
+            pathTraceShader->Use();
+            GLuint shaderObject = pathTraceShader->getObject();
+            glUniform2f(glGetUniformLocation(shaderObject, "cameraJitter"), visibilityPass->GetJitter().x, visibilityPass->GetJitter().y);
+            glUniform2f(glGetUniformLocation(shaderObject, "lensOffset"), visibilityPass->GetLensOffset().x, visibilityPass->GetLensOffset().y);
+            pathTraceShader->StopUsing();
+        }
+
         glBindFramebuffer(GL_FRAMEBUFFER, pathTraceFBO);
         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, pathTraceTexture[currentPathTraceOutput], 0);
         glViewport(0, 0, renderSize.x, renderSize.y);
-        quad->Draw(pathTraceShader);
+
+        if (persistentTracer)
+            persistentTracer->Trace(pathTraceTexture[currentPathTraceOutput], gNormalTexture, gPositionTexture);
+        else if (wavefrontTracer)
+            wavefrontTracer->Trace(pathTraceTexture[currentPathTraceOutput], gNormalTexture, gPositionTexture);
+        else
+            quad->Draw(pathTraceShader);
+
+        glEndQuery(GL_TIME_ELAPSED);
+        numPathTraceQueries++;
         scene->instancesModified = false;
         scene->envMapModified = false;
 
@@ -601,8 +818,40 @@ namespace GLSLPT
     {
         return sampleCounter;
     }
+
+    unsigned int Renderer::GetRayCount()
+    {
+        GLuint numRays = 0;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, rayStatsBuffer);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &numRays);
+        return numRays;
+    }
+
+    float Renderer::GetPathTraceTime()
+    {
+        return pathTraceTime;
+    }
+
+    void Renderer::ResetRayCount()
+    {
+        GLuint zero = 0;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, rayStatsBuffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &zero);
+    }
     void Renderer::Update(float secondsElapsed)
     {
+        // Pose deformed meshes and refit their BLAS, the TLAS is built over them below
+        if (scene->deformationModified)
+        {
+            if (scene->UsesGpuDeformation())
+            {
+                if (!gpuDeformer)
+                    gpuDeformer = new GpuDeformer(scene, shadersDirectory, verticesBuffer, normalsBuffer, vertexIndicesBuffer, BVHBuffer, trianglesBuffer);
+                gpuDeformer->Deform();
+            }
+            scene->deformationModified = false;
+        }
+
         // Update data for instances
         if (scene->instancesModified)
         {
@@ -614,12 +863,37 @@ namespace GLSLPT
             glBindTexture(GL_TEXTURE_2D, materialsTex);
             glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, (sizeof(Material) / sizeof(Vec4)) * scene->materials.size(), 1, 0, GL_RGBA, GL_FLOAT, &scene->materials[0]);
 
-            // Update top level BVH
-            int index = scene->bvhTranslator.topLevelIndex;
-            int offset = sizeof(RadeonRays::BvhTranslator::Node) * index;
-            int size = sizeof(RadeonRays::BvhTranslator::Node) * (scene->bvhTranslator.nodes.size() - index);
+            // Update top level BVH, built on the GPU from the transforms or as
+            // the runs of nodes touched by the last refit or rebuild on the CPU
+            if (scene->UsesGpuTlasBuild())
+            {
+                if (!gpuTlasBuilder)
+                    gpuTlasBuilder = new GpuTlasBuilder(scene, shadersDirectory, BVHBuffer, BVHLinksBuffer);
+                gpuTlasBuilder->Build();
+            }
+
+            std::vector<int>& modifiedNodes = scene->bvhTranslator.modifiedNodes;
             glBindBuffer(GL_TEXTURE_BUFFER, BVHBuffer);
-            glBufferSubData(GL_TEXTURE_BUFFER, offset, size, &scene->bvhTranslator.nodes[index]);
+            for (size_t i = 0; i < modifiedNodes.size();)
+            {
+                int first = modifiedNodes[i];
+                int count = 1;
+                while (i + count < modifiedNodes.size() && modifiedNodes[i + count] == first + count)
+                    count++;
+
+                GLintptr offset = scene->bvhTranslator.GetNodeSize() * first;
+                GLsizeiptr size = scene->bvhTranslator.GetNodeSize() * count;
+                glBufferSubData(GL_TEXTURE_BUFFER, offset, size, scene->bvhTranslator.GetNodeData(first));
+
+                if (scene->bvhTranslator.parentLinks)
+                {
+                    glBindBuffer(GL_TEXTURE_BUFFER, BVHLinksBuffer);
+                    glBufferSubData(GL_TEXTURE_BUFFER, sizeof(int) * first, sizeof(int) * count, &scene->bvhTranslator.links[first]);
+                    glBindBuffer(GL_TEXTURE_BUFFER, BVHBuffer);
+                }
+                i += count;
+            }
+            modifiedNodes.clear();
         }
 
         // Recreate texture for envmaps
@@ -641,11 +915,14 @@ namespace GLSLPT
                 //glUniform1f(glGetUniformLocation(shaderObject, "envMapTotalSum"), scene->envMap->totalSum);
                 //pathTraceShader->StopUsing();
 
-                pathTraceShader->Use();
-                shaderObject = pathTraceShader->getObject();
-                glUniform2f(glGetUniformLocation(shaderObject, "envMapRes"), (float)scene->envMap->width, (float)scene->envMap->height);
-                glUniform1f(glGetUniformLocation(shaderObject, "envMapTotalSum"), scene->envMap->totalSum);
-                pathTraceShader->StopUsing();
+                for (Program* shader : GetPathTracePrograms())
+                {
+                    shader->Use();
+                    shaderObject = shader->getObject();
+                    glUniform2f(glGetUniformLocation(shaderObject, "envMapRes"), (float)scene->envMap->width, (float)scene->envMap->height);
+                    glUniform1f(glGetUniformLocation(shaderObject, "envMapTotalSum"), scene->envMap->totalSum);
+                    shader->StopUsing();
+                }
             }
         }
 
@@ -671,23 +948,26 @@ namespace GLSLPT
         //glUniform1i(glGetUniformLocation(shaderObject, "frameNum"), frameCounter);   
         //pathTraceShader->StopUsing();
 
-        pathTraceShader->Use();
-        shaderObject = pathTraceShader->getObject();
-        glUniform3f(glGetUniformLocation(shaderObject, "camera.position"), scene->camera->position.x, scene->camera->position.y, scene->camera->position.z);
-        glUniform3f(glGetUniformLocation(shaderObject, "camera.right"), scene->camera->right.x, scene->camera->right.y, scene->camera->right.z);
-        glUniform3f(glGetUniformLocation(shaderObject, "camera.up"), scene->camera->up.x, scene->camera->up.y, scene->camera->up.z);
-        glUniform3f(glGetUniformLocation(shaderObject, "camera.forward"), scene->camera->forward.x, scene->camera->forward.y, scene->camera->forward.z);
-        glUniform1f(glGetUniformLocation(shaderObject, "camera.fov"), scene->camera->fov);
-        glUniform1f(glGetUniformLocation(shaderObject, "camera.focalDist"), scene->camera->focalDist);
-        glUniform1f(glGetUniformLocation(shaderObject, "camera.aperture"), scene->camera->aperture);
-        glUniform1i(glGetUniformLocation(shaderObject, "enableEnvMap"), scene->envMap == nullptr ? false : scene->renderOptions.enableEnvMap);
-        glUniform1f(glGetUniformLocation(shaderObject, "envMapIntensity"), scene->renderOptions.envMapIntensity);
-        glUniform1f(glGetUniformLocation(shaderObject, "envMapRot"), scene->renderOptions.envMapRot / 360.0f);
-        glUniform1i(glGetUniformLocation(shaderObject, "maxDepth"), scene->renderOptions.maxDepth);
-        //glUniform3f(glGetUniformLocation(shaderObject, "camera.position"), scene->camera->position.x, scene->camera->position.y, scene->camera->position.z);
-        glUniform3f(glGetUniformLocation(shaderObject, "uniformLightCol"), scene->renderOptions.uniformLightCol.x, scene->renderOptions.uniformLightCol.y, scene->renderOptions.uniformLightCol.z);
-        glUniform1f(glGetUniformLocation(shaderObject, "roughnessMollificationAmt"), scene->renderOptions.roughnessMollificationAmt);
-        pathTraceShader->StopUsing();
+        for (Program* shader : GetPathTracePrograms())
+        {
+            shader->Use();
+            shaderObject = shader->getObject();
+            glUniform3f(glGetUniformLocation(shaderObject, "camera.position"), scene->camera->position.x, scene->camera->position.y, scene->camera->position.z);
+            glUniform3f(glGetUniformLocation(shaderObject, "camera.right"), scene->camera->right.x, scene->camera->right.y, scene->camera->right.z);
+            glUniform3f(glGetUniformLocation(shaderObject, "camera.up"), scene->camera->up.x, scene->camera->up.y, scene->camera->up.z);
+            glUniform3f(glGetUniformLocation(shaderObject, "camera.forward"), scene->camera->forward.x, scene->camera->forward.y, scene->camera->forward.z);
+            glUniform1f(glGetUniformLocation(shaderObject, "camera.fov"), scene->camera->fov);
+            glUniform1f(glGetUniformLocation(shaderObject, "camera.focalDist"), scene->camera->focalDist);
+            glUniform1f(glGetUniformLocation(shaderObject, "camera.aperture"), scene->camera->aperture);
+            glUniform1i(glGetUniformLocation(shaderObject, "enableEnvMap"), scene->envMap == nullptr ? false : scene->renderOptions.enableEnvMap);
+            glUniform1f(glGetUniformLocation(shaderObject, "envMapIntensity"), scene->renderOptions.envMapIntensity);
+            glUniform1f(glGetUniformLocation(shaderObject, "envMapRot"), scene->renderOptions.envMapRot / 360.0f);
+            glUniform1i(glGetUniformLocation(shaderObject, "maxDepth"), scene->renderOptions.maxDepth);
+            //glUniform3f(glGetUniformLocation(shaderObject, "camera.position"), scene->camera->position.x, scene->camera->position.y, scene->camera->position.z);
+            glUniform3f(glGetUniformLocation(shaderObject, "uniformLightCol"), scene->renderOptions.uniformLightCol.x, scene->renderOptions.uniformLightCol.y, scene->renderOptions.uniformLightCol.z);
+            glUniform1f(glGetUniformLocation(shaderObject, "roughnessMollificationAmt"), scene->renderOptions.roughnessMollificationAmt);
+            shader->StopUsing();
+        }
 
         tonemapShader->Use();
         shaderObject = tonemapShader->getObject();
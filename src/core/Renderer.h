@@ -24,6 +24,7 @@
 
 #pragma once
 
+#include <string>
 #include <vector>
 #include "Quad.h"
 #include "Program.h"
@@ -33,6 +34,15 @@
 namespace GLSLPT
 {
     Program* LoadShaders(const ShaderInclude::ShaderSource& vertShaderObj, const ShaderInclude::ShaderSource& fragShaderObj);
+    Program* LoadComputeShader(const ShaderInclude::ShaderSource& computeShaderObj);
+
+    // Shader that traces the paths of a frame, see RenderOptions::pathTraceMode
+    enum PathTraceMode
+    {
+        FragmentPathTrace,  // preview.glsl drawn over the render target
+        PersistentPathTrace,// PersistentTracer, the same megakernel in persistent compute workgroups
+        WavefrontPathTrace  // WavefrontTracer, separate compute stages per bounce
+    };
 
     struct RenderOptions
     {
@@ -72,6 +82,29 @@ namespace GLSLPT
             sigmaD = 0.048;
             sigmaN = 0.62;
             kernelSize = 33;
+
+            sbvhMaxSplitDepth = 24;
+            sbvhMinOverlap = 0.001f;
+            sbvhRefBudget = 0.3f;
+            tlasRebuildThreshold = 1.5f;
+            bvhOptimizePasses = 0;
+            bvhWidth = 2;
+            enableRayStats = false;
+            quantizeBvh = false;
+            bvhLayout = 0;
+            packTriangles = false;
+            stacklessTraversal = false;
+            lightBvh = true;
+            bvhCacheDir = "";
+            bvhStatsFile = "";
+            tlasBraidFactor = 1.0f;
+            mergeMeshTriangles = 0;
+            rdhSampleRays = 0;
+            gpuTlasBuild = false;
+            playAnimation = true;
+            pathTraceMode = FragmentPathTrace;
+            persistentGroups = 1024;
+            rasterPrimary = false;
         }
 
         iVec2 renderResolution;
@@ -109,9 +142,66 @@ namespace GLSLPT
         float sigmaD;
         float sigmaN;
         int kernelSize;
+
+        // Spatial split BVH: split depth 0 disables spatial splits, the budget
+        // is the allowed number of extra primitive references as a fraction of
+        // the triangle count
+        int sbvhMaxSplitDepth;
+        float sbvhMinOverlap;
+        float sbvhRefBudget;
+        // Refitted TLAS is rebuilt once its SAH cost exceeds the cost after
+        // the last build by this factor
+        float tlasRebuildThreshold;
+        // Treelet restructuring passes run over every mesh BVH after it is built, 0 disables them
+        int bvhOptimizePasses;
+        // Children per node of the flattened BVH: 2, 4 or 8
+        int bvhWidth;
+        // Count traced rays on the GPU, see Renderer::GetRayCount
+        bool enableRayStats;
+        // Upload BVH nodes with 8 bit child bounds and integer indices
+        bool quantizeBvh;
+        // Order of the flattened BLAS nodes, a RadeonRays::BvhTranslator::NodeLayout
+        int bvhLayout;
+        // Intersect triangles from Scene::leafTriangles instead of going through vertex indices
+        bool packTriangles;
+        // Traverse the BVH through parent links instead of a stack per ray. Binary float BVHs only
+        bool stacklessTraversal;
+        // Intersect quad and sphere lights through Scene::lightBvhNodes instead of looping over all of them
+        bool lightBvh;
+        // Directory of cached mesh BVHs, see RadeonRays::BvhCache. Empty disables the cache
+        std::string bvhCacheDir;
+        // JSON file ProcessScene writes BVH quality statistics to, see RadeonRays::BvhStatistics. Empty disables it
+        std::string bvhStatsFile;
+        // TLAS primitives per instance on average: the largest instances are opened
+        // into their top BLAS nodes until the budget is used, 1 disables re-braiding
+        float tlasBraidFactor;
+        // Meshes used by a single instance and with at most this many triangles are
+        // moved to world space and merged into one BLAS, 0 disables merging
+        int mergeMeshTriangles;
+        // Camera rays sampled for the ray distribution heuristic, their hits weight the
+        // SAH splits of every BVH, see RadeonRays::RayDistribution. 0 builds plain SAH trees
+        int rdhSampleRays;
+        // Build the TLAS with compute shaders from the transforms on the GPU every
+        // time instances move, see GpuTlasBuilder. Binary float BVHs only
+        bool gpuTlasBuild;
+        // Play the animations of glTF files, skinned and morphed meshes are posed
+        // by GpuDeformer and refitted on the GPU every frame
+        bool playAnimation;
+        PathTraceMode pathTraceMode;
+        // Workgroups PersistentTracer keeps running, they take tiles until the
+        // frame is done. 0 dispatches a group per tile
+        int persistentGroups;
+        // Draw the camera ray hits into a visibility buffer with VisibilityPass
+        // and trace from the first bounce on. Fragment path tracer only
+        bool rasterPrimary;
     };
 
     class Scene;
+    class GpuTlasBuilder;
+    class GpuDeformer;
+    class PersistentTracer;
+    class WavefrontTracer;
+    class VisibilityPass;
 
     class Renderer
     {
@@ -122,18 +212,43 @@ namespace GLSLPT
         // Opengl buffer objects and textures for storing scene data on the GPU
         GLuint BVHBuffer;
         GLuint BVHTex;
+        GLuint BVHLinksBuffer;
+        GLuint BVHLinksTex;
         GLuint vertexIndicesBuffer;
         GLuint vertexIndicesTex;
         GLuint verticesBuffer;
         GLuint verticesTex;
         GLuint normalsBuffer;
         GLuint normalsTex;
+        GLuint trianglesBuffer;
+        GLuint trianglesTex;
+        GLuint triangleMaterialsBuffer;
+        GLuint triangleMaterialsTex;
         GLuint materialsTex;
         GLuint transformsTex;
         GLuint lightsTex;
+        GLuint lightBVHBuffer;
+        GLuint lightBVHTex;
         GLuint textureMapsArrayTex;
         GLuint envMapTex;
         GLuint envMapCDFTex;
+        GLuint rayStatsBuffer;
+
+        // Created by the first Update that moves instances with renderOptions.gpuTlasBuild set
+        GpuTlasBuilder* gpuTlasBuilder;
+        // Created by the first Update that poses deformed meshes
+        GpuDeformer* gpuDeformer;
+        // Created with the shaders for their renderOptions.pathTraceMode
+        PersistentTracer* persistentTracer;
+        WavefrontTracer* wavefrontTracer;
+        // Created with the shaders when renderOptions.rasterPrimary is set
+        VisibilityPass* visibilityPass;
+
+        // GPU time of the path tracing pass, the queries of the last two frames
+        // are used in turn so reading one back doesn't wait for the GPU
+        GLuint pathTraceQueries[2];
+        int numPathTraceQueries;
+        float pathTraceTime;
 
         // FBOs
         GLuint pathTraceFBO;
@@ -187,6 +302,11 @@ namespace GLSLPT
         void PostUpdate();
         float GetProgress();
         int GetSampleCount();
+        // Rays traced since the last reset, needs renderOptions.enableRayStats
+        unsigned int GetRayCount();
+        void ResetRayCount();
+        // Milliseconds the GPU spent tracing paths two frames ago
+        float GetPathTraceTime();
         void GetOutputBuffer(unsigned char**, int& w, int& h);
 
     private:
@@ -195,5 +315,7 @@ namespace GLSLPT
         void InitFBOs();
         //ʼShader
         void InitShaders();
+        // The path tracing shader of every mode, they share their uniforms
+        std::vector<Program*> GetPathTracePrograms();
     };
 }
\ No newline at end of file
@@ -24,12 +24,23 @@
 
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
 
+#include <chrono>
+#include <fstream>
 #include <iostream>
+#include <random>
 #include <vector>
+#include <cstring>
 #include "stb_image_resize.h"
 #include "stb_image.h"
 #include "Scene.h"
 #include "Camera.h"
+#include "lbvh.h"
+#include "bvh_optimizer.h"
+#include "bvh_cache.h"
+#include "bvh_stats.h"
+#include "ray_distribution.h"
+#include "Simd.h"
+#include "GpuTlasBuilder.h"
 
 namespace GLSLPT
 {
@@ -43,6 +54,10 @@ namespace GLSLPT
             delete textures[i];
         textures.clear();
 
+        for (int i = 0; i < animations.size(); i++)
+            delete animations[i];
+        animations.clear();
+
         if (camera)
             delete camera;
 
@@ -137,6 +152,17 @@ namespace GLSLPT
         meshInstances.push_back(meshInstance);
         return id;
     }
+
+    int Scene::AddInstanceGroup(const std::string& name, const std::vector<MeshInstance>& instances)
+    {
+        Mesh* group = new Mesh;
+        group->name = name;
+        group->groupInstances = instances;
+
+        int id = meshes.size();
+        meshes.push_back(group);
+        return id;
+    }
     //򳡾мLight
     int Scene::AddLight(const Light& light)
     {
@@ -148,90 +174,724 @@ namespace GLSLPT
     //ݳеmeshʵbvh
     void Scene::createTLAS()
     {
-        // Loop through all the mesh Instances and build a Top Level BVH
-        std::vector<RadeonRays::bbox> bounds;
-        bounds.resize(meshInstances.size());
+        // Loop through all the mesh Instances and build a Top Level BVH over their entries
+        tlasBounds.resize(tlasEntries.size());
 
-        for (int i = 0; i < meshInstances.size(); i++)
+        for (int i = 0; i < tlasInstances.size(); i++)
+            updateInstanceBounds(i);
+
+        if (!instanceRayWeights.empty())
         {
-            RadeonRays::bbox bbox = meshes[meshInstances[i].meshID]->bvh->Bounds();
-            Mat4 matrix = meshInstances[i].transform;
+            // Entries split by the weight of their instance
+            std::vector<float> weights(tlasEntries.size());
+            for (int i = 0; i < tlasEntries.size(); i++)
+                weights[i] = instanceRayWeights[tlasEntries[i].instance];
+            sceneBvh->SetPrimitiveWeights(weights);
+        }
 
-            Vec3 minBound = bbox.pmin;
-            Vec3 maxBound = bbox.pmax;
+        sceneBvh->Build(&tlasBounds[0], tlasBounds.size());
+        sceneBounds = sceneBvh->Bounds();
+        tlasBuildSahCost = sceneBvh->GetSahCost();
+    }
 
-            Vec3 right       = Vec3(matrix[0][0], matrix[0][1], matrix[0][2]);
-            Vec3 up          = Vec3(matrix[1][0], matrix[1][1], matrix[1][2]);
-            Vec3 forward     = Vec3(matrix[2][0], matrix[2][1], matrix[2][2]);
-            Vec3 translation = Vec3(matrix[3][0], matrix[3][1], matrix[3][2]);
+    void Scene::braidInstances()
+    {
+        int numInstances = tlasInstances.size();
+        int budget = std::max(numInstances, (int)(renderOptions.tlasBraidFactor * numInstances));
 
-            Vec3 xa = right * minBound.x;
-            Vec3 xb = right * maxBound.x;
+        tlasEntries.clear();
+        for (int i = 0; i < numInstances; i++)
+        {
+            const RadeonRays::Bvh* bvh = meshes[tlasInstances[i].meshID]->bvh;
+            tlasEntries.push_back({ i, bvh->GetNodeIndex(bvh->GetRoot()), bvh->GetRoot()->bounds });
+        }
 
-            Vec3 ya = up * minBound.y;
-            Vec3 yb = up * maxBound.y;
+        // Open the entry with the largest world bounds first (Benthin et al. 2017):
+        // a large box is entered by many rays, and its BLAS nodes are tighter in
+        // world space when the instance is long, diagonal or sparse
+        auto worldArea = [this](const RadeonRays::BvhTranslator::InstanceEntry& entry)
+        {
+            return RadeonRays::transform(entry.bounds, tlasInstances[entry.instance].transform).surface_area();
+        };
 
-            Vec3 za = forward * minBound.z;
-            Vec3 zb = forward * maxBound.z;
+        std::vector<std::pair<float, int>> queue;
+        double rootsArea = 0.0;
+        for (int i = 0; i < numInstances; i++)
+        {
+            queue.push_back({ worldArea(tlasEntries[i]), i });
+            rootsArea += queue.back().first;
+        }
+        std::make_heap(queue.begin(), queue.end());
 
-            minBound = Vec3::Min(xa, xb) + Vec3::Min(ya, yb) + Vec3::Min(za, zb) + translation;
-            maxBound = Vec3::Max(xa, xb) + Vec3::Max(ya, yb) + Vec3::Max(za, zb) + translation;
+        while (!queue.empty() && (int)tlasEntries.size() < budget)
+        {
+            std::pop_heap(queue.begin(), queue.end());
+            int entry = queue.back().second;
+            queue.pop_back();
 
-            RadeonRays::bbox bound;
-            bound.pmin = minBound;
-            bound.pmax = maxBound;
+            int instance = tlasEntries[entry].instance;
+            const RadeonRays::Bvh* bvh = meshes[tlasInstances[instance].meshID]->bvh;
 
-            bounds[i] = bound;
+            int children[8];
+            int numChildren = bvhTranslator.GetEntryChildren(bvh, tlasEntries[entry].node, children);
+            if (numChildren == 0 || (int)tlasEntries.size() + numChildren - 1 > budget)
+                continue;
+
+            for (int i = 0; i < numChildren; i++)
+            {
+                int child = i == 0 ? entry : (int)tlasEntries.size();
+                RadeonRays::BvhTranslator::InstanceEntry opened = { instance, children[i], bvh->GetNode(children[i])->bounds };
+                if (i == 0)
+                    tlasEntries[entry] = opened;
+                else
+                    tlasEntries.push_back(opened);
+
+                queue.push_back({ worldArea(tlasEntries[child]), child });
+                std::push_heap(queue.begin(), queue.end());
+            }
+        }
+
+        instanceEntries.assign(numInstances, std::vector<int>());
+        for (int i = 0; i < tlasEntries.size(); i++)
+            instanceEntries[tlasEntries[i].instance].push_back(i);
+
+        if (tlasEntries.size() > numInstances)
+        {
+            // Rays entering a box in proportion to its area, roughly how many BLAS each ray enters
+            double entriesArea = 0.0;
+            for (const RadeonRays::BvhTranslator::InstanceEntry& entry : tlasEntries)
+                entriesArea += worldArea(entry);
+
+            RadeonRays::bbox sceneBox;
+            for (int i = 0; i < numInstances; i++)
+                sceneBox.grow(RadeonRays::transform(meshes[tlasInstances[i].meshID]->bvh->Bounds(), tlasInstances[i].transform));
+
+            printf("TLAS re-braiding: %d instances opened into %d entries, BLAS entries per ray %.2f -> %.2f\n", numInstances, (int)tlasEntries.size(),
+                rootsArea / sceneBox.surface_area(), entriesArea / sceneBox.surface_area());
         }
-        sceneBvh->Build(&bounds[0], bounds.size());
-        sceneBounds = sceneBvh->Bounds();
+    }
+
+    void Scene::updateInstanceBounds(int instance)
+    {
+        const Mat4& matrix = tlasInstances[instance].transform;
+        for (int entry : instanceEntries[instance])
+            tlasBounds[entry] = RadeonRays::transform(tlasEntries[entry].bounds, matrix);
     }
     //Process scene data
     //ΪʹõMeshBVH
     void Scene::createBLAS()
     {
+        bvhCacheHits = 0;
+        bvhCacheMisses = 0;
+        bvhCacheSavedMs = 0.0f;
+
+        // Linear BVHs parallelize with loops that can't run inside a task, build them first
+        for (int i = 0; i < meshes.size(); i++)
+        {
+            if (meshes[i]->bvhBuilder == Linear && !meshes[i]->IsGroup() && meshes[i]->bvh)
+                buildMeshBVH(meshes[i]);
+        }
+
         // Loop through all meshes and build BVHs
-#pragma omp parallel for
+        // One task per mesh, large meshes spawn subtree tasks into the same team
+        // Meshes that only live on in the merged mesh have no BVH to build
+#pragma omp parallel
+#pragma omp single
+        for (int i = 0; i < meshes.size(); i++)
+        {
+            if (meshes[i]->bvhBuilder == Linear || meshes[i]->IsGroup() || !meshes[i]->bvh)
+                continue;
+
+#pragma omp task firstprivate(i)
+            buildMeshBVH(meshes[i]);
+        }
+
+        // Groups come after their members, nested ones after the groups in them
         for (int i = 0; i < meshes.size(); i++)
         {
-            printf("Building BVH for %s\n", meshes[i]->name.c_str());
-            meshes[i]->BuildBVH();
+            if (meshes[i]->IsGroup())
+                buildGroupBVH(meshes[i]);
+        }
+
+        if (!renderOptions.bvhCacheDir.empty())
+            printf("BVH cache: %d hits, %d misses, %.1f ms of builds saved\n", bvhCacheHits, bvhCacheMisses, bvhCacheSavedMs);
+    }
+
+    void Scene::buildMeshBVH(Mesh* mesh)
+    {
+        delete mesh->bvh;
+        if (mesh->bvhBuilder == Linear)
+            mesh->bvh = new RadeonRays::Lbvh(2.0f);
+        else if (mesh->bvhBuilder == BinnedSah)
+            mesh->bvh = new RadeonRays::Bvh(2.0f, 64, true);
+        else
+            mesh->bvh = new RadeonRays::SplitBvh(2.0f, 64, renderOptions.sbvhMaxSplitDepth, renderOptions.sbvhMinOverlap, renderOptions.sbvhRefBudget);
+        // Linear BVHs don't look at split costs and ignore them
+        mesh->bvh->SetPrimitiveWeights(mesh->triangleWeights);
+
+        // The key covers the geometry and every option that changes the tree
+        // the builder and optimizer produce for it
+        RadeonRays::BvhCache cache(renderOptions.bvhCacheDir);
+        std::uint64_t cacheKey = 0;
+        if (!renderOptions.bvhCacheDir.empty())
+        {
+            struct
+            {
+                int builder;
+                int sbvhMaxSplitDepth;
+                float sbvhMinOverlap;
+                float sbvhRefBudget;
+                int bvhOptimizePasses;
+            } params = {};
+
+            params.builder = mesh->bvhBuilder;
+            if (mesh->bvhBuilder == SpatialSplit)
+            {
+                params.sbvhMaxSplitDepth = renderOptions.sbvhMaxSplitDepth;
+                params.sbvhMinOverlap = renderOptions.sbvhMinOverlap;
+                params.sbvhRefBudget = renderOptions.sbvhRefBudget;
+            }
+            params.bvhOptimizePasses = renderOptions.bvhOptimizePasses;
+
+            cacheKey = RadeonRays::BvhCache::Hash(mesh->verticesUVX.data(), mesh->verticesUVX.size() * sizeof(Vec4));
+            cacheKey = RadeonRays::BvhCache::Hash(&params, sizeof(params), cacheKey);
+            if (!mesh->triangleWeights.empty())
+                cacheKey = RadeonRays::BvhCache::Hash(mesh->triangleWeights.data(), mesh->triangleWeights.size() * sizeof(float), cacheKey);
+
+            auto start = std::chrono::high_resolution_clock::now();
+            float buildMs = 0.0f;
+            if (cache.Load(cacheKey, *mesh->bvh, buildMs))
+            {
+                float loadMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+                printf("Loaded cached BVH for %s in %.1f ms, saved %.1f ms\n", mesh->name.c_str(), loadMs, buildMs - loadMs);
+#pragma omp atomic
+                bvhCacheHits++;
+#pragma omp atomic
+                bvhCacheSavedMs += buildMs - loadMs;
+                return;
+            }
+        }
+
+        printf("Building BVH for %s\n", mesh->name.c_str());
+        auto buildStart = std::chrono::high_resolution_clock::now();
+        mesh->BuildBVH();
+
+        // Static scenes render for long enough to pay back a slower, better tree
+        if (renderOptions.bvhOptimizePasses > 0)
+        {
+            std::vector<RadeonRays::bbox> bounds;
+            mesh->GetTriangleBounds(bounds);
+
+            RadeonRays::BvhOptimizer optimizer(renderOptions.bvhOptimizePasses);
+            float sahBefore = mesh->bvh->GetSahCost();
+            RadeonRays::BvhOptimizer::RayCost before = RadeonRays::BvhOptimizer::MeasureTraversalCost(*mesh->bvh, &bounds[0]);
+
+            optimizer.Optimize(*mesh->bvh);
+
+            RadeonRays::BvhOptimizer::RayCost after = RadeonRays::BvhOptimizer::MeasureTraversalCost(*mesh->bvh, &bounds[0]);
+            printf("Optimized BVH for %s: SAH cost %.2f -> %.2f, per ray %.1f -> %.1f node tests, %.1f -> %.1f prim tests\n", mesh->name.c_str(),
+                sahBefore, mesh->bvh->GetSahCost(), before.nodetests, after.nodetests, before.primtests, after.primtests);
+        }
+
+        if (!renderOptions.bvhCacheDir.empty())
+        {
+            float buildMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - buildStart).count();
+            if (!cache.Store(cacheKey, *mesh->bvh, buildMs))
+                printf("Unable to write cached BVH for %s to %s\n", mesh->name.c_str(), renderOptions.bvhCacheDir.c_str());
+#pragma omp atomic
+            bvhCacheMisses++;
         }
     }
 
+    void Scene::buildGroupBVH(Mesh* group)
+    {
+        // Single member leaves like the TLAS, a leaf is entered like a TLAS leaf
+        delete group->bvh;
+        group->bvh = new RadeonRays::Bvh(10.0f, 64, false);
+
+        std::vector<RadeonRays::bbox> bounds;
+        getGroupBounds(group, bounds);
+        group->bvh->Build(&bounds[0], bounds.size());
+
+        printf("BVH for group %s: %d instances, %d nodes\n", group->name.c_str(), (int)bounds.size(), group->bvh->GetNumNodes());
+    }
+
+    void Scene::getGroupBounds(const Mesh* group, std::vector<RadeonRays::bbox>& bounds) const
+    {
+        bounds.clear();
+        for (const MeshInstance& instance : group->groupInstances)
+            bounds.push_back(RadeonRays::transform(meshes[instance.meshID]->bvh->Bounds(), instance.transform));
+    }
+
+    static std::string JsonString(const std::string& str)
+    {
+        std::string quoted = "\"";
+        for (char c : str)
+        {
+            if (c == '"' || c == '\\')
+                quoted += '\\';
+            quoted += c;
+        }
+        return quoted + "\"";
+    }
+
+    void Scene::writeBvhStatistics(const std::string& filename)
+    {
+        printf("Writing BVH statistics to %s\n", filename.c_str());
+
+        std::ofstream file(filename);
+        if (!file)
+        {
+            printf("Unable to open %s\n", filename.c_str());
+            return;
+        }
+
+        file << "{\n  \"meshes\": [";
+        bool first = true;
+        for (int i = 0; i < meshes.size(); i++)
+        {
+            Mesh* mesh = meshes[i];
+            if (!mesh->bvh)
+                continue;
+
+            std::vector<RadeonRays::bbox> bounds;
+            if (mesh->IsGroup())
+                getGroupBounds(mesh, bounds);
+            else
+                mesh->GetTriangleBounds(bounds);
+            std::vector<Vec3> triangles(mesh->verticesUVX.size());
+            for (int j = 0; j < triangles.size(); j++)
+                triangles[j] = Vec3(mesh->verticesUVX[j]);
+
+            RadeonRays::BvhStatistics stats(*mesh->bvh, bounds.data(), bounds.size(), mesh->IsGroup() ? nullptr : triangles.data());
+            file << (first ? "" : ",") << "\n    {\n      \"name\": " << JsonString(mesh->name) << ",\n      \"bvh\": ";
+            stats.WriteJson(file, "      ");
+            file << "\n    }";
+            first = false;
+        }
+        file << "\n  ],\n";
+
+        RadeonRays::BvhStatistics tlasStats(*sceneBvh, tlasBounds.data(), tlasBounds.size());
+        file << "  \"tlas\": ";
+        tlasStats.WriteJson(file, "  ");
+
+        // What the renderer actually uploads, after collapsing, quantizing and packing
+        size_t triangleBytes = vertIndices.size() * sizeof(Indices) + leafTriangles.size() * sizeof(Vec4);
+        file << ",\n  \"gpu\": {\n";
+        file << "    \"nodeBytes\": " << bvhTranslator.GetNodeSize() * bvhTranslator.GetNodeCount() << ",\n";
+        file << "    \"triangleBytes\": " << triangleBytes << "\n";
+        file << "  }\n}\n";
+    }
+
     void Scene::RebuildInstances()
     {
-        delete sceneBvh;
-        sceneBvh = new RadeonRays::Bvh(10.0f, 64, false);
+        // A merged instance that moved is split back out: it returns to the TLAS,
+        // its mesh gets the BLAS it never had and the merged mesh is rebuilt
+        // without it, which changes every buffer
+        std::vector<Mesh*> splitMeshes;
+        for (int i = 0; i < meshInstances.size(); i++)
+        {
+            if (tlasInstanceIndices[i] < 0 && memcmp(&mergedTransforms[i], &meshInstances[i].transform, sizeof(Mat4)) != 0)
+            {
+                printf("Splitting %s out of the merged mesh\n", meshInstances[i].name.c_str());
+                keepInstanced[i] = true;
+                splitMeshes.push_back(meshes[meshInstances[i].meshID]);
+            }
+        }
 
-        createTLAS();
-        bvhTranslator.UpdateTLAS(sceneBvh, meshInstances);
+        if (!splitMeshes.empty())
+        {
+            mergeMeshes();
+            // Instance weights follow tlasInstances, the new merged mesh gets its own
+            sampleRayDistribution();
+            for (Mesh* mesh : splitMeshes)
+                buildMeshBVH(mesh);
+            if (HasMergedMeshes())
+                buildMeshBVH(meshes[mergedMeshID]);
+            FlattenBVH();
+            copyMeshData();
+
+            geometryModified = true;
+            instancesModified = true;
+            dirty = true;
+            return;
+        }
+
+        // The GPU builds the TLAS from the transforms alone. Once it did, the CPU
+        // TLAS doesn't know where anything went and is built again on the way back
+        if (UsesGpuTlasBuild() || tlasOnGpu)
+        {
+            for (int i = 0; i < meshInstances.size(); i++)
+            {
+                int instance = tlasInstanceIndices[i];
+                if (instance >= 0)
+                {
+                    transforms[instance] = meshInstances[i].transform;
+                    tlasInstances[instance].transform = meshInstances[i].transform;
+                }
+            }
+
+            if (!UsesGpuTlasBuild())
+            {
+                delete sceneBvh;
+                sceneBvh = new RadeonRays::Bvh(10.0f, 64, !instanceRayWeights.empty());
 
-        //Copy transforms
+                createTLAS();
+                bvhTranslator.UpdateTLAS(sceneBvh, tlasInstances);
+            }
+
+            tlasOnGpu = UsesGpuTlasBuild();
+            instancesModified = true;
+            dirty = true;
+            return;
+        }
+
+        // Only instances whose transform differs from the copy on the GPU moved,
+        // material edits leave the TLAS untouched
+        // Entries keep the BLAS nodes they were opened into, only their bounds move
+        std::vector<int> movedEntries;
         for (int i = 0; i < meshInstances.size(); i++)
-            transforms[i] = meshInstances[i].transform;
+        {
+            int instance = tlasInstanceIndices[i];
+            if (instance >= 0 && memcmp(&transforms[instance], &meshInstances[i].transform, sizeof(Mat4)) != 0)
+            {
+                transforms[instance] = meshInstances[i].transform;
+                tlasInstances[instance].transform = meshInstances[i].transform;
+                updateInstanceBounds(instance);
+                movedEntries.insert(movedEntries.end(), instanceEntries[instance].begin(), instanceEntries[instance].end());
+            }
+        }
+
+        if (!movedEntries.empty())
+        {
+            std::vector<int> refitted;
+            sceneBvh->Refit(&tlasBounds[0], &movedEntries[0], movedEntries.size(), refitted);
+
+            float sahCost = sceneBvh->GetSahCost();
+            if (sahCost > tlasBuildSahCost * renderOptions.tlasRebuildThreshold)
+            {
+                printf("TLAS SAH cost went from %.2f to %.2f, rebuilding\n", tlasBuildSahCost, sahCost);
+
+                delete sceneBvh;
+                sceneBvh = new RadeonRays::Bvh(10.0f, 64, !instanceRayWeights.empty());
+
+                createTLAS();
+                bvhTranslator.UpdateTLAS(sceneBvh, tlasInstances);
+            }
+            else
+            {
+                sceneBounds = sceneBvh->Bounds();
+                bvhTranslator.RefitTLAS(refitted, tlasInstances);
+            }
+        }
 
         instancesModified = true;
         dirty = true;
     }
-    //ݣMeshbvhbvhmeshʵbvh
-    void Scene::ProcessScene()
+    void Scene::BuildLeafTriangles()
     {
-        printf("Processing scene data\n");
-        createBLAS();
+        leafTriangles.resize(vertIndices.size() * 3);
+
+#pragma omp parallel for
+        for (int i = 0; i < vertIndices.size(); i++)
+        {
+            const Vec4& v0 = verticesUVX[vertIndices[i].x];
+            const Vec4& v1 = verticesUVX[vertIndices[i].y];
+            const Vec4& v2 = verticesUVX[vertIndices[i].z];
+
+            leafTriangles[i * 3 + 0] = Vec4(v0.x, v0.y, v0.z, 0.0f);
+            leafTriangles[i * 3 + 1] = Vec4(v1.x - v0.x, v1.y - v0.y, v1.z - v0.z, 0.0f);
+            leafTriangles[i * 3 + 2] = Vec4(v2.x - v0.x, v2.y - v0.y, v2.z - v0.z, 0.0f);
+        }
+    }
+
+    void Scene::FlattenBVH()
+    {
+        int width = renderOptions.bvhWidth;
+        if (width != 2 && width != 4 && width != 8)
+        {
+            printf("Unsupported BVH width %d, using 2\n", width);
+            width = 2;
+        }
+
+        // Group leaves are only written to binary float nodes
+        bool quantized = renderOptions.quantizeBvh;
+        if (HasInstanceGroups() && (width != 2 || quantized))
+        {
+            printf("Instance groups need the binary float BVH layout, using it\n");
+            width = 2;
+            quantized = false;
+        }
+
+        bvhTranslator.width = width;
+        bvhTranslator.quantized = quantized;
+        bvhTranslator.layout = (RadeonRays::BvhTranslator::NodeLayout)renderOptions.bvhLayout;
+        if (bvhTranslator.layout != RadeonRays::BvhTranslator::NodeLayout::kDepthFirst && (width > 2 || bvhTranslator.quantized))
+            printf("BVH layout %s only applies to binary float nodes\n", RadeonRays::BvhTranslator::GetNodeLayoutName(bvhTranslator.layout));
+
+        bvhTranslator.parentLinks = renderOptions.stacklessTraversal && width == 2 && !quantized;
+        if (renderOptions.stacklessTraversal && !bvhTranslator.parentLinks)
+            printf("Stackless traversal needs the binary float BVH layout, using the stack\n");
 
         printf("Building scene BVH\n");
+        braidInstances();
         createTLAS();
+        tlasOnGpu = false;
 
-        // Flatten BVH
         printf("Flattening BVH\n");
-        bvhTranslator.Process(sceneBvh, meshes, meshInstances);
+        bvhTranslator.topLevelEntries = tlasEntries;
+        bvhTranslator.Process(sceneBvh, meshes, tlasInstances);
+        bvhTranslator.modifiedNodes.clear();
+    }
+    void Scene::BuildLightBVH()
+    {
+        // Distant lights are never hit
+        std::vector<RadeonRays::bbox> bounds;
+        std::vector<int> lightIDs;
+        for (int i = 0; i < lights.size(); i++)
+        {
+            const Light& light = lights[i];
+            RadeonRays::bbox box;
+            if (light.type == LightType::RectLight)
+            {
+                box.grow(light.position);
+                box.grow(light.position + light.u);
+                box.grow(light.position + light.v);
+                box.grow(light.position + light.u + light.v);
+                // Rays that hit the edge of a flat quad may miss its box by rounding
+                box.pmin = box.pmin - Vec3(1e-4f, 1e-4f, 1e-4f);
+                box.pmax = box.pmax + Vec3(1e-4f, 1e-4f, 1e-4f);
+            }
+            else if (light.type == LightType::SphereLight)
+            {
+                Vec3 radius(light.radius, light.radius, light.radius);
+                box.grow(light.position - radius);
+                box.grow(light.position + radius);
+            }
+            else
+                continue;
+
+            bounds.push_back(box);
+            lightIDs.push_back(i);
+        }
+
+        lightBvhNodes.clear();
+        if (bounds.empty())
+            return;
+
+        RadeonRays::Bvh bvh(10.0f, 64, true);
+        bvh.Build(&bounds[0], bounds.size());
+        RadeonRays::BvhTranslator::FlattenPrimitives(&bvh, lightBvhNodes);
+
+        for (RadeonRays::BvhTranslator::Node& node : lightBvhNodes)
+        {
+            if (node.LRLeaf.z > 0)
+                node.LRLeaf.x = lightIDs[(int)node.LRLeaf.x];
+        }
+    }
+
+    bool Scene::UsesGpuTlasBuild() const
+    {
+        return (renderOptions.gpuTlasBuild || UsesGpuDeformation()) && bvhTranslator.width == 2 && !bvhTranslator.quantized
+            && bvhTranslator.topLevelEntries.size() <= GpuTlasBuilder::maxEntries;
+    }
+
+    bool Scene::HasInstanceGroups() const
+    {
+        for (const Mesh* mesh : meshes)
+        {
+            if (mesh->IsGroup())
+                return true;
+        }
+        return false;
+    }
+
+    int Scene::GetInstanceLevels() const
+    {
+        // Members come before their groups, so their levels are known first
+        std::vector<int> levels(meshes.size(), 1);
+        int maxLevels = 1;
+        for (int i = 0; i < meshes.size(); i++)
+        {
+            for (const MeshInstance& instance : meshes[i]->groupInstances)
+                levels[i] = std::max(levels[i], levels[instance.meshID] + 1);
+            maxLevels = std::max(maxLevels, levels[i]);
+        }
+        return maxLevels;
+    }
+
+    bool Scene::HasDeformingMeshes() const
+    {
+        for (const Animation* animation : animations)
+        {
+            if (!animation->meshes.empty())
+                return true;
+        }
+        return false;
+    }
+
+    bool Scene::UsesGpuDeformation() const
+    {
+        return HasDeformingMeshes() && bvhTranslator.width == 2 && !bvhTranslator.quantized;
+    }
+
+    void Scene::AdvanceAnimation(float seconds)
+    {
+        if (animations.empty())
+            return;
+
+        animationTime += seconds;
+
+        bool moved = false;
+        for (Animation* animation : animations)
+        {
+            animation->Evaluate(animationTime);
+            for (const Animation::AnimatedInstance& instance : animation->instances)
+            {
+                meshInstances[instance.instance].transform = animation->GetInstanceTransform(instance);
+                moved = true;
+            }
+        }
+
+        // The refitted BLAS bounds change the TLAS even when no instance moved
+        deformationModified = UsesGpuDeformation();
+        if (moved || deformationModified)
+            RebuildInstances();
+    }
+
+
+    void Scene::mergeMeshes()
+    {
+        // The merged mesh of an earlier pass is rebuilt from scratch
+        if (mergedMeshID >= 0)
+        {
+            delete meshes[mergedMeshID];
+            meshes.erase(meshes.begin() + mergedMeshID);
+            mergedMeshID = -1;
+        }
+
+        tlasInstances.clear();
+        tlasInstanceIndices.assign(meshInstances.size(), -1);
+        mergedTransforms.resize(meshInstances.size());
+        keepInstanced.resize(meshInstances.size(), false);
+        mergedMaterials.clear();
+
+        for (const Animation* animation : animations)
+        {
+            for (const Animation::AnimatedInstance& instance : animation->instances)
+                keepInstanced[instance.instance] = true;
+        }
+
+        std::vector<int> meshUses(meshes.size(), 0);
+        for (int i = 0; i < meshInstances.size(); i++)
+            meshUses[meshInstances[i].meshID]++;
+
+        // Such meshes cost a TLAS leaf, a transform and a BLAS entry per ray for a
+        // handful of triangles
+        Mesh* merged = new Mesh;
+        merged->name = "merged";
+        int numMerged = 0;
+        std::vector<bool> baked(meshes.size(), false);
+
+        for (int i = 0; i < meshInstances.size(); i++)
+        {
+            const MeshInstance& instance = meshInstances[i];
+            const Mesh* mesh = meshes[instance.meshID];
+            int numTris = mesh->verticesUVX.size() / 3;
+
+            // Animated instances, deformed meshes and groups can't be baked into world space
+            if (renderOptions.mergeMeshTriangles <= 0 || numTris > renderOptions.mergeMeshTriangles || meshUses[instance.meshID] != 1 || keepInstanced[i]
+                || mesh->IsDeforming() || mesh->IsGroup())
+            {
+                tlasInstanceIndices[i] = tlasInstances.size();
+                tlasInstances.push_back(instance);
+                continue;
+            }
+
+            // Points take the rows of the transform, normals the rows of its
+            // cofactor matrix, which is the inverse transpose up to the determinant
+            Mat4 matrix = instance.transform;
+            Vec3 right       = Vec3(matrix[0][0], matrix[0][1], matrix[0][2]);
+            Vec3 up          = Vec3(matrix[1][0], matrix[1][1], matrix[1][2]);
+            Vec3 forward     = Vec3(matrix[2][0], matrix[2][1], matrix[2][2]);
+
+            Vec3 normalX = Vec3::Cross(up, forward);
+            Vec3 normalY = Vec3::Cross(forward, right);
+            Vec3 normalZ = Vec3::Cross(right, up);
+            float sign = Vec3::Dot(right, normalX) < 0.0f ? -1.0f : 1.0f;
+
+            int firstVertex = merged->verticesUVX.size();
+            merged->verticesUVX.resize(firstVertex + mesh->verticesUVX.size());
+            TransformPoints(matrix, mesh->verticesUVX.data(), mesh->verticesUVX.size(), &merged->verticesUVX[firstVertex]);
+
+            for (int j = 0; j < mesh->normalsUVY.size(); j++)
+            {
+                const Vec4& n = mesh->normalsUVY[j];
+                Vec3 normal = Vec3::Normalize((normalX * n.x + normalY * n.y + normalZ * n.z) * sign);
+                merged->normalsUVY.push_back(Vec4(normal.x, normal.y, normal.z, n.w));
+            }
+
+            mergedMaterials.insert(mergedMaterials.end(), numTris, instance.materialID);
+            mergedTransforms[i] = instance.transform;
+            baked[instance.meshID] = true;
+            numMerged++;
+        }
+
+        if (numMerged > 0)
+        {
+            mergedMeshID = meshes.size();
+            meshes.push_back(merged);
+            tlasInstances.push_back(MeshInstance(merged->name, mergedMeshID, Mat4(), -1));
+            printf("Merged %d instances with %d triangles into one BLAS, %d TLAS instances left\n", numMerged, (int)mergedMaterials.size(), (int)tlasInstances.size());
+        }
+        else
+            delete merged;
+
+        // Baked meshes that are neither in the TLAS nor members of a group only live
+        // on in the merged mesh: they get no BLAS and none of their geometry is
+        // uploaded. The rest keep or get back a BVH for createBLAS or
+        // RebuildInstances to build
+        baked.resize(meshes.size(), false);
+        std::vector<bool> referenced(meshes.size(), false);
+        for (const MeshInstance& instance : tlasInstances)
+            referenced[instance.meshID] = true;
+        for (const Mesh* mesh : meshes)
+        {
+            for (const MeshInstance& instance : mesh->groupInstances)
+                referenced[instance.meshID] = true;
+        }
+        for (int i = 0; i < meshes.size(); i++)
+        {
+            if (baked[i] && !referenced[i])
+            {
+                delete meshes[i]->bvh;
+                meshes[i]->bvh = nullptr;
+            }
+            else if (!meshes[i]->bvh)
+                meshes[i]->bvh = new RadeonRays::Bvh(2.0f, 64, true);
+        }
+    }
+
+    void Scene::copyMeshData()
+    {
+        vertIndices.clear();
+        verticesUVX.clear();
+        normalsUVY.clear();
+        triangleMaterials.clear();
+        meshTriangleOffsets.clear();
+        meshVertexOffsets.clear();
 
-        // Copy mesh data
         int verticesCnt = 0;
         printf("Copying Mesh Data\n");
         for (int i = 0; i < meshes.size(); i++)
         {
+            meshTriangleOffsets.push_back(vertIndices.size());
+            meshVertexOffsets.push_back(verticesCnt);
+
+            // Groups index instances, not triangles, merged meshes are in the merged one
+            if (meshes[i]->IsGroup() || !meshes[i]->bvh)
+                continue;
+
             // Copy indices from BVH and not from Mesh. 
             // Required if splitBVH is used as a triangle can be shared by leaf nodes
             int numIndices = meshes[i]->bvh->GetNumIndices();
@@ -245,6 +905,8 @@ namespace GLSLPT
                 int v3 = (index * 3 + 2) + verticesCnt;
 
                 vertIndices.push_back(Indices{ v1, v2, v3 });
+                if (HasMergedMeshes())
+                    triangleMaterials.push_back(i == mergedMeshID ? mergedMaterials[index] : -1);
             }
 
             verticesUVX.insert(verticesUVX.end(), meshes[i]->verticesUVX.begin(), meshes[i]->verticesUVX.end());
@@ -252,12 +914,104 @@ namespace GLSLPT
 
             verticesCnt += meshes[i]->verticesUVX.size();
         }
+        meshTriangleOffsets.push_back(vertIndices.size());
+        meshVertexOffsets.push_back(verticesCnt);
+
+        if (renderOptions.packTriangles)
+            BuildLeafTriangles();
 
         // Copy transforms
         printf("Copying transforms\n");
-        transforms.resize(meshInstances.size());
-        for (int i = 0; i < meshInstances.size(); i++)
-            transforms[i] = meshInstances[i].transform;
+        transforms.resize(tlasInstances.size());
+        for (int i = 0; i < tlasInstances.size(); i++)
+            transforms[i] = tlasInstances[i].transform;
+
+        // The leaves of group BVHs number their members in the same order
+        for (const Mesh* mesh : meshes)
+        {
+            for (const MeshInstance& instance : mesh->groupInstances)
+                transforms.push_back(instance.transform);
+        }
+    }
+    void Scene::sampleRayDistribution()
+    {
+        for (Mesh* mesh : meshes)
+            mesh->triangleWeights.clear();
+        instanceRayWeights.clear();
+
+        int numRays = renderOptions.rdhSampleRays;
+        if (numRays <= 0)
+            return;
+
+        if (!camera)
+        {
+            printf("Ray distribution heuristic needs a camera, building plain SAH BVHs\n");
+            return;
+        }
+
+        // Sampled rays don't enter groups, their members would look like they are never hit
+        if (HasInstanceGroups())
+        {
+            printf("Ray distribution heuristic doesn't support instance groups, building plain SAH BVHs\n");
+            return;
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+
+        // Jittered primary rays over the whole frame, the same way the tile shader shoots them
+        std::vector<Vec3> origins(numRays, camera->position);
+        std::vector<Vec3> directions(numRays);
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+
+        float scale = tanf(camera->fov * 0.5f);
+        float aspect = (float)renderOptions.renderResolution.y / renderOptions.renderResolution.x;
+        for (int i = 0; i < numRays; i++)
+        {
+            float dx = uniform(rng) * scale;
+            float dy = uniform(rng) * scale * aspect;
+            directions[i] = Vec3::Normalize(camera->right * dx + camera->up * dy + camera->forward);
+        }
+
+        RadeonRays::RayDistribution distribution(meshes, tlasInstances);
+        distribution.Sample(origins, directions);
+
+        for (int i = 0; i < meshes.size(); i++)
+            meshes[i]->triangleWeights = distribution.GetTriangleWeights(i);
+        instanceRayWeights = distribution.GetInstanceWeights();
+
+        float ms = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        printf("Ray distribution: %d of %d sampled rays hit, %.1f ms\n", distribution.GetNumHits(), distribution.GetNumRays(), ms);
+    }
+
+    void Scene::BuildBVH()
+    {
+        sampleRayDistribution();
+        createBLAS();
+
+        // The TLAS only uses SAH splits when they are weighted by sampled rays,
+        // it keeps the median splits otherwise
+        delete sceneBvh;
+        sceneBvh = new RadeonRays::Bvh(10.0f, 64, !instanceRayWeights.empty());
+
+        // Builds the TLAS too
+        FlattenBVH();
+
+        copyMeshData();
+    }
+    //ݣMeshbvhbvhmeshʵbvh
+    void Scene::ProcessScene()
+    {
+        printf("Processing scene data\n");
+        mergeMeshes();
+        BuildBVH();
+        BuildLightBVH();
+
+        if (HasDeformingMeshes() && !UsesGpuDeformation())
+            printf("Deformed meshes need the binary float BVH layout, they stay in their bind pose\n");
+
+        if (!renderOptions.bvhStatsFile.empty())
+            writeBvhStatistics(renderOptions.bvhStatsFile);
 
         // Copy textures
         if (!textures.empty())
@@ -35,6 +35,7 @@
 #include "bvh_translator.h"
 #include "Texture.h"
 #include "Material.h"
+#include "Animation.h"
 
 namespace GLSLPT
 {
@@ -75,13 +76,53 @@ namespace GLSLPT
         int AddTexture(const std::string& filename);
         int AddMaterial(const Material& material);
         int AddMeshInstance(const MeshInstance& meshInstance);
+        // Add a group of instances that is itself instanced like a mesh, with
+        // AddMeshInstance or as a member of another group, so a repeated assembly
+        // costs one transform per member once plus one per placement. Members are
+        // placed relative to the group and keep their own materials; they must be
+        // added before the group and must not deform. Returns the group's mesh ID
+        int AddInstanceGroup(const std::string& name, const std::vector<MeshInstance>& instances);
         int AddLight(const Light& light);
 
         void AddCamera(Vec3 eye, Vec3 lookat, float fov);
         void AddEnvMap(const std::string& filename);
 
         void ProcessScene();
+        // Build every BVH and gather the mesh data for the GPU again with the
+        // current render options, ProcessScene calls it once
+        void BuildBVH();
+        // Build the TLAS and flatten it and the BLAS for the GPU with the layout
+        // in renderOptions.bvhWidth. The BLAS nodes re-braiding may open depend
+        // on that layout, so the TLAS is built here rather than with the BLAS
+        void FlattenBVH();
+        // Refit the top level BVH to moved instances, rebuilds it once the
+        // SAH cost degrades past renderOptions.tlasRebuildThreshold
         void RebuildInstances();
+        // Fill leafTriangles from vertIndices, done by ProcessScene when renderOptions.packTriangles is set
+        void BuildLeafTriangles();
+        // Whether meshes were merged into the world space BLAS, see renderOptions.mergeMeshTriangles
+        bool HasMergedMeshes() const { return mergedMeshID >= 0; }
+        // Instances a ray can be inside of at once: 1 without groups, one more per
+        // level of groups nested in each other. Groups need the binary float BVH
+        bool HasInstanceGroups() const;
+        int GetInstanceLevels() const;
+        // Whether RebuildInstances leaves the TLAS to the renderer's GpuTlasBuilder,
+        // set with renderOptions.gpuTlasBuild for binary float BVHs
+        bool UsesGpuTlasBuild() const;
+        // Whether a glTF file has skinned or morphed meshes
+        bool HasDeformingMeshes() const;
+        // Whether the renderer's GpuDeformer poses them, only for binary float
+        // BVHs. The TLAS is then built on the GPU too, from the refitted BLAS
+        bool UsesGpuDeformation() const;
+        // Move the animations on by seconds: animated instances are moved through
+        // RebuildInstances and deformed meshes flagged for the GpuDeformer
+        void AdvanceAnimation(float seconds);
+        // Build lightBvhNodes over the quad and sphere lights, done by ProcessScene
+        void BuildLightBVH();
+        // Whether rays find lights through lightBvhNodes, see renderOptions.lightBvh
+        bool UsesLightBVH() const { return renderOptions.lightBvh && !lightBvhNodes.empty(); }
+        // Instances the TLAS is built over, their transforms are the first of transforms
+        const std::vector<MeshInstance>& GetTlasInstances() const { return tlasInstances; }
 
         // Options
         RenderOptions renderOptions;
@@ -93,6 +134,17 @@ namespace GLSLPT
         std::vector<Indices> vertIndices;
         std::vector<Vec4> verticesUVX; // Vertex + texture Coord (u/s)
         std::vector<Vec4> normalsUVY; // Normal + texture Coord (v/t)
+        // v0, v1 - v0 and v2 - v0 of every entry of vertIndices, which remains
+        // the side index to the shading attributes of a hit triangle
+        std::vector<Vec4> leafTriangles;
+        // Material of every entry of vertIndices, -1 unless it belongs to the merged mesh
+        std::vector<int> triangleMaterials;
+        // First entry of vertIndices of every mesh and, last, their number. Groups have no entries
+        std::vector<int> meshTriangleOffsets;
+        // Same for verticesUVX. Groups and meshes that were only merged have no vertices there
+        std::vector<int> meshVertexOffsets;
+        // One per TLAS instance, merged instances have none, followed by the
+        // members of every instance group in mesh order
         std::vector<Mat4> transforms;
 
         // Materials
@@ -103,6 +155,13 @@ namespace GLSLPT
 
         // Lights
         std::vector<Light> lights;
+        // Binary BVH over the lights rays can hit, in the binary float node layout
+        // with the root first. Leaves hold one light, its index in LRLeaf.x
+        std::vector<RadeonRays::BvhTranslator::Node> lightBvhNodes;
+
+        // Animations of the loaded glTF files and the time they are at
+        std::vector<Animation*> animations;
+        float animationTime = 0.0f;
 
         // Environment Map
         EnvironmentMap* envMap;
@@ -123,12 +182,63 @@ namespace GLSLPT
         // To check if scene elements need to be resent to GPU
         bool instancesModified = false;
         bool envMapModified = false;
+        // Set when moving a merged instance split it back out and every buffer has to be sent again
+        bool geometryModified = false;
+        // Set when deformed meshes were posed and their vertices and BLAS need updating
+        bool deformationModified = false;
 
     private:
         RadeonRays::Bvh* sceneBvh;
+        // Primitives of the TLAS, one per instance unless re-braiding opened it,
+        // and the world space bounds the TLAS was built or refitted with
+        std::vector<RadeonRays::BvhTranslator::InstanceEntry> tlasEntries;
+        std::vector<RadeonRays::bbox> tlasBounds;
+        // Indices into tlasEntries of the primitives of each instance
+        std::vector<std::vector<int>> instanceEntries;
+        // SAH cost right after the last TLAS build, refits are compared against it
+        float tlasBuildSahCost = 0.0f;
+        // Set once instances moved with the TLAS built on the GPU, sceneBvh and
+        // tlasBounds are stale until the CPU builds the TLAS again
+        bool tlasOnGpu = false;
+        // Instances the TLAS is built over: the ones that were not merged and, last,
+        // the merged mesh with an identity transform and material -1
+        std::vector<MeshInstance> tlasInstances;
+        // Index into tlasInstances of each instance, -1 if it was merged
+        std::vector<int> tlasInstanceIndices;
+        // Transforms merged instances were baked with, to tell when one is moved
+        std::vector<Mat4> mergedTransforms;
+        // Instances that were moved after being merged, they stay in the TLAS
+        std::vector<bool> keepInstanced;
+        // Merged mesh, always the last of meshes, and the material of each of its triangles
+        int mergedMeshID = -1;
+        std::vector<int> mergedMaterials;
+        // TLAS split cost weight of each of tlasInstances, empty without the ray distribution heuristic
+        std::vector<float> instanceRayWeights;
+        // BVH cache results of the last createBLAS
+        int bvhCacheHits = 0;
+        int bvhCacheMisses = 0;
+        float bvhCacheSavedMs = 0.0f;
         //DXRײٽṹbottom level acceleration structure
         void createBLAS();
+        // Build one mesh's BVH with the builder selected for it and report its cost
+        void buildMeshBVH(Mesh* mesh);
+        // Build an instance group's BVH over the bounds of its members, once their BVHs are built
+        void buildGroupBVH(Mesh* group);
+        void getGroupBounds(const Mesh* group, std::vector<RadeonRays::bbox>& bounds) const;
         //DXRٽṹtop level acceleration structure
         void createTLAS();
+        // Pick tlasEntries: instance roots, the ones with the largest world bounds
+        // opened into BLAS nodes while renderOptions.tlasBraidFactor allows
+        void braidInstances();
+        void updateInstanceBounds(int instance);
+        // Move small meshes used by one instance to world space and merge them, fills tlasInstances
+        void mergeMeshes();
+        // Gather vertices, indices and transforms of all meshes in BVH order for the GPU
+        void copyMeshData();
+        // Trace renderOptions.rdhSampleRays rays from the camera and set the
+        // triangle and instance weights the BVH builders split by
+        void sampleRayDistribution();
+        // Write the statistics of every BLAS, the TLAS and the flattened buffers as JSON
+        void writeBvhStatistics(const std::string& filename);
     };
 }
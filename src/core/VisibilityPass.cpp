@@ -0,0 +1,224 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include "VisibilityPass.h"
+#include "Renderer.h"
+#include "Scene.h"
+
+namespace GLSLPT
+{
+    // Radical inverse of index in base, the Halton sequence over the frames
+    static float Halton(int index, int base)
+    {
+        float result = 0.0f;
+        float f = 1.0f / base;
+        for (int i = index; i > 0; i /= base, f /= base)
+            result += f * (i % base);
+        return result;
+    }
+
+    VisibilityPass::VisibilityPass(Scene* scene, const std::string& shadersDirectory, iVec2 renderSize)
+        : scene(scene)
+        , renderSize(renderSize)
+        , frame(0)
+    {
+        glGenTextures(1, &visibilityTexture);
+        glBindTexture(GL_TEXTURE_2D, visibilityTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32UI, renderSize.x, renderSize.y, 0, GL_RGBA_INTEGER, GL_UNSIGNED_INT, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        glGenRenderbuffers(1, &depthBuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F, renderSize.x, renderSize.y);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+        glGenFramebuffers(1, &visibilityFBO);
+        glBindFramebuffer(GL_FRAMEBUFFER, visibilityFBO);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, visibilityTexture, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+        GLuint attachments[] = { GL_COLOR_ATTACHMENT0 };
+        glDrawBuffers(1, attachments);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        glGenBuffers(1, &drawsBuffer);
+
+        // Vertices are fetched from the scene buffers by gl_VertexID
+        glGenVertexArrays(1, &vao);
+
+        ShaderInclude::ShaderSource vertexSrcObj = ShaderInclude::load(shadersDirectory + "visibility_vertex.glsl");
+        ShaderInclude::ShaderSource fragmentSrcObj = ShaderInclude::load(shadersDirectory + "visibility.glsl");
+        shader = LoadShaders(vertexSrcObj, fragmentSrcObj);
+
+        shader->Use();
+        glUniform1i(glGetUniformLocation(shader->getObject(), "vertexIndicesTex"), 2);
+        glUniform1i(glGetUniformLocation(shader->getObject(), "verticesTex"), 3);
+        shader->StopUsing();
+    }
+
+    VisibilityPass::~VisibilityPass()
+    {
+        glDeleteFramebuffers(1, &visibilityFBO);
+        glDeleteTextures(1, &visibilityTexture);
+        glDeleteRenderbuffers(1, &depthBuffer);
+        glDeleteBuffers(1, &drawsBuffer);
+        glDeleteVertexArrays(1, &vao);
+
+        delete shader;
+    }
+
+    size_t VisibilityPass::GetBufferBytes(iVec2 renderSize)
+    {
+        return (size_t)renderSize.x * renderSize.y * (sizeof(GLuint) * 4 + sizeof(float));
+    }
+
+    void VisibilityPass::AddDraws(const MeshInstance& instance, const Mat4& parent, std::vector<std::pair<int, DrawRecord>>& records)
+    {
+        Mat4 transform = instance.transform * parent;
+        const Mesh* mesh = scene->meshes[instance.meshID];
+
+        for (const MeshInstance& member : mesh->groupInstances)
+            AddDraws(member, transform, records);
+
+        if (!mesh->IsGroup())
+        {
+            DrawRecord record = { transform, instance.materialID, { 0, 0, 0 } };
+            records.push_back(std::make_pair(instance.meshID, record));
+        }
+    }
+
+    void VisibilityPass::UpdateDraws()
+    {
+        std::vector<std::pair<int, DrawRecord>> records;
+        for (const MeshInstance& instance : scene->GetTlasInstances())
+            AddDraws(instance, Mat4(), records);
+
+        std::stable_sort(records.begin(), records.end(), [](const std::pair<int, DrawRecord>& a, const std::pair<int, DrawRecord>& b)
+        {
+            return a.first < b.first;
+        });
+
+        meshDraws.clear();
+        std::vector<DrawRecord> draws(records.size());
+        for (int i = 0; i < records.size(); i++)
+        {
+            int meshID = records[i].first;
+            if (i == 0 || meshID != records[i - 1].first)
+            {
+                int firstTriangle = scene->meshTriangleOffsets[meshID];
+                meshDraws.push_back({ firstTriangle, scene->meshTriangleOffsets[meshID + 1] - firstTriangle, i, 0 });
+            }
+            meshDraws.back().numDraws++;
+            draws[i] = records[i].second;
+        }
+
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, drawsBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(DrawRecord) * std::max<size_t>(draws.size(), 1), draws.data(), GL_DYNAMIC_DRAW);
+    }
+
+    void VisibilityPass::GetViewProjection(float matrix[16]) const
+    {
+        const Camera* camera = scene->camera;
+        Vec3 C = camera->position;
+        Vec3 R = camera->right;
+        Vec3 U = camera->up;
+        Vec3 F = camera->forward;
+
+        // Rays of the frame start at the lens offset and pass through the pixel
+        // centers moved by the jitter on the focal plane, the projection maps
+        // each point to the pixel whose ray goes through it
+        float scaleX = tanf(camera->fov * 0.5f);
+        float scaleY = scaleX * renderSize.y / renderSize.x;
+        float focalDist = camera->focalDist;
+        float kx = lensOffset.x / (focalDist * scaleX) - jitter.x;
+        float ky = lensOffset.y / (focalDist * scaleY) - jitter.y;
+
+        Vec3 rowX = R * (1.0f / scaleX) + F * kx;
+        Vec3 rowY = U * (1.0f / scaleY) + F * ky;
+
+        // Depth range around the scene bounds
+        const RadeonRays::bbox& bounds = scene->sceneBounds;
+        float farPlane = (Vec3::Length(C - bounds.center()) + 0.5f * Vec3::Length(bounds.extents())) * 1.1f;
+        float nearPlane = farPlane * 1e-5f;
+        float a = (farPlane + nearPlane) / (farPlane - nearPlane);
+        float b = -2.0f * farPlane * nearPlane / (farPlane - nearPlane);
+
+        Vec3 rows[4] = { rowX, rowY, F * a, F };
+        float offsets[4] = { -lensOffset.x / scaleX, -lensOffset.y / scaleY, b, 0.0f };
+        for (int i = 0; i < 4; i++)
+        {
+            matrix[i * 4 + 0] = rows[i].x;
+            matrix[i * 4 + 1] = rows[i].y;
+            matrix[i * 4 + 2] = rows[i].z;
+            matrix[i * 4 + 3] = offsets[i] - Vec3::Dot(rows[i], C);
+        }
+    }
+
+    void VisibilityPass::Draw()
+    {
+        if (meshDraws.empty() || scene->instancesModified)
+            UpdateDraws();
+
+        // Tent filtered jitter and a uniform point on the aperture like CameraRay
+        frame++;
+        float r1 = 2.0f * Halton(frame, 2);
+        float r2 = 2.0f * Halton(frame, 3);
+        jitter.x = (r1 < 1.0f ? sqrtf(r1) - 1.0f : 1.0f - sqrtf(2.0f - r1)) / (renderSize.x * 0.5f);
+        jitter.y = (r2 < 1.0f ? sqrtf(r2) - 1.0f : 1.0f - sqrtf(2.0f - r2)) / (renderSize.y * 0.5f);
+
+        float angle = Halton(frame, 5) * 2.0f * PI;
+        float radius = sqrtf(Halton(frame, 7) * scene->camera->aperture);
+        lensOffset = Vec2(cosf(angle) * radius, sinf(angle) * radius);
+
+        float viewProjection[16];
+        GetViewProjection(viewProjection);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, visibilityFBO);
+        glViewport(0, 0, renderSize.x, renderSize.y);
+        GLuint clearVisibility[] = { 0, 0, 0, 0 };
+        glClearBufferuiv(GL_COLOR, 0, clearVisibility);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        glEnable(GL_DEPTH_TEST);
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, drawsBuffer);
+
+        shader->Use();
+        GLuint shaderObject = shader->getObject();
+        glUniformMatrix4fv(glGetUniformLocation(shaderObject, "viewProjection"), 1, GL_TRUE, viewProjection);
+        glBindVertexArray(vao);
+        for (const MeshDraws& draws : meshDraws)
+        {
+            glUniform1i(glGetUniformLocation(shaderObject, "firstDraw"), draws.firstDraw);
+            glDrawArraysInstanced(GL_TRIANGLES, draws.firstTriangle * 3, draws.numTriangles * 3, draws.numDraws);
+        }
+        glBindVertexArray(0);
+        shader->StopUsing();
+
+        glDisable(GL_DEPTH_TEST);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+}
@@ -0,0 +1,107 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "Config.h"
+#include "Vec2.h"
+#include "Mat4.h"
+
+namespace GLSLPT
+{
+    class Program;
+    class Scene;
+    class MeshInstance;
+
+    // Rasterized primary visibility for the fragment path tracer: every mesh
+    // instance is drawn into a visibility buffer holding the triangle and draw
+    // seen through each pixel, see visibility_vertex.glsl and visibility.glsl.
+    // The path tracer then takes its camera ray hits from there and only traces
+    // from the first bounce on. Pixels all share the frame's jitter and lens
+    // sample, they move from frame to frame along a Halton sequence
+    class VisibilityPass
+    {
+    public:
+        VisibilityPass(Scene* scene, const std::string& shadersDirectory, iVec2 renderSize);
+        ~VisibilityPass();
+
+        // Move on to the next jitter and lens sample and draw the scene with them
+        // into the visibility buffer, the default framebuffer is bound afterwards
+        void Draw();
+
+        // Offset of the frame's camera rays from the pixel centers in NDC
+        Vec2 GetJitter() const { return jitter; }
+        // Point on the aperture the frame's camera rays start from, along the camera's right and up
+        Vec2 GetLensOffset() const { return lensOffset; }
+        // RGBA32UI texture, triangle + 1 and draw of each pixel, 0 where nothing was drawn
+        GLuint GetVisibilityTexture() const { return visibilityTexture; }
+        // Per draw transform and material, shading reads them at binding 9
+        GLuint GetDrawsBuffer() const { return drawsBuffer; }
+
+        // Bytes of the visibility and depth buffers at a render size
+        static size_t GetBufferBytes(iVec2 renderSize);
+
+    private:
+        // World transform and material of one instance, in std430 layout
+        struct DrawRecord
+        {
+            Mat4 transform;
+            int materialID;
+            int pad[3];
+        };
+
+        // Instances of one mesh are drawn with one instanced draw call
+        struct MeshDraws
+        {
+            int firstTriangle;
+            int numTriangles;
+            int firstDraw;
+            int numDraws;
+        };
+
+        // Gather the instances, with the members of groups placed in the world, and upload them
+        void UpdateDraws();
+        void AddDraws(const MeshInstance& instance, const Mat4& parent, std::vector<std::pair<int, DrawRecord>>& records);
+        void GetViewProjection(float matrix[16]) const;
+
+        Scene* scene;
+        iVec2 renderSize;
+        int frame;
+
+        Vec2 jitter;
+        Vec2 lensOffset;
+
+        std::vector<MeshDraws> meshDraws;
+
+        GLuint visibilityFBO;
+        GLuint visibilityTexture;
+        GLuint depthBuffer;
+        GLuint drawsBuffer;
+        GLuint vao;
+
+        Program* shader;
+    };
+}
@@ -0,0 +1,203 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include "WavefrontTracer.h"
+#include "Renderer.h"
+#include "Scene.h"
+
+namespace GLSLPT
+{
+    static const int blockSize = 64;
+
+    // Bytes of a path state, hit and shadow ray record, see wavefront.glsl
+    static const int pathRecordSize = sizeof(Vec4) * 7;
+    static const int hitRecordSize = sizeof(Vec4) * 6;
+    static const int shadowRecordSize = sizeof(Vec4) * 6;
+
+    // Dispatch sizes then the lengths of the two path queues and of the shadow queues
+    static const int numCounters = 10;
+    static const GLintptr extendArgsOffset = 0;
+    static const GLintptr shadowArgsOffset = sizeof(GLuint) * 3;
+
+    // Alpha tested surfaces let paths pass without counting a bounce, the ones
+    // still alive after this many of them end with the light gathered so far
+    static const int alphaTestBounces = 8;
+
+    WavefrontTracer::WavefrontTracer(Scene* scene, const std::string& shadersDirectory, const std::string& defines, iVec2 renderSize)
+        : scene(scene)
+        , renderSize(renderSize)
+    {
+        numPixels = renderSize.x * renderSize.y;
+        queueSize = std::min(numPixels, maxBatchPaths);
+        extraBounces = defines.find("OPT_ALPHA_TEST") != std::string::npos ? alphaTestBounces : 0;
+
+        glGenBuffers(1, &pathsBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, pathsBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)pathRecordSize * queueSize, nullptr, GL_DYNAMIC_COPY);
+
+        glGenBuffers(1, &hitsBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, hitsBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)hitRecordSize * queueSize, nullptr, GL_DYNAMIC_COPY);
+
+        // Two path queues and the shadow queue
+        glGenBuffers(1, &queuesBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, queuesBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * 3 * queueSize, nullptr, GL_DYNAMIC_COPY);
+
+        glGenBuffers(1, &shadowRaysBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, shadowRaysBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)shadowRecordSize * queueSize, nullptr, GL_DYNAMIC_COPY);
+
+        glGenBuffers(1, &countersBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, countersBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * numCounters, nullptr, GL_DYNAMIC_COPY);
+
+        generateShader = LoadKernel(shadersDirectory, defines, "KERNEL_GENERATE");
+        extendShader = LoadKernel(shadersDirectory, defines, "KERNEL_EXTEND");
+        shadeShader = LoadKernel(shadersDirectory, defines, "KERNEL_SHADE");
+        argsShader = LoadKernel(shadersDirectory, defines, "KERNEL_ARGS");
+        shadowShader = LoadKernel(shadersDirectory, defines, "KERNEL_SHADOW");
+        accumulateShader = LoadKernel(shadersDirectory, defines, "KERNEL_ACCUMULATE");
+    }
+
+    WavefrontTracer::~WavefrontTracer()
+    {
+        glDeleteBuffers(1, &pathsBuffer);
+        glDeleteBuffers(1, &hitsBuffer);
+        glDeleteBuffers(1, &queuesBuffer);
+        glDeleteBuffers(1, &shadowRaysBuffer);
+        glDeleteBuffers(1, &countersBuffer);
+
+        delete generateShader;
+        delete extendShader;
+        delete shadeShader;
+        delete argsShader;
+        delete shadowShader;
+        delete accumulateShader;
+    }
+
+    Program* WavefrontTracer::LoadKernel(const std::string& shadersDirectory, const std::string& defines, const std::string& kernel)
+    {
+        ShaderInclude::ShaderSource kernelSrcObj = ShaderInclude::load(shadersDirectory + "wavefront.glsl");
+
+        size_t idx = kernelSrcObj.src.find("#version");
+        if (idx != -1)
+            idx = kernelSrcObj.src.find("\n", idx);
+        else
+            idx = 0;
+        kernelSrcObj.src.insert(idx + 1, "#define " + kernel + "\n" + defines);
+
+        Program* shader = LoadComputeShader(kernelSrcObj);
+
+        shader->Use();
+        glUniform1ui(glGetUniformLocation(shader->getObject(), "queueSize"), queueSize);
+        shader->StopUsing();
+
+        return shader;
+    }
+
+    std::vector<Program*> WavefrontTracer::GetPathTracePrograms()
+    {
+        return { generateShader, extendShader, shadeShader, shadowShader, accumulateShader };
+    }
+
+    size_t WavefrontTracer::GetBufferBytes(iVec2 renderSize)
+    {
+        int queueSize = std::min(renderSize.x * renderSize.y, maxBatchPaths);
+        return (size_t)(pathRecordSize + hitRecordSize + shadowRecordSize + sizeof(GLuint) * 3) * queueSize + sizeof(GLuint) * numCounters;
+    }
+
+    void WavefrontTracer::Dispatch(Program* shader, int numGroups)
+    {
+        shader->Use();
+        if (numGroups > 0)
+            glDispatchCompute(numGroups, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+    }
+
+    void WavefrontTracer::DispatchIndirect(Program* shader, GLintptr offset)
+    {
+        shader->Use();
+        glDispatchComputeIndirect(offset);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+    }
+
+    void WavefrontTracer::Trace(GLuint colorTexture, GLuint normalTexture, GLuint positionTexture)
+    {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, pathsBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, hitsBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, queuesBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, shadowRaysBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, countersBuffer);
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, countersBuffer);
+
+        glBindImageTexture(0, colorTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+        glBindImageTexture(1, normalTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+        glBindImageTexture(2, positionTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+
+        // A path shades a vertex per bounce up to the maximum depth, where it ends
+        int numBounces = scene->renderOptions.maxDepth + 1 + extraBounces;
+
+        for (int batchStart = 0; batchStart < numPixels; batchStart += queueSize)
+        {
+            int numBatchPaths = std::min(queueSize, numPixels - batchStart);
+            int numGroups = (numBatchPaths + blockSize - 1) / blockSize;
+
+            // Every path in the first queue, nothing in the others
+            const GLuint counters[numCounters] = { (GLuint)numGroups, 1, 1, 0, 1, 1, (GLuint)numBatchPaths, 0, 0, 0 };
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, countersBuffer);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counters), counters);
+
+            for (Program* shader : { generateShader, accumulateShader })
+            {
+                shader->Use();
+                glUniform1ui(glGetUniformLocation(shader->getObject(), "numBatchPaths"), numBatchPaths);
+                glUniform1ui(glGetUniformLocation(shader->getObject(), "batchStart"), batchStart);
+            }
+
+            Dispatch(generateShader, numGroups);
+
+            // Queues swap every bounce, stages past the end of all paths dispatch no groups
+            for (int bounce = 0; bounce < numBounces; bounce++)
+            {
+                for (Program* shader : { extendShader, shadeShader, argsShader, shadowShader })
+                {
+                    shader->Use();
+                    glUniform1ui(glGetUniformLocation(shader->getObject(), "queue"), bounce & 1);
+                }
+
+                DispatchIndirect(extendShader, extendArgsOffset);
+                DispatchIndirect(shadeShader, extendArgsOffset);
+                Dispatch(argsShader, 1);
+                DispatchIndirect(shadowShader, shadowArgsOffset);
+            }
+
+            Dispatch(accumulateShader, numGroups);
+        }
+        accumulateShader->StopUsing();
+
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT);
+    }
+}
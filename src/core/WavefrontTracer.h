@@ -0,0 +1,91 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "Config.h"
+#include "Vec2.h"
+
+namespace GLSLPT
+{
+    class Program;
+    class Scene;
+
+    // Path tracer split into compute stages, the alternative to the preview.glsl
+    // megakernel: camera rays are generated for a batch of pixels, then every
+    // bounce extends the live paths to their closest hit, shades them with the
+    // megakernel's ShadeVertex and traces the shadow rays they queued. Stages
+    // pass path indices through queues with atomic counters, terminated paths
+    // drop out and the next stage is dispatched indirectly over the survivors,
+    // see wavefront.glsl. The result lands in the same textures the megakernel
+    // renders to, so denoising and presenting are unchanged
+    class WavefrontTracer
+    {
+    public:
+        // Pixels traced by one pass of the stages, larger images take several
+        static const int maxBatchPaths = 1 << 19;
+
+        // defines are the preprocessor defines of the path tracing shader
+        WavefrontTracer(Scene* scene, const std::string& shadersDirectory, const std::string& defines, iVec2 renderSize);
+        ~WavefrontTracer();
+
+        // Kernels reading the path tracing uniforms and scene textures, the
+        // renderer sets those on them like on the megakernel
+        std::vector<Program*> GetPathTracePrograms();
+
+        // Render a sample of every pixel into the RGBA32F color, normal and
+        // position textures, texture fetches issued afterwards see the result
+        void Trace(GLuint colorTexture, GLuint normalTexture, GLuint positionTexture);
+
+        // Bytes of the path state, hit, shadow ray and queue buffers at a render size
+        static size_t GetBufferBytes(iVec2 renderSize);
+
+    private:
+        Scene* scene;
+        iVec2 renderSize;
+        int numPixels;
+        int queueSize;
+        // Vertices a path can have past the maximum depth, alpha tested ones don't count
+        int extraBounces;
+
+        GLuint pathsBuffer;
+        GLuint hitsBuffer;
+        GLuint queuesBuffer;
+        GLuint shadowRaysBuffer;
+        GLuint countersBuffer;
+
+        Program* generateShader;
+        Program* extendShader;
+        Program* shadeShader;
+        Program* argsShader;
+        Program* shadowShader;
+        Program* accumulateShader;
+
+        Program* LoadKernel(const std::string& shadersDirectory, const std::string& defines, const std::string& kernel);
+        void Dispatch(Program* shader, int numGroups);
+        void DispatchIndirect(Program* shader, GLintptr offset);
+    };
+}
@@ -30,6 +30,7 @@
 #include <map>
 #include <cstdint>
 #include "GLTFLoader.h"
+#include "Animation.h"
 #include "tiny_gltf.h"
 
 namespace GLSLPT
@@ -40,6 +41,68 @@ namespace GLSLPT
         int materialId;
     };
 
+    // Read any accessor as floats, components per element. Normalized integers are
+    // mapped to [0, 1] or [-1, 1] and other integers, like joint indices, kept as is.
+    // Sparse accessors are not supported
+    void ReadAccessor(tinygltf::Model& gltfModel, int accessorIndex, std::vector<float>& values, int& components)
+    {
+        const tinygltf::Accessor& accessor = gltfModel.accessors[accessorIndex];
+        components = tinygltf::GetNumComponentsInType(accessor.type);
+        values.assign(accessor.count * components, 0.0f);
+
+        // Accessors without a buffer view are all zeros
+        if (accessor.bufferView < 0)
+            return;
+
+        const tinygltf::BufferView& bufferView = gltfModel.bufferViews[accessor.bufferView];
+        const uint8_t* address = gltfModel.buffers[bufferView.buffer].data.data() + bufferView.byteOffset + accessor.byteOffset;
+        int componentSize = tinygltf::GetComponentSizeInBytes(accessor.componentType);
+        int stride = bufferView.byteStride > 0 ? bufferView.byteStride : componentSize * components;
+
+        for (size_t i = 0; i < accessor.count; i++)
+        {
+            for (int c = 0; c < components; c++)
+            {
+                const uint8_t* component = address + i * stride + c * componentSize;
+                float value = 0.0f;
+                switch (accessor.componentType)
+                {
+                case TINYGLTF_COMPONENT_TYPE_FLOAT:
+                    memcpy(&value, component, 4);
+                    break;
+                case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+                    value = accessor.normalized ? *component / 255.0f : *component;
+                    break;
+                case TINYGLTF_COMPONENT_TYPE_BYTE:
+                    value = accessor.normalized ? std::max(*(const int8_t*)component / 127.0f, -1.0f) : *(const int8_t*)component;
+                    break;
+                case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+                {
+                    uint16_t half;
+                    memcpy(&half, component, 2);
+                    value = accessor.normalized ? half / 65535.0f : half;
+                    break;
+                }
+                case TINYGLTF_COMPONENT_TYPE_SHORT:
+                {
+                    int16_t half;
+                    memcpy(&half, component, 2);
+                    value = accessor.normalized ? std::max(half / 32767.0f, -1.0f) : half;
+                    break;
+                }
+                case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+                {
+                    uint32_t full;
+                    memcpy(&full, component, 4);
+                    value = (float)full;
+                    break;
+                }
+                }
+                values[i * components + c] = value;
+            }
+        }
+    }
+
     // Note: A GLTF mesh can contain multiple primitives and each primitive can potentially have a different material applied.
     // The two level BVH in this repo holds material ids per mesh and not per primitive, so this function loads each primitive from the gltf mesh as a new mesh
     void LoadMeshes(Scene* scene, tinygltf::Model& gltfModel, std::map<int, std::vector<Primitive>>& meshPrimMap)
@@ -205,6 +268,49 @@ namespace GLSLPT
                     mesh->normalsUVY.push_back(Vec4(nrm.x, nrm.y, nrm.z, uv.y));
                 }
 
+                // Skinning, only the first set of four joints is used
+                if (prim.attributes.count("JOINTS_0") > 0 && prim.attributes.count("WEIGHTS_0") > 0)
+                {
+                    std::vector<float> joints, weights;
+                    int jointComponents, weightComponents;
+                    ReadAccessor(gltfModel, prim.attributes["JOINTS_0"], joints, jointComponents);
+                    ReadAccessor(gltfModel, prim.attributes["WEIGHTS_0"], weights, weightComponents);
+
+                    for (int v = 0; v < indices.size(); v++)
+                    {
+                        const float* j = &joints[indices[v] * 4];
+                        const float* w = &weights[indices[v] * 4];
+                        mesh->skinJoints.push_back(Vec4(j[0], j[1], j[2], j[3]));
+                        mesh->skinWeights.push_back(Vec4(w[0], w[1], w[2], w[3]));
+                    }
+                }
+
+                // Morph targets, missing attributes leave their offsets at zero
+                mesh->numMorphTargets = (int)prim.targets.size();
+                mesh->morphPositions.resize(indices.size() * prim.targets.size());
+                mesh->morphNormals.resize(indices.size() * prim.targets.size());
+                for (int t = 0; t < prim.targets.size(); t++)
+                {
+                    std::map<std::string, int>& target = prim.targets[t];
+                    std::vector<Vec4>* offsets[2] = { &mesh->morphPositions, &mesh->morphNormals };
+                    const char* attributes[2] = { "POSITION", "NORMAL" };
+
+                    for (int a = 0; a < 2; a++)
+                    {
+                        if (target.count(attributes[a]) == 0)
+                            continue;
+
+                        std::vector<float> values;
+                        int components;
+                        ReadAccessor(gltfModel, target[attributes[a]], values, components);
+                        for (int v = 0; v < indices.size(); v++)
+                        {
+                            const float* d = &values[indices[v] * 3];
+                            (*offsets[a])[t * indices.size() + v] = Vec4(d[0], d[1], d[2], 0.0f);
+                        }
+                    }
+                }
+
                 mesh->name = gltfMesh.name;
                 int sceneMeshId = scene->meshes.size();
                 scene->meshes.push_back(mesh);
@@ -289,10 +395,111 @@ namespace GLSLPT
         }
     }
 
-    void TraverseNodes(Scene* scene, tinygltf::Model& gltfModel, int nodeIdx, Mat4& parentMat, std::map<int, std::vector<Primitive>>& meshPrimMap)
+    // Nodes, skins and the first animation, nullptr for a static file
+    Animation* LoadAnimation(tinygltf::Model& gltfModel, Mat4 xform)
     {
-        tinygltf::Node gltfNode = gltfModel.nodes[nodeIdx];
+        bool hasMorphTargets = false;
+        for (const tinygltf::Mesh& gltfMesh : gltfModel.meshes)
+            for (const tinygltf::Primitive& prim : gltfMesh.primitives)
+                hasMorphTargets |= !prim.targets.empty();
+
+        if (gltfModel.animations.empty() && gltfModel.skins.empty() && !hasMorphTargets)
+            return nullptr;
+
+        if (gltfModel.animations.size() > 1)
+            printf("Only the first of %zu animations is played\n", gltfModel.animations.size());
+
+        Animation* animation = new Animation();
+        animation->rootTransform = xform;
+
+        animation->nodes.resize(gltfModel.nodes.size());
+        for (int i = 0; i < gltfModel.nodes.size(); i++)
+        {
+            const tinygltf::Node& gltfNode = gltfModel.nodes[i];
+            Animation::Node& node = animation->nodes[i];
+
+            for (int child : gltfNode.children)
+                animation->nodes[child].parent = i;
+
+            if (gltfNode.matrix.size() > 0)
+            {
+                node.hasMatrix = true;
+                for (int j = 0; j < 16; j++)
+                    node.matrix.data[j / 4][j % 4] = (float)gltfNode.matrix[j];
+            }
+            if (gltfNode.translation.size() > 0)
+                node.translation = Vec3((float)gltfNode.translation[0], (float)gltfNode.translation[1], (float)gltfNode.translation[2]);
+            if (gltfNode.rotation.size() > 0)
+                node.rotation = Vec4((float)gltfNode.rotation[0], (float)gltfNode.rotation[1], (float)gltfNode.rotation[2], (float)gltfNode.rotation[3]);
+            if (gltfNode.scale.size() > 0)
+                node.scale = Vec3((float)gltfNode.scale[0], (float)gltfNode.scale[1], (float)gltfNode.scale[2]);
+            for (double weight : gltfNode.weights)
+                node.weights.push_back((float)weight);
+        }
+
+        for (const tinygltf::Skin& gltfSkin : gltfModel.skins)
+        {
+            Animation::Skin skin;
+            skin.joints = gltfSkin.joints;
+            if (gltfSkin.inverseBindMatrices > -1)
+            {
+                std::vector<float> values;
+                int components;
+                ReadAccessor(gltfModel, gltfSkin.inverseBindMatrices, values, components);
+                // Column major, read row by row it is the transform for row vectors
+                skin.inverseBindMatrices.resize(values.size() / 16);
+                for (size_t m = 0; m < skin.inverseBindMatrices.size(); m++)
+                    for (int j = 0; j < 16; j++)
+                        skin.inverseBindMatrices[m].data[j / 4][j % 4] = values[m * 16 + j];
+            }
+            animation->skins.push_back(skin);
+        }
+
+        if (!gltfModel.animations.empty())
+        {
+            const tinygltf::Animation& gltfAnimation = gltfModel.animations[0];
+            for (const tinygltf::AnimationChannel& gltfChannel : gltfAnimation.channels)
+            {
+                const tinygltf::AnimationSampler& sampler = gltfAnimation.samplers[gltfChannel.sampler];
+                if (gltfChannel.target_node < 0)
+                    continue;
+
+                Animation::Channel channel;
+                channel.node = gltfChannel.target_node;
+
+                if (gltfChannel.target_path == "translation") channel.path = Animation::Path::Translation;
+                else if (gltfChannel.target_path == "rotation") channel.path = Animation::Path::Rotation;
+                else if (gltfChannel.target_path == "scale") channel.path = Animation::Path::Scale;
+                else if (gltfChannel.target_path == "weights") channel.path = Animation::Path::Weights;
+                else continue;
+
+                if (sampler.interpolation == "STEP") channel.interpolation = Animation::Interpolation::Step;
+                else if (sampler.interpolation == "CUBICSPLINE") channel.interpolation = Animation::Interpolation::CubicSpline;
+                else channel.interpolation = Animation::Interpolation::Linear;
+
+                int timeComponents;
+                ReadAccessor(gltfModel, sampler.input, channel.times, timeComponents);
+                ReadAccessor(gltfModel, sampler.output, channel.values, channel.components);
+                if (channel.times.empty())
+                    continue;
+
+                // Weights are scalars, one per morph target for each keyframe
+                if (channel.path == Animation::Path::Weights)
+                {
+                    int stride = channel.interpolation == Animation::Interpolation::CubicSpline ? 3 : 1;
+                    channel.components = (int)(channel.values.size() / (channel.times.size() * stride));
+                }
+
+                animation->duration = std::max(animation->duration, channel.times.back());
+                animation->channels.push_back(channel);
+            }
+        }
+
+        return animation;
+    }
 
+    Mat4 GetLocalMatrix(const tinygltf::Node& gltfNode)
+    {
         Mat4 localMat;
 
         if (gltfNode.matrix.size() > 0)
@@ -343,7 +550,87 @@ namespace GLSLPT
             localMat = scale * rot * translate;
         }
 
-        Mat4 xform = localMat * parentMat;
+        return localMat;
+    }
+
+    // Subtrees that occur more than once in a static file become instance groups,
+    // so a repeated assembly is instanced once per part and once per occurrence
+    // instead of once per part and occurrence
+    struct InstanceGroups
+    {
+        // Per node, the subtree under it: nodes with the same mesh and the same
+        // subtrees under children with the same local transforms share it
+        std::vector<int> subtrees;
+        // Per subtree, how often it is instanced once the subtrees around it are
+        // groups, the primitives in it and its group mesh, -1 until made. A part
+        // in every occurrence of a group occurs once, in the group
+        std::vector<int> counts;
+        std::vector<int> numPrims;
+        std::vector<int> meshIDs;
+        std::map<std::string, int> keys;
+
+        bool IsGroup(int nodeIdx) const
+        {
+            int subtree = subtrees[nodeIdx];
+            return counts[subtree] > 1 && numPrims[subtree] > 1;
+        }
+    };
+
+    int IdentifySubtree(tinygltf::Model& gltfModel, int nodeIdx, std::map<int, std::vector<Primitive>>& meshPrimMap, InstanceGroups& groups)
+    {
+        const tinygltf::Node& gltfNode = gltfModel.nodes[nodeIdx];
+
+        // Only leaf nodes are instanced, see TraverseChildren
+        int mesh = gltfNode.children.size() == 0 ? gltfNode.mesh : -1;
+        int numPrims = mesh != -1 ? (int)meshPrimMap[mesh].size() : 0;
+
+        std::string key((const char*)&mesh, sizeof(int));
+        std::vector<int> children;
+        for (int child : gltfNode.children)
+        {
+            children.push_back(IdentifySubtree(gltfModel, child, meshPrimMap, groups));
+            Mat4 localMat = GetLocalMatrix(gltfModel.nodes[child]);
+            key.append((const char*)&children.back(), sizeof(int));
+            key.append((const char*)&localMat, sizeof(Mat4));
+            numPrims += groups.numPrims[children.back()];
+        }
+
+        auto inserted = groups.keys.insert({ key, (int)groups.counts.size() });
+        int subtree = inserted.first->second;
+        if (inserted.second)
+        {
+            groups.counts.push_back(0);
+            groups.numPrims.push_back(numPrims);
+            groups.meshIDs.push_back(-1);
+
+            // A child counts once per distinct parent subtree, however often that parent occurs
+            for (int child : children)
+                groups.counts[child]++;
+        }
+
+        groups.subtrees[nodeIdx] = subtree;
+        return subtree;
+    }
+
+    // Add to the scene or, for the members of a group, to instances. Returns
+    // the scene instance ID, -1 for a group member
+    int AddInstance(Scene* scene, const MeshInstance& instance, std::vector<MeshInstance>* instances)
+    {
+        if (!instances)
+            return scene->AddMeshInstance(instance);
+
+        instances->push_back(instance);
+        return -1;
+    }
+
+    void TraverseNodes(Scene* scene, tinygltf::Model& gltfModel, int nodeIdx, Mat4& parentMat, std::map<int, std::vector<Primitive>>& meshPrimMap,
+        Animation* animation, bool animatedParent, InstanceGroups* groups, std::vector<MeshInstance>* instances);
+
+    // Instances of the meshes in the subtree under a node relative to the node
+    void TraverseChildren(Scene* scene, tinygltf::Model& gltfModel, int nodeIdx, Mat4& xform, std::map<int, std::vector<Primitive>>& meshPrimMap,
+        Animation* animation, bool animated, InstanceGroups* groups, std::vector<MeshInstance>* instances)
+    {
+        tinygltf::Node gltfNode = gltfModel.nodes[nodeIdx];
 
         // When at a leaf node, add an instance to the scene (if a mesh exists for it)
         if (gltfNode.children.size() == 0 && gltfNode.mesh != -1)
@@ -358,25 +645,103 @@ namespace GLSLPT
                 if (strcmp(name.c_str(), "") == 0)
                     name = "Mesh " + std::to_string(gltfNode.mesh) + " Prim" + std::to_string(prims[i].primitiveId);
 
-                MeshInstance instance(name, prims[i].primitiveId, xform, prims[i].materialId < 0 ? 0 : prims[i].materialId);
-                scene->AddMeshInstance(instance);
+                Mesh* mesh = scene->meshes[prims[i].primitiveId];
+                bool skinned = gltfNode.skin > -1 && !mesh->skinJoints.empty();
+                // Skinned meshes are placed by their joints, not by the node
+                MeshInstance instance(name, prims[i].primitiveId, skinned ? animation->rootTransform : xform, prims[i].materialId < 0 ? 0 : prims[i].materialId);
+                int instanceId = AddInstance(scene, instance, instances);
+
+                if (!animation)
+                    continue;
+
+                if (animated || skinned)
+                    animation->instances.push_back(Animation::AnimatedInstance{ instanceId, nodeIdx, skinned });
+
+                // A mesh used by several nodes is deformed once, by the first of them
+                bool deformed = false;
+                for (const Animation::DeformedMesh& deformedMesh : animation->meshes)
+                    deformed |= deformedMesh.mesh == prims[i].primitiveId;
+
+                if (!deformed && (skinned || mesh->numMorphTargets > 0))
+                {
+                    std::vector<float> weights;
+                    for (double weight : gltfModel.meshes[gltfNode.mesh].weights)
+                        weights.push_back((float)weight);
+                    animation->meshes.push_back(Animation::DeformedMesh{ prims[i].primitiveId, nodeIdx, skinned ? gltfNode.skin : -1, weights });
+                }
             }
         }
 
         for (size_t i = 0; i < gltfNode.children.size(); i++)
         {
-            TraverseNodes(scene, gltfModel, gltfNode.children[i], xform, meshPrimMap);
+            TraverseNodes(scene, gltfModel, gltfNode.children[i], xform, meshPrimMap, animation, animated, groups, instances);
         }
     }
 
-    void LoadInstances(Scene* scene, tinygltf::Model& gltfModel, Mat4 xform, std::map<int, std::vector<Primitive>>& meshPrimMap)
+    void TraverseNodes(Scene* scene, tinygltf::Model& gltfModel, int nodeIdx, Mat4& parentMat, std::map<int, std::vector<Primitive>>& meshPrimMap,
+        Animation* animation, bool animatedParent, InstanceGroups* groups, std::vector<MeshInstance>* instances)
+    {
+        const tinygltf::Node& gltfNode = gltfModel.nodes[nodeIdx];
+
+        Mat4 xform = GetLocalMatrix(gltfNode) * parentMat;
+
+        // Instances under a node moved by the animation follow it every frame
+        bool animated = animatedParent;
+        if (animation)
+        {
+            for (const Animation::Channel& channel : animation->channels)
+                animated |= channel.node == nodeIdx && channel.path != Animation::Path::Weights;
+        }
+
+        if (groups && groups->IsGroup(nodeIdx))
+        {
+            // The first occurrence makes the group, nested groups inside it first
+            int subtree = groups->subtrees[nodeIdx];
+            if (groups->meshIDs[subtree] < 0)
+            {
+                std::vector<MeshInstance> members;
+                Mat4 identity;
+                TraverseChildren(scene, gltfModel, nodeIdx, identity, meshPrimMap, nullptr, false, groups, &members);
+
+                std::string name = gltfNode.name.empty() ? "Group " + std::to_string(subtree) : gltfNode.name;
+                groups->meshIDs[subtree] = scene->AddInstanceGroup(name, members);
+            }
+
+            // The material is unused, the members keep theirs
+            int meshID = groups->meshIDs[subtree];
+            std::string name = gltfNode.name.empty() ? scene->meshes[meshID]->name : gltfNode.name;
+            AddInstance(scene, MeshInstance(name, meshID, xform, scene->meshes[meshID]->groupInstances[0].materialID), instances);
+            return;
+        }
+
+        TraverseChildren(scene, gltfModel, nodeIdx, xform, meshPrimMap, animation, animated, groups, instances);
+    }
+
+    void LoadInstances(Scene* scene, tinygltf::Model& gltfModel, Mat4 xform, std::map<int, std::vector<Primitive>>& meshPrimMap, Animation* animation)
     {
         const tinygltf::Scene gltfScene = gltfModel.scenes[gltfModel.defaultScene];
 
+        // Animated nodes move on their own, only static files share subtrees
+        InstanceGroups groups;
+        if (!animation)
+        {
+            groups.subtrees.assign(gltfModel.nodes.size(), -1);
+            for (int rootIdx = 0; rootIdx < gltfScene.nodes.size(); rootIdx++)
+                groups.counts[IdentifySubtree(gltfModel, gltfScene.nodes[rootIdx], meshPrimMap, groups)]++;
+        }
+
+        int numGroups = 0;
+        size_t numMeshes = scene->meshes.size();
+        size_t numInstances = scene->meshInstances.size();
         for (int rootIdx = 0; rootIdx < gltfScene.nodes.size(); rootIdx++)
         {
-            TraverseNodes(scene, gltfModel, gltfScene.nodes[rootIdx], xform, meshPrimMap);
+            TraverseNodes(scene, gltfModel, gltfScene.nodes[rootIdx], xform, meshPrimMap, animation, false, animation ? nullptr : &groups, nullptr);
         }
+
+        for (size_t i = numMeshes; i < scene->meshes.size(); i++)
+            numGroups += scene->meshes[i]->IsGroup() ? 1 : 0;
+        if (numGroups > 0)
+            printf("Shared %d repeated subtrees as instance groups, %zu instances\n", numGroups, scene->meshInstances.size() - numInstances);
     }
 
     bool LoadGLTF(const std::string& filename, Scene* scene, RenderOptions& renderOptions, Mat4 xform, bool binary)
@@ -405,7 +770,22 @@ namespace GLSLPT
         LoadMeshes(scene, gltfModel, meshPrimMap);
         LoadMaterials(scene, gltfModel);
         LoadTextures(scene, gltfModel);
-        LoadInstances(scene, gltfModel, xform, meshPrimMap);
+
+        Animation* animation = LoadAnimation(gltfModel, xform);
+        LoadInstances(scene, gltfModel, xform, meshPrimMap, animation);
+
+        // Files with skins or morph targets that deform nothing that was instanced stay static
+        if (animation && animation->meshes.empty() && animation->instances.empty())
+        {
+            delete animation;
+            animation = nullptr;
+        }
+
+        if (animation)
+        {
+            printf("Animation of %.2f seconds, %zu deformed meshes, %zu animated instances\n", animation->duration, animation->meshes.size(), animation->instances.size());
+            scene->animations.push_back(animation);
+        }
 
         return true;
     }
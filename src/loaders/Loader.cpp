@@ -268,6 +268,17 @@ namespace GLSLPT
                 char enableRoughnessMollification[10] = "none";
                 char enableVolumeMIS[10] = "none";
                 char enableUniformLight[10] = "none";
+                char quantizeBvh[10] = "none";
+                char bvhLayout[20] = "none";
+                char packTriangles[10] = "none";
+                char stacklessTraversal[10] = "none";
+                char lightBvh[10] = "none";
+                char bvhCacheDir[200] = "none";
+                char bvhStatsFile[200] = "none";
+                char gpuTlasBuild[10] = "none";
+                char playAnimation[10] = "none";
+                char pathTracer[20] = "none";
+                char rasterPrimary[10] = "none";
 
                 while (fgets(line, kMaxLineLength, file))
                 {
@@ -301,6 +312,27 @@ namespace GLSLPT
                     sscanf(line, " enablevolumemis %s", enableVolumeMIS);
                     sscanf(line, " enableuniformlight %s", enableUniformLight);
                     sscanf(line, " uniformlightcolor %f %f %f", &renderOptions.uniformLightCol.x, &renderOptions.uniformLightCol.y, &renderOptions.uniformLightCol.z);
+                    sscanf(line, " splitbvhdepth %i", &renderOptions.sbvhMaxSplitDepth);
+                    sscanf(line, " splitbvhminoverlap %f", &renderOptions.sbvhMinOverlap);
+                    sscanf(line, " splitbvhrefbudget %f", &renderOptions.sbvhRefBudget);
+                    sscanf(line, " tlasrebuildthreshold %f", &renderOptions.tlasRebuildThreshold);
+                    sscanf(line, " bvhoptimizepasses %i", &renderOptions.bvhOptimizePasses);
+                    sscanf(line, " bvhwidth %i", &renderOptions.bvhWidth);
+                    sscanf(line, " quantizebvh %s", quantizeBvh);
+                    sscanf(line, " bvhlayout %s", bvhLayout);
+                    sscanf(line, " packtriangles %s", packTriangles);
+                    sscanf(line, " stacklesstraversal %s", stacklessTraversal);
+                    sscanf(line, " lightbvh %s", lightBvh);
+                    sscanf(line, " bvhcachedir %s", bvhCacheDir);
+                    sscanf(line, " bvhstatsfile %s", bvhStatsFile);
+                    sscanf(line, " tlasbraidfactor %f", &renderOptions.tlasBraidFactor);
+                    sscanf(line, " mergemeshtriangles %i", &renderOptions.mergeMeshTriangles);
+                    sscanf(line, " rdhsamplerays %i", &renderOptions.rdhSampleRays);
+                    sscanf(line, " gputlasbuild %s", gpuTlasBuild);
+                    sscanf(line, " playanimation %s", playAnimation);
+                    sscanf(line, " pathtracer %s", pathTracer);
+                    sscanf(line, " persistentgroups %i", &renderOptions.persistentGroups);
+                    sscanf(line, " rasterprimary %s", rasterPrimary);
                 }
 
                 if (strcmp(envMap, "none") != 0)
@@ -366,6 +398,67 @@ namespace GLSLPT
                 else if (strcmp(enableUniformLight, "true") == 0)
                     renderOptions.enableUniformLight = true;
 
+                if (strcmp(quantizeBvh, "false") == 0)
+                    renderOptions.quantizeBvh = false;
+                else if (strcmp(quantizeBvh, "true") == 0)
+                    renderOptions.quantizeBvh = true;
+
+                if (strcmp(bvhLayout, "dfs") == 0)
+                    renderOptions.bvhLayout = (int)RadeonRays::BvhTranslator::NodeLayout::kDepthFirst;
+                else if (strcmp(bvhLayout, "sah") == 0)
+                    renderOptions.bvhLayout = (int)RadeonRays::BvhTranslator::NodeLayout::kLargerChildFirst;
+                else if (strcmp(bvhLayout, "veb") == 0)
+                    renderOptions.bvhLayout = (int)RadeonRays::BvhTranslator::NodeLayout::kVanEmdeBoas;
+                else if (strcmp(bvhLayout, "frequency") == 0)
+                    renderOptions.bvhLayout = (int)RadeonRays::BvhTranslator::NodeLayout::kVisitFrequency;
+                else if (strcmp(bvhLayout, "none") != 0)
+                    printf("Unknown bvh layout %s\n", bvhLayout);
+
+                if (strcmp(packTriangles, "false") == 0)
+                    renderOptions.packTriangles = false;
+                else if (strcmp(packTriangles, "true") == 0)
+                    renderOptions.packTriangles = true;
+
+                if (strcmp(stacklessTraversal, "false") == 0)
+                    renderOptions.stacklessTraversal = false;
+                else if (strcmp(stacklessTraversal, "true") == 0)
+                    renderOptions.stacklessTraversal = true;
+
+                if (strcmp(lightBvh, "false") == 0)
+                    renderOptions.lightBvh = false;
+                else if (strcmp(lightBvh, "true") == 0)
+                    renderOptions.lightBvh = true;
+
+                if (strcmp(gpuTlasBuild, "false") == 0)
+                    renderOptions.gpuTlasBuild = false;
+                else if (strcmp(gpuTlasBuild, "true") == 0)
+                    renderOptions.gpuTlasBuild = true;
+
+                if (strcmp(playAnimation, "false") == 0)
+                    renderOptions.playAnimation = false;
+                else if (strcmp(playAnimation, "true") == 0)
+                    renderOptions.playAnimation = true;
+
+                if (strcmp(pathTracer, "fragment") == 0)
+                    renderOptions.pathTraceMode = FragmentPathTrace;
+                else if (strcmp(pathTracer, "persistent") == 0)
+                    renderOptions.pathTraceMode = PersistentPathTrace;
+                else if (strcmp(pathTracer, "wavefront") == 0)
+                    renderOptions.pathTraceMode = WavefrontPathTrace;
+                else if (strcmp(pathTracer, "none") != 0)
+                    printf("Unknown path tracer %s\n", pathTracer);
+
+                if (strcmp(rasterPrimary, "false") == 0)
+                    renderOptions.rasterPrimary = false;
+                else if (strcmp(rasterPrimary, "true") == 0)
+                    renderOptions.rasterPrimary = true;
+
+                if (strcmp(bvhCacheDir, "none") != 0)
+                    renderOptions.bvhCacheDir = path + bvhCacheDir;
+
+                if (strcmp(bvhStatsFile, "none") != 0)
+                    renderOptions.bvhStatsFile = path + bvhStatsFile;
+
                 if (!renderOptions.independentRenderSize)
                     renderOptions.windowResolution = renderOptions.renderResolution;
             }
@@ -381,6 +474,7 @@ namespace GLSLPT
                 Mat4 xform, translate, rot, scale;
                 int material_id = 0; // Default Material ID
                 char meshName[200] = "none";
+                char bvhBuilder[20] = "none";
                 bool matrixProvided = false;
 
                 while (fgets(line, kMaxLineLength, file))
@@ -393,6 +487,7 @@ namespace GLSLPT
                     char matName[100];
 
                     sscanf(line, " name %[^\t\n]s", meshName);
+                    sscanf(line, " bvh %s", bvhBuilder);
 
                     if (sscanf(line, " file %s", file) == 1)
                         filename = path + file;
@@ -427,6 +522,15 @@ namespace GLSLPT
                     {
                         std::string instanceName;
 
+                        if (strcmp(bvhBuilder, "sbvh") == 0)
+                            scene->meshes[mesh_id]->bvhBuilder = SpatialSplit;
+                        else if (strcmp(bvhBuilder, "sah") == 0)
+                            scene->meshes[mesh_id]->bvhBuilder = BinnedSah;
+                        else if (strcmp(bvhBuilder, "lbvh") == 0)
+                            scene->meshes[mesh_id]->bvhBuilder = Linear;
+                        else if (strcmp(bvhBuilder, "none") != 0)
+                            printf("Unknown bvh builder %s\n", bvhBuilder);
+
                         if (strcmp(meshName, "none") != 0)
                             instanceName = std::string(meshName);
                         else
@@ -0,0 +1,284 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GLSLPT_SIMD_SSE 1
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <limits>
+#include "Vec3.h"
+#include "Vec4.h"
+#include "Mat4.h"
+
+namespace GLSLPT
+{
+    // Four floats in an SSE register, plain floats where SSE2 is not available.
+    // Only used by CPU side geometry processing: Vec3, Vec4 and Mat4 keep their
+    // layout because the GPU buffers are uploaded from them as is.
+    // Min and Max take their operands in the order of std::min and std::max,
+    // so results match Vec3::Min and Vec3::Max bit for bit
+    struct alignas(16) Float4
+    {
+    public:
+        Float4();
+        Float4(float x, float y, float z, float w);
+        // w is set to 0
+        explicit Float4(const Vec3& a);
+        explicit Float4(const Vec4& a);
+
+        static Float4 Splat(float a);
+        // Loads one row of a matrix
+        static Float4 Row(const Mat4& m, int row);
+
+        Float4 operator+(const Float4& b) const;
+        Float4 operator-(const Float4& b) const;
+        Float4 operator*(const Float4& b) const;
+        Float4 operator*(float b) const;
+
+        float operator[](int i) const;
+        // Copy with lane i set to a
+        Float4 Replace(int i, float a) const;
+
+        Vec3 ToVec3() const;
+        // xyz of this with the given w
+        Vec4 ToVec4(float w) const;
+
+        static Float4 Min(const Float4& a, const Float4& b);
+        static Float4 Max(const Float4& a, const Float4& b);
+
+#if GLSLPT_SIMD_SSE
+        explicit Float4(__m128 v) : v(v) {}
+        __m128 v;
+#else
+        float v[4];
+#endif
+    };
+
+    // Bounding box as two Float4, mirrors RadeonRays::bbox
+    struct Box4
+    {
+    public:
+        // Empty box
+        Box4();
+        Box4(const Vec3& pmin, const Vec3& pmax);
+        // Six consecutive floats, min xyz followed by max xyz like RadeonRays::bbox.
+        // w of both corners is undefined
+        explicit Box4(const float* minMax);
+
+        void Grow(const Float4& p);
+        void Grow(const Float4& boxMin, const Float4& boxMax);
+        void Grow(const Box4& b);
+        // Same operation order as bbox::surface_area
+        float SurfaceArea() const;
+        void Store(Vec3& boxMin, Vec3& boxMax) const;
+
+        Float4 pmin;
+        Float4 pmax;
+    };
+
+    // Points of a row vector convention matrix, w of every point is kept
+    void TransformPoints(const Mat4& m, const Vec4* points, int count, Vec4* transformed);
+
+#if GLSLPT_SIMD_SSE
+    inline Float4::Float4() : v(_mm_setzero_ps()) {}
+
+    inline Float4::Float4(float x, float y, float z, float w) : v(_mm_setr_ps(x, y, z, w)) {}
+
+    inline Float4::Float4(const Vec3& a) : v(_mm_setr_ps(a.x, a.y, a.z, 0.0f)) {}
+
+    inline Float4::Float4(const Vec4& a) : v(_mm_loadu_ps(&a.x)) {}
+
+    inline Float4 Float4::Splat(float a) { return Float4(_mm_set1_ps(a)); }
+
+    inline Float4 Float4::Row(const Mat4& m, int row) { return Float4(_mm_loadu_ps(m.data[row])); }
+
+    inline Float4 Float4::operator+(const Float4& b) const { return Float4(_mm_add_ps(v, b.v)); }
+
+    inline Float4 Float4::operator-(const Float4& b) const { return Float4(_mm_sub_ps(v, b.v)); }
+
+    inline Float4 Float4::operator*(const Float4& b) const { return Float4(_mm_mul_ps(v, b.v)); }
+
+    inline Float4 Float4::operator*(float b) const { return Float4(_mm_mul_ps(v, _mm_set1_ps(b))); }
+
+    inline float Float4::operator[](int i) const
+    {
+        alignas(16) float out[4];
+        _mm_store_ps(out, v);
+        return out[i];
+    }
+
+    inline Float4 Float4::Replace(int i, float a) const
+    {
+        __m128 mask = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_set1_epi32(i), _mm_setr_epi32(0, 1, 2, 3)));
+        return Float4(_mm_or_ps(_mm_and_ps(mask, _mm_set1_ps(a)), _mm_andnot_ps(mask, v)));
+    }
+
+    inline Vec3 Float4::ToVec3() const
+    {
+        Vec3 out;
+        _mm_storel_pi(reinterpret_cast<__m64*>(&out.x), v);
+        _mm_store_ss(&out.z, _mm_movehl_ps(v, v));
+        return out;
+    }
+
+    inline Vec4 Float4::ToVec4(float w) const
+    {
+        alignas(16) float out[4];
+        _mm_store_ps(out, v);
+        return Vec4(out[0], out[1], out[2], w);
+    }
+
+    // minps returns its second operand unless the first is smaller, std::min(a, b) returns a unless b is smaller
+    inline Float4 Float4::Min(const Float4& a, const Float4& b) { return Float4(_mm_min_ps(b.v, a.v)); }
+
+    inline Float4 Float4::Max(const Float4& a, const Float4& b) { return Float4(_mm_max_ps(b.v, a.v)); }
+
+    inline Box4::Box4(const float* minMax)
+    {
+        // Two overlapping loads stay inside the six floats
+        __m128 high = _mm_loadu_ps(minMax + 2);
+        pmin = Float4(_mm_loadu_ps(minMax));
+        pmax = Float4(_mm_shuffle_ps(high, high, _MM_SHUFFLE(3, 3, 2, 1)));
+    }
+
+    inline float Box4::SurfaceArea() const
+    {
+        __m128 ext = _mm_sub_ps(pmax.v, pmin.v);
+        // (x, x, y) * (y, z, z)
+        __m128 products = _mm_mul_ps(_mm_shuffle_ps(ext, ext, _MM_SHUFFLE(3, 1, 0, 0)), _mm_shuffle_ps(ext, ext, _MM_SHUFFLE(3, 2, 2, 1)));
+        alignas(16) float p[4];
+        _mm_store_ps(p, products);
+        return 2.f * (p[0] + p[1] + p[2]);
+    }
+#else
+    inline Float4::Float4() { v[0] = v[1] = v[2] = v[3] = 0.0f; }
+
+    inline Float4::Float4(float x, float y, float z, float w) { v[0] = x; v[1] = y; v[2] = z; v[3] = w; }
+
+    inline Float4::Float4(const Vec3& a) : Float4(a.x, a.y, a.z, 0.0f) {}
+
+    inline Float4::Float4(const Vec4& a) : Float4(a.x, a.y, a.z, a.w) {}
+
+    inline Float4 Float4::Splat(float a) { return Float4(a, a, a, a); }
+
+    inline Float4 Float4::Row(const Mat4& m, int row) { return Float4(m.data[row][0], m.data[row][1], m.data[row][2], m.data[row][3]); }
+
+    inline Float4 Float4::operator+(const Float4& b) const { return Float4(v[0] + b.v[0], v[1] + b.v[1], v[2] + b.v[2], v[3] + b.v[3]); }
+
+    inline Float4 Float4::operator-(const Float4& b) const { return Float4(v[0] - b.v[0], v[1] - b.v[1], v[2] - b.v[2], v[3] - b.v[3]); }
+
+    inline Float4 Float4::operator*(const Float4& b) const { return Float4(v[0] * b.v[0], v[1] * b.v[1], v[2] * b.v[2], v[3] * b.v[3]); }
+
+    inline Float4 Float4::operator*(float b) const { return Float4(v[0] * b, v[1] * b, v[2] * b, v[3] * b); }
+
+    inline float Float4::operator[](int i) const { return v[i]; }
+
+    inline Float4 Float4::Replace(int i, float a) const
+    {
+        Float4 out = *this;
+        out.v[i] = a;
+        return out;
+    }
+
+    inline Vec3 Float4::ToVec3() const { return Vec3(v[0], v[1], v[2]); }
+
+    inline Vec4 Float4::ToVec4(float w) const { return Vec4(v[0], v[1], v[2], w); }
+
+    inline Float4 Float4::Min(const Float4& a, const Float4& b)
+    {
+        return Float4(std::min(a.v[0], b.v[0]), std::min(a.v[1], b.v[1]), std::min(a.v[2], b.v[2]), std::min(a.v[3], b.v[3]));
+    }
+
+    inline Float4 Float4::Max(const Float4& a, const Float4& b)
+    {
+        return Float4(std::max(a.v[0], b.v[0]), std::max(a.v[1], b.v[1]), std::max(a.v[2], b.v[2]), std::max(a.v[3], b.v[3]));
+    }
+
+    inline Box4::Box4(const float* minMax)
+        : pmin(minMax[0], minMax[1], minMax[2], 0.0f)
+        , pmax(minMax[3], minMax[4], minMax[5], 0.0f)
+    {
+    }
+
+    inline float Box4::SurfaceArea() const
+    {
+        Float4 ext = pmax - pmin;
+        return 2.f * (ext.v[0] * ext.v[1] + ext.v[0] * ext.v[2] + ext.v[1] * ext.v[2]);
+    }
+#endif
+
+    inline Box4::Box4()
+        : pmin(Float4::Splat(std::numeric_limits<float>::max()))
+        , pmax(Float4::Splat(-std::numeric_limits<float>::max()))
+    {
+    }
+
+    inline Box4::Box4(const Vec3& pmin, const Vec3& pmax)
+        : pmin(pmin)
+        , pmax(pmax)
+    {
+    }
+
+    inline void Box4::Grow(const Float4& p)
+    {
+        pmin = Float4::Min(pmin, p);
+        pmax = Float4::Max(pmax, p);
+    }
+
+    inline void Box4::Grow(const Float4& boxMin, const Float4& boxMax)
+    {
+        pmin = Float4::Min(pmin, boxMin);
+        pmax = Float4::Max(pmax, boxMax);
+    }
+
+    inline void Box4::Grow(const Box4& b)
+    {
+        Grow(b.pmin, b.pmax);
+    }
+
+    inline void Box4::Store(Vec3& boxMin, Vec3& boxMax) const
+    {
+        boxMin = pmin.ToVec3();
+        boxMax = pmax.ToVec3();
+    }
+
+    inline void TransformPoints(const Mat4& m, const Vec4* points, int count, Vec4* transformed)
+    {
+        Float4 right = Float4::Row(m, 0);
+        Float4 up = Float4::Row(m, 1);
+        Float4 forward = Float4::Row(m, 2);
+        Float4 translation = Float4::Row(m, 3);
+
+        for (int i = 0; i < count; ++i)
+        {
+            const Vec4& p = points[i];
+            Float4 position = right * p.x + up * p.y + forward * p.z + translation;
+            transformed[i] = position.ToVec4(p.w);
+        }
+    }
+}
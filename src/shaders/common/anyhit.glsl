@@ -24,10 +24,18 @@
 
 bool AnyHit(Ray r, float maxDist)
 {
+#ifdef OPT_RAY_STATS
+    numRaysTraced++;
+#endif
 
 #ifdef OPT_LIGHTS
     // Intersect Emitters
+#ifdef OPT_LIGHT_BVH
+    LightTraversal lights = BeginLights();
+    for (int i = NextLight(lights, r); i != -1; i = NextLight(lights, r))
+#else
     for (int i = 0; i < numOfLights; i++)
+#endif
     {
         // Fetch light Data
         vec3 position = texelFetch(lightsTex, ivec2(i * 5 + 0, 0), 0).xyz;
@@ -63,9 +71,16 @@ bool AnyHit(Ray r, float maxDist)
 #endif
 
     // Intersect BVH and tris
+#ifndef OPT_STACKLESS
+#ifdef OPT_BVH_WIDTH
+    // Wide nodes push up to OPT_BVH_WIDTH - 1 children per level
+    int stack[OPT_BVH_WIDTH * 16];
+#else
     int stack[64];
+#endif
     int ptr = 0;
     stack[ptr++] = -1;
+#endif
 
     int index = topBVHIndex;
     float leftHit = 0.0;
@@ -74,7 +89,22 @@ bool AnyHit(Ray r, float maxDist)
 #if defined(OPT_ALPHA_TEST) && !defined(OPT_MEDIUM)
     int currMatID = 0;
 #endif
+#ifdef OPT_NESTED_INSTANCES
+    // Instances the ray is inside of, see ClosestHit
+    int level = 0;
+    mat4 levelTransforms[OPT_NESTED_INSTANCES];
+    Ray levelRays[OPT_NESTED_INSTANCES];
+#ifdef OPT_STACKLESS
+    int levelLeaves[OPT_NESTED_INSTANCES];
+    int levelEntries[OPT_NESTED_INSTANCES];
+#endif
+#else
     bool BLAS = false;
+#ifdef OPT_STACKLESS
+    int tlasLeaf = -1;
+    int blasEntry = -1;
+#endif
+#endif
 
     Ray rTrans;
     rTrans.origin = r.origin;
@@ -82,16 +112,36 @@ bool AnyHit(Ray r, float maxDist)
 
     while (index != -1)
     {
+#if defined(OPT_BVH_QUANTIZED)
+        // Indices address texels, internal nodes keep their number of children in rightIndex
+        uvec4 header = texelFetch(BVH, index);
+        uint kind = (header.w >> 24u) & 15u;
+
+        int leftIndex  = int(header.x);
+        int rightIndex = kind == BVH_KIND_INTERNAL ? int(header.w >> 28u) : int(header.y);
+        int leaf       = kind == BVH_KIND_BLAS_LEAF ? 1 : (kind == BVH_KIND_TLAS_LEAF ? -int(header.z) - 1 : 0);
+#else
+#ifdef OPT_BVH_WIDTH
+        ivec3 LRLeaf = ivec3(texelFetch(BVH, (index / OPT_BVH_WIDTH) * OPT_BVH_WIDTH * 3 + OPT_BVH_WIDTH * 2 + index % OPT_BVH_WIDTH).xyz);
+#else
         ivec3 LRLeaf = ivec3(texelFetch(BVH, index * 3 + 2).xyz);
+#endif
 
         int leftIndex  = int(LRLeaf.x);
         int rightIndex = int(LRLeaf.y);
         int leaf       = int(LRLeaf.z);
+#endif
 
         if (leaf > 0) // Leaf node of BLAS
         {
             for (int i = 0; i < rightIndex; i++) // Loop through tris
             {
+#ifdef OPT_PACKED_TRIANGLES
+                // First vertex and both edges, stored contiguously in leaf order
+                vec3 v0 = texelFetch(trianglesTex, (leftIndex + i) * 3 + 0).xyz;
+                vec3 e0 = texelFetch(trianglesTex, (leftIndex + i) * 3 + 1).xyz;
+                vec3 e1 = texelFetch(trianglesTex, (leftIndex + i) * 3 + 2).xyz;
+#else
                 ivec3 vertIndices = ivec3(texelFetch(vertexIndicesTex, leftIndex + i).xyz);
 
                 vec4 v0 = texelFetch(verticesTex, vertIndices.x);
@@ -100,6 +150,7 @@ bool AnyHit(Ray r, float maxDist)
 
                 vec3 e0 = v1.xyz - v0.xyz;
                 vec3 e1 = v2.xyz - v0.xyz;
+#endif
                 vec3 pv = cross(rTrans.direction, e1);
                 float det = dot(e0, pv);
 
@@ -116,14 +167,26 @@ bool AnyHit(Ray r, float maxDist)
                 if (all(greaterThanEqual(uvt, vec4(0.0))) && uvt.z < maxDist)
                 {
 #if defined(OPT_ALPHA_TEST) && !defined(OPT_MEDIUM)
-                    vec2 t0 = vec2(v0.w, texelFetch(normalsTex, vertIndices.x).w);
-                    vec2 t1 = vec2(v1.w, texelFetch(normalsTex, vertIndices.y).w);
-                    vec2 t2 = vec2(v2.w, texelFetch(normalsTex, vertIndices.z).w);
+#ifdef OPT_PACKED_TRIANGLES
+                    // Texture coords are only needed here, fetch them through the side index
+                    ivec3 vertIndices = texelFetch(vertexIndicesTex, leftIndex + i).xyz;
+                    vec3 uvX = vec3(texelFetch(verticesTex, vertIndices.x).w, texelFetch(verticesTex, vertIndices.y).w, texelFetch(verticesTex, vertIndices.z).w);
+#else
+                    vec3 uvX = vec3(v0.w, v1.w, v2.w);
+#endif
+                    vec2 t0 = vec2(uvX.x, texelFetch(normalsTex, vertIndices.x).w);
+                    vec2 t1 = vec2(uvX.y, texelFetch(normalsTex, vertIndices.y).w);
+                    vec2 t2 = vec2(uvX.z, texelFetch(normalsTex, vertIndices.z).w);
 
                     vec2 texCoord = t0 * uvt.w + t1 * uvt.x + t2 * uvt.y;
 
-                    vec4 texIDs      = texelFetch(materialsTex, ivec2(currMatID * 8 + 6, 0), 0);
-                    vec4 alphaParams = texelFetch(materialsTex, ivec2(currMatID * 8 + 7, 0), 0);
+#ifdef OPT_MERGED_MESHES
+                    int matID = currMatID < 0 ? texelFetch(triangleMaterialsTex, leftIndex + i).x : currMatID;
+#else
+                    int matID = currMatID;
+#endif
+                    vec4 texIDs      = texelFetch(materialsTex, ivec2(matID * 8 + 6, 0), 0);
+                    vec4 alphaParams = texelFetch(materialsTex, ivec2(matID * 8 + 7, 0), 0);
                     
                     float alpha = texture(textureMapsArrayTex, vec3(texCoord, texIDs.x)).a;
 
@@ -143,23 +206,43 @@ bool AnyHit(Ray r, float maxDist)
                     
             }
         }
-        else if (leaf < 0) // Leaf node of TLAS
+        else if (leaf < 0) // Leaf node of TLAS or of an instance group
         {
             vec4 r1 = texelFetch(transformsTex, ivec2((-leaf - 1) * 4 + 0, 0), 0).xyzw;
             vec4 r2 = texelFetch(transformsTex, ivec2((-leaf - 1) * 4 + 1, 0), 0).xyzw;
             vec4 r3 = texelFetch(transformsTex, ivec2((-leaf - 1) * 4 + 2, 0), 0).xyzw;
             vec4 r4 = texelFetch(transformsTex, ivec2((-leaf - 1) * 4 + 3, 0), 0).xyzw;
 
+#ifdef OPT_NESTED_INSTANCES
+            mat4 transform = level > 0 ? levelTransforms[level - 1] * mat4(r1, r2, r3, r4) : mat4(r1, r2, r3, r4);
+#else
             mat4 transform = mat4(r1, r2, r3, r4);
+#endif
 
             rTrans.origin    = vec3(inverse(transform) * vec4(r.origin, 1.0));
             rTrans.direction = vec3(inverse(transform) * vec4(r.direction, 0.0));
 
+#ifdef OPT_STACKLESS
+#ifdef OPT_NESTED_INSTANCES
+            levelLeaves[level] = index;
+            levelEntries[level] = leftIndex;
+#else
+            tlasLeaf = index;
+            blasEntry = leftIndex;
+#endif
+#else
             // Add a marker. We'll return to this spot after we've traversed the entire BLAS
             stack[ptr++] = -1;
+#endif
 
             index = leftIndex;
+#ifdef OPT_NESTED_INSTANCES
+            levelTransforms[level] = transform;
+            levelRays[level] = rTrans;
+            level++;
+#else
             BLAS = true;
+#endif
 #if defined(OPT_ALPHA_TEST) && !defined(OPT_MEDIUM)
             currMatID = rightIndex;
 #endif
@@ -167,6 +250,85 @@ bool AnyHit(Ray r, float maxDist)
         }
         else
         {
+#if defined(OPT_BVH_QUANTIZED) || defined(OPT_BVH_WIDTH)
+            // Wide node: rightIndex is its number of children. Continue with the
+            // nearest child that is hit and push the others so that nearer ones
+            // are popped first. Float layouts keep the node in leftIndex and
+            // address child records
+#ifdef OPT_BVH_QUANTIZED
+            // Child bounds are 8 bit offsets from the node's bounds minimum in
+            // power of two steps. The translator rounds them outwards with the
+            // same float math, so decoded boxes always contain the exact ones
+            vec3 origin = uintBitsToFloat(header.xyz);
+            vec3 scale = uintBitsToFloat(((uvec3(header.w) >> uvec3(0u, 8u, 16u)) & 0xFFu) << 23u);
+            uint body[BVH_QUANTIZED_BODY * 4];
+            for (int i = 0; i < BVH_QUANTIZED_BODY; i++)
+            {
+                uvec4 texel = texelFetch(BVH, index + 1 + i);
+                body[i * 4 + 0] = texel.x;
+                body[i * 4 + 1] = texel.y;
+                body[i * 4 + 2] = texel.z;
+                body[i * 4 + 3] = texel.w;
+            }
+#else
+            int nodeBase = leftIndex * OPT_BVH_WIDTH * 3;
+#endif
+            float childHits[BVH_WIDTH];
+            int childIndices[BVH_WIDTH];
+            int numHits = 0;
+
+            for (int i = 0; i < rightIndex; i++)
+            {
+#ifdef OPT_BVH_QUANTIZED
+                uvec3 q = uvec3(body[i / 2], body[BVH_WIDTH / 2 + i / 2], body[BVH_WIDTH + i / 2]) >> uint(i % 2 * 16);
+                vec3 bboxmin = origin + vec3(q & 0xFFu) * scale;
+                vec3 bboxmax = origin + vec3((q >> 8u) & 0xFFu) * scale;
+                // The first child directly follows the node
+                int childIndex = i == 0 ? index + 1 + BVH_QUANTIZED_BODY : int(body[BVH_WIDTH * 3 / 2 + i - 1]);
+#else
+                vec3 bboxmin = texelFetch(BVH, nodeBase + i).xyz;
+                vec3 bboxmax = texelFetch(BVH, nodeBase + OPT_BVH_WIDTH + i).xyz;
+                int childIndex = leftIndex * OPT_BVH_WIDTH + i;
+#endif
+                float hit = AABBIntersect(bboxmin, bboxmax, rTrans);
+                if (hit > 0.0)
+                {
+                    // Insertion sort, farthest first
+                    int j = numHits++;
+                    for (; j > 0 && childHits[j - 1] < hit; j--)
+                    {
+                        childHits[j] = childHits[j - 1];
+                        childIndices[j] = childIndices[j - 1];
+                    }
+                    childHits[j] = hit;
+                    childIndices[j] = childIndex;
+                }
+            }
+
+            if (numHits > 0)
+            {
+                for (int i = 0; i < numHits - 1; i++)
+                    stack[ptr++] = childIndices[i];
+
+                index = childIndices[numHits - 1];
+                continue;
+            }
+#elif defined(OPT_STACKLESS)
+            // Same child order as ClosestHit, the climb back up relies on it
+            int nearChild = NearChild(texelFetch(bvhLinksTex, index).x, leftIndex, rightIndex, rTrans.direction);
+            int farChild = leftIndex + rightIndex - nearChild;
+
+            if (AABBIntersect(texelFetch(BVH, nearChild * 3 + 0).xyz, texelFetch(BVH, nearChild * 3 + 1).xyz, rTrans) > 0.0)
+            {
+                index = nearChild;
+                continue;
+            }
+            if (AABBIntersect(texelFetch(BVH, farChild * 3 + 0).xyz, texelFetch(BVH, farChild * 3 + 1).xyz, rTrans) > 0.0)
+            {
+                index = farChild;
+                continue;
+            }
+#else
             leftHit =  AABBIntersect(texelFetch(BVH, leftIndex  * 3 + 0).xyz, texelFetch(BVH, leftIndex  * 3 + 1).xyz, rTrans);
             rightHit = AABBIntersect(texelFetch(BVH, rightIndex * 3 + 0).xyz, texelFetch(BVH, rightIndex * 3 + 1).xyz, rTrans);
 
@@ -197,9 +359,71 @@ bool AnyHit(Ray r, float maxDist)
                 index = rightIndex;
                 continue;
             }
+#endif
+        }
+#ifdef OPT_STACKLESS
+        // Climb out of the finished subtree, see ClosestHit
+        int node = index;
+        index = -1;
+        while (index == -1)
+        {
+#ifdef OPT_NESTED_INSTANCES
+            if (level > 0 && node == levelEntries[level - 1])
+            {
+                level--;
+                node = levelLeaves[level];
+
+                if (level > 0)
+                    rTrans = levelRays[level - 1];
+                else
+                {
+                    rTrans.origin = r.origin;
+                    rTrans.direction = r.direction;
+                }
+                continue;
+            }
+#else
+            if (BLAS && node == blasEntry)
+            {
+                BLAS = false;
+                node = tlasLeaf;
+
+                rTrans.origin = r.origin;
+                rTrans.direction = r.direction;
+                continue;
+            }
+#endif
+            int parent = (texelFetch(bvhLinksTex, node).x >> 3) - 1;
+            if (parent == -1)
+                break;
+
+            ivec3 parentLR = ivec3(texelFetch(BVH, parent * 3 + 2).xyz);
+            int nearChild = NearChild(texelFetch(bvhLinksTex, parent).x, parentLR.x, parentLR.y, rTrans.direction);
+            int farChild = parentLR.x + parentLR.y - nearChild;
+            if (node == nearChild && AABBIntersect(texelFetch(BVH, farChild * 3 + 0).xyz, texelFetch(BVH, farChild * 3 + 1).xyz, rTrans) > 0.0)
+                index = farChild;
+
+            node = parent;
         }
+#else
         index = stack[--ptr];
 
+#ifdef OPT_NESTED_INSTANCES
+        // Step out of every instance whose BLAS is done
+        while (level > 0 && index == -1)
+        {
+            level--;
+            index = stack[--ptr];
+
+            if (level > 0)
+                rTrans = levelRays[level - 1];
+            else
+            {
+                rTrans.origin = r.origin;
+                rTrans.direction = r.direction;
+            }
+        }
+#else
         // If we've traversed the entire BLAS then switch to back to TLAS and resume where we left off
         if (BLAS && index == -1)
         {
@@ -210,6 +434,8 @@ bool AnyHit(Ray r, float maxDist)
             rTrans.origin = r.origin;
             rTrans.direction = r.direction;
         }
+#endif
+#endif
     }
 
     return false;
@@ -0,0 +1,74 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Ray through a pixel of the camera, jittered with a tent filter and sampled
+// over the aperture. texCoords is the pixel center over the render resolution
+Ray CameraRay(vec2 texCoords)
+{
+    float r1 = 2.0 * rand();
+    float r2 = 2.0 * rand();
+
+    vec2 jitter;
+    jitter.x = r1 < 1.0 ? sqrt(r1) - 1.0 : 1.0 - sqrt(2.0 - r1);
+    jitter.y = r2 < 1.0 ? sqrt(r2) - 1.0 : 1.0 - sqrt(2.0 - r2);
+
+    // Direction in NDC, then in camera space
+    jitter /= (resolution * 0.5);
+    vec2 d = (2.0 * texCoords - 1.0) + jitter;
+
+    float scale = tan(camera.fov * 0.5);
+    d.y *= resolution.y / resolution.x * scale;
+    d.x *= scale;
+    vec3 rayDir = normalize(d.x * camera.right + d.y * camera.up + camera.forward);
+
+    // Random start on the aperture, aimed at the focal point
+    vec3 focalPoint = camera.focalDist * rayDir;
+    float cam_r1 = rand() * TWO_PI;
+    float cam_r2 = rand() * camera.aperture;
+    vec3 randomAperturePos = (cos(cam_r1) * camera.right + sin(cam_r1) * camera.up) * sqrt(cam_r2);
+    vec3 finalRayDir = normalize(focalPoint - randomAperturePos);
+
+    return Ray(camera.position + randomAperturePos, finalRayDir);
+}
+
+#ifdef OPT_RASTER_PRIMARY
+// Ray through a pixel with the jitter and lens sample the visibility buffer
+// was drawn with, aimed at the pixel's point on the focal plane so that it
+// goes through the triangle drawn there
+Ray FrameCameraRay(vec2 texCoords)
+{
+    // Same number of random numbers as CameraRay, later bounces see the same sequence
+    rand(); rand(); rand(); rand();
+
+    vec2 d = (2.0 * texCoords - 1.0) + cameraJitter;
+
+    float scale = tan(camera.fov * 0.5);
+    d.y *= resolution.y / resolution.x * scale;
+    d.x *= scale;
+    vec3 focalPoint = camera.focalDist * (d.x * camera.right + d.y * camera.up + camera.forward);
+    vec3 aperturePos = lensOffset.x * camera.right + lensOffset.y * camera.up;
+
+    return Ray(camera.position + aperturePos, normalize(focalPoint - aperturePos));
+}
+#endif
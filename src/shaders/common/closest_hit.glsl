@@ -22,17 +22,18 @@
  * SOFTWARE.
  */
 
-bool ClosestHit(Ray r, inout State state, inout LightSampleRec lightSample)
+#ifdef OPT_LIGHTS
+// Intersect the emitters, keeping the closest one nearer than t
+void ClosestLight(Ray r, inout float t, inout State state, inout LightSampleRec lightSample)
 {
-    float t = INF;
     float d;
 
-#ifdef OPT_LIGHTS
-    // Intersect Emitters
-#ifdef OPT_HIDE_EMITTERS
-if(state.depth > 0)
-#endif
+#ifdef OPT_LIGHT_BVH
+    LightTraversal lights = BeginLights();
+    for (int i = NextLight(lights, r); i != -1; i = NextLight(lights, r))
+#else
     for (int i = 0; i < numOfLights; i++)
+#endif
     {
         // Fetch light Data
         vec3 position = texelFetch(lightsTex, ivec2(i * 5 + 0, 0), 0).xyz;
@@ -85,21 +86,104 @@ if(state.depth > 0)
             }
         }
     }
+}
+#endif
+
+// Surface attributes of a hit at barycentrics bary of the triangle with vertex
+// indices triID, whose vertices are placed in the world by transform
+void TriangleHitState(Ray r, ivec3 triID, vec4 vert0, vec4 vert1, vec4 vert2, vec3 bary, mat4 transform, inout State state)
+{
+    state.isEmitter = false;
+
+    // Normals
+    vec4 n0 = texelFetch(normalsTex, triID.x);
+    vec4 n1 = texelFetch(normalsTex, triID.y);
+    vec4 n2 = texelFetch(normalsTex, triID.z);
+
+    // Get texcoords from w coord of vertices and normals
+    vec2 t0 = vec2(vert0.w, n0.w);
+    vec2 t1 = vec2(vert1.w, n1.w);
+    vec2 t2 = vec2(vert2.w, n2.w);
+
+    // Interpolate texture coords and normals using barycentric coords
+    state.texCoord = t0 * bary.x + t1 * bary.y + t2 * bary.z;
+    vec3 normal = normalize(n0.xyz * bary.x + n1.xyz * bary.y + n2.xyz * bary.z);
+
+    state.normal = normalize(transpose(inverse(mat3(transform))) * normal);
+    state.ffnormal = dot(state.normal, r.direction) <= 0.0 ? state.normal : -state.normal;
+
+    // Calculate tangent and bitangent
+    vec3 deltaPos1 = vert1.xyz - vert0.xyz;
+    vec3 deltaPos2 = vert2.xyz - vert0.xyz;
+
+    vec2 deltaUV1 = t1 - t0;
+    vec2 deltaUV2 = t2 - t0;
+
+    float invdet = 1.0f / (deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x);
+
+    state.tangent = (deltaPos1 * deltaUV2.y - deltaPos2 * deltaUV1.y) * invdet;
+    state.bitangent = (deltaPos2 * deltaUV1.x - deltaPos1 * deltaUV2.x) * invdet;
+
+    state.tangent = normalize(mat3(transform) * state.tangent);
+    state.bitangent = normalize(mat3(transform) * state.bitangent);
+}
+
+bool ClosestHit(Ray r, inout State state, inout LightSampleRec lightSample)
+{
+#ifdef OPT_RAY_STATS
+    numRaysTraced++;
+#endif
+
+    float t = INF;
+
+#ifdef OPT_LIGHTS
+    // Intersect Emitters
+#ifdef OPT_HIDE_EMITTERS
+if(state.depth > 0)
+#endif
+    ClosestLight(r, t, state, lightSample);
 #endif
 
     // Intersect BVH and tris
+#ifndef OPT_STACKLESS
+#ifdef OPT_BVH_WIDTH
+    // Wide nodes push up to OPT_BVH_WIDTH - 1 children per level
+    int stack[OPT_BVH_WIDTH * 16];
+#else
     int stack[64];
+#endif
     int ptr = 0;
     stack[ptr++] = -1;
+#endif
 
     int index = topBVHIndex;
     float leftHit = 0.0;
     float rightHit = 0.0;
 
     int currMatID = 0;
+#ifdef OPT_NESTED_INSTANCES
+    // Instances the ray is inside of, groups first. Level i keeps the world
+    // transform of the instance entered at that level and the ray in its space
+    int level = 0;
+    mat4 levelTransforms[OPT_NESTED_INSTANCES];
+    Ray levelRays[OPT_NESTED_INSTANCES];
+#ifdef OPT_STACKLESS
+    // Leaf each instance was entered from and the node its BLAS was entered at
+    int levelLeaves[OPT_NESTED_INSTANCES];
+    int levelEntries[OPT_NESTED_INSTANCES];
+#endif
+#else
     bool BLAS = false;
+#ifdef OPT_STACKLESS
+    int tlasLeaf = -1;
+    int blasEntry = -1;
+#endif
+#endif
 
     ivec3 triID = ivec3(-1);
+#ifdef OPT_PACKED_TRIANGLES
+    int hitTriIndex = -1;
+#endif
     mat4 transMat;
     mat4 transform;
     vec3 bary;
@@ -111,16 +195,36 @@ if(state.depth > 0)
 
     while (index != -1)
     {
+#if defined(OPT_BVH_QUANTIZED)
+        // Indices address texels, internal nodes keep their number of children in rightIndex
+        uvec4 header = texelFetch(BVH, index);
+        uint kind = (header.w >> 24u) & 15u;
+
+        int leftIndex  = int(header.x);
+        int rightIndex = kind == BVH_KIND_INTERNAL ? int(header.w >> 28u) : int(header.y);
+        int leaf       = kind == BVH_KIND_BLAS_LEAF ? 1 : (kind == BVH_KIND_TLAS_LEAF ? -int(header.z) - 1 : 0);
+#else
+#ifdef OPT_BVH_WIDTH
+        ivec3 LRLeaf = ivec3(texelFetch(BVH, (index / OPT_BVH_WIDTH) * OPT_BVH_WIDTH * 3 + OPT_BVH_WIDTH * 2 + index % OPT_BVH_WIDTH).xyz);
+#else
         ivec3 LRLeaf = ivec3(texelFetch(BVH, index * 3 + 2).xyz);
+#endif
 
         int leftIndex  = int(LRLeaf.x);
         int rightIndex = int(LRLeaf.y);
         int leaf       = int(LRLeaf.z);
+#endif
 
         if (leaf > 0) // Leaf node of BLAS
         {
             for (int i = 0; i < rightIndex; i++) // Loop through tris
             {
+#ifdef OPT_PACKED_TRIANGLES
+                // First vertex and both edges, stored contiguously in leaf order
+                vec3 v0 = texelFetch(trianglesTex, (leftIndex + i) * 3 + 0).xyz;
+                vec3 e0 = texelFetch(trianglesTex, (leftIndex + i) * 3 + 1).xyz;
+                vec3 e1 = texelFetch(trianglesTex, (leftIndex + i) * 3 + 2).xyz;
+#else
                 ivec3 vertIndices = ivec3(texelFetch(vertexIndicesTex, leftIndex + i).xyz);
 
                 vec4 v0 = texelFetch(verticesTex, vertIndices.x);
@@ -129,6 +233,7 @@ if(state.depth > 0)
 
                 vec3 e0 = v1.xyz - v0.xyz;
                 vec3 e1 = v2.xyz - v0.xyz;
+#endif
                 vec3 pv = cross(rTrans.direction, e1);
                 float det = dot(e0, pv);
 
@@ -145,35 +250,146 @@ if(state.depth > 0)
                 if (all(greaterThanEqual(uvt, vec4(0.0))) && uvt.z < t)
                 {
                     t = uvt.z;
+#ifdef OPT_PACKED_TRIANGLES
+                    hitTriIndex = leftIndex + i;
+#else
                     triID = vertIndices;
+                    vert0 = v0, vert1 = v1, vert2 = v2;
+#endif
+#ifdef OPT_MERGED_MESHES
+                    // The merged world space BLAS has no material of its own, each triangle keeps one
+                    state.matID = currMatID < 0 ? texelFetch(triangleMaterialsTex, leftIndex + i).x : currMatID;
+#else
                     state.matID = currMatID;
+#endif
                     bary = uvt.wxy;
-                    vert0 = v0, vert1 = v1, vert2 = v2;
                     transform = transMat;
                 }
             }
         }
-        else if (leaf < 0) // Leaf node of TLAS
+        else if (leaf < 0) // Leaf node of TLAS or of an instance group
         {
             vec4 r1 = texelFetch(transformsTex, ivec2((-leaf - 1) * 4 + 0, 0), 0).xyzw;
             vec4 r2 = texelFetch(transformsTex, ivec2((-leaf - 1) * 4 + 1, 0), 0).xyzw;
             vec4 r3 = texelFetch(transformsTex, ivec2((-leaf - 1) * 4 + 2, 0), 0).xyzw;
             vec4 r4 = texelFetch(transformsTex, ivec2((-leaf - 1) * 4 + 3, 0), 0).xyzw;
 
+#ifdef OPT_NESTED_INSTANCES
+            // Group members are placed relative to the group
+            transMat = level > 0 ? levelTransforms[level - 1] * mat4(r1, r2, r3, r4) : mat4(r1, r2, r3, r4);
+#else
             transMat = mat4(r1, r2, r3, r4);
+#endif
 
             rTrans.origin    = vec3(inverse(transMat) * vec4(r.origin, 1.0));
             rTrans.direction = vec3(inverse(transMat) * vec4(r.direction, 0.0));
 
+#ifdef OPT_STACKLESS
+            // Climbing back up the BLAS stops at its entry node and goes on from this leaf
+#ifdef OPT_NESTED_INSTANCES
+            levelLeaves[level] = index;
+            levelEntries[level] = leftIndex;
+#else
+            tlasLeaf = index;
+            blasEntry = leftIndex;
+#endif
+#else
             // Add a marker. We'll return to this spot after we've traversed the entire BLAS
             stack[ptr++] = -1;
+#endif
             index = leftIndex;
+#ifdef OPT_NESTED_INSTANCES
+            levelTransforms[level] = transMat;
+            levelRays[level] = rTrans;
+            level++;
+#else
             BLAS = true;
+#endif
             currMatID = rightIndex;
             continue;
         }
         else
         {
+#if defined(OPT_BVH_QUANTIZED) || defined(OPT_BVH_WIDTH)
+            // Wide node: rightIndex is its number of children. Continue with the
+            // nearest child that is hit and push the others so that nearer ones
+            // are popped first. Float layouts keep the node in leftIndex and
+            // address child records
+#ifdef OPT_BVH_QUANTIZED
+            // Child bounds are 8 bit offsets from the node's bounds minimum in
+            // power of two steps. The translator rounds them outwards with the
+            // same float math, so decoded boxes always contain the exact ones
+            vec3 origin = uintBitsToFloat(header.xyz);
+            vec3 scale = uintBitsToFloat(((uvec3(header.w) >> uvec3(0u, 8u, 16u)) & 0xFFu) << 23u);
+            uint body[BVH_QUANTIZED_BODY * 4];
+            for (int i = 0; i < BVH_QUANTIZED_BODY; i++)
+            {
+                uvec4 texel = texelFetch(BVH, index + 1 + i);
+                body[i * 4 + 0] = texel.x;
+                body[i * 4 + 1] = texel.y;
+                body[i * 4 + 2] = texel.z;
+                body[i * 4 + 3] = texel.w;
+            }
+#else
+            int nodeBase = leftIndex * OPT_BVH_WIDTH * 3;
+#endif
+            float childHits[BVH_WIDTH];
+            int childIndices[BVH_WIDTH];
+            int numHits = 0;
+
+            for (int i = 0; i < rightIndex; i++)
+            {
+#ifdef OPT_BVH_QUANTIZED
+                uvec3 q = uvec3(body[i / 2], body[BVH_WIDTH / 2 + i / 2], body[BVH_WIDTH + i / 2]) >> uint(i % 2 * 16);
+                vec3 bboxmin = origin + vec3(q & 0xFFu) * scale;
+                vec3 bboxmax = origin + vec3((q >> 8u) & 0xFFu) * scale;
+                // The first child directly follows the node
+                int childIndex = i == 0 ? index + 1 + BVH_QUANTIZED_BODY : int(body[BVH_WIDTH * 3 / 2 + i - 1]);
+#else
+                vec3 bboxmin = texelFetch(BVH, nodeBase + i).xyz;
+                vec3 bboxmax = texelFetch(BVH, nodeBase + OPT_BVH_WIDTH + i).xyz;
+                int childIndex = leftIndex * OPT_BVH_WIDTH + i;
+#endif
+                float hit = AABBIntersect(bboxmin, bboxmax, rTrans);
+                if (hit > 0.0)
+                {
+                    // Insertion sort, farthest first
+                    int j = numHits++;
+                    for (; j > 0 && childHits[j - 1] < hit; j--)
+                    {
+                        childHits[j] = childHits[j - 1];
+                        childIndices[j] = childIndices[j - 1];
+                    }
+                    childHits[j] = hit;
+                    childIndices[j] = childIndex;
+                }
+            }
+
+            if (numHits > 0)
+            {
+                for (int i = 0; i < numHits - 1; i++)
+                    stack[ptr++] = childIndices[i];
+
+                index = childIndices[numHits - 1];
+                continue;
+            }
+#elif defined(OPT_STACKLESS)
+            // Children in a fixed order for the ray direction, so the climb back up
+            // knows which one is left to visit. The far one is tested again then
+            int nearChild = NearChild(texelFetch(bvhLinksTex, index).x, leftIndex, rightIndex, rTrans.direction);
+            int farChild = leftIndex + rightIndex - nearChild;
+
+            if (AABBIntersect(texelFetch(BVH, nearChild * 3 + 0).xyz, texelFetch(BVH, nearChild * 3 + 1).xyz, rTrans) > 0.0)
+            {
+                index = nearChild;
+                continue;
+            }
+            if (AABBIntersect(texelFetch(BVH, farChild * 3 + 0).xyz, texelFetch(BVH, farChild * 3 + 1).xyz, rTrans) > 0.0)
+            {
+                index = farChild;
+                continue;
+            }
+#else
             leftHit  = AABBIntersect(texelFetch(BVH, leftIndex  * 3 + 0).xyz, texelFetch(BVH, leftIndex  * 3 + 1).xyz, rTrans);
             rightHit = AABBIntersect(texelFetch(BVH, rightIndex * 3 + 0).xyz, texelFetch(BVH, rightIndex * 3 + 1).xyz, rTrans);
 
@@ -204,9 +420,79 @@ if(state.depth > 0)
                 index = rightIndex;
                 continue;
             }
+#endif
+        }
+#ifdef OPT_STACKLESS
+        // Climb out of the finished subtree to the first far child the ray hits
+        int node = index;
+        index = -1;
+        while (index == -1)
+        {
+#ifdef OPT_NESTED_INSTANCES
+            if (level > 0 && node == levelEntries[level - 1])
+            {
+                // Done with the instance, go on from its leaf in the group or TLAS
+                level--;
+                node = levelLeaves[level];
+
+                if (level > 0)
+                {
+                    transMat = levelTransforms[level - 1];
+                    rTrans = levelRays[level - 1];
+                }
+                else
+                {
+                    rTrans.origin = r.origin;
+                    rTrans.direction = r.direction;
+                }
+                continue;
+            }
+#else
+            if (BLAS && node == blasEntry)
+            {
+                BLAS = false;
+                node = tlasLeaf;
+
+                rTrans.origin = r.origin;
+                rTrans.direction = r.direction;
+                continue;
+            }
+#endif
+            // Done once the climb gets past the root of the TLAS
+            int parent = (texelFetch(bvhLinksTex, node).x >> 3) - 1;
+            if (parent == -1)
+                break;
+
+            ivec3 parentLR = ivec3(texelFetch(BVH, parent * 3 + 2).xyz);
+            int nearChild = NearChild(texelFetch(bvhLinksTex, parent).x, parentLR.x, parentLR.y, rTrans.direction);
+            int farChild = parentLR.x + parentLR.y - nearChild;
+            if (node == nearChild && AABBIntersect(texelFetch(BVH, farChild * 3 + 0).xyz, texelFetch(BVH, farChild * 3 + 1).xyz, rTrans) > 0.0)
+                index = farChild;
+
+            node = parent;
         }
+#else
         index = stack[--ptr];
 
+#ifdef OPT_NESTED_INSTANCES
+        // Step out of every instance whose BLAS is done, back to the group or TLAS it was reached from
+        while (level > 0 && index == -1)
+        {
+            level--;
+            index = stack[--ptr];
+
+            if (level > 0)
+            {
+                transMat = levelTransforms[level - 1];
+                rTrans = levelRays[level - 1];
+            }
+            else
+            {
+                rTrans.origin = r.origin;
+                rTrans.direction = r.direction;
+            }
+        }
+#else
         // If we've traversed the entire BLAS then switch to back to TLAS and resume where we left off
         if (BLAS && index == -1)
         {
@@ -217,52 +503,31 @@ if(state.depth > 0)
             rTrans.origin = r.origin;
             rTrans.direction = r.direction;
         }
+#endif
+#endif
     }
 
     // No intersections
     if (t == INF)
         return false;
 
+#ifdef OPT_PACKED_TRIANGLES
+    // Shading attributes are fetched through the side index, once for the closest hit
+    if (hitTriIndex != -1)
+    {
+        triID = texelFetch(vertexIndicesTex, hitTriIndex).xyz;
+        vert0 = texelFetch(verticesTex, triID.x);
+        vert1 = texelFetch(verticesTex, triID.y);
+        vert2 = texelFetch(verticesTex, triID.z);
+    }
+#endif
+
     state.hitDist = t;
     state.fhp = r.origin + r.direction * t;
 
     // Ray hit a triangle and not a light source
     if (triID.x != -1)
-    {
-        state.isEmitter = false;
-
-        // Normals
-        vec4 n0 = texelFetch(normalsTex, triID.x);
-        vec4 n1 = texelFetch(normalsTex, triID.y);
-        vec4 n2 = texelFetch(normalsTex, triID.z);
-
-        // Get texcoords from w coord of vertices and normals
-        vec2 t0 = vec2(vert0.w, n0.w);
-        vec2 t1 = vec2(vert1.w, n1.w);
-        vec2 t2 = vec2(vert2.w, n2.w);
-
-        // Interpolate texture coords and normals using barycentric coords
-        state.texCoord = t0 * bary.x + t1 * bary.y + t2 * bary.z;
-        vec3 normal = normalize(n0.xyz * bary.x + n1.xyz * bary.y + n2.xyz * bary.z);
-
-        state.normal = normalize(transpose(inverse(mat3(transform))) * normal);
-        state.ffnormal = dot(state.normal, r.direction) <= 0.0 ? state.normal : -state.normal;
-
-        // Calculate tangent and bitangent
-        vec3 deltaPos1 = vert1.xyz - vert0.xyz;
-        vec3 deltaPos2 = vert2.xyz - vert0.xyz;
-
-        vec2 deltaUV1 = t1 - t0;
-        vec2 deltaUV2 = t2 - t0;
-
-        float invdet = 1.0f / (deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x);
-
-        state.tangent = (deltaPos1 * deltaUV2.y - deltaPos2 * deltaUV1.y) * invdet;
-        state.bitangent = (deltaPos2 * deltaUV1.x - deltaPos1 * deltaUV2.x) * invdet;
-
-        state.tangent = normalize(mat3(transform) * state.tangent);
-        state.bitangent = normalize(mat3(transform) * state.bitangent);
-    }
+        TriangleHitState(r, triID, vert0, vert1, vert2, bary, transform, state);
 
     return true;
 }
\ No newline at end of file
@@ -43,6 +43,18 @@
 #define MEDIUM_SCATTER 2
 #define MEDIUM_EMISSIVE 3
 
+#ifdef OPT_BVH_WIDTH
+#define BVH_WIDTH OPT_BVH_WIDTH
+#else
+#define BVH_WIDTH 2
+#endif
+
+// Quantized BVH node kinds and number of texels after a node header, see BvhTranslator::quantized
+#define BVH_KIND_INTERNAL 0u
+#define BVH_KIND_BLAS_LEAF 1u
+#define BVH_KIND_TLAS_LEAF 2u
+#define BVH_QUANTIZED_BODY ((BVH_WIDTH * 5 / 2 + 2) / 4)
+
 struct Ray
 {
     vec3 origin;
@@ -65,6 +65,17 @@ float RectIntersect(in vec3 pos, in vec3 u, in vec3 v, in vec4 plane, in Ray r)
     return INF;
 }
 
+#ifdef OPT_STACKLESS
+// Child of an internal node that a ray along dir reaches first, by the split
+// the node's parent link keeps: its axis in the low two bits and whether the
+// left child lies above the right one in the third
+int NearChild(int link, int leftIndex, int rightIndex, vec3 dir)
+{
+    bool leftAbove = (link & 4) != 0;
+    return (dir[link & 3] < 0.0) != leftAbove ? rightIndex : leftIndex;
+}
+#endif
+
 float AABBIntersect(vec3 minCorner, vec3 maxCorner, Ray r)
 {
     vec3 invDir = 1.0 / r.direction;
@@ -79,4 +90,40 @@ float AABBIntersect(vec3 minCorner, vec3 maxCorner, Ray r)
     float t0 = max(tmin.x, max(tmin.y, tmin.z));
 
     return (t1 >= t0) ? (t0 > 0.f ? t0 : t1) : -1.0;
-}
\ No newline at end of file
+}
+
+#ifdef OPT_LIGHT_BVH
+// Nodes of the light BVH still to visit
+struct LightTraversal
+{
+    int stack[64];
+    int ptr;
+};
+
+LightTraversal BeginLights()
+{
+    LightTraversal lights;
+    lights.stack[0] = 0;
+    lights.ptr = 1;
+    return lights;
+}
+
+// Index of the next light whose box r hits, -1 once there are none
+int NextLight(inout LightTraversal lights, Ray r)
+{
+    while (lights.ptr > 0)
+    {
+        int index = lights.stack[--lights.ptr];
+        if (AABBIntersect(texelFetch(lightBVHTex, index * 3 + 0).xyz, texelFetch(lightBVHTex, index * 3 + 1).xyz, r) > 0.0)
+        {
+            ivec3 LRLeaf = ivec3(texelFetch(lightBVHTex, index * 3 + 2).xyz);
+            if (LRLeaf.z > 0)
+                return LRLeaf.x;
+
+            lights.stack[lights.ptr++] = LRLeaf.y;
+            lights.stack[lights.ptr++] = LRLeaf.x;
+        }
+    }
+    return -1;
+}
+#endif
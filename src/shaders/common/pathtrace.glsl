@@ -155,7 +155,16 @@ vec3 EvalTransmittance(Ray r)
 }
 #endif
 
-vec3 DirectLight(in Ray r, in State state, bool isSurface)
+#ifdef OPT_WAVEFRONT
+// Shadow rays are traced by a later stage of the wavefront integrator, which
+// adds the light they carry if nothing blocks them, see wavefront.glsl
+#define UNOCCLUDED_LIGHT(shadowRay, maxDist, L) QueueShadowRay(shadowRay, maxDist, L)
+#else
+#define UNOCCLUDED_LIGHT(shadowRay, maxDist, L) (L)
+#endif
+
+// Light sampled at the path vertex, scaled by the throughput of the path
+vec3 DirectLight(in Ray r, in State state, bool isSurface, vec3 throughput)
 {
     vec3 Ld = vec3(0.0);
     vec3 Li = vec3(0.0);
@@ -191,11 +200,15 @@ vec3 DirectLight(in Ray r, in State state, bool isSurface)
         {
             float misWeight = PowerHeuristic(lightPdf, scatterSample.pdf);
             if (misWeight > 0.0)
-                Ld += misWeight * Li * scatterSample.f * envMapIntensity / lightPdf;
+                Ld += misWeight * Li * scatterSample.f * envMapIntensity / lightPdf * throughput;
         }
 #else
         // If there are no volumes in the scene then use a simple binary hit test
+#ifdef OPT_WAVEFRONT
+        bool inShadow = false;
+#else
         bool inShadow = AnyHit(shadowRay, INF - EPS);
+#endif
 
         if (!inShadow)
         {
@@ -205,7 +218,7 @@ vec3 DirectLight(in Ray r, in State state, bool isSurface)
             {
                 float misWeight = PowerHeuristic(lightPdf, scatterSample.pdf);
                 if (misWeight > 0.0)
-                    Ld += misWeight * Li * scatterSample.f * envMapIntensity / lightPdf;
+                    Ld += UNOCCLUDED_LIGHT(shadowRay, INF - EPS, misWeight * Li * scatterSample.f * envMapIntensity / lightPdf * throughput);
             }
         }
 #endif
@@ -258,10 +271,14 @@ vec3 DirectLight(in Ray r, in State state, bool isSurface)
                 misWeight = PowerHeuristic(lightSample.pdf, scatterSample.pdf);
 
             if (scatterSample.pdf > 0.0)
-                Ld += misWeight * scatterSample.f * Li / lightSample.pdf;
+                Ld += misWeight * scatterSample.f * Li / lightSample.pdf * throughput;
 #else
             // If there are no volumes in the scene then use a simple binary hit test
+#ifdef OPT_WAVEFRONT
+            bool inShadow = false;
+#else
             bool inShadow = AnyHit(shadowRay, lightSample.dist - EPS);
+#endif
 
             if (!inShadow)
             {
@@ -272,7 +289,7 @@ vec3 DirectLight(in Ray r, in State state, bool isSurface)
                     misWeight = PowerHeuristic(lightSample.pdf, scatterSample.pdf);
 
                 if (scatterSample.pdf > 0.0)
-                    Ld += misWeight * Li * scatterSample.f / lightSample.pdf;
+                    Ld += UNOCCLUDED_LIGHT(shadowRay, lightSample.dist - EPS, misWeight * Li * scatterSample.f / lightSample.pdf * throughput);
             }
 #endif
         }
@@ -282,207 +299,241 @@ vec3 DirectLight(in Ray r, in State state, bool isSurface)
     return Ld;
 }
 
-vec4 PathTrace(Ray r, inout GBuffer gBuffer)
+// Path variables carried from one vertex to the next
+struct Path
 {
-    vec3 radiance = vec3(0.0);
-    vec3 throughput = vec3(1.0);
-    State state;
-    LightSampleRec lightSample;
-    ScatterSampleRec scatterSample;
-
+    vec3 radiance;
+    vec3 throughput;
     // FIXME: alpha from material opacity/medium density
-    float alpha = 1.0;
-
+    float alpha;
+    // Pdf of the direction sampled at the previous vertex, for MIS
+    float scatterPdf;
     // For medium tracking
-    bool inMedium = false;
+    bool inMedium;
+    bool surfaceScatter;
+};
+
+// Shades the vertex ray r reached and sets r to the next ray of the path,
+// returns false once the path terminates. The megakernel calls it in a loop,
+// the wavefront integrator once per pass of its shade stage
+bool ShadeVertex(inout Ray r, inout State state, inout Path path, bool hit, in LightSampleRec lightSample, inout GBuffer gBuffer)
+{
+    ScatterSampleRec scatterSample;
+    scatterSample.pdf = path.scatterPdf;
+#ifdef OPT_MEDIUM
     bool mediumSampled = false;
-    bool surfaceScatter = false;
+#endif
 
-    for (state.depth = 0;; state.depth++)
+    //ûйཻ㣬жѭ
+    if (!hit)
     {
-        bool hit = ClosestHit(r, state, lightSample);
-        //ûйཻ㣬жѭ
-        if (!hit)
-        {
 #if defined(OPT_BACKGROUND) || defined(OPT_TRANSPARENT_BACKGROUND)
-            if (state.depth == 0)
-            {
-                alpha = 0.0;
-                //gBuffer.depth = state.hitDist;
-                //gBuffer.normal = state.ffnormal;
-                //gBuffer.position = r.origin + r.direction * state.hitDist;
-            }
+        if (state.depth == 0)
+        {
+            path.alpha = 0.0;
+            //gBuffer.depth = state.hitDist;
+            //gBuffer.normal = state.ffnormal;
+            //gBuffer.position = r.origin + r.direction * state.hitDist;
+        }
 #endif
 
 #ifdef OPT_HIDE_EMITTERS
-            if(state.depth > 0)
+        if(state.depth > 0)
 #endif
-            {
+        {
 #ifdef OPT_UNIFORM_LIGHT
-                radiance += uniformLightCol * throughput;
+            path.radiance += uniformLightCol * path.throughput;
 #else
 #ifdef OPT_ENVMAP
-                vec4 envMapColPdf = EvalEnvMap(r);
+            vec4 envMapColPdf = EvalEnvMap(r);
 
-                float misWeight = 1.0;
+            float misWeight = 1.0;
 
-                // Gather radiance from envmap and use scatterSample.pdf from previous bounce for MIS
-                if (state.depth > 0)
-                    misWeight = PowerHeuristic(scatterSample.pdf, envMapColPdf.w);
+            // Gather radiance from envmap and use scatterSample.pdf from previous bounce for MIS
+            if (state.depth > 0)
+                misWeight = PowerHeuristic(scatterSample.pdf, envMapColPdf.w);
 
 #if defined(OPT_MEDIUM) && !defined(OPT_VOL_MIS)
-                if(!surfaceScatter)
-                    misWeight = 1.0f;
+            if(!path.surfaceScatter)
+                misWeight = 1.0f;
 #endif
 
-                if(misWeight > 0)
-                    radiance += misWeight * envMapColPdf.rgb * throughput * envMapIntensity;
+            if(misWeight > 0)
+                path.radiance += misWeight * envMapColPdf.rgb * path.throughput * envMapIntensity;
 #endif
 #endif
-             }
-             break;
-        }
-        //йཻ
-        GetMaterial(state, r);
+         }
+         return false;
+    }
+    //йཻ
+    GetMaterial(state, r);
 
-        if (state.depth == 0)
-        {
-            gBuffer.depth = state.hitDist;
-            gBuffer.normal = state.ffnormal;
-            gBuffer.position = r.origin+ r.direction* state.hitDist;
-        }
-            
-        // Gather radiance from emissive objects. Emission from meshes is not importance sampled
-        radiance += state.mat.emission * throughput;
+    if (state.depth == 0)
+    {
+        gBuffer.depth = state.hitDist;
+        gBuffer.normal = state.ffnormal;
+        gBuffer.position = r.origin+ r.direction* state.hitDist;
+    }
         
+    // Gather radiance from emissive objects. Emission from meshes is not importance sampled
+    path.radiance += state.mat.emission * path.throughput;
+    
 #ifdef OPT_LIGHTS
 
-        // Gather radiance from light and use scatterSample.pdf from previous bounce for MIS
-        if (state.isEmitter)
-        {
-            float misWeight = 1.0;
+    // Gather radiance from light and use scatterSample.pdf from previous bounce for MIS
+    if (state.isEmitter)
+    {
+        float misWeight = 1.0;
 
-            if (state.depth > 0)
-                misWeight = PowerHeuristic(scatterSample.pdf, lightSample.pdf);
+        if (state.depth > 0)
+            misWeight = PowerHeuristic(scatterSample.pdf, lightSample.pdf);
 
 #if defined(OPT_MEDIUM) && !defined(OPT_VOL_MIS)
-            if(!surfaceScatter)
-                misWeight = 1.0f;
+        if(!path.surfaceScatter)
+            misWeight = 1.0f;
 #endif
 
-            radiance += misWeight * lightSample.emission * throughput;
+        path.radiance += misWeight * lightSample.emission * path.throughput;
 
-            break;
-        }
+        return false;
+    }
 #endif
-        // Stop tracing ray if maximum depth was reached
-        if(state.depth == maxDepth)
-            break;
+    // Stop tracing ray if maximum depth was reached
+    if(state.depth == maxDepth)
+        return false;
 
 #ifdef OPT_MEDIUM
 
-        mediumSampled = false;
-        surfaceScatter = false;
+    mediumSampled = false;
+    path.surfaceScatter = false;
 
-        // Handle absorption/emission/scattering from medium
-        // TODO: Handle light sources placed inside medium
-        if(inMedium)
+    // Handle absorption/emission/scattering from medium
+    // TODO: Handle light sources placed inside medium
+    if(path.inMedium)
+    {
+        if(state.medium.type == MEDIUM_ABSORB)
         {
-            if(state.medium.type == MEDIUM_ABSORB)
-            {
-                throughput *= exp(-(1.0 - state.medium.color) * state.hitDist * state.medium.density);
-            }
-            else if(state.medium.type == MEDIUM_EMISSIVE)
-            {
-                radiance += state.medium.color * state.hitDist * state.medium.density * throughput;
-            }
-            else
+            path.throughput *= exp(-(1.0 - state.medium.color) * state.hitDist * state.medium.density);
+        }
+        else if(state.medium.type == MEDIUM_EMISSIVE)
+        {
+            path.radiance += state.medium.color * state.hitDist * state.medium.density * path.throughput;
+        }
+        else
+        {
+            // Sample a distance in the medium
+            float scatterDist = min(-log(rand()) / state.medium.density, state.hitDist);
+            mediumSampled = scatterDist < state.hitDist;
+
+            if (mediumSampled)
             {
-                // Sample a distance in the medium
-                float scatterDist = min(-log(rand()) / state.medium.density, state.hitDist);
-                mediumSampled = scatterDist < state.hitDist;
-
-                if (mediumSampled)
-                {
-                    throughput *= state.medium.color;
-
-                    // Move ray origin to scattering position
-                    r.origin += r.direction * scatterDist;
-                    state.fhp = r.origin;
-
-                    // Transmittance Evaluation
-                    radiance += DirectLight(r, state, false) * throughput;
-
-                    // Pick a new direction based on the phase function
-                    vec3 scatterDir = SampleHG(-r.direction, state.medium.anisotropy, rand(), rand());
-                    scatterSample.pdf = PhaseHG(dot(-r.direction, scatterDir), state.medium.anisotropy);
-                    r.direction = scatterDir;
-                }
+                path.throughput *= state.medium.color;
+
+                // Move ray origin to scattering position
+                r.origin += r.direction * scatterDist;
+                state.fhp = r.origin;
+
+                // Transmittance Evaluation
+                path.radiance += DirectLight(r, state, false, path.throughput);
+
+                // Pick a new direction based on the phase function
+                vec3 scatterDir = SampleHG(-r.direction, state.medium.anisotropy, rand(), rand());
+                scatterSample.pdf = PhaseHG(dot(-r.direction, scatterDir), state.medium.anisotropy);
+                r.direction = scatterDir;
             }
         }
+    }
 
-        // If medium was not sampled then proceed with surface BSDF evaluation
-        if (!mediumSampled)
-        {
+    // If medium was not sampled then proceed with surface BSDF evaluation
+    if (!mediumSampled)
+    {
 #endif
 #ifdef OPT_ALPHA_TEST
 
-            // Ignore intersection and continue ray based on alpha test
-            if ((state.mat.alphaMode == ALPHA_MODE_MASK && state.mat.opacity < state.mat.alphaCutoff) ||
-                (state.mat.alphaMode == ALPHA_MODE_BLEND && rand() > state.mat.opacity))
-            {
-                scatterSample.L = r.direction;
-                state.depth--;
-            }
-            else
+        // Ignore intersection and continue ray based on alpha test
+        if ((state.mat.alphaMode == ALPHA_MODE_MASK && state.mat.opacity < state.mat.alphaCutoff) ||
+            (state.mat.alphaMode == ALPHA_MODE_BLEND && rand() > state.mat.opacity))
+        {
+            scatterSample.L = r.direction;
+            state.depth--;
+        }
+        else
 #endif
-            {
-                surfaceScatter = true;
+        {
+            path.surfaceScatter = true;
 
-                // Next event estimation
-                radiance += DirectLight(r, state, true) * throughput;
+            // Next event estimation
+            path.radiance += DirectLight(r, state, true, path.throughput);
 
-                // Sample BSDF for color and outgoing direction
-                scatterSample.f = DisneySample(state, -r.direction, state.ffnormal, scatterSample.L, scatterSample.pdf);
-                if (scatterSample.pdf > 0.0)
-                    throughput *= scatterSample.f / scatterSample.pdf;
-                else
-                    break;
-            }
+            // Sample BSDF for color and outgoing direction
+            scatterSample.f = DisneySample(state, -r.direction, state.ffnormal, scatterSample.L, scatterSample.pdf);
+            if (scatterSample.pdf > 0.0)
+                path.throughput *= scatterSample.f / scatterSample.pdf;
+            else
+                return false;
+        }
 
-            // Move ray origin to hit point and set direction for next bounce
-            r.direction = scatterSample.L;
-            r.origin = state.fhp + r.direction * EPS;
+        // Move ray origin to hit point and set direction for next bounce
+        r.direction = scatterSample.L;
+        r.origin = state.fhp + r.direction * EPS;
 
 #ifdef OPT_MEDIUM
 
-            // Note: Nesting of volumes isn't supported due to lack of a volume stack for performance reasons
-            // Ray is in medium only if it is entering a surface containing a medium
-            if (dot(r.direction, state.normal) < 0 && state.mat.medium.type != MEDIUM_NONE)
-            {
-                inMedium = true;
-                // Get medium params from the intersected object
-                state.medium = state.mat.medium;
-            }
-            // FIXME: Objects clipping or inside a medium were shaded incorrectly as inMedium would be set to false.
-            // This hack works for now but needs some rethinking
-            else if(state.mat.medium.type != MEDIUM_NONE)
-                inMedium = false;
+        // Note: Nesting of volumes isn't supported due to lack of a volume stack for performance reasons
+        // Ray is in medium only if it is entering a surface containing a medium
+        if (dot(r.direction, state.normal) < 0 && state.mat.medium.type != MEDIUM_NONE)
+        {
+            path.inMedium = true;
+            // Get medium params from the intersected object
+            state.medium = state.mat.medium;
         }
+        // FIXME: Objects clipping or inside a medium were shaded incorrectly as inMedium would be set to false.
+        // This hack works for now but needs some rethinking
+        else if(state.mat.medium.type != MEDIUM_NONE)
+            path.inMedium = false;
+    }
 #endif
 
 #ifdef OPT_RR
-        // Russian roulette
-        if (state.depth >= OPT_RR_DEPTH)
-        {
-            float q = min(max(throughput.x, max(throughput.y, throughput.z)) + 0.001, 0.95);
-            if (rand() > q)
-                break;
-            throughput /= q;
-        }
+    // Russian roulette
+    if (state.depth >= OPT_RR_DEPTH)
+    {
+        float q = min(max(path.throughput.x, max(path.throughput.y, path.throughput.z)) + 0.001, 0.95);
+        if (rand() > q)
+            return false;
+        path.throughput /= q;
+    }
+#endif
+
+    path.scatterPdf = scatterSample.pdf;
+    return true;
+}
+
+vec4 PathTrace(Ray r, inout GBuffer gBuffer)
+{
+    State state;
+    LightSampleRec lightSample;
+    Path path = Path(vec3(0.0), vec3(1.0), 1.0, 0.0, false, false);
+
+#ifdef OPT_RASTER_PRIMARY
+    // The camera ray's hit comes from the visibility buffer, rays going on
+    // through alpha tested surfaces at depth 0 are traced
+    bool primary = true;
 #endif
 
+    for (state.depth = 0;; state.depth++)
+    {
+#ifdef OPT_RASTER_PRIMARY
+        bool hit;
+        if (!primary || !PrimaryHit(r, state, lightSample, hit))
+            hit = ClosestHit(r, state, lightSample);
+        primary = false;
+#else
+        bool hit = ClosestHit(r, state, lightSample);
+#endif
+        if (!ShadeVertex(r, state, path, hit, lightSample, gBuffer))
+            break;
     }
 
-    return vec4(radiance, alpha);
-}
\ No newline at end of file
+    return vec4(path.radiance, path.alpha);
+}
@@ -0,0 +1,90 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef OPT_RASTER_PRIMARY
+// Closest hit of a FrameCameraRay from the visibility buffer: the triangle
+// drawn at the pixel is intersected on its own and only the lights are
+// tested against it. Returns false if the ray misses the triangle's plane,
+// it has to be traced then
+bool PrimaryHit(Ray r, inout State state, inout LightSampleRec lightSample, out bool hit)
+{
+    hit = false;
+    float t = INF;
+
+#if defined(OPT_LIGHTS) && !defined(OPT_HIDE_EMITTERS)
+    ClosestLight(r, t, state, lightSample);
+#endif
+
+    uvec4 visibility = texelFetch(visibilityTex, ivec2(gl_FragCoord.xy), 0);
+    int triangle = int(visibility.x) - 1;
+    if (triangle >= 0)
+    {
+        DrawRecord draw = draws[visibility.y];
+        ivec3 triID = texelFetch(vertexIndicesTex, triangle).xyz;
+        vec4 vert0 = texelFetch(verticesTex, triID.x);
+        vec4 vert1 = texelFetch(verticesTex, triID.y);
+        vec4 vert2 = texelFetch(verticesTex, triID.z);
+
+        mat4 invTransform = inverse(draw.transform);
+        vec3 origin = vec3(invTransform * vec4(r.origin, 1.0));
+        vec3 direction = vec3(invTransform * vec4(r.direction, 0.0));
+
+        // The rasterizer decided coverage, barycentrics just past an edge are kept
+        vec3 e0 = vert1.xyz - vert0.xyz;
+        vec3 e1 = vert2.xyz - vert0.xyz;
+        vec3 pv = cross(direction, e1);
+        vec3 tv = origin - vert0.xyz;
+        vec3 qv = cross(tv, e0);
+
+        vec3 uvt = vec3(dot(tv, pv), dot(direction, qv), dot(e1, qv)) / dot(e0, pv);
+        if (!(uvt.z > 0.0))
+            return false;
+
+        if (uvt.z < t)
+        {
+            t = uvt.z;
+#ifdef OPT_MERGED_MESHES
+            state.matID = draw.materialID < 0 ? texelFetch(triangleMaterialsTex, triangle).x : draw.materialID;
+#else
+            state.matID = draw.materialID;
+#endif
+            state.hitDist = t;
+            state.fhp = r.origin + r.direction * t;
+            TriangleHitState(r, triID, vert0, vert1, vert2, vec3(1.0 - uvt.x - uvt.y, uvt.xy), draw.transform, state);
+            hit = true;
+            return true;
+        }
+    }
+
+    // A light or nothing
+    if (t < INF)
+    {
+        hit = true;
+        state.hitDist = t;
+        state.fhp = r.origin + r.direction * t;
+    }
+
+    return true;
+}
+#endif
@@ -29,10 +29,26 @@ uniform vec2 tileOffset;
 uniform vec2 invNumTiles;
 
 uniform sampler2D accumTexture;
+#ifdef OPT_BVH_QUANTIZED
+uniform usamplerBuffer BVH;
+#else
 uniform samplerBuffer BVH;
+#endif
 uniform isamplerBuffer vertexIndicesTex;
 uniform samplerBuffer verticesTex;
 uniform samplerBuffer normalsTex;
+#ifdef OPT_PACKED_TRIANGLES
+uniform samplerBuffer trianglesTex;
+#endif
+#ifdef OPT_MERGED_MESHES
+uniform isamplerBuffer triangleMaterialsTex;
+#endif
+#ifdef OPT_STACKLESS
+uniform isamplerBuffer bvhLinksTex;
+#endif
+#ifdef OPT_LIGHT_BVH
+uniform samplerBuffer lightBVHTex;
+#endif
 uniform sampler2D materialsTex;
 uniform sampler2D transformsTex;
 uniform sampler2D lightsTex;
@@ -50,4 +66,29 @@ uniform int numOfLights;
 uniform int maxDepth;
 uniform int topBVHIndex;
 uniform int frameNum;
-uniform float roughnessMollificationAmt;
\ No newline at end of file
+uniform float roughnessMollificationAmt;
+
+#ifdef OPT_RASTER_PRIMARY
+// Visibility buffer of VisibilityPass and the camera sample it was drawn with
+uniform usampler2D visibilityTex;
+uniform vec2 cameraJitter;
+uniform vec2 lensOffset;
+
+struct DrawRecord
+{
+    mat4 transform;
+    int materialID;
+};
+
+layout(std430, binding = 9) readonly buffer Draws { DrawRecord draws[]; };
+#endif
+
+#ifdef OPT_RAY_STATS
+layout(std430, binding = 0) buffer RayStats
+{
+    uint numRays;
+};
+
+// Rays traced by this invocation, added to numRays once at the end
+uint numRaysTraced = 0u;
+#endif
\ No newline at end of file
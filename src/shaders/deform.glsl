@@ -0,0 +1,208 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Compute kernels of GpuDeformer, the one to compile is picked by a KERNEL_*
+// define added after the version line. KERNEL_SKIN poses the vertices of
+// skinned and morphed meshes in place in the scene vertex and normal buffers,
+// KERNEL_REFIT then refits the binary float BLAS nodes of those meshes bottom
+// up, keeping the tree they were built with on load. All big buffers are bound
+// as ranges, the *Base uniforms turn scene indices into indices of the ranges
+#version 430
+
+#define BLOCK_SIZE 256
+
+layout(local_size_x = BLOCK_SIZE) in;
+
+#ifdef KERNEL_SKIN
+
+uniform int numVertices;
+uniform int vertexBase;
+
+struct DeformVertex
+{
+    // Bind pose, w holds the texture coordinates as in the scene buffers
+    vec4 position;
+    vec4 normal;
+    ivec4 joints;
+    vec4 weights;
+    // Scene vertex, deformed mesh and first morph offset
+    ivec4 info;
+};
+
+struct MorphOffset
+{
+    vec4 position;
+    vec4 normal;
+};
+
+layout(std430, binding = 1) readonly buffer DeformVertices { DeformVertex deformVertices[]; };
+// Per deformed mesh: first joint matrix (-1 without a skin), morph targets, first morph weight and vertices
+layout(std430, binding = 2) readonly buffer DeformMeshes { ivec4 deformMeshes[]; };
+layout(std430, binding = 3) readonly buffer JointMatrices { mat4 jointMatrices[]; };
+layout(std430, binding = 4) readonly buffer MorphWeights { float morphWeights[]; };
+layout(std430, binding = 5) readonly buffer MorphOffsets { MorphOffset morphOffsets[]; };
+layout(std430, binding = 6) writeonly buffer Vertices { vec4 vertices[]; };
+layout(std430, binding = 7) writeonly buffer Normals { vec4 normals[]; };
+
+void main()
+{
+    int i = int(gl_GlobalInvocationID.x);
+    if (i >= numVertices)
+        return;
+
+    DeformVertex vertex = deformVertices[i];
+    ivec4 mesh = deformMeshes[vertex.info.y];
+    vec3 position = vertex.position.xyz;
+    vec3 normal = vertex.normal.xyz;
+
+    // Morph targets are offsets in the bind pose, applied before skinning
+    for (int t = 0; t < mesh.y; t++)
+    {
+        float weight = morphWeights[mesh.z + t];
+        if (weight != 0.0)
+        {
+            MorphOffset offset = morphOffsets[vertex.info.z + t * mesh.w];
+            position += weight * offset.position.xyz;
+            normal += weight * offset.normal.xyz;
+        }
+    }
+
+    if (mesh.x >= 0)
+    {
+        // Row vector matrices, the rows of m are the transformed axes and the translation
+        mat4 m = vertex.weights.x * jointMatrices[mesh.x + vertex.joints.x]
+               + vertex.weights.y * jointMatrices[mesh.x + vertex.joints.y]
+               + vertex.weights.z * jointMatrices[mesh.x + vertex.joints.z]
+               + vertex.weights.w * jointMatrices[mesh.x + vertex.joints.w];
+
+        position = position.x * m[0].xyz + position.y * m[1].xyz + position.z * m[2].xyz + m[3].xyz;
+        // The rows of the cofactor matrix, the inverse transpose up to the determinant
+        normal = normal.x * cross(m[1].xyz, m[2].xyz) + normal.y * cross(m[2].xyz, m[0].xyz) + normal.z * cross(m[0].xyz, m[1].xyz);
+    }
+
+    float length2 = dot(normal, normal);
+    if (length2 > 0.0)
+        normal *= inversesqrt(length2);
+
+    vertices[vertex.info.x + vertexBase] = vec4(position, vertex.position.w);
+    normals[vertex.info.x + vertexBase] = vec4(normal, vertex.normal.w);
+}
+
+#endif
+
+#ifdef KERNEL_REFIT
+
+uniform int numRefitNodes;
+uniform int nodeBase;
+uniform int indexBase;
+uniform int vertexBase;
+uniform int triangleBase;
+
+// Flattened node, index of its parent in this list (-1 at the root) and whether it is a leaf
+layout(std430, binding = 1) readonly buffer RefitNodes { ivec4 refitNodes[]; };
+// Children that arrived at every node of RefitNodes
+layout(std430, binding = 2) coherent buffer Visits { int visits[]; };
+// Three scene vertices per triangle, as in vertexIndicesTex
+layout(std430, binding = 3) readonly buffer VertexIndices { int vertexIndices[]; };
+layout(std430, binding = 4) readonly buffer Vertices { vec4 vertices[]; };
+// BLAS nodes, nine floats each: bboxmin, bboxmax and LRLeaf
+layout(std430, binding = 5) coherent buffer Nodes { float nodes[]; };
+#ifdef PACK_TRIANGLES
+// v0, v1 - v0 and v2 - v0 of every triangle, as in trianglesTex
+layout(std430, binding = 6) writeonly buffer Triangles { vec4 triangles[]; };
+#endif
+
+int NodeAddress(int node)
+{
+    return node * 9 + nodeBase;
+}
+
+vec3 ReadNodeVec3(int node, int offset)
+{
+    int address = NodeAddress(node) + offset;
+    return vec3(nodes[address], nodes[address + 1], nodes[address + 2]);
+}
+
+void WriteNodeBounds(int node, vec3 pmin, vec3 pmax)
+{
+    int address = NodeAddress(node);
+    nodes[address + 0] = pmin.x;
+    nodes[address + 1] = pmin.y;
+    nodes[address + 2] = pmin.z;
+    nodes[address + 3] = pmax.x;
+    nodes[address + 4] = pmax.y;
+    nodes[address + 5] = pmax.z;
+}
+
+void main()
+{
+    int i = int(gl_GlobalInvocationID.x);
+    if (i >= numRefitNodes)
+        return;
+
+    // Only leaves start, internal nodes are refitted by the last child to arrive
+    ivec4 refitNode = refitNodes[i];
+    if (refitNode.z == 0)
+        return;
+
+    ivec3 LRLeaf = ivec3(ReadNodeVec3(refitNode.x, 6));
+    vec3 pmin = vec3(1e30);
+    vec3 pmax = vec3(-1e30);
+    for (int t = LRLeaf.x; t < LRLeaf.x + LRLeaf.y; t++)
+    {
+        int index = t * 3 + indexBase;
+        vec3 v0 = vertices[vertexIndices[index] + vertexBase].xyz;
+        vec3 v1 = vertices[vertexIndices[index + 1] + vertexBase].xyz;
+        vec3 v2 = vertices[vertexIndices[index + 2] + vertexBase].xyz;
+        pmin = min(pmin, min(v0, min(v1, v2)));
+        pmax = max(pmax, max(v0, max(v1, v2)));
+
+#ifdef PACK_TRIANGLES
+        triangles[t * 3 + triangleBase] = vec4(v0, 0.0);
+        triangles[t * 3 + triangleBase + 1] = vec4(v1 - v0, 0.0);
+        triangles[t * 3 + triangleBase + 2] = vec4(v2 - v0, 0.0);
+#endif
+    }
+    WriteNodeBounds(refitNode.x, pmin, pmax);
+
+    // Bounds bottom-up: the second child to arrive at a node grows it and moves on
+    int parent = refitNode.y;
+    while (parent != -1)
+    {
+        memoryBarrierBuffer();
+        if (atomicAdd(visits[parent], 1) == 0)
+            break;
+        memoryBarrierBuffer();
+
+        int node = refitNodes[parent].x;
+        int address = NodeAddress(node);
+        int lc = int(nodes[address + 6]);
+        int rc = int(nodes[address + 7]);
+        WriteNodeBounds(node, min(ReadNodeVec3(lc, 0), ReadNodeVec3(rc, 0)), max(ReadNodeVec3(lc, 3), ReadNodeVec3(rc, 3)));
+
+        parent = refitNodes[parent].y;
+    }
+}
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Compute version of the preview.glsl megakernel for PersistentTracer. A
+// workgroup traces an 8x8 tile of pixels and takes tiles from a global counter
+// until the frame is done, so groups that drew cheap sky tiles go on to take
+// more while others are still in glass. Tiles are handed out in Morton order
+// and threads cover their tile in Morton order too, which keeps the rays of a
+// subgroup and of groups running together close on screen and in the BVH
+#version 430
+
+#define TILE_SIZE 8
+
+// A thread per pixel of a TILE_SIZE x TILE_SIZE tile
+layout(local_size_x = 64) in;
+
+uniform uint numTiles;
+
+#include common/uniforms.glsl
+#include common/globals.glsl
+#include common/intersection.glsl
+#include common/sampling.glsl
+#include common/envmap.glsl
+#include common/camera.glsl
+#include common/anyhit.glsl
+#include common/closest_hit.glsl
+#include common/disney.glsl
+#include common/lambert.glsl
+#include common/pathtrace.glsl
+
+// Tile coordinates in the order they are handed out, x in the low 16 bits
+layout(std430, binding = 1) readonly buffer Tiles { uint tiles[]; };
+layout(std430, binding = 2) buffer TileCounter { uint nextTile; };
+
+layout(rgba32f, binding = 0) uniform writeonly image2D colorImage;
+layout(rgba32f, binding = 1) uniform writeonly image2D normalImage;
+layout(rgba32f, binding = 2) uniform writeonly image2D positionImage;
+
+shared uint groupTile;
+
+// Pixel of the tile a thread traces, even bits of the index give x and odd bits y
+ivec2 MortonPixel(uint i)
+{
+    return ivec2((i & 1u) | ((i >> 1u) & 2u) | ((i >> 2u) & 4u),
+                 ((i >> 1u) & 1u) | ((i >> 2u) & 2u) | ((i >> 3u) & 4u));
+}
+
+void main()
+{
+    for (;;)
+    {
+        if (gl_LocalInvocationIndex == 0u)
+            groupTile = atomicAdd(nextTile, 1u);
+        memoryBarrierShared();
+        barrier();
+        uint tile = groupTile;
+        // Every thread has the tile before the next one is taken
+        barrier();
+
+        if (tile >= numTiles)
+            break;
+
+        ivec2 tileCoord = ivec2(tiles[tile] & 0xffffu, tiles[tile] >> 16u);
+        ivec2 pixel = tileCoord * TILE_SIZE + MortonPixel(gl_LocalInvocationIndex);
+        if (pixel.x >= int(resolution.x) || pixel.y >= int(resolution.y))
+            continue;
+
+        vec2 fragCoord = vec2(pixel) + 0.5;
+        InitRNG(fragCoord, 1);
+
+        Ray ray = CameraRay(fragCoord / resolution);
+
+        GBuffer gBuffer;
+        gBuffer.normal = vec3(0.0);
+        gBuffer.position = vec3(0.0);
+        gBuffer.depth = 0.0;
+        vec4 pixelColor = PathTrace(ray, gBuffer);
+
+        imageStore(colorImage, pixel, pixelColor);
+        imageStore(normalImage, pixel, vec4(gBuffer.normal, 0.0));
+        imageStore(positionImage, pixel, vec4(gBuffer.position, gBuffer.depth));
+    }
+
+#ifdef OPT_RAY_STATS
+    atomicAdd(numRays, numRaysTraced);
+#endif
+}
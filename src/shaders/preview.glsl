@@ -34,8 +34,10 @@ in vec2 TexCoords;
 #include common/intersection.glsl
 #include common/sampling.glsl
 #include common/envmap.glsl
+#include common/camera.glsl
 #include common/anyhit.glsl
 #include common/closest_hit.glsl
+#include common/primary_hit.glsl
 #include common/disney.glsl
 #include common/lambert.glsl
 #include common/pathtrace.glsl
@@ -44,29 +46,11 @@ void main(void)
 {
     InitRNG(gl_FragCoord.xy, 1);
 
-    float r1 = 2.0 * rand();
-    float r2 = 2.0 * rand();
-
-    vec2 jitter;
-    jitter.x = r1 < 1.0 ? sqrt(r1) - 1.0 : 1.0 - sqrt(2.0 - r1);
-    jitter.y = r2 < 1.0 ? sqrt(r2) - 1.0 : 1.0 - sqrt(2.0 - r2);
-
-    jitter /= (resolution * 0.5);
-    vec2 d = (2.0 * TexCoords - 1.0) + jitter;//ʱNDCռķ
-
-    float scale = tan(camera.fov * 0.5);
-    d.y *= resolution.y / resolution.x * scale;
-    d.x *= scale;
-    //ʱ(d.x,d.y,1)ϵµķ
-    vec3 rayDir = normalize(d.x * camera.right + d.y * camera.up + camera.forward);//ʱϵߵĵλ
-
-    vec3 focalPoint = camera.focalDist * rayDir;
-    float cam_r1 = rand() * TWO_PI;
-    float cam_r2 = rand() * camera.aperture;
-    vec3 randomAperturePos = (cos(cam_r1) * camera.right + sin(cam_r1) * camera.up) * sqrt(cam_r2);//ӹȦѡȡһ
-    vec3 finalRayDir = normalize(focalPoint - randomAperturePos);
-
-    Ray ray = Ray(camera.position + randomAperturePos, finalRayDir);
+#ifdef OPT_RASTER_PRIMARY
+    Ray ray = FrameCameraRay(TexCoords);
+#else
+    Ray ray = CameraRay(TexCoords);
+#endif
 
     GBuffer gBuffer;
     vec4 pixelColor = PathTrace(ray, gBuffer);
@@ -74,4 +58,8 @@ void main(void)
     color = pixelColor;
     gNormal = gBuffer.normal;
     gPosition = vec4(gBuffer.position, gBuffer.depth);
+
+#ifdef OPT_RAY_STATS
+    atomicAdd(numRays, numRaysTraced);
+#endif
 }
\ No newline at end of file
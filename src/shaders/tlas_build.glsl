@@ -0,0 +1,436 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Compute kernels of GpuTlasBuilder, the one to compile is picked by a KERNEL_*
+// define added after the version line. They follow RadeonRays::Lbvh step by
+// step: Morton codes of the centroids of the world bounds, a stable radix sort
+// and the Karras hierarchy, so the TLAS is the one the CPU linear BVH builds
+// over the same bounds, written in the binary node layout of BVHBuffer
+#version 430
+
+#define BLOCK_SIZE 256
+#define RADIX_SIZE 256
+#define GRID_SIZE 1024.0
+
+layout(local_size_x = BLOCK_SIZE) in;
+
+uniform uint numEntries;
+uniform uint numBlocks;
+// Stored as the child indices of TLAS nodes
+uniform int topLevelIndex;
+// First float of the TLAS in the bound range of the BVH buffer
+uniform uint nodeOffset;
+// First link of the TLAS in the bound range of the links buffer
+uniform uint linkOffset;
+uniform uint radixShift;
+// Half of sortKeys the radix pass reads from
+uniform uint sortInput;
+
+// The BVH texture, which holds the object space bounds of the BLAS node each
+// entry starts at. GpuDeformer refits deformed BLAS in place before the build
+uniform samplerBuffer BVH;
+
+struct Entry
+{
+    // Traversal index of the BLAS node, material and instance
+    ivec4 leaf;
+};
+
+layout(std430, binding = 1) readonly buffer Entries { Entry entries[]; };
+layout(std430, binding = 2) readonly buffer Transforms { mat4 transforms[]; };
+// World bounds of every entry, min then max
+layout(std430, binding = 3) buffer WorldBounds { vec4 worldBounds[]; };
+// Codes then entry indices, twice for the radix passes to go back and forth
+layout(std430, binding = 4) buffer SortKeys { uint sortKeys[]; };
+// Centroid bounds as order preserving uints, then the counts of every digit in every block
+layout(std430, binding = 5) buffer Counts { uint centroidBounds[6]; uint blockCounts[]; };
+// Parent of every node, then the visit counters of the internal nodes
+layout(std430, binding = 6) coherent buffer Hierarchy { int hierarchy[]; };
+// TLAS nodes, nine floats each: bboxmin, bboxmax and LRLeaf
+layout(std430, binding = 7) coherent buffer Nodes { float nodes[]; };
+#ifdef OPT_BVH_LINKS
+// Parent links of the TLAS nodes for stackless traversal, see RadeonRays::BvhTranslator::links
+layout(std430, binding = 8) buffer Links { int links[]; };
+#endif
+
+// Unsigned integers that compare like the floats they come from, for atomicMin and atomicMax
+uint FloatToOrdered(float f)
+{
+    uint bits = floatBitsToUint(f);
+    return (bits & 0x80000000u) != 0u ? ~bits : bits | 0x80000000u;
+}
+
+float OrderedToFloat(uint u)
+{
+    return uintBitsToFloat((u & 0x80000000u) != 0u ? u & 0x7fffffffu : ~u);
+}
+
+uint NodeAddress(int node)
+{
+    return nodeOffset + uint(node) * 9u;
+}
+
+void WriteNodeBounds(int node, vec3 pmin, vec3 pmax)
+{
+    uint address = NodeAddress(node);
+    nodes[address + 0u] = pmin.x;
+    nodes[address + 1u] = pmin.y;
+    nodes[address + 2u] = pmin.z;
+    nodes[address + 3u] = pmax.x;
+    nodes[address + 4u] = pmax.y;
+    nodes[address + 5u] = pmax.z;
+}
+
+void WriteNodeLRLeaf(int node, vec3 LRLeaf)
+{
+    uint address = NodeAddress(node);
+    nodes[address + 6u] = LRLeaf.x;
+    nodes[address + 7u] = LRLeaf.y;
+    nodes[address + 8u] = LRLeaf.z;
+}
+
+#ifdef KERNEL_WORLD_BOUNDS
+
+shared uint groupBounds[6];
+
+void main()
+{
+    uint i = gl_GlobalInvocationID.x;
+    uint t = gl_LocalInvocationIndex;
+
+    if (t < 6u)
+        groupBounds[t] = t < 3u ? 0xffffffffu : 0u;
+    barrier();
+
+    if (i < numEntries)
+    {
+        Entry entry = entries[i];
+        mat4 m = transforms[entry.leaf.z];
+        vec3 entryMin = texelFetch(BVH, entry.leaf.x * 3).xyz;
+        vec3 entryMax = texelFetch(BVH, entry.leaf.x * 3 + 1).xyz;
+
+        // Same operations in the same order as RadeonRays::transform, precise
+        // keeps them from being fused so the bounds match the CPU bit for bit
+        precise vec3 xa = m[0].xyz * entryMin.x;
+        precise vec3 xb = m[0].xyz * entryMax.x;
+        precise vec3 ya = m[1].xyz * entryMin.y;
+        precise vec3 yb = m[1].xyz * entryMax.y;
+        precise vec3 za = m[2].xyz * entryMin.z;
+        precise vec3 zb = m[2].xyz * entryMax.z;
+        precise vec3 pmin = min(xa, xb) + min(ya, yb) + min(za, zb) + m[3].xyz;
+        precise vec3 pmax = max(xa, xb) + max(ya, yb) + max(za, zb) + m[3].xyz;
+
+        worldBounds[2u * i] = vec4(pmin, 0.0);
+        worldBounds[2u * i + 1u] = vec4(pmax, 0.0);
+
+        precise vec3 center = (pmax + pmin) * 0.5;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            uint ordered = FloatToOrdered(center[axis]);
+            atomicMin(groupBounds[axis], ordered);
+            atomicMax(groupBounds[axis + 3], ordered);
+        }
+    }
+
+    // One global atomic per block and bound
+    barrier();
+    if (t < 3u)
+        atomicMin(centroidBounds[t], groupBounds[t]);
+    else if (t < 6u)
+        atomicMax(centroidBounds[t], groupBounds[t]);
+}
+
+#endif
+
+#ifdef KERNEL_MORTON
+
+// Insert two zero bits after each of the lower 10 bits
+uint ExpandBits10(uint v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+void main()
+{
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= numEntries)
+        return;
+
+    vec3 origin = vec3(OrderedToFloat(centroidBounds[0]), OrderedToFloat(centroidBounds[1]), OrderedToFloat(centroidBounds[2]));
+    vec3 top = vec3(OrderedToFloat(centroidBounds[3]), OrderedToFloat(centroidBounds[4]), OrderedToFloat(centroidBounds[5]));
+    precise vec3 extents = top - origin;
+    precise vec3 scale = vec3(extents.x > 0.0 ? GRID_SIZE / extents.x : 0.0,
+                              extents.y > 0.0 ? GRID_SIZE / extents.y : 0.0,
+                              extents.z > 0.0 ? GRID_SIZE / extents.z : 0.0);
+
+    precise vec3 center = (worldBounds[2u * i + 1u].xyz + worldBounds[2u * i].xyz) * 0.5;
+    precise vec3 c = (center - origin) * scale;
+    uvec3 q = uvec3(min(max(c, vec3(0.0)), vec3(GRID_SIZE - 1.0)));
+
+    sortKeys[i] = (ExpandBits10(q.x) << 2) | (ExpandBits10(q.y) << 1) | ExpandBits10(q.z);
+    sortKeys[numEntries + i] = i;
+}
+
+#endif
+
+#ifdef KERNEL_RADIX_COUNT
+
+shared uint digitCounts[RADIX_SIZE];
+
+void main()
+{
+    uint i = gl_GlobalInvocationID.x;
+    uint t = gl_LocalInvocationIndex;
+
+    digitCounts[t] = 0u;
+    barrier();
+
+    if (i < numEntries)
+        atomicAdd(digitCounts[(sortKeys[sortInput * 2u * numEntries + i] >> radixShift) & 0xffu], 1u);
+    barrier();
+
+    // Digit major, so the scan hands every block its offset within its digit
+    blockCounts[t * numBlocks + gl_WorkGroupID.x] = digitCounts[t];
+}
+
+#endif
+
+#ifdef KERNEL_RADIX_SCAN
+
+shared uint digitOffsets[RADIX_SIZE];
+
+// Single block: every invocation scans the counts of one digit
+void main()
+{
+    uint digit = gl_LocalInvocationIndex;
+    uint row = digit * numBlocks;
+
+    uint total = 0u;
+    for (uint b = 0u; b < numBlocks; b++)
+    {
+        uint count = blockCounts[row + b];
+        blockCounts[row + b] = total;
+        total += count;
+    }
+
+    digitOffsets[digit] = total;
+    barrier();
+
+    if (digit == 0u)
+    {
+        uint offset = 0u;
+        for (int d = 0; d < RADIX_SIZE; d++)
+        {
+            uint count = digitOffsets[d];
+            digitOffsets[d] = offset;
+            offset += count;
+        }
+    }
+    barrier();
+
+    for (uint b = 0u; b < numBlocks; b++)
+        blockCounts[row + b] += digitOffsets[digit];
+}
+
+#endif
+
+#ifdef KERNEL_RADIX_SCATTER
+
+shared uint blockDigits[BLOCK_SIZE];
+
+void main()
+{
+    uint i = gl_GlobalInvocationID.x;
+    uint t = gl_LocalInvocationIndex;
+    uint src = sortInput * 2u * numEntries;
+    uint dst = (1u - sortInput) * 2u * numEntries;
+
+    // Invocations past the end take a digit no key has
+    uint key = 0u;
+    uint digit = RADIX_SIZE;
+    if (i < numEntries)
+    {
+        key = sortKeys[src + i];
+        digit = (key >> radixShift) & 0xffu;
+    }
+
+    blockDigits[t] = digit;
+    barrier();
+
+    if (i >= numEntries)
+        return;
+
+    // Keys of the block with the same digit keep their order, which keeps the sort stable
+    uint rank = 0u;
+    for (uint k = 0u; k < t; k++)
+        rank += blockDigits[k] == digit ? 1u : 0u;
+
+    uint pos = blockCounts[digit * numBlocks + gl_WorkGroupID.x] + rank;
+    sortKeys[dst + pos] = key;
+    sortKeys[dst + numEntries + pos] = sortKeys[src + numEntries + i];
+}
+
+#endif
+
+#ifdef KERNEL_HIERARCHY
+
+// Length of the common prefix of the sorted codes i and j as 64 bit keys, equal
+// codes fall back to the indices so every key is unique. -1 outside the range
+int Delta(int i, int j)
+{
+    if (j < 0 || j >= int(numEntries))
+        return -1;
+
+    uint ci = sortKeys[i];
+    uint cj = sortKeys[j];
+    if (ci == cj)
+        return 64 + 31 - findMSB(uint(i ^ j));
+
+    return 32 + 31 - findMSB(ci ^ cj);
+}
+
+void main()
+{
+    int i = int(gl_GlobalInvocationID.x);
+    int numInternal = int(numEntries) - 1;
+    if (i >= numInternal)
+        return;
+
+    // Direction of the node's range
+    int d = Delta(i, i + 1) - Delta(i, i - 1) >= 0 ? 1 : -1;
+
+    // Upper bound for the range length, then binary search for the other end
+    int dmin = Delta(i, i - d);
+    int lmax = 2;
+    while (Delta(i, i + lmax * d) > dmin)
+        lmax *= 2;
+
+    int l = 0;
+    for (int t = lmax / 2; t >= 1; t /= 2)
+    {
+        if (Delta(i, i + (l + t) * d) > dmin)
+            l += t;
+    }
+
+    int j = i + l * d;
+
+    // Split position: last key sharing more than the range's common prefix with i
+    int dnode = Delta(i, j);
+    int s = 0;
+    int t = l;
+    do
+    {
+        t = (t + 1) >> 1;
+        if (Delta(i, i + (s + t) * d) > dnode)
+            s += t;
+    } while (t > 1);
+
+    int gamma = i + s * d + min(d, 0);
+
+    int left = min(i, j) == gamma ? numInternal + gamma : gamma;
+    int right = max(i, j) == gamma + 1 ? numInternal + gamma + 1 : gamma + 1;
+
+    WriteNodeLRLeaf(i, vec3(float(topLevelIndex + left), float(topLevelIndex + right), 0.0));
+    hierarchy[left] = i;
+    hierarchy[right] = i;
+    if (i == 0)
+        hierarchy[0] = -1;
+
+#ifdef OPT_BVH_LINKS
+    // The split bits follow once the bounds are known
+    links[linkOffset + uint(left)] = (topLevelIndex + i + 1) << 3;
+    links[linkOffset + uint(right)] = (topLevelIndex + i + 1) << 3;
+    if (i == 0)
+        links[linkOffset] = 0;
+#endif
+}
+
+#endif
+
+#ifdef KERNEL_NODES
+
+vec3 ReadNodeVec3(int node, uint offset)
+{
+    uint address = NodeAddress(node) + offset;
+    return vec3(nodes[address], nodes[address + 1u], nodes[address + 2u]);
+}
+
+#ifdef OPT_BVH_LINKS
+// Axis the centers of the children lie farthest apart along and whether the
+// left child lies above the right one, as RadeonRays::BvhTranslator computes it
+int SplitCode(int lc, int rc)
+{
+    vec3 offset = (ReadNodeVec3(rc, 0u) + ReadNodeVec3(rc, 3u)) - (ReadNodeVec3(lc, 0u) + ReadNodeVec3(lc, 3u));
+    vec3 size = abs(offset);
+    int axis = size.x >= size.y && size.x >= size.z ? 0 : (size.y >= size.z ? 1 : 2);
+    return axis | (offset[axis] < 0.0 ? 4 : 0);
+}
+#endif
+
+void main()
+{
+    int k = int(gl_GlobalInvocationID.x);
+    int numInternal = int(numEntries) - 1;
+    if (k >= int(numEntries))
+        return;
+
+#ifdef OPT_BVH_LINKS
+    // A single leaf is the root
+    if (numInternal == 0)
+        links[linkOffset] = 0;
+#endif
+
+    // Leaves follow the internal nodes in code order
+    int leaf = numInternal + k;
+    uint e = sortKeys[numEntries + uint(k)];
+    ivec4 record = entries[e].leaf;
+    WriteNodeBounds(leaf, worldBounds[2u * e].xyz, worldBounds[2u * e + 1u].xyz);
+    WriteNodeLRLeaf(leaf, vec3(float(record.x), float(record.y), float(-record.z - 1)));
+
+    // Bounds bottom-up: the second child to arrive at a node grows it and moves on
+    int node = numInternal > 0 ? hierarchy[leaf] : -1;
+    while (node != -1)
+    {
+        memoryBarrierBuffer();
+        if (atomicAdd(hierarchy[2 * int(numEntries) - 1 + node], 1) == 0)
+            break;
+        memoryBarrierBuffer();
+
+        uint address = NodeAddress(node);
+        int lc = int(nodes[address + 6u]) - topLevelIndex;
+        int rc = int(nodes[address + 7u]) - topLevelIndex;
+        WriteNodeBounds(node, min(ReadNodeVec3(lc, 0u), ReadNodeVec3(rc, 0u)), max(ReadNodeVec3(lc, 3u), ReadNodeVec3(rc, 3u)));
+#ifdef OPT_BVH_LINKS
+        links[linkOffset + uint(node)] = (links[linkOffset + uint(node)] & ~7) | SplitCode(lc, rc);
+#endif
+
+        node = hierarchy[node];
+    }
+}
+
+#endif
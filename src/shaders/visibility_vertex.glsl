@@ -0,0 +1,54 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Vertex shader of VisibilityPass. Draws are instanced per mesh, gl_VertexID
+// runs over the mesh's entries of the scene vertex indices and each instance
+// is a draw record placing the mesh in the world
+#version 430
+
+struct DrawRecord
+{
+    mat4 transform;
+    int materialID;
+};
+
+layout(std430, binding = 9) readonly buffer Draws { DrawRecord draws[]; };
+
+uniform isamplerBuffer vertexIndicesTex;
+uniform samplerBuffer verticesTex;
+uniform mat4 viewProjection;
+uniform int firstDraw;
+
+flat out int triangle;
+flat out int draw;
+
+void main()
+{
+    triangle = gl_VertexID / 3;
+    draw = firstDraw + gl_InstanceID;
+
+    int vertex = texelFetch(vertexIndicesTex, triangle)[gl_VertexID % 3];
+    vec3 position = texelFetch(verticesTex, vertex).xyz;
+    gl_Position = viewProjection * (draws[draw].transform * vec4(position, 1.0));
+}
@@ -0,0 +1,370 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Compute kernels of WavefrontTracer, the one to compile is picked by a KERNEL_*
+// define added after the version line, next to the defines of the path tracing
+// shader. Paths live in the Paths buffer and move through the stages as indices
+// in the Queues buffer: KERNEL_EXTEND finds the closest hit of every queued
+// path, KERNEL_SHADE runs ShadeVertex on it and appends the paths that go on to
+// the other queue, so terminated ones drop out, and the ones that sampled a
+// light to the shadow queue, which KERNEL_SHADOW traces. KERNEL_ARGS sizes the
+// indirect dispatches of the next stages from the queue counters
+#version 430
+
+#define OPT_WAVEFRONT
+#define BLOCK_SIZE 64
+// Shadow rays a single vertex queues: one to the environment map and one to a light
+#define MAX_SHADOW_RAYS 2
+
+#define PATH_IN_MEDIUM 1
+#define PATH_SURFACE_SCATTER 2
+
+#define HIT_FOUND 1
+#define HIT_EMITTER 2
+
+layout(local_size_x = BLOCK_SIZE) in;
+
+// Pixels of the batch and where it starts in the image
+uniform uint numBatchPaths;
+uniform uint batchStart;
+// Capacity of each queue, the largest batch
+uniform uint queueSize;
+// Path queue the stage reads, the shade stage appends to the other one
+uniform uint queue;
+
+#include common/uniforms.glsl
+#include common/globals.glsl
+
+// State of a path between stages
+struct PathRecord
+{
+    // w: pdf of the last sampled direction
+    vec4 origin;
+    // w: alpha
+    vec4 direction;
+    // w: roughness at the last vertex, for roughness mollification
+    vec4 throughput;
+    // w: density of the medium the path is in
+    vec4 radiance;
+    // w: anisotropy of the medium
+    vec4 mediumColor;
+    uvec4 seed;
+    // Pixel index, depth, PATH_* flags and medium type
+    ivec4 info;
+};
+
+// The State fields ClosestHit writes. Fields it leaves alone keep the value of
+// the previous vertex, like the loop of the megakernel does
+struct HitRecord
+{
+    // w: hit distance
+    vec4 fhp;
+    // w: texture coordinate u
+    vec4 normal;
+    // w: texture coordinate v
+    vec4 ffnormal;
+    // w: material ID
+    vec4 tangent;
+    // w: HIT_* flags
+    vec4 bitangent;
+    // Emission and pdf of the light hit
+    vec4 light;
+};
+
+struct ShadowRecord
+{
+    // w: distance to the light
+    vec4 origin[MAX_SHADOW_RAYS];
+    // w: number of rays, in the first one
+    vec4 direction[MAX_SHADOW_RAYS];
+    // Light the ray adds to the path radiance if nothing blocks it
+    vec4 light[MAX_SHADOW_RAYS];
+};
+
+layout(std430, binding = 1) buffer Paths { PathRecord paths[]; };
+layout(std430, binding = 2) buffer Hits { HitRecord hits[]; };
+// Two path queues then the shadow queue, queueSize entries each
+layout(std430, binding = 3) buffer Queues { uint queues[]; };
+layout(std430, binding = 4) buffer ShadowRays { ShadowRecord shadowRays[]; };
+// Indirect dispatch sizes of the extend and shadow stages, then the lengths of the queues
+layout(std430, binding = 5) buffer Counters
+{
+    uint extendArgs[3];
+    uint shadowArgs[3];
+    uint numPaths[2];
+    uint numShadowRays[2];
+};
+
+layout(rgba32f, binding = 0) uniform writeonly image2D colorImage;
+layout(rgba32f, binding = 1) uniform writeonly image2D normalImage;
+layout(rgba32f, binding = 2) uniform writeonly image2D positionImage;
+
+// Shadow rays of the vertex being shaded, written to the shadow queue after ShadeVertex
+int numQueuedShadowRays = 0;
+ShadowRecord queuedShadowRays;
+
+vec3 QueueShadowRay(Ray shadowRay, float maxDist, vec3 L)
+{
+    queuedShadowRays.origin[numQueuedShadowRays] = vec4(shadowRay.origin, maxDist);
+    queuedShadowRays.direction[numQueuedShadowRays] = vec4(shadowRay.direction, 0.0);
+    queuedShadowRays.light[numQueuedShadowRays] = vec4(L, 0.0);
+    numQueuedShadowRays++;
+    return vec3(0.0);
+}
+
+#include common/intersection.glsl
+#include common/sampling.glsl
+#include common/envmap.glsl
+#include common/camera.glsl
+#include common/anyhit.glsl
+#include common/closest_hit.glsl
+#include common/disney.glsl
+#include common/lambert.glsl
+#include common/pathtrace.glsl
+
+ivec2 PixelCoord(int pixelIndex)
+{
+    int width = int(resolution.x);
+    return ivec2(pixelIndex % width, pixelIndex / width);
+}
+
+void LoadHit(uint p, inout State state, inout LightSampleRec lightSample, out bool hit)
+{
+    HitRecord record = hits[p];
+    state.fhp = record.fhp.xyz;
+    state.hitDist = record.fhp.w;
+    state.normal = record.normal.xyz;
+    state.ffnormal = record.ffnormal.xyz;
+    state.texCoord = vec2(record.normal.w, record.ffnormal.w);
+    state.tangent = record.tangent.xyz;
+    state.matID = floatBitsToInt(record.tangent.w);
+    state.bitangent = record.bitangent.xyz;
+    int flags = floatBitsToInt(record.bitangent.w);
+    hit = (flags & HIT_FOUND) != 0;
+    state.isEmitter = (flags & HIT_EMITTER) != 0;
+    lightSample.emission = record.light.xyz;
+    lightSample.pdf = record.light.w;
+}
+
+void StoreHit(uint p, in State state, in LightSampleRec lightSample, bool hit)
+{
+    int flags = (hit ? HIT_FOUND : 0) | (state.isEmitter ? HIT_EMITTER : 0);
+    hits[p] = HitRecord(vec4(state.fhp, state.hitDist),
+                        vec4(state.normal, state.texCoord.x),
+                        vec4(state.ffnormal, state.texCoord.y),
+                        vec4(state.tangent, intBitsToFloat(state.matID)),
+                        vec4(state.bitangent, intBitsToFloat(flags)),
+                        vec4(lightSample.emission, lightSample.pdf));
+}
+
+#ifdef KERNEL_GENERATE
+
+// Camera rays of the batch pixels
+void main()
+{
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= numBatchPaths)
+        return;
+
+    int pixelIndex = int(batchStart + i);
+    ivec2 coord = PixelCoord(pixelIndex);
+    vec2 fragCoord = vec2(coord) + 0.5;
+    InitRNG(fragCoord, 1);
+
+    Ray ray = CameraRay(fragCoord / resolution);
+
+    PathRecord path;
+    path.origin = vec4(ray.origin, 0.0);
+    path.direction = vec4(ray.direction, 1.0);
+    path.throughput = vec4(1.0);
+    path.radiance = vec4(0.0);
+    path.mediumColor = vec4(0.0);
+    path.seed = seed;
+    path.info = ivec4(pixelIndex, 0, 0, MEDIUM_NONE);
+    paths[i] = path;
+
+    // Vertices read the State fields a hit leaves alone from here, the
+    // megakernel starts with an empty State
+    hits[i] = HitRecord(vec4(0.0), vec4(0.0), vec4(0.0), vec4(0.0), vec4(0.0), vec4(0.0));
+    queues[i] = i;
+
+    // Pixels whose camera ray misses keep an empty G-buffer
+    imageStore(normalImage, coord, vec4(0.0));
+    imageStore(positionImage, coord, vec4(0.0));
+}
+
+#endif
+
+#ifdef KERNEL_EXTEND
+
+void main()
+{
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= numPaths[queue])
+        return;
+
+    uint p = queues[queue * queueSize + i];
+    PathRecord path = paths[p];
+
+    State state;
+    LightSampleRec lightSample;
+    bool hit;
+    LoadHit(p, state, lightSample, hit);
+    state.depth = path.info.y;
+
+    hit = ClosestHit(Ray(path.origin.xyz, path.direction.xyz), state, lightSample);
+    StoreHit(p, state, lightSample, hit);
+
+#ifdef OPT_RAY_STATS
+    atomicAdd(numRays, numRaysTraced);
+#endif
+}
+
+#endif
+
+#ifdef KERNEL_SHADE
+
+void main()
+{
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= numPaths[queue])
+        return;
+
+    uint p = queues[queue * queueSize + i];
+    PathRecord record = paths[p];
+
+    State state;
+    LightSampleRec lightSample;
+    bool hit;
+    LoadHit(p, state, lightSample, hit);
+    state.depth = record.info.y;
+    state.mat.roughness = record.throughput.w;
+    state.medium.type = record.info.w;
+    state.medium.density = record.radiance.w;
+    state.medium.color = record.mediumColor.xyz;
+    state.medium.anisotropy = record.mediumColor.w;
+
+    Ray r = Ray(record.origin.xyz, record.direction.xyz);
+    Path path = Path(record.radiance.xyz, record.throughput.xyz, record.direction.w, record.origin.w,
+                     (record.info.z & PATH_IN_MEDIUM) != 0, (record.info.z & PATH_SURFACE_SCATTER) != 0);
+    seed = record.seed;
+
+    bool primary = hit && state.depth == 0;
+    GBuffer gBuffer;
+    bool alive = ShadeVertex(r, state, path, hit, lightSample, gBuffer);
+
+    if (primary)
+    {
+        ivec2 coord = PixelCoord(record.info.x);
+        imageStore(normalImage, coord, vec4(gBuffer.normal, 0.0));
+        imageStore(positionImage, coord, vec4(gBuffer.position, gBuffer.depth));
+    }
+
+    if (numQueuedShadowRays > 0)
+    {
+        queuedShadowRays.direction[0].w = intBitsToFloat(numQueuedShadowRays);
+        shadowRays[p] = queuedShadowRays;
+        queues[2u * queueSize + atomicAdd(numShadowRays[queue], 1u)] = p;
+    }
+
+    if (alive)
+    {
+        state.depth++;
+        queues[(1u - queue) * queueSize + atomicAdd(numPaths[1u - queue], 1u)] = p;
+    }
+
+    int flags = (path.inMedium ? PATH_IN_MEDIUM : 0) | (path.surfaceScatter ? PATH_SURFACE_SCATTER : 0);
+    paths[p] = PathRecord(vec4(r.origin, path.scatterPdf),
+                          vec4(r.direction, path.alpha),
+                          vec4(path.throughput, state.mat.roughness),
+                          vec4(path.radiance, state.medium.density),
+                          vec4(state.medium.color, state.medium.anisotropy),
+                          seed,
+                          ivec4(record.info.x, state.depth, flags, state.medium.type));
+    StoreHit(p, state, lightSample, hit);
+}
+
+#endif
+
+#ifdef KERNEL_ARGS
+
+// Sizes the shadow stage of this pass and the extend stage of the next one,
+// and empties the queues those stages fill next
+void main()
+{
+    uint next = 1u - queue;
+    extendArgs[0] = (numPaths[next] + BLOCK_SIZE - 1u) / BLOCK_SIZE;
+    shadowArgs[0] = (numShadowRays[queue] + BLOCK_SIZE - 1u) / BLOCK_SIZE;
+    numPaths[queue] = 0u;
+    numShadowRays[next] = 0u;
+}
+
+#endif
+
+#ifdef KERNEL_SHADOW
+
+void main()
+{
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= numShadowRays[queue])
+        return;
+
+    uint p = queues[2u * queueSize + i];
+    ShadowRecord record = shadowRays[p];
+    int count = floatBitsToInt(record.direction[0].w);
+
+    // Alpha tested blockers draw from the path's sequence
+    seed = paths[p].seed;
+
+    vec3 Ld = vec3(0.0);
+    for (int k = 0; k < count; k++)
+    {
+        if (!AnyHit(Ray(record.origin[k].xyz, record.direction[k].xyz), record.origin[k].w))
+            Ld += record.light[k].xyz;
+    }
+
+    paths[p].radiance.xyz += Ld;
+    paths[p].seed = seed;
+
+#ifdef OPT_RAY_STATS
+    atomicAdd(numRays, numRaysTraced);
+#endif
+}
+
+#endif
+
+#ifdef KERNEL_ACCUMULATE
+
+// Radiance of every path of the batch, to the pixel preview.glsl would write it to
+void main()
+{
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= numBatchPaths)
+        return;
+
+    PathRecord path = paths[i];
+    imageStore(colorImage, PixelCoord(path.info.x), vec4(path.radiance.xyz, path.direction.w));
+}
+
+#endif
@@ -21,30 +21,10 @@ THE SOFTWARE.
 ********************************************************************/
 
 #include "bbox.h"
+#include "Simd.h"
 
 namespace RadeonRays
 {
-	Vec3 bbox::center()  const { return (pmax + pmin) * 0.5f; }
-	Vec3 bbox::extents() const { return pmax - pmin; }
-
-	float bbox::surface_area() const
-	{
-		Vec3 ext = extents();
-		return 2.f * (ext.x * ext.y + ext.x * ext.z + ext.y * ext.z);
-	}
-
-	void bbox::grow(Vec3 const& p)
-	{
-		pmin = Vec3::Min(pmin, p);
-		pmax = Vec3::Max(pmax, p);
-	}
-
-	void bbox::grow(bbox const& b)
-	{
-		pmin = Vec3::Min(pmin, b.pmin);
-		pmax = Vec3::Max(pmax, b.pmax);
-	}
-
 	bool bbox::contains(Vec3 const& p) const
 	{
 		Vec3 radius = extents() * 0.5f;
@@ -91,5 +71,59 @@ namespace RadeonRays
 		return box1.contains(box2.pmin) && box1.contains(box2.pmax);
 	}
 
+	bbox bboxunion(bbox const* boxes, int count)
+	{
+		Box4 result;
+		for (int i = 0; i < count; ++i)
+			result.Grow(Box4(&boxes[i].pmin.x));
+
+		bbox res;
+		result.Store(res.pmin, res.pmax);
+		return res;
+	}
+
+	void centers(bbox const* boxes, int count, Vec3* centers, bbox& center_bounds)
+	{
+		Box4 bounds(center_bounds.pmin, center_bounds.pmax);
+		for (int i = 0; i < count; ++i)
+		{
+			Box4 box(&boxes[i].pmin.x);
+			Float4 c = (box.pmax + box.pmin) * 0.5f;
+			bounds.Grow(c);
+			centers[i] = c.ToVec3();
+		}
+		bounds.Store(center_bounds.pmin, center_bounds.pmax);
+	}
+
+	void triangle_bounds(Vec4 const* vertices, int numtris, bbox* bounds)
+	{
+		for (int i = 0; i < numtris; ++i)
+		{
+			Box4 box;
+			box.Grow(Float4(vertices[i * 3 + 0]));
+			box.Grow(Float4(vertices[i * 3 + 1]));
+			box.Grow(Float4(vertices[i * 3 + 2]));
+			box.Store(bounds[i].pmin, bounds[i].pmax);
+		}
+	}
+
+	bbox transform(bbox const& box, Mat4 const& matrix)
+	{
+		// Per axis the smaller and larger of the row scaled by the box extremes
+		// add up to the transformed corners closest to -inf and +inf
+		Float4 xa = Float4::Row(matrix, 0) * box.pmin.x;
+		Float4 xb = Float4::Row(matrix, 0) * box.pmax.x;
+		Float4 ya = Float4::Row(matrix, 1) * box.pmin.y;
+		Float4 yb = Float4::Row(matrix, 1) * box.pmax.y;
+		Float4 za = Float4::Row(matrix, 2) * box.pmin.z;
+		Float4 zb = Float4::Row(matrix, 2) * box.pmax.z;
+		Float4 translation = Float4::Row(matrix, 3);
+
+		bbox res;
+		res.pmin = (Float4::Min(xa, xb) + Float4::Min(ya, yb) + Float4::Min(za, zb) + translation).ToVec3();
+		res.pmax = (Float4::Max(xa, xb) + Float4::Max(ya, yb) + Float4::Max(za, zb) + translation).ToVec3();
+		return res;
+	}
+
 	
 }
@@ -64,9 +64,9 @@ namespace RadeonRays
         {
         }
         //Χе
-		Vec3 center()  const;
+		Vec3 center()  const { return (pmax + pmin) * 0.5f; }
         //Χгߴ
-		Vec3 extents() const;
+		Vec3 extents() const { return pmax - pmin; }
         //ǷڰΧڲ
         bool contains(Vec3 const& p) const;
         //Χгߴάȣߣ
@@ -85,17 +85,29 @@ namespace RadeonRays
 		}
 
         //Χб
-		float surface_area() const;
+		float surface_area() const
+		{
+			Vec3 ext = extents();
+			return 2.f * (ext.x * ext.y + ext.x * ext.z + ext.y * ext.z);
+		}
 
         // TODO: this is non-portable, optimization trial for fast intersection test
         Vec3 const& operator [] (int i) const { return *(&pmin + i); }
 
         // Grow the bounding box by a point
 	    //Χʹµĵ
-		void grow(Vec3 const& p);
+		void grow(Vec3 const& p)
+		{
+			pmin = Vec3::Min(pmin, p);
+			pmax = Vec3::Max(pmax, p);
+		}
         // Grow the bounding box by a box
 	    //ΧʹµİΧ
-		void grow(bbox const& b);
+		void grow(bbox const& b)
+		{
+			pmin = Vec3::Min(pmin, b.pmin);
+			pmax = Vec3::Max(pmax, b.pmax);
+		}
         //ΧеС
         Vec3 pmin;
         //ΧеĴ
@@ -111,6 +123,18 @@ namespace RadeonRays
 	bool intersects(bbox const& box1, bbox const& box2);
     //жϰΧbox2Ƿbox1ڲ
 	bool contains(bbox const& box1, bbox const& box2);
+
+    // Batch versions for CPU side geometry processing. They run on the SSE
+    // types of Simd.h and give the same results as looping over the single
+    // box functions
+    // Union of count boxes
+	bbox bboxunion(bbox const* boxes, int count);
+    // Centers of count boxes and the bounds of those centers
+	void centers(bbox const* boxes, int count, Vec3* centers, bbox& center_bounds);
+    // Bounds of numtris triangles stored as 3 consecutive vertices, w is ignored
+	void triangle_bounds(Vec4 const* vertices, int numtris, bbox* bounds);
+    // Bounds of a box under the affine transform of a row vector convention matrix
+	bbox transform(bbox const& box, Mat4 const& matrix);
 }
 
 #endif
\ No newline at end of file
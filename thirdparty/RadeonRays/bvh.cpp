@@ -27,11 +27,17 @@ THE SOFTWARE.
 #include <cassert>
 #include <vector>
 #include <future>
+#include <cstring>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "bvh.h"
 
 namespace RadeonRays
 {
     static int constexpr kMaxPrimitivesPerLeaf = 1;
+    // Subtrees with more prims than this are built as separate tasks
+    static int constexpr kParallelBuildCutoff = 4096;
 
     static bool is_nan(float v)
     {
@@ -40,12 +46,12 @@ namespace RadeonRays
 
     void Bvh::Build(bbox const* bounds, int numbounds)
     {
+        m_parents.clear();
+        m_prim_leaves.clear();
+        m_refit_pending.clear();
+
         //ȼMeshbbox
-        for (int i = 0; i < numbounds; ++i)
-        {
-            // Calc bbox
-            m_bounds.grow(bounds[i]);
-        }
+        m_bounds.grow(bboxunion(bounds, numbounds));
         //Buildʵ
         BuildImpl(bounds, numbounds);
     }
@@ -66,31 +72,25 @@ namespace RadeonRays
         return &m_nodes[m_nodecnt++];
     }
 
-    void Bvh::BuildNode(SplitRequest const& req, bbox const* bounds, Vec3 const* centroids, int* primindices)
+    void Bvh::BuildNode(SplitRequest const& req, int nodeidx, bbox const* bounds, Vec3 const* centroids, int* primindices)
     {
-        m_height = std::max(m_height, req.level);
+        UpdateHeight(req.level);
 
-        Node* node = AllocateNode();
+        // Slots are fixed by the preorder layout, so concurrent subtrees never
+        // touch the same node or packed index and the result does not depend
+        // on the thread count
+        Node* node = &m_nodes[nodeidx];
+        m_nodecnt.fetch_add(1, std::memory_order_relaxed);
         node->bounds = req.bounds;
-        node->index = req.index;
 
         // Create leaf node if we have enough prims
         if (req.numprims < 2)
         {
-#ifdef USE_TBB
-            primitive_mutex_.lock();
-#endif
             node->type = NodeType::kLeaf;
-            node->startidx = static_cast<int>(m_packed_indices.size());
+            node->startidx = req.startidx;
             node->numprims = req.numprims;
 
-            for (auto i = 0; i < req.numprims; ++i)
-            {
-                m_packed_indices.push_back(primindices[req.startidx + i]);
-            }
-#ifdef USE_TBB
-            primitive_mutex_.unlock();
-#endif
+            std::copy(primindices + req.startidx, primindices + req.startidx + req.numprims, m_packed_indices.begin() + req.startidx);
         }
         else
         {
@@ -110,15 +110,10 @@ namespace RadeonRays
                     if (req.numprims < ss.sah && req.numprims < kMaxPrimitivesPerLeaf)
                     {
                         node->type = kLeaf;
-                        node->startidx = static_cast<int>(m_packed_indices.size());
+                        node->startidx = req.startidx;
                         node->numprims = req.numprims;
 
-                        for (auto i = 0; i < req.numprims; ++i)
-                        {
-                            m_packed_indices.push_back(primindices[req.startidx + i]);
-                        }
-
-                        if (req.ptr) *req.ptr = node;
+                        std::copy(primindices + req.startidx, primindices + req.startidx + req.numprims, m_packed_indices.begin() + req.startidx);
                         return;
                     }
                 }
@@ -225,25 +220,56 @@ namespace RadeonRays
             }
 
             // Left request
-            SplitRequest leftrequest = { req.startidx, splitidx - req.startidx, &node->lc, leftbounds, leftcentroid_bounds, req.level + 1, (req.index << 1) };
+            SplitRequest leftrequest = { req.startidx, splitidx - req.startidx, nullptr, leftbounds, leftcentroid_bounds, req.level + 1 };
             // Right request
-            SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightcentroid_bounds, req.level + 1, (req.index << 1) + 1 };
+            SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), nullptr, rightbounds, rightcentroid_bounds, req.level + 1 };
 
+            // Left subtree follows its parent, right one starts after the 2n - 1 left nodes
+            int leftidx = nodeidx + 1;
+            int rightidx = nodeidx + 2 * leftrequest.numprims;
+            node->lc = leftidx;
+            node->rc = rightidx;
+
+            if (req.numprims > kParallelBuildCutoff)
             {
-                // Put those to stack
-                BuildNode(leftrequest, bounds, centroids, primindices);
-            }
+#pragma omp task firstprivate(leftrequest, leftidx)
+                BuildNode(leftrequest, leftidx, bounds, centroids, primindices);
 
+                BuildNode(rightrequest, rightidx, bounds, centroids, primindices);
+
+#pragma omp taskwait
+            }
+            else
             {
-                BuildNode(rightrequest, bounds, centroids, primindices);
+                BuildNode(leftrequest, leftidx, bounds, centroids, primindices);
+                BuildNode(rightrequest, rightidx, bounds, centroids, primindices);
             }
         }
-
-        // Set parent ptr if any
-        if (req.ptr) *req.ptr = node;
     }
 
     Bvh::SahSplit Bvh::FindSahSplit(SplitRequest const& req, bbox const* bounds, Vec3 const* centroids, int* primindices) const
+    {
+        // The binning kernels count prims, weighted ones only go through the legacy path
+        if (m_sah_kernel == SahKernel::kLegacy || !m_prim_weights.empty())
+            return FindSahSplitLegacy(req, bounds, centroids, primindices);
+
+        SahSplit split;
+        split.dim = 0;
+        split.split = std::numeric_limits<float>::quiet_NaN();
+
+        int binidx;
+        float sah;
+        if (FindBinnedSahSplit(m_sah_kernel, m_sah_prims, primindices, req.startidx, req.numprims,
+            req.bounds, req.centroid_bounds, m_num_bins, m_traversal_cost, split.dim, binidx, sah))
+        {
+            split.sah = sah;
+            split.split = req.centroid_bounds.pmin[split.dim] + (binidx + 1) * (req.centroid_bounds.extents()[split.dim] / m_num_bins);
+        }
+
+        return split;
+    }
+
+    Bvh::SahSplit Bvh::FindSahSplitLegacy(SplitRequest const& req, bbox const* bounds, Vec3 const* centroids, int* primindices) const
     {
         // SAH implementation
         // calc centroids histogram
@@ -266,11 +292,11 @@ namespace RadeonRays
             return split;
         }
 
-        // Bin has bbox and occurence count
+        // Bin has bbox and occurence count, the sum of prim weights
         struct Bin
         {
             bbox bounds;
-            int count;
+            float count;
         };
 
         // Keep bins for each dimension
@@ -279,8 +305,20 @@ namespace RadeonRays
         bins[1].resize(m_num_bins);
         bins[2].resize(m_num_bins);
 
+        // Weights are scaled to average 1 within the node so the cost stays
+        // in units of prims, without weights the scale is exactly 1
+        float totalweight = static_cast<float>(req.numprims);
+        if (!m_prim_weights.empty())
+        {
+            totalweight = 0.f;
+            for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
+                totalweight += m_prim_weights[primindices[i]];
+        }
+
         // Precompute inverse parent area
         float invarea = 1.f / req.bounds.surface_area();
+        if (!m_prim_weights.empty() && totalweight > 0.f)
+            invarea *= req.numprims / totalweight;
         // Precompute min point
         Vec3 rootmin = req.centroid_bounds.pmin;
 
@@ -298,7 +336,7 @@ namespace RadeonRays
             // Initialize bins
             for (int i = 0; i < m_num_bins; ++i)
             {
-                bins[axis][i].count = 0;
+                bins[axis][i].count = 0.f;
                 bins[axis][i].bounds = bbox();
             }
 
@@ -308,7 +346,7 @@ namespace RadeonRays
                 int idx = primindices[i];
                 int binidx = (int)std::min<float>(static_cast<float>(m_num_bins) * ((centroids[idx][axis] - rootminc) * invcentroid_rng), static_cast<float>(m_num_bins - 1));
 
-                ++bins[axis][binidx].count;
+                bins[axis][binidx].count += GetPrimitiveWeight(idx);
                 bins[axis][binidx].bounds.grow(bounds[idx]);
             }
 
@@ -323,8 +361,8 @@ namespace RadeonRays
             }
 
             bbox leftbox = bbox();
-            int  leftcount = 0;
-            int  rightcount = req.numprims;
+            float leftcount = 0.f;
+            float rightcount = totalweight;
 
             // Start best SAH search
             // i is current split candidate (split between i and i + 1)
@@ -361,6 +399,7 @@ namespace RadeonRays
     {
         // Structure describing split request
         InitNodeAllocator(2 * numbounds - 1);
+        m_packed_indices.resize(numbounds);
 
         // Cache some stuff to have faster partitioning
         std::vector<Vec3> centroids(numbounds);
@@ -370,14 +409,12 @@ namespace RadeonRays
 
         // Calc bboxаΧĵİΧУͬʱ¼ÿΧе
         bbox centroid_bounds;
-        for (size_t i = 0; i < static_cast<size_t>(numbounds); ++i)
-        {
-            Vec3 c = bounds[i].center();
-            centroid_bounds.grow(c);
-            centroids[i] = c;
-        }
+        centers(bounds, numbounds, &centroids[0], centroid_bounds);
+
+        SplitRequest init = { 0, numbounds, nullptr, m_bounds, centroid_bounds, 0 };
 
-        SplitRequest init = { 0, numbounds, nullptr, m_bounds, centroid_bounds, 0, 1 };
+        if (m_usesah && m_sah_kernel != SahKernel::kLegacy)
+            m_sah_prims.Init(bounds, &centroids[0], numbounds);
 
 #ifdef USE_BUILD_STACK
         std::stack<SplitRequest> stack;
@@ -482,23 +519,184 @@ namespace RadeonRays
                 stack.push(rightrequest);
             }
 
-            // Set parent ptr if any
-            if (req.ptr) *req.ptr = node;
+            // Set parent's child index if any
+            if (req.ptr) *req.ptr = static_cast<int>(node - &m_nodes[0]);
         }
 #else
-        BuildNode(init, bounds, &centroids[0], &m_indices[0]);
+#ifdef _OPENMP
+        // When called from an enclosing parallel region (e.g. one task per mesh)
+        // the subtree tasks simply join that team
+        if (!omp_in_parallel() && numbounds > kParallelBuildCutoff)
+        {
+#pragma omp parallel
+#pragma omp single nowait
+            BuildNode(init, 0, bounds, &centroids[0], &m_indices[0]);
+        }
+        else
 #endif
+        {
+            BuildNode(init, 0, bounds, &centroids[0], &m_indices[0]);
+        }
+#endif
+
+        m_sah_prims.Clear();
+        // The tree only refers to m_packed_indices
+        std::vector<int>().swap(m_indices);
 
         // Set root_ pointer
         m_root = &m_nodes[0];
     }
 
+    float Bvh::GetSahCost() const
+    {
+        if (!m_root)
+            return 0.f;
+
+        double invrootarea = 1.0 / m_root->bounds.surface_area();
+        double cost = 0.0;
+
+        std::vector<Node const*> stack;
+        stack.push_back(m_root);
+
+        while (!stack.empty())
+        {
+            Node const* node = stack.back();
+            stack.pop_back();
+
+            double area = node->bounds.surface_area() * invrootarea;
+
+            if (node->type == kLeaf)
+            {
+                cost += area * node->numprims;
+            }
+            else
+            {
+                cost += area * m_traversal_cost;
+                stack.push_back(&m_nodes[node->lc]);
+                stack.push_back(&m_nodes[node->rc]);
+            }
+        }
+
+        return (float)cost;
+    }
+
+    void Bvh::InitRefit()
+    {
+        m_parents.assign(m_nodes.size(), -1);
+        m_prim_leaves.assign(m_packed_indices.size(), -1);
+        m_refit_pending.assign(m_nodes.size(), -1);
+
+        std::vector<Node const*> stack;
+        stack.push_back(m_root);
+
+        while (!stack.empty())
+        {
+            Node const* node = stack.back();
+            stack.pop_back();
+
+            int nodeidx = static_cast<int>(node - &m_nodes[0]);
+
+            if (node->type == kLeaf)
+            {
+                for (int i = node->startidx; i < node->startidx + node->numprims; ++i)
+                    m_prim_leaves[m_packed_indices[i]] = nodeidx;
+            }
+            else
+            {
+                m_parents[node->lc] = nodeidx;
+                m_parents[node->rc] = nodeidx;
+                stack.push_back(&m_nodes[node->lc]);
+                stack.push_back(&m_nodes[node->rc]);
+            }
+        }
+    }
+
+    void Bvh::Refit(bbox const* bounds, int const* dirtyprims, int numdirty, std::vector<int>& refitted)
+    {
+        if (!m_root || numdirty == 0)
+            return;
+
+        if (m_parents.empty())
+            InitRefit();
+
+        size_t first = refitted.size();
+
+        // Mark dirty leaves and their ancestors, counting for every internal
+        // node how many of its children will be refitted
+        for (int i = 0; i < numdirty; ++i)
+        {
+            int leaf = m_prim_leaves[dirtyprims[i]];
+            if (m_refit_pending[leaf] != -1)
+                continue;
+
+            m_refit_pending[leaf] = 0;
+            refitted.push_back(leaf);
+
+            for (int parent = m_parents[leaf]; parent != -1; parent = m_parents[parent])
+            {
+                if (m_refit_pending[parent] != -1)
+                {
+                    ++m_refit_pending[parent];
+                    break;
+                }
+
+                m_refit_pending[parent] = 1;
+                refitted.push_back(parent);
+            }
+        }
+
+        // Walk up from every leaf, the last child to arrive refits the parent
+        // so each node is recomputed once, after all of its children
+        for (size_t i = first; i < refitted.size(); ++i)
+        {
+            Node* leaf = &m_nodes[refitted[i]];
+            if (leaf->type != kLeaf)
+                continue;
+
+            leaf->bounds = bbox();
+            for (int j = leaf->startidx; j < leaf->startidx + leaf->numprims; ++j)
+                leaf->bounds.grow(bounds[m_packed_indices[j]]);
+
+            for (int parent = m_parents[refitted[i]]; parent != -1 && --m_refit_pending[parent] == 0; parent = m_parents[parent])
+            {
+                Node* node = &m_nodes[parent];
+                node->bounds = bboxunion(m_nodes[node->lc].bounds, m_nodes[node->rc].bounds);
+            }
+        }
+
+        for (size_t i = first; i < refitted.size(); ++i)
+            m_refit_pending[refitted[i]] = -1;
+
+        m_bounds = m_root->bounds;
+    }
+
+    bool Bvh::IsSameTree(Bvh const& other) const
+    {
+        if (m_nodecnt != other.m_nodecnt || m_packed_indices != other.m_packed_indices)
+            return false;
+
+        for (int i = 0; i < m_nodecnt; ++i)
+        {
+            Node const& a = m_nodes[i];
+            Node const& b = other.m_nodes[i];
+
+            if (std::memcmp(&a.bounds, &b.bounds, sizeof(bbox)) != 0 || a.type != b.type)
+                return false;
+
+            // Leaf ranges and child indices share the same two ints
+            if (a.startidx != b.startidx || a.numprims != b.numprims)
+                return false;
+        }
+
+        return true;
+    }
+
     void Bvh::PrintStatistics(std::ostream& os) const
     {
         os << "Class name: " << "Bvh\n";
         os << "SAH: " << (m_usesah ? "enabled\n" : "disabled\n");
         os << "SAH bins: " << m_num_bins << "\n";
-        os << "Number of triangles: " << m_indices.size() << "\n";
+        os << "Number of triangles: " << m_packed_indices.size() << "\n";
         os << "Number of nodes: " << m_nodecnt << "\n";
         os << "Tree height: " << GetHeight() << "\n";
     }
@@ -30,6 +30,7 @@ THE SOFTWARE.
 #include <atomic>
 #include <iostream>
 #include "bbox.h"
+#include "sah_binning.h"
 
 namespace RadeonRays
 {
@@ -45,10 +46,23 @@ namespace RadeonRays
             , m_usesah(usesah)
             , m_height(0)
             , m_traversal_cost(traversal_cost)
+            , m_sah_kernel(GetBestSahKernel())
         {
         }
 
-        ~Bvh() = default;
+        // Lbvh and SplitBvh are owned and deleted through Bvh pointers
+        virtual ~Bvh() = default;
+
+        // BVH node
+        struct Node;
+
+        // Root node, null before Build
+        Node const* GetRoot() const;
+
+        // Node at a position in the node array and back, indices stay valid
+        // where node pointers can't be kept
+        Node const* GetNode(int index) const;
+        int GetNodeIndex(Node const* node) const;
 
         // World space bounding box
         //ӦǷصǰBVHµİΧ
@@ -62,6 +76,21 @@ namespace RadeonRays
         // Get tree height
         int GetHeight() const;
 
+        // Kernel used by FindSahSplit, defaults to the best one the CPU supports
+        void SetSahKernel(SahKernel kernel);
+
+        // Ray distribution heuristic: weight of every primitive in the split
+        // cost instead of 1, see RayDistribution. Set before Build, weighted
+        // splits are found with the legacy kernel. Empty gives plain SAH
+        void SetPrimitiveWeights(std::vector<float> weights);
+
+        // Get number of nodes
+        int GetNumNodes() const;
+
+        // SAH cost of the whole tree: traversal cost per internal node and one
+        // per primitive in a leaf, weighted by area relative to the root
+        float GetSahCost() const;
+
         // Get reordered prim indices Nodes are pointing to
         virtual int const* GetIndices() const;
 
@@ -72,12 +101,21 @@ namespace RadeonRays
 
         // Print BVH statistics
         virtual void PrintStatistics(std::ostream& os) const;
+
+        // Bitwise comparison of nodes and packed indices with another build
+        bool IsSameTree(Bvh const& other) const;
+
+        // Update node bounds for new primitive bounds keeping the topology.
+        // bounds holds every primitive, only leaves of dirtyprims and their
+        // ancestors are recomputed and their indices in the node array are
+        // appended to refitted. Assumes each primitive sits in a single leaf,
+        // which holds for everything but SplitBvh
+        void Refit(bbox const* bounds, int const* dirtyprims, int numdirty, std::vector<int>& refitted);
+
     protected:
         // Build function
         //Buildľʵ֣麯ԣӵвͬʵϸ
         virtual void BuildImpl(bbox const* bounds, int numbounds);
-        // BVH node
-        struct Node;
         // Node allocation
         //֮ǰm_nodesлȡһδֵNodeַ
         virtual Node* AllocateNode();
@@ -97,16 +135,15 @@ namespace RadeonRays
             int startidx;
             // Number of primitives
             int numprims;
-            // Root node
-            Node** ptr;
+            // Child index of the parent to fill in, only the USE_BUILD_STACK
+            // path allocates a node before knowing where its children go
+            int* ptr;
             // Bounding box
             bbox bounds;
             // Centroid bounds
             bbox centroid_bounds;
             // Level
             int level;
-            // Node index
-            int index;
         };
 
         struct SahSplit
@@ -122,9 +159,21 @@ namespace RadeonRays
         //2)аΧ
         //3)аΧе
         //4)ͼԪ
-        void BuildNode(SplitRequest const& req, bbox const* bounds, Vec3 const* centroids, int* primindices);
+        // nodeidx is the node's preorder slot in m_nodes, a subtree over n prims
+        // takes exactly 2n - 1 slots so children positions are known up front
+        void BuildNode(SplitRequest const& req, int nodeidx, bbox const* bounds, Vec3 const* centroids, int* primindices);
 
         SahSplit FindSahSplit(SplitRequest const& req, bbox const* bounds, Vec3 const* centroids, int* primindices) const;
+        SahSplit FindSahSplitLegacy(SplitRequest const& req, bbox const* bounds, Vec3 const* centroids, int* primindices) const;
+
+        // Weight of a primitive in the split cost, 1 without primitive weights
+        float GetPrimitiveWeight(int prim) const;
+
+        // Raise m_height to level, safe to call from concurrent build tasks
+        void UpdateHeight(int level);
+
+        // Fill parent links and primitive leaves used by Refit
+        void InitRefit();
 
         // Enum for node type
         enum NodeType
@@ -154,12 +203,22 @@ namespace RadeonRays
         bool m_usesah;
         // Tree height
         //ӦǵǰڵBVHеĸ߶
-        int m_height;
+        std::atomic<int> m_height;
         // Node traversal cost
         //Ӧǵǰڵıɱ
         float m_traversal_cost;
         // Number of spatial bins to use for SAH
         int m_num_bins;
+        // SAH evaluation kernel and the prim data it bins, the latter only lives during the build
+        SahKernel m_sah_kernel;
+        SahPrimData m_sah_prims;
+        // Per primitive split cost weights, empty for plain SAH
+        std::vector<float> m_prim_weights;
+        // Parent node of each node, leaf of each primitive and per node count
+        // of refitted children still pending (-1 when untouched), set up lazily
+        std::vector<int> m_parents;
+        std::vector<int> m_prim_leaves;
+        std::vector<int> m_refit_pending;
 
 
     private:
@@ -167,28 +226,31 @@ namespace RadeonRays
         Bvh& operator = (Bvh const&) = delete;
 
 		friend class BvhTranslator;
+		friend class BvhOptimizer;
+		friend class BvhCache;
+		friend class BvhStatistics;
+		friend class RayDistribution;
     };
     //ܰ
     //1)Node°Χ
     //2)Node(ڲڵ/ⲿڵ)
-    //3)NodeBVHе
-    //4)union(ڲڵ㣺ָ룬Ҷڵ㣺ͼԪʼͼԪ)
+    //3)union(ڲڵ㣺ӽڵm_nodesеҶڵ㣺ͼԪʼͼԪ)
+    // Builders write child indices as they go, so m_nodes is the only copy of
+    // the tree and has the 36 bytes per node of a flattened binary node
     struct Bvh::Node
     {
         // Node bounds in world space
         bbox bounds;
         // Type of the node
         NodeType type;
-        // Node index in a complete tree
-        int index;
 
         union
         {
-            // For internal nodes: left and right children
+            // For internal nodes: left and right children in m_nodes
             struct
             {
-                Node* lc;
-                Node* rc;
+                int lc;
+                int rc;
             };
 
             // For leaves: starting primitive index and number of primitives
@@ -200,6 +262,21 @@ namespace RadeonRays
         };
     };
 
+    inline Bvh::Node const* Bvh::GetRoot() const
+    {
+        return m_root;
+    }
+
+    inline Bvh::Node const* Bvh::GetNode(int index) const
+    {
+        return &m_nodes[index];
+    }
+
+    inline int Bvh::GetNodeIndex(Node const* node) const
+    {
+        return static_cast<int>(node - &m_nodes[0]);
+    }
+
     inline int const* Bvh::GetIndices() const
     {
         return &m_packed_indices[0];
@@ -214,6 +291,33 @@ namespace RadeonRays
     {
         return m_height;
     }
+
+    inline void Bvh::SetSahKernel(SahKernel kernel)
+    {
+        m_sah_kernel = IsSahKernelSupported(kernel) ? kernel : GetBestSahKernel();
+    }
+
+    inline void Bvh::SetPrimitiveWeights(std::vector<float> weights)
+    {
+        m_prim_weights = std::move(weights);
+    }
+
+    inline float Bvh::GetPrimitiveWeight(int prim) const
+    {
+        return m_prim_weights.empty() ? 1.f : m_prim_weights[prim];
+    }
+
+    inline int Bvh::GetNumNodes() const
+    {
+        return m_nodecnt;
+    }
+
+    inline void Bvh::UpdateHeight(int level)
+    {
+        int height = m_height.load(std::memory_order_relaxed);
+        while (height < level && !m_height.compare_exchange_weak(height, level, std::memory_order_relaxed))
+            ;
+    }
 }
 
 #endif // BVH_H
@@ -0,0 +1,332 @@
+/**********************************************************************
+ Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ ********************************************************************/
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "bvh_cache.h"
+
+namespace RadeonRays
+{
+    // Bump whenever the file layout or any builder changes the trees it produces
+    static const std::uint32_t kCacheVersion = 2;
+    static const char kCacheMagic[4] = { 'R', 'R', 'B', 'V' };
+
+    struct CacheHeader
+    {
+        char magic[4];
+        std::uint32_t version;
+        std::uint64_t key;
+        std::uint32_t numnodes;
+        std::uint32_t numindices;
+        std::int32_t height;
+        float buildms;
+        float bounds[6];
+    };
+
+    // Nodes are stored in preorder, root first. a and b are the children of
+    // internal nodes and the first primitive and primitive count of leaves
+    struct CacheNode
+    {
+        float bounds[6];
+        std::int32_t type;
+        std::int32_t a;
+        std::int32_t b;
+    };
+
+    // Read only view of a whole file
+    class MappedFile
+    {
+    public:
+        MappedFile(std::string const& path)
+        {
+#if defined(_WIN32)
+            m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (m_file == INVALID_HANDLE_VALUE)
+                return;
+
+            LARGE_INTEGER size;
+            if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+                return;
+
+            m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (!m_mapping)
+                return;
+
+            m_data = static_cast<char const*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+            m_size = m_data ? (std::size_t)size.QuadPart : 0;
+#else
+            m_file = open(path.c_str(), O_RDONLY);
+            if (m_file < 0)
+                return;
+
+            struct stat info;
+            if (fstat(m_file, &info) != 0 || info.st_size == 0)
+                return;
+
+            void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, m_file, 0);
+            if (data == MAP_FAILED)
+                return;
+
+            m_data = static_cast<char const*>(data);
+            m_size = info.st_size;
+#endif
+        }
+
+        ~MappedFile()
+        {
+#if defined(_WIN32)
+            if (m_data)
+                UnmapViewOfFile(m_data);
+            if (m_mapping)
+                CloseHandle(m_mapping);
+            if (m_file != INVALID_HANDLE_VALUE)
+                CloseHandle(m_file);
+#else
+            if (m_data)
+                munmap(const_cast<char*>(m_data), m_size);
+            if (m_file >= 0)
+                close(m_file);
+#endif
+        }
+
+        char const* GetData() const { return m_data; }
+        std::size_t GetSize() const { return m_size; }
+
+    private:
+        char const* m_data = nullptr;
+        std::size_t m_size = 0;
+#if defined(_WIN32)
+        HANDLE m_file = INVALID_HANDLE_VALUE;
+        HANDLE m_mapping = nullptr;
+#else
+        int m_file = -1;
+#endif
+
+        MappedFile(MappedFile const&) = delete;
+        MappedFile& operator = (MappedFile const&) = delete;
+    };
+
+    std::uint64_t BvhCache::Hash(void const* data, std::size_t size, std::uint64_t seed)
+    {
+        // FNV-1a over 64 bit words with an extra rotation for better mixing,
+        // the tail is hashed bytewise
+        const std::uint64_t prime = 0x100000001b3ull;
+        unsigned char const* bytes = static_cast<unsigned char const*>(data);
+        std::uint64_t hash = seed;
+
+        std::size_t numwords = size / sizeof(std::uint64_t);
+        for (std::size_t i = 0; i < numwords; ++i)
+        {
+            std::uint64_t word;
+            std::memcpy(&word, bytes + i * sizeof(std::uint64_t), sizeof(word));
+            hash = (hash ^ word) * prime;
+            hash ^= hash >> 29;
+        }
+
+        for (std::size_t i = numwords * sizeof(std::uint64_t); i < size; ++i)
+            hash = (hash ^ bytes[i]) * prime;
+
+        return hash;
+    }
+
+    std::string BvhCache::GetPath(std::uint64_t key) const
+    {
+        char filename[32];
+        snprintf(filename, sizeof(filename), "%016" PRIx64 ".bvh", key);
+        return m_directory + "/" + filename;
+    }
+
+    bool BvhCache::Load(std::uint64_t key, Bvh& bvh, float& buildms) const
+    {
+        MappedFile file(GetPath(key));
+        if (file.GetSize() < sizeof(CacheHeader))
+            return false;
+
+        CacheHeader header;
+        std::memcpy(&header, file.GetData(), sizeof(header));
+        if (std::memcmp(header.magic, kCacheMagic, sizeof(kCacheMagic)) != 0 || header.version != kCacheVersion || header.key != key)
+            return false;
+
+        // A truncated or foreign file must not be trusted
+        std::size_t numnodes = header.numnodes;
+        std::size_t numindices = header.numindices;
+        if (numnodes == 0 || file.GetSize() != sizeof(CacheHeader) + numnodes * sizeof(CacheNode) + numindices * sizeof(int))
+            return false;
+
+        CacheNode const* records = reinterpret_cast<CacheNode const*>(file.GetData() + sizeof(CacheHeader));
+        int const* indices = reinterpret_cast<int const*>(records + numnodes);
+
+        bvh.m_nodes.resize(numnodes);
+        for (std::size_t i = 0; i < numnodes; ++i)
+        {
+            CacheNode const& record = records[i];
+            Bvh::Node& node = bvh.m_nodes[i];
+
+            node.bounds.pmin = Vec3(record.bounds[0], record.bounds[1], record.bounds[2]);
+            node.bounds.pmax = Vec3(record.bounds[3], record.bounds[4], record.bounds[5]);
+            node.type = record.type == Bvh::kLeaf ? Bvh::kLeaf : Bvh::kInternal;
+
+            if (node.type == Bvh::kInternal)
+            {
+                if (record.a <= (int)i || record.a >= (int)numnodes || record.b <= (int)i || record.b >= (int)numnodes)
+                    return false;
+
+                node.lc = record.a;
+                node.rc = record.b;
+            }
+            else
+            {
+                if (record.a < 0 || record.b < 0 || (std::size_t)record.a + record.b > numindices)
+                    return false;
+
+                node.startidx = record.a;
+                node.numprims = record.b;
+            }
+        }
+
+        bvh.m_packed_indices.assign(indices, indices + numindices);
+        bvh.m_indices.clear();
+        bvh.m_nodecnt = (int)numnodes;
+        bvh.m_root = &bvh.m_nodes[0];
+        bvh.m_bounds.pmin = Vec3(header.bounds[0], header.bounds[1], header.bounds[2]);
+        bvh.m_bounds.pmax = Vec3(header.bounds[3], header.bounds[4], header.bounds[5]);
+        bvh.m_height = header.height;
+        bvh.m_parents.clear();
+        bvh.m_prim_leaves.clear();
+        bvh.m_refit_pending.clear();
+
+        buildms = header.buildms;
+        return true;
+    }
+
+    bool BvhCache::Store(std::uint64_t key, Bvh const& bvh, float buildms) const
+    {
+        if (!bvh.m_root)
+            return false;
+
+        // Renumber the nodes reachable from the root, builders may leave unused slots
+        std::vector<Bvh::Node const*> order;
+        std::vector<int> position(bvh.m_nodes.size());
+        std::vector<Bvh::Node const*> stack = { bvh.m_root };
+        while (!stack.empty())
+        {
+            Bvh::Node const* node = stack.back();
+            stack.pop_back();
+
+            position[node - &bvh.m_nodes[0]] = (int)order.size();
+            order.push_back(node);
+
+            if (node->type == Bvh::kInternal)
+            {
+                stack.push_back(&bvh.m_nodes[node->rc]);
+                stack.push_back(&bvh.m_nodes[node->lc]);
+            }
+        }
+
+        std::vector<CacheNode> records(order.size());
+        for (std::size_t i = 0; i < order.size(); ++i)
+        {
+            Bvh::Node const* node = order[i];
+            CacheNode& record = records[i];
+
+            std::memcpy(&record.bounds[0], &node->bounds.pmin, 3 * sizeof(float));
+            std::memcpy(&record.bounds[3], &node->bounds.pmax, 3 * sizeof(float));
+            record.type = node->type;
+
+            if (node->type == Bvh::kInternal)
+            {
+                record.a = position[node->lc];
+                record.b = position[node->rc];
+            }
+            else
+            {
+                record.a = node->startidx;
+                record.b = node->numprims;
+            }
+        }
+
+        CacheHeader header = {};
+        std::memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+        header.version = kCacheVersion;
+        header.key = key;
+        header.numnodes = (std::uint32_t)records.size();
+        header.numindices = (std::uint32_t)bvh.m_packed_indices.size();
+        header.height = bvh.m_height;
+        header.buildms = buildms;
+        std::memcpy(&header.bounds[0], &bvh.m_bounds.pmin, 3 * sizeof(float));
+        std::memcpy(&header.bounds[3], &bvh.m_bounds.pmax, 3 * sizeof(float));
+
+#if defined(_WIN32)
+        _mkdir(m_directory.c_str());
+#else
+        mkdir(m_directory.c_str(), 0755);
+#endif
+
+        // Write next to the entry and move it in place, so a concurrent reader
+        // or an interrupted write never leaves a partial entry behind. Meshes
+        // are built in parallel and several processes may share the directory,
+        // so every writer gets its own temporary file
+#if defined(_WIN32)
+        unsigned long long pid = (unsigned long long)_getpid();
+#else
+        unsigned long long pid = (unsigned long long)getpid();
+#endif
+        unsigned long long tid = (unsigned long long)std::hash<std::thread::id>()(std::this_thread::get_id());
+        std::string path = GetPath(key);
+        std::string temppath = path + "." + std::to_string(pid) + "." + std::to_string(tid) + ".tmp";
+        FILE* file = fopen(temppath.c_str(), "wb");
+        if (!file)
+            return false;
+
+        bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+        written = written && fwrite(records.data(), sizeof(CacheNode), records.size(), file) == records.size();
+        written = written && fwrite(bvh.m_packed_indices.data(), sizeof(int), bvh.m_packed_indices.size(), file) == bvh.m_packed_indices.size();
+        written = fclose(file) == 0 && written;
+
+        if (written)
+        {
+            std::remove(path.c_str());
+            written = std::rename(temppath.c_str(), path.c_str()) == 0;
+        }
+
+        if (!written)
+            std::remove(temppath.c_str());
+
+        return written;
+    }
+}
@@ -0,0 +1,64 @@
+/**********************************************************************
+ Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ ********************************************************************/
+#pragma once
+
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include "bvh.h"
+
+namespace RadeonRays
+{
+    ///< Directory of built hierarchies, one file per key holding the nodes
+    ///< and packed indices of a Bvh. Files are named after the key, so meshes
+    ///< that share a name never share an entry and entries of keys no longer
+    ///< in use stay until the directory is cleared. Files are memory mapped
+    ///< on load, the only work besides I/O is turning child indices back into
+    ///< pointers.
+    class BvhCache
+    {
+    public:
+        BvhCache(std::string const& directory)
+            : m_directory(directory)
+        {
+        }
+
+        // Hash of size bytes, chain calls through seed to hash several buffers
+        static std::uint64_t Hash(void const* data, std::size_t size, std::uint64_t seed = 0xcbf29ce484222325ull);
+
+        // Fill bvh, which must be of the type it was stored from, with the
+        // tree stored under key. buildms receives the time the stored build took
+        bool Load(std::uint64_t key, Bvh& bvh, float& buildms) const;
+
+        // Store the tree of bvh under key, replacing any older entry
+        bool Store(std::uint64_t key, Bvh const& bvh, float buildms) const;
+
+    private:
+        std::string GetPath(std::uint64_t key) const;
+
+        std::string m_directory;
+    };
+}
+
+#endif // BVH_CACHE_H
@@ -0,0 +1,399 @@
+/**********************************************************************
+ Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ ********************************************************************/
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "bvh_optimizer.h"
+
+namespace RadeonRays
+{
+    // Subtrees with more prims than this are optimized as separate tasks
+    static int constexpr kParallelOptimizeCutoff = 4096;
+
+    static inline int PopCount(unsigned v)
+    {
+        int count = 0;
+        for (; v; v &= v - 1)
+            ++count;
+        return count;
+    }
+
+    static inline int LowestBit(unsigned v)
+    {
+        int bit = 0;
+        while (!(v & (1u << bit)))
+            ++bit;
+        return bit;
+    }
+
+    // Subsets of the treelet leaves are bit masks
+    struct BvhOptimizer::Treelet
+    {
+        static int constexpr kMaxLeaves = 7;
+        static int constexpr kNumSubsets = 1 << kMaxLeaves;
+
+        Bvh::Node* leaves[kMaxLeaves];
+        Bvh::Node* internals[kMaxLeaves - 1];
+        int numleaves;
+        int numinternals;
+
+        bbox bounds[kNumSubsets];
+        float cost[kNumSubsets];
+        int numprims[kNumSubsets];
+        unsigned partition[kNumSubsets];
+    };
+
+    int BvhOptimizer::CountPrims(Bvh::Node const* node, Bvh::Node const* nodes, std::vector<int>& numprims)
+    {
+        int count = node->type == Bvh::kLeaf ? node->numprims : CountPrims(&nodes[node->lc], nodes, numprims) + CountPrims(&nodes[node->rc], nodes, numprims);
+        numprims[node - nodes] = count;
+        return count;
+    }
+
+    void BvhOptimizer::Optimize(Bvh& bvh) const
+    {
+        if (!bvh.m_root || bvh.m_root->type == Bvh::kLeaf)
+            return;
+
+        // Prim counts decide which subtrees become tasks, restructuring keeps them up to date
+        std::vector<float> cost(bvh.m_nodes.size());
+        std::vector<int> numprims(bvh.m_nodes.size());
+        CountPrims(bvh.m_root, &bvh.m_nodes[0], numprims);
+
+        for (int pass = 0; pass < m_num_passes; ++pass)
+        {
+#ifdef _OPENMP
+            if (!omp_in_parallel())
+            {
+#pragma omp parallel
+#pragma omp single nowait
+                OptimizeSubtree(bvh, bvh.m_root, cost, numprims);
+            }
+            else
+#endif
+            {
+                OptimizeSubtree(bvh, bvh.m_root, cost, numprims);
+            }
+        }
+
+        // Restructuring changes depths and invalidates the parent links used by Refit
+        bvh.m_parents.clear();
+        bvh.m_prim_leaves.clear();
+        bvh.m_refit_pending.clear();
+
+        int height = 0;
+        std::vector<std::pair<Bvh::Node const*, int>> stack;
+        stack.push_back(std::make_pair(bvh.m_root, 0));
+
+        while (!stack.empty())
+        {
+            Bvh::Node const* node = stack.back().first;
+            int level = stack.back().second;
+            stack.pop_back();
+
+            height = std::max(height, level);
+            if (node->type == Bvh::kInternal)
+            {
+                stack.push_back(std::make_pair(&bvh.m_nodes[node->lc], level + 1));
+                stack.push_back(std::make_pair(&bvh.m_nodes[node->rc], level + 1));
+            }
+        }
+        bvh.m_height = height;
+    }
+
+    void BvhOptimizer::OptimizeSubtree(Bvh& bvh, Bvh::Node* node, std::vector<float>& cost, std::vector<int>& numprims) const
+    {
+        int nodeidx = static_cast<int>(node - &bvh.m_nodes[0]);
+
+        if (node->type == Bvh::kLeaf)
+        {
+            cost[nodeidx] = node->bounds.surface_area() * node->numprims;
+            numprims[nodeidx] = node->numprims;
+            return;
+        }
+
+        if (numprims[nodeidx] > kParallelOptimizeCutoff)
+        {
+#pragma omp task shared(bvh, cost, numprims)
+            OptimizeSubtree(bvh, &bvh.m_nodes[node->lc], cost, numprims);
+            OptimizeSubtree(bvh, &bvh.m_nodes[node->rc], cost, numprims);
+#pragma omp taskwait
+        }
+        else
+        {
+            OptimizeSubtree(bvh, &bvh.m_nodes[node->lc], cost, numprims);
+            OptimizeSubtree(bvh, &bvh.m_nodes[node->rc], cost, numprims);
+        }
+
+        int lc = node->lc;
+        int rc = node->rc;
+        numprims[nodeidx] = numprims[lc] + numprims[rc];
+        cost[nodeidx] = bvh.m_traversal_cost * node->bounds.surface_area() + cost[lc] + cost[rc];
+
+        RestructureTreelet(bvh, node, cost, numprims);
+    }
+
+    void BvhOptimizer::EmitTreelet(Treelet& treelet, unsigned subset, Bvh::Node* node, Bvh::Node const* nodes, std::vector<float>& cost, std::vector<int>& numprims)
+    {
+        unsigned left = treelet.partition[subset];
+        unsigned right = subset & ~left;
+        int* children[2] = { &node->lc, &node->rc };
+        unsigned childsubsets[2] = { left, right };
+
+        for (int i = 0; i < 2; ++i)
+        {
+            unsigned childsubset = childsubsets[i];
+
+            if (PopCount(childsubset) == 1)
+            {
+                *children[i] = static_cast<int>(treelet.leaves[LowestBit(childsubset)] - nodes);
+            }
+            else
+            {
+                Bvh::Node* child = treelet.internals[treelet.numinternals++];
+                EmitTreelet(treelet, childsubset, child, nodes, cost, numprims);
+                *children[i] = static_cast<int>(child - nodes);
+            }
+        }
+
+        int nodeidx = static_cast<int>(node - nodes);
+        node->type = Bvh::kInternal;
+        node->bounds = treelet.bounds[subset];
+        cost[nodeidx] = treelet.cost[subset];
+        numprims[nodeidx] = treelet.numprims[subset];
+    }
+
+    void BvhOptimizer::RestructureTreelet(Bvh& bvh, Bvh::Node* root, std::vector<float>& cost, std::vector<int>& numprims) const
+    {
+        Bvh::Node* nodes = &bvh.m_nodes[0];
+        Treelet treelet;
+
+        // Grow the treelet by expanding the leaf with the largest area, the
+        // root and every expanded node become its internal nodes
+        treelet.leaves[0] = &nodes[root->lc];
+        treelet.leaves[1] = &nodes[root->rc];
+        treelet.numleaves = 2;
+        treelet.internals[0] = root;
+        treelet.numinternals = 1;
+
+        while (treelet.numleaves < Treelet::kMaxLeaves)
+        {
+            int best = -1;
+            float bestarea = -1.f;
+            for (int i = 0; i < treelet.numleaves; ++i)
+            {
+                Bvh::Node* leaf = treelet.leaves[i];
+                float area = leaf->bounds.surface_area();
+                if (leaf->type == Bvh::kInternal && area > bestarea)
+                {
+                    best = i;
+                    bestarea = area;
+                }
+            }
+
+            if (best == -1)
+                break;
+
+            Bvh::Node* expanded = treelet.leaves[best];
+            treelet.internals[treelet.numinternals++] = expanded;
+            treelet.leaves[best] = &nodes[expanded->lc];
+            treelet.leaves[treelet.numleaves++] = &nodes[expanded->rc];
+        }
+
+        // Two or three leaves leave no choice worth searching
+        if (treelet.numleaves < 4)
+            return;
+
+        int numleaves = treelet.numleaves;
+        unsigned full = (1u << numleaves) - 1;
+
+        for (int i = 0; i < numleaves; ++i)
+        {
+            int leafidx = static_cast<int>(treelet.leaves[i] - nodes);
+            treelet.bounds[1u << i] = treelet.leaves[i]->bounds;
+            treelet.cost[1u << i] = cost[leafidx];
+            treelet.numprims[1u << i] = numprims[leafidx];
+        }
+
+        // Subsets of a set are smaller numbers, so increasing order sees
+        // every partition's halves before the set itself
+        for (unsigned subset = 1; subset <= full; ++subset)
+        {
+            if (PopCount(subset) < 2)
+                continue;
+
+            unsigned lowest = subset & (0u - subset);
+            unsigned rest = subset & ~lowest;
+            treelet.bounds[subset] = bboxunion(treelet.bounds[lowest], treelet.bounds[rest]);
+            treelet.numprims[subset] = treelet.numprims[lowest] + treelet.numprims[rest];
+
+            // The half holding the lowest leaf is always the left one, which
+            // visits every unordered partition exactly once
+            float bestcost = std::numeric_limits<float>::max();
+            unsigned bestpartition = 0;
+            for (unsigned left = (subset - 1) & subset; left; left = (left - 1) & subset)
+            {
+                if (!(left & lowest))
+                    continue;
+
+                float partitioncost = treelet.cost[left] + treelet.cost[subset & ~left];
+                if (partitioncost < bestcost)
+                {
+                    bestcost = partitioncost;
+                    bestpartition = left;
+                }
+            }
+
+            treelet.cost[subset] = bvh.m_traversal_cost * treelet.bounds[subset].surface_area() + bestcost;
+            treelet.partition[subset] = bestpartition;
+        }
+
+        // Keep the current treelet unless the gain is above rounding noise
+        int rootidx = static_cast<int>(root - nodes);
+        if (treelet.cost[full] >= cost[rootidx] * (1.f - 1e-5f))
+            return;
+
+        treelet.numinternals = 1;
+        EmitTreelet(treelet, full, root, nodes, cost, numprims);
+    }
+
+    static bool IntersectBox(bbox const& box, Vec3 const& origin, Vec3 const& invdir, float tmax, float& tnear)
+    {
+        float t0 = 0.f;
+        float t1 = tmax;
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float ta = (box.pmin[axis] - origin[axis]) * invdir[axis];
+            float tb = (box.pmax[axis] - origin[axis]) * invdir[axis];
+            t0 = std::max(t0, std::min(ta, tb));
+            t1 = std::min(t1, std::max(ta, tb));
+        }
+
+        tnear = t0;
+        return t0 <= t1;
+    }
+
+    BvhOptimizer::RayCost BvhOptimizer::MeasureTraversalCost(Bvh const& bvh, bbox const* bounds, int numrays, std::vector<int>* visits)
+    {
+        RayCost result = { 0.f, 0.f };
+        if (visits)
+            visits->assign(bvh.m_nodes.size(), 0);
+        if (!bvh.m_root || numrays <= 0)
+            return result;
+
+        bbox const& rootbounds = bvh.m_root->bounds;
+        Vec3 center = rootbounds.center();
+        Vec3 extents = rootbounds.extents();
+        float radius = 0.5f * Vec3::Length(extents);
+
+        // Rays are generated up front from a fixed seed so every tree sees the same set
+        std::vector<Vec3> origins(numrays);
+        std::vector<Vec3> targets(numrays);
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<float> uniform(0.f, 1.f);
+
+        for (int i = 0; i < numrays; ++i)
+        {
+            float z = 1.f - 2.f * uniform(rng);
+            float r = std::sqrt(std::max(0.f, 1.f - z * z));
+            float phi = 2.f * 3.14159265f * uniform(rng);
+            origins[i] = center + Vec3(r * std::cos(phi), r * std::sin(phi), z) * radius;
+            targets[i] = rootbounds.pmin + Vec3(uniform(rng) * extents.x, uniform(rng) * extents.y, uniform(rng) * extents.z);
+        }
+
+        double nodetests = 0.0;
+        double primtests = 0.0;
+
+#pragma omp parallel for reduction(+ : nodetests, primtests) schedule(dynamic, 256)
+        for (int i = 0; i < numrays; ++i)
+        {
+            Vec3 origin = origins[i];
+            Vec3 dir = targets[i] - origin;
+            Vec3 invdir(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+
+            float closest = std::numeric_limits<float>::max();
+            float tnear;
+
+            std::vector<std::pair<Bvh::Node const*, float>> stack;
+
+            ++nodetests;
+            if (IntersectBox(bvh.m_root->bounds, origin, invdir, closest, tnear))
+                stack.push_back(std::make_pair(bvh.m_root, tnear));
+
+            while (!stack.empty())
+            {
+                Bvh::Node const* node = stack.back().first;
+                float tentry = stack.back().second;
+                stack.pop_back();
+
+                if (tentry > closest)
+                    continue;
+
+                if (visits)
+                {
+#pragma omp atomic
+                    (*visits)[node - &bvh.m_nodes[0]]++;
+                }
+
+                if (node->type == Bvh::kLeaf)
+                {
+                    for (int j = node->startidx; j < node->startidx + node->numprims; ++j)
+                    {
+                        ++primtests;
+                        if (IntersectBox(bounds[bvh.m_packed_indices[j]], origin, invdir, closest, tnear))
+                            closest = tnear;
+                    }
+                    continue;
+                }
+
+                float tl, tr;
+                nodetests += 2;
+                bool hitl = IntersectBox(bvh.m_nodes[node->lc].bounds, origin, invdir, closest, tl);
+                bool hitr = IntersectBox(bvh.m_nodes[node->rc].bounds, origin, invdir, closest, tr);
+
+                // Push the far child first so the near one is traversed next
+                if (hitl && hitr && tl < tr)
+                {
+                    stack.push_back(std::make_pair(&bvh.m_nodes[node->rc], tr));
+                    stack.push_back(std::make_pair(&bvh.m_nodes[node->lc], tl));
+                }
+                else
+                {
+                    if (hitl)
+                        stack.push_back(std::make_pair(&bvh.m_nodes[node->lc], tl));
+                    if (hitr)
+                        stack.push_back(std::make_pair(&bvh.m_nodes[node->rc], tr));
+                }
+            }
+        }
+
+        result.nodetests = (float)(nodetests / numrays);
+        result.primtests = (float)(primtests / numrays);
+        return result;
+    }
+}
@@ -0,0 +1,78 @@
+/**********************************************************************
+ Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ ********************************************************************/
+#pragma once
+
+#ifndef BVH_OPTIMIZER_H
+#define BVH_OPTIMIZER_H
+
+#include "bvh.h"
+
+namespace RadeonRays
+{
+    ///< Post build pass that lowers the SAH cost of a finished Bvh with
+    ///< treelet restructuring (Karras and Aila 2013). Every internal node
+    ///< grows a treelet of up to seven subtrees and the optimal binary tree
+    ///< over them is found by dynamic programming over subsets.
+    ///< Internal nodes are rewired in place, so the node array, the leaves
+    ///< and the packed indices stay valid for BvhTranslator.
+    class BvhOptimizer
+    {
+    public:
+        // Average work per ray for a closest hit traversal
+        struct RayCost
+        {
+            float nodetests;
+            float primtests;
+        };
+
+        BvhOptimizer(int num_passes = 3)
+            : m_num_passes(num_passes)
+        {
+        }
+
+        // Restructure treelets of bvh, subtrees are processed in parallel
+        void Optimize(Bvh& bvh) const;
+
+        // Trace a fixed set of rays from a sphere around the tree towards
+        // points inside it, primitives are approximated by their bounds.
+        // visits, if given, is sized to the node array and receives how many
+        // rays visited every node
+        static RayCost MeasureTraversalCost(Bvh const& bvh, bbox const* bounds, int numrays = 1 << 16, std::vector<int>* visits = nullptr);
+
+    private:
+        // Treelet leaves, reusable internal nodes and the per subset solution
+        struct Treelet;
+
+        static int CountPrims(Bvh::Node const* node, Bvh::Node const* nodes, std::vector<int>& numprims);
+        // Optimize the subtree under node bottom-up, fills cost with the SAH
+        // cost (not normalized) of every visited node
+        void OptimizeSubtree(Bvh& bvh, Bvh::Node* node, std::vector<float>& cost, std::vector<int>& numprims) const;
+        // Replace the treelet rooted at node with the optimal one if it is cheaper
+        void RestructureTreelet(Bvh& bvh, Bvh::Node* node, std::vector<float>& cost, std::vector<int>& numprims) const;
+        // Rewire node as the optimal tree over subset, taking internal nodes from the treelet
+        static void EmitTreelet(Treelet& treelet, unsigned subset, Bvh::Node* node, Bvh::Node const* nodes, std::vector<float>& cost, std::vector<int>& numprims);
+
+        int m_num_passes;
+    };
+}
+
+#endif // BVH_OPTIMIZER_H
@@ -0,0 +1,251 @@
+/**********************************************************************
+ Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ ********************************************************************/
+#include <algorithm>
+#include <iomanip>
+#include "bvh_stats.h"
+
+namespace RadeonRays
+{
+    // A triangle clipped by the six planes of a box has at most nine vertices
+    static const int kMaxClippedVertices = 9;
+
+    // Keep the part of polygon in on the side of the plane x[axis] = value
+    // given by sign, Sutherland-Hodgman style
+    static int ClipPolygon(Vec3 const* in, int numin, int axis, float value, float sign, Vec3* out)
+    {
+        int numout = 0;
+        for (int i = 0; i < numin; ++i)
+        {
+            Vec3 const& a = in[i];
+            Vec3 const& b = in[(i + 1) % numin];
+            float da = (a[axis] - value) * sign;
+            float db = (b[axis] - value) * sign;
+
+            if (da >= 0.f)
+                out[numout++] = a;
+
+            if ((da < 0.f) != (db < 0.f))
+                out[numout++] = a + (b - a) * (da / (da - db));
+        }
+
+        return numout;
+    }
+
+    float BvhStatistics::ClippedArea(int prim, bbox const& bounds, bbox const& clip, bbox const* primbounds, Vec3 const* triangles)
+    {
+        bbox box;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            box.pmin[axis] = std::max(bounds.pmin[axis], clip.pmin[axis]);
+            box.pmax[axis] = std::min(bounds.pmax[axis], clip.pmax[axis]);
+            if (box.pmin[axis] > box.pmax[axis])
+                return 0.f;
+        }
+
+        if (!triangles)
+        {
+            // Every face of the primitive box within the clip box contributes
+            // the rectangle it shares with it
+            bbox const& prim_box = primbounds[prim];
+            float area = 0.f;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                int u = (axis + 1) % 3;
+                int v = (axis + 2) % 3;
+                float face = std::max(std::min(prim_box.pmax[u], box.pmax[u]) - std::max(prim_box.pmin[u], box.pmin[u]), 0.f) *
+                    std::max(std::min(prim_box.pmax[v], box.pmax[v]) - std::max(prim_box.pmin[v], box.pmin[v]), 0.f);
+
+                for (int side = 0; side < 2; ++side)
+                {
+                    float plane = prim_box[side][axis];
+                    if (plane >= box.pmin[axis] && plane <= box.pmax[axis])
+                        area += face;
+                }
+            }
+
+            return area;
+        }
+
+        Vec3 polygon[2][kMaxClippedVertices];
+        int numvertices = 3;
+        polygon[0][0] = triangles[prim * 3 + 0];
+        polygon[0][1] = triangles[prim * 3 + 1];
+        polygon[0][2] = triangles[prim * 3 + 2];
+
+        int current = 0;
+        for (int axis = 0; axis < 3 && numvertices > 0; ++axis)
+        {
+            numvertices = ClipPolygon(polygon[current], numvertices, axis, box.pmin[axis], 1.f, polygon[1 - current]);
+            current = 1 - current;
+            numvertices = ClipPolygon(polygon[current], numvertices, axis, box.pmax[axis], -1.f, polygon[1 - current]);
+            current = 1 - current;
+        }
+
+        Vec3 normal(0.f, 0.f, 0.f);
+        for (int i = 1; i + 1 < numvertices; ++i)
+            normal = normal + Vec3::Cross(polygon[current][i] - polygon[current][0], polygon[current][i + 1] - polygon[current][0]);
+
+        return 0.5f * Vec3::Length(normal);
+    }
+
+    BvhStatistics::BvhStatistics(Bvh const& bvh, bbox const* bounds, int numbounds, Vec3 const* triangles)
+    {
+        numprims = numbounds;
+        numrefs = (int)bvh.m_packed_indices.size();
+        nodebytes = bvh.m_nodecnt * sizeof(Bvh::Node);
+        indexbytes = numrefs * sizeof(int);
+
+        if (!bvh.m_root || numprims == 0)
+            return;
+
+        sahcost = bvh.GetSahCost();
+
+        // Preorder walk: a subtree covers the preorder range [first[n], last[n])
+        std::vector<Bvh::Node const*> order;
+        std::vector<int> first(bvh.m_nodes.size());
+        std::vector<int> last(bvh.m_nodes.size());
+        // Leaves referencing each primitive, more than one with spatial splits
+        std::vector<std::vector<int>> primleaves(numprims);
+
+        struct Entry
+        {
+            Bvh::Node const* node;
+            int depth;
+            bool done;
+        };
+
+        std::vector<Entry> stack = { { bvh.m_root, 0, false } };
+        double sumleafdepth = 0.0;
+        while (!stack.empty())
+        {
+            Entry entry = stack.back();
+            stack.pop_back();
+
+            int nodeidx = (int)(entry.node - &bvh.m_nodes[0]);
+            if (entry.done)
+            {
+                last[nodeidx] = (int)order.size();
+                continue;
+            }
+
+            first[nodeidx] = (int)order.size();
+            order.push_back(entry.node);
+            maxdepth = std::max(maxdepth, entry.depth);
+
+            if (entry.node->type == Bvh::kLeaf)
+            {
+                last[nodeidx] = (int)order.size();
+                ++numleaves;
+                sumleafdepth += entry.depth;
+
+                if ((int)leafhistogram.size() <= entry.node->numprims)
+                    leafhistogram.resize(entry.node->numprims + 1);
+                ++leafhistogram[entry.node->numprims];
+
+                for (int i = 0; i < entry.node->numprims; ++i)
+                    primleaves[bvh.m_packed_indices[entry.node->startidx + i]].push_back(first[nodeidx]);
+            }
+            else
+            {
+                stack.push_back({ entry.node, entry.depth, true });
+                stack.push_back({ &bvh.m_nodes[entry.node->rc], entry.depth + 1, false });
+                stack.push_back({ &bvh.m_nodes[entry.node->lc], entry.depth + 1, false });
+            }
+        }
+
+        numnodes = (int)order.size();
+        avgleafdepth = (float)(sumleafdepth / numleaves);
+
+        double totalarea = 0.0;
+        for (int i = 0; i < numprims; ++i)
+            totalarea += ClippedArea(i, bounds[i], bounds[i], bounds, triangles);
+
+        if (totalarea <= 0.0)
+            return;
+
+        // For every node find the geometry outside its subtree by querying the
+        // tree with the node bounds. References are clipped to their leaf, the
+        // part of a split primitive other leaves hold is accounted there
+        double overlap = 0.0;
+#pragma omp parallel for schedule(dynamic, 64) reduction(+:overlap)
+        for (int i = 1; i < numnodes; ++i)
+        {
+            Bvh::Node const* node = order[i];
+            int nodeidx = (int)(node - &bvh.m_nodes[0]);
+            double area = 0.0;
+
+            std::vector<Bvh::Node const*> query = { bvh.m_root };
+            while (!query.empty())
+            {
+                Bvh::Node const* other = query.back();
+                query.pop_back();
+
+                if (other == node || !intersects(other->bounds, node->bounds))
+                    continue;
+
+                if (other->type == Bvh::kInternal)
+                {
+                    query.push_back(&bvh.m_nodes[other->lc]);
+                    query.push_back(&bvh.m_nodes[other->rc]);
+                    continue;
+                }
+
+                for (int j = 0; j < other->numprims; ++j)
+                {
+                    int prim = bvh.m_packed_indices[other->startidx + j];
+
+                    bool inside = false;
+                    for (int leaf : primleaves[prim])
+                        inside = inside || (leaf >= first[nodeidx] && leaf < last[nodeidx]);
+
+                    if (!inside)
+                        area += ClippedArea(prim, node->bounds, other->bounds, bounds, triangles);
+                }
+            }
+
+            overlap += area * (node->type == Bvh::kLeaf ? node->numprims : bvh.m_traversal_cost);
+        }
+
+        epo = (float)(overlap / totalarea);
+    }
+
+    void BvhStatistics::WriteJson(std::ostream& os, std::string const& indent) const
+    {
+        os << "{\n";
+        os << indent << "  \"sahCost\": " << sahcost << ",\n";
+        os << indent << "  \"epo\": " << epo << ",\n";
+        os << indent << "  \"primitives\": " << numprims << ",\n";
+        os << indent << "  \"references\": " << numrefs << ",\n";
+        os << indent << "  \"duplicationFactor\": " << (numprims > 0 ? (float)numrefs / numprims : 0.f) << ",\n";
+        os << indent << "  \"nodes\": " << numnodes << ",\n";
+        os << indent << "  \"leaves\": " << numleaves << ",\n";
+        os << indent << "  \"maxDepth\": " << maxdepth << ",\n";
+        os << indent << "  \"avgLeafDepth\": " << avgleafdepth << ",\n";
+        os << indent << "  \"leafPrimitiveHistogram\": [";
+        for (size_t i = 0; i < leafhistogram.size(); ++i)
+            os << (i > 0 ? ", " : "") << leafhistogram[i];
+        os << "],\n";
+        os << indent << "  \"nodeBytes\": " << nodebytes << ",\n";
+        os << indent << "  \"indexBytes\": " << indexbytes << "\n";
+        os << indent << "}";
+    }
+}
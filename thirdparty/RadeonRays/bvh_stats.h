@@ -0,0 +1,69 @@
+/**********************************************************************
+ Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ ********************************************************************/
+#pragma once
+
+#ifndef BVH_STATS_H
+#define BVH_STATS_H
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include "bvh.h"
+
+namespace RadeonRays
+{
+    ///< Quality report of a built Bvh. Besides the SAH cost it measures the
+    ///< end-point overlap (EPO, Aila et al. 2013): the surface area of geometry
+    ///< that lies inside a node without belonging to its subtree, weighted like
+    ///< the SAH and normalized by the total surface area of the geometry. Rays
+    ///< hitting that geometry traverse the node for nothing, so EPO tracks
+    ///< traversal cost better than SAH for trees with overlapping siblings.
+    class BvhStatistics
+    {
+    public:
+        // triangles holds three vertices per primitive in build order. Without
+        // them primitives are taken to be their bounding boxes, as for a TLAS
+        BvhStatistics(Bvh const& bvh, bbox const* bounds, int numbounds, Vec3 const* triangles = nullptr);
+
+        // Write the report as a JSON object, indent prefixes every line after the first
+        void WriteJson(std::ostream& os, std::string const& indent) const;
+
+        float sahcost = 0.f;
+        float epo = 0.f;
+        int numprims = 0;
+        int numrefs = 0;
+        int numnodes = 0;
+        int numleaves = 0;
+        int maxdepth = 0;
+        float avgleafdepth = 0.f;
+        // Number of leaves per primitive count
+        std::vector<int> leafhistogram;
+        size_t nodebytes = 0;
+        size_t indexbytes = 0;
+
+    private:
+        // Area of primitive prim inside both boxes
+        static float ClippedArea(int prim, bbox const& bounds, bbox const& clip, bbox const* primbounds, Vec3 const* triangles);
+    };
+}
+
+#endif // BVH_STATS_H
@@ -22,100 +22,806 @@ THE SOFTWARE.
 
 //	Modified version of code from https://github.com/GPUOpen-LibrariesAndSDKs/RadeonRays_SDK 
 
+#include <algorithm>
+#include <numeric>
 #include <cassert>
+#include <cmath>
+#include <cstring>
 #include <stack>
 #include <iostream>
 #include "bvh_translator.h"
+#include "bvh_optimizer.h"
 
 namespace RadeonRays
 {
-    int BvhTranslator::ProcessBLASNodes(const Bvh::Node* node)
+    // Nodes per cluster of the visit frequency layout, about one 128 byte cache line
+    static const int kFrequencyClusterSize = 4;
+
+    const char* BvhTranslator::GetNodeLayoutName(NodeLayout layout)
+    {
+        switch (layout)
+        {
+        case NodeLayout::kDepthFirst: return "dfs";
+        case NodeLayout::kLargerChildFirst: return "sah";
+        case NodeLayout::kVanEmdeBoas: return "veb";
+        case NodeLayout::kVisitFrequency: return "frequency";
+        }
+        return "unknown";
+    }
+
+    void BvhTranslator::FlattenPrimitives(const Bvh* bvh, std::vector<Node>& nodes)
     {
-        RadeonRays::bbox bbox = node->bounds;
+        // Depth first, children are placed together when their parent is visited
+        std::vector<std::pair<const Bvh::Node*, int>> stack = { { bvh->m_root, 0 } };
+        nodes.assign(1, Node());
+        while (!stack.empty())
+        {
+            const Bvh::Node* node = stack.back().first;
+            int index = stack.back().second;
+            stack.pop_back();
 
-        nodes[curNode].bboxmin = bbox.pmin;
-        nodes[curNode].bboxmax = bbox.pmax;
-        nodes[curNode].LRLeaf.z = 0;
+            nodes[index].bboxmin = node->bounds.pmin;
+            nodes[index].bboxmax = node->bounds.pmax;
+            if (node->type == Bvh::NodeType::kLeaf)
+            {
+                assert(node->numprims == 1);
+                nodes[index].LRLeaf = Vec3(bvh->m_packed_indices[node->startidx], 0, 1);
+                continue;
+            }
 
-        int index = curNode;
+            int left = nodes.size();
+            nodes[index].LRLeaf = Vec3(left, left + 1, 0);
+            nodes.resize(left + 2);
+            stack.push_back({ &bvh->m_nodes[node->lc], left });
+            stack.push_back({ &bvh->m_nodes[node->rc], left + 1 });
+        }
+    }
+
+    void BvhTranslator::OrderDepthFirst(const Bvh* bvh, bool largerFirst, std::vector<const Bvh::Node*>& order)
+    {
+        std::vector<const Bvh::Node*> stack = { bvh->m_root };
+        while (!stack.empty())
+        {
+            const Bvh::Node* node = stack.back();
+            stack.pop_back();
+            order.push_back(node);
+
+            if (node->type == RadeonRays::Bvh::NodeType::kInternal)
+            {
+                const Bvh::Node* left = &bvh->m_nodes[node->lc];
+                const Bvh::Node* right = &bvh->m_nodes[node->rc];
+                bool swap = largerFirst && right->bounds.surface_area() > left->bounds.surface_area();
+                stack.push_back(swap ? left : right);
+                stack.push_back(swap ? right : left);
+            }
+        }
+    }
 
+    void BvhTranslator::OrderVanEmdeBoas(const Bvh* bvh, const Bvh::Node* node, int levels, std::vector<const Bvh::Node*>& order, std::vector<const Bvh::Node*>& frontier)
+    {
         if (node->type == RadeonRays::Bvh::NodeType::kLeaf)
         {
-            nodes[curNode].LRLeaf.x = curTriIndex + node->startidx;
-            nodes[curNode].LRLeaf.y = node->numprims;
-            nodes[curNode].LRLeaf.z = 1;
+            order.push_back(node);
+            return;
         }
-        else
+
+        if (levels == 1)
         {
-            curNode++;
-            nodes[index].LRLeaf.x = ProcessBLASNodes(node->lc);
-            curNode++;
-            nodes[index].LRLeaf.y = ProcessBLASNodes(node->rc);
+            order.push_back(node);
+            frontier.push_back(&bvh->m_nodes[node->lc]);
+            frontier.push_back(&bvh->m_nodes[node->rc]);
+            return;
         }
+
+        // The top half of the levels comes first, then every subtree below it
+        int top = levels / 2;
+        std::vector<const Bvh::Node*> bottomRoots;
+        OrderVanEmdeBoas(bvh, node, top, order, bottomRoots);
+
+        for (const Bvh::Node* root : bottomRoots)
+            OrderVanEmdeBoas(bvh, root, levels - top, order, frontier);
+    }
+
+    void BvhTranslator::OrderByFrequency(const Bvh* bvh, const std::vector<int>& visits, std::vector<const Bvh::Node*>& order)
+    {
+        // Ties (mostly nodes no sampled ray reached) go to the larger node
+        auto lessVisited = [bvh, &visits](const Bvh::Node* a, const Bvh::Node* b)
+        {
+            int va = visits[a - &bvh->m_nodes[0]];
+            int vb = visits[b - &bvh->m_nodes[0]];
+            return va != vb ? va < vb : a->bounds.surface_area() < b->bounds.surface_area();
+        };
+
+        // A ray at an internal node reads the bounds of both children, so
+        // siblings are always stored next to each other. Every cluster grows
+        // from a parent by placing the children of the most visited node whose
+        // children are not placed yet (Yoon and Manocha 2006). Nodes left over
+        // start new clusters, the most visited one is laid out next
+        order.push_back(bvh->m_root);
+        std::vector<const Bvh::Node*> parents;
+        std::vector<const Bvh::Node*> candidates;
+        if (bvh->m_root->type == RadeonRays::Bvh::NodeType::kInternal)
+            parents.push_back(bvh->m_root);
+
+        while (!parents.empty())
+        {
+            candidates.assign(1, parents.back());
+            parents.pop_back();
+
+            for (int size = 0; size < kFrequencyClusterSize && !candidates.empty(); size += 2)
+            {
+                auto best = std::max_element(candidates.begin(), candidates.end(), lessVisited);
+                const Bvh::Node* node = *best;
+                candidates.erase(best);
+
+                const Bvh::Node* left = &bvh->m_nodes[node->lc];
+                const Bvh::Node* right = &bvh->m_nodes[node->rc];
+                bool swap = lessVisited(left, right);
+                for (const Bvh::Node* child : { swap ? right : left, swap ? left : right })
+                {
+                    order.push_back(child);
+                    if (child->type == RadeonRays::Bvh::NodeType::kInternal)
+                        candidates.push_back(child);
+                }
+            }
+
+            std::sort(candidates.begin(), candidates.end(), lessVisited);
+            parents.insert(parents.end(), candidates.begin(), candidates.end());
+        }
+    }
+
+    void BvhTranslator::OrderNodes(const GLSLPT::Mesh* mesh, std::vector<const Bvh::Node*>& order) const
+    {
+        const Bvh* bvh = mesh->bvh;
+        order.clear();
+        order.reserve(bvh->m_nodecnt);
+
+        // Visits are counted with rays against triangles, groups have none
+        NodeLayout meshLayout = mesh->IsGroup() && layout == NodeLayout::kVisitFrequency ? NodeLayout::kDepthFirst : layout;
+
+        switch (meshLayout)
+        {
+        case NodeLayout::kDepthFirst:
+        case NodeLayout::kLargerChildFirst:
+            OrderDepthFirst(bvh, meshLayout == NodeLayout::kLargerChildFirst, order);
+            break;
+        case NodeLayout::kVanEmdeBoas:
+        {
+            // Count the levels of the tree, which may be deeper than a balanced one
+            int levels = 0;
+            std::vector<std::pair<const Bvh::Node*, int>> stack = { { bvh->m_root, 1 } };
+            while (!stack.empty())
+            {
+                const Bvh::Node* node = stack.back().first;
+                int level = stack.back().second;
+                stack.pop_back();
+                levels = std::max(levels, level);
+
+                if (node->type == RadeonRays::Bvh::NodeType::kInternal)
+                {
+                    stack.push_back({ &bvh->m_nodes[node->lc], level + 1 });
+                    stack.push_back({ &bvh->m_nodes[node->rc], level + 1 });
+                }
+            }
+
+            std::vector<const Bvh::Node*> frontier;
+            OrderVanEmdeBoas(bvh, bvh->m_root, levels, order, frontier);
+            assert(frontier.empty());
+            break;
+        }
+        case NodeLayout::kVisitFrequency:
+        {
+            std::vector<bbox> bounds;
+            std::vector<int> visits;
+            mesh->GetTriangleBounds(bounds);
+            BvhOptimizer::MeasureTraversalCost(*bvh, bounds.data(), 1 << 16, &visits);
+            OrderByFrequency(bvh, visits, order);
+            break;
+        }
+        }
+    }
+
+    void BvhTranslator::ProcessBLASNodes(int mesh, int rootIndex, int triIndex)
+    {
+        const Bvh* bvh = meshes[mesh]->bvh;
+        std::vector<const Bvh::Node*> order;
+        OrderNodes(meshes[mesh], order);
+        assert(order.size() == bvh->m_nodecnt);
+
+        std::vector<int>& position = blasEntryIndices[mesh];
+        position.assign(bvh->m_nodes.size(), -1);
+        for (int i = 0; i < order.size(); i++)
+            position[order[i] - &bvh->m_nodes[0]] = rootIndex + i;
+
+        for (int i = 0; i < order.size(); i++)
+        {
+            const Bvh::Node* node = order[i];
+            Node& flat = nodes[rootIndex + i];
+            flat.bboxmin = node->bounds.pmin;
+            flat.bboxmax = node->bounds.pmax;
+
+            if (node->type == RadeonRays::Bvh::NodeType::kLeaf && meshes[mesh]->IsGroup())
+            {
+                // Single member leaves, written like TLAS leaves so a ray enters
+                // the member's BLAS with the member's transform on top of the group's
+                int member = bvh->m_packed_indices[node->startidx];
+                const GLSLPT::MeshInstance& instance = meshes[mesh]->groupInstances[member];
+                flat.LRLeaf = Vec3(bvhRootStartIndices[instance.meshID], instance.materialID, -(groupInstanceStarts[mesh] + member) - 1);
+            }
+            else if (node->type == RadeonRays::Bvh::NodeType::kLeaf)
+                flat.LRLeaf = Vec3(triIndex + node->startidx, node->numprims, 1);
+            else
+                flat.LRLeaf = Vec3(position[node->lc], position[node->rc], 0);
+        }
+    }
+
+    void BvhTranslator::ProcessTLASNodes(const Bvh::Node* root)
+    {
+        // Preorder with the left child first, the child indices of a node are
+        // filled in when its children are reached
+        int curNode = topLevelIndex;
+        std::vector<PendingNode> stack = { { root, -1, 0 } };
+
+        while (!stack.empty())
+        {
+            PendingNode pending = stack.back();
+            stack.pop_back();
+
+            const Bvh::Node* node = pending.node;
+            int index = curNode++;
+            tlasNodeIndices[node - &topLevelBvh->m_nodes[0]] = index;
+            if (pending.parent >= 0)
+                (pending.slot == 0 ? nodes[pending.parent].LRLeaf.x : nodes[pending.parent].LRLeaf.y) = index;
+
+            nodes[index].bboxmin = node->bounds.pmin;
+            nodes[index].bboxmax = node->bounds.pmax;
+
+            if (node->type == RadeonRays::Bvh::NodeType::kLeaf)
+            {
+                int entryIndex, materialID, instanceIndex;
+                GetTLASLeaf(node, entryIndex, materialID, instanceIndex);
+
+                nodes[index].LRLeaf = Vec3(entryIndex, materialID, -instanceIndex - 1);
+            }
+            else
+            {
+                nodes[index].LRLeaf = Vec3(0, 0, 0);
+                stack.push_back({ &topLevelBvh->m_nodes[node->rc], index, 1 });
+                stack.push_back({ &topLevelBvh->m_nodes[node->lc], index, 0 });
+            }
+        }
+    }
+
+    int BvhTranslator::GetSplitCode(int node) const
+    {
+        const Node& left = nodes[(int)nodes[node].LRLeaf.x];
+        const Node& right = nodes[(int)nodes[node].LRLeaf.y];
+        Vec3 offset = (right.bboxmin + right.bboxmax) - (left.bboxmin + left.bboxmax);
+
+        int axis = 0;
+        for (int i = 1; i < 3; i++)
+        {
+            if (std::abs(offset[i]) > std::abs(offset[axis]))
+                axis = i;
+        }
+        return axis | (offset[axis] < 0.0f ? 4 : 0);
+    }
+
+    void BvhTranslator::ProcessLinks(int root)
+    {
+        links[root] = 0;
+
+        std::vector<int> stack = { root };
+        while (!stack.empty())
+        {
+            int index = stack.back();
+            stack.pop_back();
+
+            // BLAS and TLAS leaves alike, a TLAS leaf points into another tree
+            const Vec3& LRLeaf = nodes[index].LRLeaf;
+            if (LRLeaf.z != 0.0f)
+                continue;
+
+            links[index] = (links[index] & ~7) | GetSplitCode(index);
+            for (int child : { (int)LRLeaf.x, (int)LRLeaf.y })
+            {
+                links[child] = (index + 1) << 3;
+                stack.push_back(child);
+            }
+        }
+    }
+
+    Vec3& BvhTranslator::WideTexel(std::vector<Node>& wideNodes, int node, int texel) const
+    {
+        static_assert(sizeof(Node) == 3 * sizeof(Vec3), "wide nodes address Node entries as texels");
+        return (&wideNodes[node * width].bboxmin)[texel];
+    }
+
+    int BvhTranslator::AllocateWideNode(std::vector<Node>& wideNodes) const
+    {
+        int index = (int)(wideNodes.size() / width);
+        wideNodes.resize(wideNodes.size() + width);
+
+        // Unused slots are never read, mark them anyway to ease debugging
+        for (int i = 0; i < width; i++)
+        {
+            WideTexel(wideNodes, index, i) = Vec3(0.0f, 0.0f, 0.0f);
+            WideTexel(wideNodes, index, width + i) = Vec3(0.0f, 0.0f, 0.0f);
+            WideTexel(wideNodes, index, 2 * width + i) = Vec3(-1.0f, 0.0f, 0.0f);
+        }
+
         return index;
     }
 
-    int BvhTranslator::ProcessTLASNodes(const Bvh::Node* node)
+    void BvhTranslator::ProcessWideChild(const FlattenTarget& target, int node, int slot, const Bvh::Node* child, std::vector<PendingNode>& pending) const
+    {
+        // Records of internal children are written once their wide node is allocated
+        Vec3 LRLeaf(-1.0f, 0.0f, 0.0f);
+
+        if (child->type == RadeonRays::Bvh::NodeType::kLeaf)
+        {
+            if (target.topLevel)
+            {
+                int entryIndex, materialID, instanceIndex;
+                GetTLASLeaf(child, entryIndex, materialID, instanceIndex);
+
+                LRLeaf = Vec3(entryIndex, materialID, -instanceIndex - 1);
+            }
+            else
+                LRLeaf = Vec3(target.triIndex + child->startidx, child->numprims, 1);
+        }
+        else
+            pending.push_back({ child, node, slot });
+
+        if (!target.topLevel)
+            (*target.entryIndices)[child - &target.bvh->m_nodes[0]] = node * width + slot;
+
+        std::vector<Node>& wideNodes = *target.nodes;
+        WideTexel(wideNodes, node, slot) = child->bounds.pmin;
+        WideTexel(wideNodes, node, width + slot) = child->bounds.pmax;
+        WideTexel(wideNodes, node, 2 * width + slot) = LRLeaf;
+    }
+
+    int BvhTranslator::CollectWideChildren(const Bvh* bvh, const Bvh::Node* root, const Bvh::Node** children) const
     {
-        RadeonRays::bbox bbox = node->bounds;
+        // Pull the binary descendants with the largest area up into the wide node
+        children[0] = &bvh->m_nodes[root->lc];
+        children[1] = &bvh->m_nodes[root->rc];
+        int numChildren = 2;
 
-        nodes[curNode].bboxmin = bbox.pmin;
-        nodes[curNode].bboxmax = bbox.pmax;
-        nodes[curNode].LRLeaf.z = 0;
+        while (numChildren < width)
+        {
+            int best = -1;
+            float bestArea = -1.0f;
+            for (int i = 0; i < numChildren; i++)
+            {
+                float area = children[i]->bounds.surface_area();
+                if (children[i]->type == RadeonRays::Bvh::NodeType::kInternal && area > bestArea)
+                {
+                    best = i;
+                    bestArea = area;
+                }
+            }
 
-        int index = curNode;
+            if (best == -1)
+                break;
 
-        if (node->type == RadeonRays::Bvh::NodeType::kLeaf)
+            const Bvh::Node* expanded = children[best];
+            children[best] = &bvh->m_nodes[expanded->lc];
+            children[numChildren++] = &bvh->m_nodes[expanded->rc];
+        }
+
+        return numChildren;
+    }
+
+    int BvhTranslator::ProcessWideRoot(const FlattenTarget& target, const Bvh::Node* root) const
+    {
+        std::vector<Node>& wideNodes = *target.nodes;
+        std::vector<PendingNode> pending;
+
+        int entry = AllocateWideNode(wideNodes);
+        ProcessWideChild(target, entry, 0, root, pending);
+
+        while (!pending.empty())
+        {
+            PendingNode child = pending.back();
+            pending.pop_back();
+
+            const Bvh::Node* children[8];
+            int numChildren = CollectWideChildren(target.bvh, child.node, children);
+            int index = AllocateWideNode(wideNodes);
+            WideTexel(wideNodes, child.parent, 2 * width + child.slot) = Vec3(index, numChildren, 0);
+
+            // Queued children are reversed so wide nodes are allocated in depth first order
+            size_t first = pending.size();
+            for (int i = 0; i < numChildren; i++)
+                ProcessWideChild(target, index, i, children[i], pending);
+            std::reverse(pending.begin() + first, pending.end());
+        }
+
+        return entry * width;
+    }
+
+    int BvhTranslator::GetQuantizedBodySize() const
+    {
+        // 6 bytes of child bounds and, for all but the first child, 4 bytes of child index
+        return (width * 3 / 2 + width - 1 + 3) / 4;
+    }
+
+    // Smallest offset q in [0, 255] for which origin + q * scale does not exceed
+    // value. The decoded sum is rounded to float just like in the shader
+    static unsigned int QuantizeMin(float value, float origin, float scale)
+    {
+        float q = std::min(std::max(std::floor((value - origin) / scale), 0.0f), 255.0f);
+        while (q > 0.0f && origin + q * scale > value)
+            q -= 1.0f;
+        return (unsigned int)q;
+    }
+
+    static unsigned int QuantizeMax(float value, float origin, float scale)
+    {
+        float q = std::min(std::max(std::ceil((value - origin) / scale), 0.0f), 255.0f);
+        while (q < 255.0f && origin + q * scale < value)
+            q += 1.0f;
+        return (unsigned int)q;
+    }
+
+    // Child index of slot in the body of the quantized node at node, slot 0
+    // has none since the first child directly follows the body
+    static unsigned char* QuantizedChildIndex(std::vector<BvhTranslator::QuantizedTexel>& texels, int node, int width, int slot)
+    {
+        return reinterpret_cast<unsigned char*>(&texels[node + 1]) + (width * 3 / 2 + slot - 1) * sizeof(unsigned int);
+    }
+
+    int BvhTranslator::ProcessQuantizedNodes(const FlattenTarget& target, const Bvh::Node* root) const
+    {
+        std::vector<QuantizedTexel>& texels = *target.quantizedNodes;
+        int rootIndex = (int)texels.size();
+        int bodySize = GetQuantizedBodySize();
+
+        // Depth first with the first child first, the child indices in the body
+        // of a node are filled in when its children are reached
+        std::vector<PendingNode> pending = { { root, -1, 0 } };
+
+        while (!pending.empty())
         {
-            int instanceIndex = topLevelBvh->m_packed_indices[node->startidx];
-            int meshIndex = meshInstances[instanceIndex].meshID;
-            int materialID = meshInstances[instanceIndex].materialID;
+            PendingNode item = pending.back();
+            pending.pop_back();
+
+            const Bvh::Node* node = item.node;
+            int index = (int)texels.size();
+            assert(item.parent < 0 || item.slot > 0 || index == item.parent + 1 + bodySize);
+            if (item.parent >= 0 && item.slot > 0)
+            {
+                unsigned int child = index;
+                std::memcpy(QuantizedChildIndex(texels, item.parent, width, item.slot), &child, sizeof(child));
+            }
+
+            if (!target.topLevel)
+                (*target.entryIndices)[node - &target.bvh->m_nodes[0]] = index;
+
+            if (node->type == RadeonRays::Bvh::NodeType::kLeaf)
+            {
+                QuantizedTexel leaf;
+
+                if (target.topLevel)
+                {
+                    int entryIndex, materialID, instanceIndex;
+                    GetTLASLeaf(node, entryIndex, materialID, instanceIndex);
+
+                    leaf = { (unsigned int)entryIndex, (unsigned int)materialID, (unsigned int)instanceIndex, kQuantizedTlasLeaf << 24 };
+                }
+                else
+                    leaf = { (unsigned int)(target.triIndex + node->startidx), (unsigned int)node->numprims, 0, kQuantizedBlasLeaf << 24 };
 
-            nodes[curNode].LRLeaf.x = bvhRootStartIndices[meshIndex];
-            nodes[curNode].LRLeaf.y = materialID;
-            nodes[curNode].LRLeaf.z = -instanceIndex - 1;
+                texels.push_back(leaf);
+                continue;
+            }
+
+            const Bvh::Node* children[8];
+            int numChildren = CollectWideChildren(target.bvh, node, children);
+
+            // Frame of the node: its bounds minimum and per axis the smallest power
+            // of two scale for which 255 steps reach its bounds maximum
+            unsigned int header[4];
+            float scale[3];
+            std::memcpy(header, &node->bounds.pmin, 3 * sizeof(float));
+            header[3] = (kQuantizedInternal << 24) | ((unsigned int)numChildren << 28);
+
+            for (int axis = 0; axis < 3; axis++)
+            {
+                float origin = node->bounds.pmin[axis];
+                float extent = node->bounds.pmax[axis] - origin;
+
+                int exponent;
+                std::frexp(extent / 255.0f, &exponent);
+                int biased = std::min(std::max(exponent + 127, 1), 254);
+                while (biased < 254 && origin + 255.0f * std::ldexp(1.0f, biased - 127) < node->bounds.pmax[axis])
+                    biased++;
+
+                scale[axis] = std::ldexp(1.0f, biased - 127);
+                header[3] |= biased << (axis * 8);
+            }
+
+            // Bytes 2 * slot and 2 * slot + 1 of the width / 2 words of an axis hold
+            // the offsets of the bounds minimum and maximum of a child
+            unsigned int body[20] = {};
+            for (int i = 0; i < numChildren; i++)
+            {
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    float origin = node->bounds.pmin[axis];
+                    unsigned int qmin = QuantizeMin(children[i]->bounds.pmin[axis], origin, scale[axis]);
+                    unsigned int qmax = QuantizeMax(children[i]->bounds.pmax[axis], origin, scale[axis]);
+                    body[axis * width / 2 + i / 2] |= (qmin | (qmax << 8)) << (i % 2 * 16);
+                }
+            }
+
+            texels.resize(index + 1 + bodySize);
+            std::memcpy(&texels[index], header, sizeof(header));
+            std::memcpy(&texels[index + 1], body, bodySize * sizeof(QuantizedTexel));
+
+            for (int i = numChildren - 1; i >= 0; i--)
+                pending.push_back({ children[i], index, i });
+        }
+
+        return rootIndex;
+    }
+
+    int BvhTranslator::GetEntryChildren(const Bvh* bvh, int node, int* children) const
+    {
+        // Every layout flattens the children CollectWideChildren picks, which
+        // are just the two binary children at width 2
+        const Bvh::Node* entry = &bvh->m_nodes[node];
+        if (entry->type == RadeonRays::Bvh::NodeType::kLeaf)
+            return 0;
+
+        const Bvh::Node* wideChildren[8];
+        int numChildren = CollectWideChildren(bvh, entry, wideChildren);
+        for (int i = 0; i < numChildren; i++)
+            children[i] = (int)(wideChildren[i] - &bvh->m_nodes[0]);
+        return numChildren;
+    }
+
+    void BvhTranslator::GetTLASLeaf(const Bvh::Node* leaf, int& entryIndex, int& materialID, int& instanceIndex) const
+    {
+        GetTopLevelLeaf(topLevelBvh->m_packed_indices[leaf->startidx], entryIndex, materialID, instanceIndex);
+    }
+
+    void BvhTranslator::GetTopLevelLeaf(int primitive, int& entryIndex, int& materialID, int& instanceIndex) const
+    {
+        if (topLevelEntries.empty())
+        {
+            instanceIndex = primitive;
+            entryIndex = bvhRootStartIndices[meshInstances[instanceIndex].meshID];
         }
         else
         {
-            curNode++;
-            nodes[index].LRLeaf.x = ProcessTLASNodes(node->lc);
-            curNode++;
-            nodes[index].LRLeaf.y = ProcessTLASNodes(node->rc);
+            const InstanceEntry& entry = topLevelEntries[primitive];
+            int meshIndex = meshInstances[entry.instance].meshID;
+
+            instanceIndex = entry.instance;
+            entryIndex = blasEntryIndices[meshIndex][entry.node];
+            assert(entryIndex != -1);
+        }
+
+        materialID = meshInstances[instanceIndex].materialID;
+    }
+
+    void BvhTranslator::GetBLASNodeRange(int mesh, int& first, int& count) const
+    {
+        assert(width == 2 && !quantized);
+        first = bvhRootStartIndices[mesh];
+        int end = mesh + 1 < bvhRootStartIndices.size() ? bvhRootStartIndices[mesh + 1] : topLevelStart;
+        count = end - first;
+    }
+
+    void BvhTranslator::ProcessBlockBLAS(const std::vector<int>& triIndices)
+    {
+        int numMeshes = (int)meshes.size();
+        std::vector<std::vector<Node>> wideBlocks(quantized ? 0 : numMeshes);
+        std::vector<std::vector<QuantizedTexel>> quantizedBlocks(quantized ? numMeshes : 0);
+
+        // The size of a collapsed tree is only known once it is built, so every
+        // mesh gets its own block with indices starting at 0
+#pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < numMeshes; i++)
+        {
+            const Bvh* bvh = meshes[i]->bvh;
+            if (!bvh)
+            {
+                blasEntryIndices[i].clear();
+                continue;
+            }
+            blasEntryIndices[i].assign(bvh->m_nodes.size(), -1);
+
+            // Size of a balanced tree, where every wide node takes width - 1 binary internal nodes
+            int numInternal = bvh->m_nodecnt / 2;
+            if (quantized)
+                quantizedBlocks[i].reserve(numInternal + 1 + numInternal / (width - 1) * (1 + GetQuantizedBodySize()));
+            else
+                wideBlocks[i].reserve((numInternal / (width - 1) + 2) * width);
+
+            FlattenTarget target = { bvh, false, triIndices[i], &blasEntryIndices[i],
+                quantized ? nullptr : &wideBlocks[i], quantized ? &quantizedBlocks[i] : nullptr };
+            bvhRootStartIndices[i] = quantized ? ProcessQuantizedNodes(target, bvh->m_root) : ProcessWideRoot(target, bvh->m_root);
+        }
+
+        std::vector<int> blockStarts(numMeshes);
+        int count = 0;
+        for (int i = 0; i < numMeshes; i++)
+        {
+            blockStarts[i] = count;
+            count += (int)(quantized ? quantizedBlocks[i].size() : wideBlocks[i].size());
+        }
+
+        if (quantized)
+            quantizedNodes.resize(count);
+        else
+            nodes.resize(count);
+
+        // Move every block into place, shifting the node indices it holds
+        int bodySize = GetQuantizedBodySize();
+#pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < numMeshes; i++)
+        {
+            // Traversal indices count texels in the quantized layout and child records in the wide one
+            int offset = blockStarts[i];
+            bvhRootStartIndices[i] += offset;
+            for (int& index : blasEntryIndices[i])
+            {
+                if (index != -1)
+                    index += offset;
+            }
+
+            if (quantized)
+            {
+                std::vector<QuantizedTexel>& block = quantizedBlocks[i];
+                for (int node = 0; node < (int)block.size(); )
+                {
+                    unsigned int w = block[node].w;
+                    if (((w >> 24) & 0xf) != kQuantizedInternal)
+                    {
+                        node++;
+                        continue;
+                    }
+
+                    for (int slot = 1; slot < (int)(w >> 28); slot++)
+                    {
+                        unsigned int child;
+                        unsigned char* bytes = QuantizedChildIndex(block, node, width, slot);
+                        std::memcpy(&child, bytes, sizeof(child));
+                        child += offset;
+                        std::memcpy(bytes, &child, sizeof(child));
+                    }
+                    node += 1 + bodySize;
+                }
+
+                std::copy(block.begin(), block.end(), quantizedNodes.begin() + offset);
+                std::vector<QuantizedTexel>().swap(block);
+            }
+            else
+            {
+                // Child records of internal nodes hold a wide node, unused slots -1
+                std::vector<Node>& block = wideBlocks[i];
+                int numWideNodes = (int)block.size() / width;
+                for (int node = 0; node < numWideNodes; node++)
+                {
+                    for (int slot = 0; slot < width; slot++)
+                    {
+                        Vec3& LRLeaf = WideTexel(block, node, 2 * width + slot);
+                        if (LRLeaf.z == 0 && LRLeaf.x >= 0)
+                            LRLeaf.x += offset / width;
+                    }
+                }
+
+                std::copy(block.begin(), block.end(), nodes.begin() + offset);
+                std::vector<Node>().swap(block);
+            }
         }
-        return index;
     }
 
     void BvhTranslator::ProcessBLAS()
     {
+        int numMeshes = (int)meshes.size();
+        bvhRootStartIndices.assign(numMeshes, 0);
+        blasEntryIndices.resize(numMeshes);
+        int numEntries = (int)(topLevelEntries.empty() ? meshInstances.size() : topLevelEntries.size());
+
+        std::vector<int> triIndices(numMeshes);
+        groupInstanceStarts.assign(numMeshes, 0);
+        int numIndices = 0;
+        int numTransforms = (int)meshInstances.size();
+        for (int i = 0; i < numMeshes; i++)
+        {
+            // Groups index their members, which have no triangles in the scene buffers,
+            // and meshes without a BVH were baked into the merged mesh
+            triIndices[i] = numIndices;
+            groupInstanceStarts[i] = numTransforms;
+            if (meshes[i]->IsGroup())
+                numTransforms += (int)meshes[i]->groupInstances.size();
+            else if (meshes[i]->bvh)
+                numIndices += (int)meshes[i]->bvh->GetNumIndices();
+        }
+
+        if (quantized)
+        {
+            nodes.clear();
+            quantizedNodes.clear();
+            ProcessBlockBLAS(triIndices);
+
+            // A tree over n entries has n leaves and at most n - 1 internal nodes
+            topLevelStart = (int)quantizedNodes.size();
+            quantizedNodes.resize(topLevelStart + numEntries + std::max(numEntries - 1, 0) * (1 + GetQuantizedBodySize()));
+            return;
+        }
+
+        quantizedNodes.clear();
+
+        if (width > 2)
+        {
+            nodes.clear();
+            ProcessBlockBLAS(triIndices);
+
+            // A collapsed tree over n entries has at most n - 1 wide nodes, plus its entry node
+            topLevelStart = (int)nodes.size();
+            nodes.resize(topLevelStart + (numEntries + 1) * width);
+            return;
+        }
+
+        // Binary trees keep their node count, so every mesh is flattened
+        // straight into place
         int nodeCnt = 0;
 
-        for (int i = 0; i < meshes.size(); i++)
-            nodeCnt += meshes[i]->bvh->m_nodecnt;
+        for (int i = 0; i < numMeshes; i++)
+        {
+            bvhRootStartIndices[i] = nodeCnt;
+            if (meshes[i]->bvh)
+                nodeCnt += meshes[i]->bvh->m_nodecnt;
+        }
         topLevelIndex = nodeCnt;
+        topLevelStart = nodeCnt;
 
         // reserve space for top level nodes
-        nodeCnt += 2 * meshInstances.size();
+        nodeCnt += 2 * numEntries;
         nodes.resize(nodeCnt);
 
-        int bvhRootIndex = 0;
-        curTriIndex = 0;
-
-        for (int i = 0; i < meshes.size(); i++)
+#pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < numMeshes; i++)
         {
-            GLSLPT::Mesh* mesh = meshes[i];
-            curNode = bvhRootIndex;
-
-            bvhRootStartIndices.push_back(bvhRootIndex);
-            bvhRootIndex += mesh->bvh->m_nodecnt;
-
-            ProcessBLASNodes(mesh->bvh->m_root);
-            curTriIndex += mesh->bvh->GetNumIndices();
+            if (meshes[i]->bvh)
+                ProcessBLASNodes(i, bvhRootStartIndices[i], triIndices[i]);
+            else
+                blasEntryIndices[i].clear();
         }
     }
 
     void BvhTranslator::ProcessTLAS()
     {
-        curNode = topLevelIndex;
+        if (quantized)
+        {
+            size_t reserved = quantizedNodes.size();
+            quantizedNodes.resize(topLevelStart);
+            FlattenTarget target = { topLevelBvh, true, 0, nullptr, nullptr, &quantizedNodes };
+            topLevelIndex = ProcessQuantizedNodes(target, topLevelBvh->m_root);
+            assert(quantizedNodes.size() <= reserved);
+            quantizedNodes.resize(reserved);
+            return;
+        }
+
+        if (width > 2)
+        {
+            size_t reserved = nodes.size();
+            nodes.resize(topLevelStart);
+            FlattenTarget target = { topLevelBvh, true, 0, nullptr, &nodes, nullptr };
+            topLevelIndex = ProcessWideRoot(target, topLevelBvh->m_root);
+            assert(nodes.size() <= reserved);
+            nodes.resize(reserved);
+            return;
+        }
+
+        topLevelIndex = topLevelStart;
+        tlasNodeIndices.resize(topLevelBvh->m_nodes.size());
         ProcessTLASNodes(topLevelBvh->m_root);
     }
 
@@ -123,8 +829,72 @@ namespace RadeonRays
     {
         this->topLevelBvh = topLevelBvh;
         meshInstances = sceneInstances;
-        curNode = topLevelIndex;
-        ProcessTLASNodes(topLevelBvh->m_root);
+        ProcessTLAS();
+        if (parentLinks)
+            ProcessLinks(topLevelIndex);
+
+        modifiedNodes.resize(GetNodeCount() - topLevelStart);
+        std::iota(modifiedNodes.begin(), modifiedNodes.end(), topLevelStart);
+    }
+
+    void BvhTranslator::RefitTLAS(const std::vector<int>& refitted, const std::vector<GLSLPT::MeshInstance>& sceneInstances)
+    {
+        // Wide nodes mix bounds of several binary nodes and quantized nodes depend
+        // on the bounds of their parent, flatten the whole TLAS again
+        if (width > 2 || quantized)
+        {
+            UpdateTLAS(topLevelBvh, sceneInstances);
+            return;
+        }
+
+        for (int nodeIndex : refitted)
+        {
+            const Bvh::Node* node = &topLevelBvh->m_nodes[nodeIndex];
+            int index = tlasNodeIndices[nodeIndex];
+
+            nodes[index].bboxmin = node->bounds.pmin;
+            nodes[index].bboxmax = node->bounds.pmax;
+
+            if (node->type == RadeonRays::Bvh::NodeType::kLeaf)
+            {
+                int entryIndex, materialID, instanceIndex;
+                GetTLASLeaf(node, entryIndex, materialID, instanceIndex);
+                meshInstances[instanceIndex] = sceneInstances[instanceIndex];
+                nodes[index].LRLeaf.y = meshInstances[instanceIndex].materialID;
+            }
+
+            modifiedNodes.push_back(index);
+        }
+
+        // Refitted children can swap sides along the split axis, which only
+        // changes the order a stackless traversal visits them in
+        if (parentLinks)
+        {
+            for (int nodeIndex : refitted)
+            {
+                int index = tlasNodeIndices[nodeIndex];
+                if (nodes[index].LRLeaf.z == 0.0f)
+                    links[index] = (links[index] & ~7) | GetSplitCode(index);
+            }
+        }
+
+        std::sort(modifiedNodes.begin(), modifiedNodes.end());
+        modifiedNodes.erase(std::unique(modifiedNodes.begin(), modifiedNodes.end()), modifiedNodes.end());
+    }
+
+    size_t BvhTranslator::GetNodeSize() const
+    {
+        return quantized ? sizeof(QuantizedTexel) : sizeof(Node);
+    }
+
+    size_t BvhTranslator::GetNodeCount() const
+    {
+        return quantized ? quantizedNodes.size() : nodes.size();
+    }
+
+    const void* BvhTranslator::GetNodeData(int first) const
+    {
+        return quantized ? (const void*)&quantizedNodes[first] : (const void*)&nodes[first];
     }
 
     void BvhTranslator::Process(const Bvh* topLevelBvh, const std::vector<GLSLPT::Mesh*>& sceneMeshes, const std::vector<GLSLPT::MeshInstance>& sceneInstances)
@@ -134,5 +904,19 @@ namespace RadeonRays
         meshInstances = sceneInstances;
         ProcessBLAS();
         ProcessTLAS();
+
+        if (parentLinks)
+        {
+            links.assign(nodes.size(), 0);
+#pragma omp parallel for schedule(dynamic)
+            for (int i = 0; i < (int)meshes.size(); i++)
+            {
+                if (meshes[i]->bvh)
+                    ProcessLinks(bvhRootStartIndices[i]);
+            }
+            ProcessLinks(topLevelIndex);
+        }
+        else
+            links.clear();
     }
 }
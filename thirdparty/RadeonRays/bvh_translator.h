@@ -49,20 +49,181 @@ namespace RadeonRays
             Vec3 LRLeaf;
         };
 
+        // Wide layouts collapse the binary trees into 4 or 8 wide nodes. Wide
+        // node k spans nodes[k * width] to nodes[(k + 1) * width - 1], read as
+        // 3 * width texels: the bbox mins of its children, their bbox maxes and
+        // one LRLeaf record per child. Child records of internal nodes hold the
+        // child node and its number of children, leaf records are the same as
+        // in the binary layout. Traversal indices (topLevelIndex and the BLAS
+        // roots in TLAS leaves) address a child record as node * width + slot,
+        // so every tree gets an entry node whose only child is its root.
+        // Set before Process, 2 keeps the binary layout
+        int width = 2;
+
+        // Quantized layout, also set before Process. It fills quantizedNodes
+        // instead of nodes, with 16 byte integer texels addressed by texel index,
+        // so indices stay exact past the 2^24 limit of the float layouts.
+        // An internal node is a header texel (its bounds minimum as float bits
+        // and, in w, per axis power of two scale exponents, kind and number of
+        // children) and its body texels: the bounds of its children as 8 bit
+        // offsets in the frame of the node, rounded outwards, followed by the
+        // indices of all children but the first, which directly follows the
+        // node. Leaves take one texel, (first tri, tri count, 0, kind) in a
+        // BLAS and (BLAS root, material, instance, kind) in the TLAS
+        bool quantized = false;
+
+        // Order of the BLAS nodes in the binary float layout, nodes that are
+        // fetched one after the other by a ray should share cache lines. The
+        // TLAS, wide and quantized layouts stay in depth first order
+        enum class NodeLayout
+        {
+            kDepthFirst,       // Preorder, left child first
+            kLargerChildFirst, // Preorder, child with the larger surface area first
+            kVanEmdeBoas,      // Cache oblivious, subtrees split recursively at half height
+            kVisitFrequency    // Clusters grown from the nodes most visited by sampled rays
+        };
+        NodeLayout layout = NodeLayout::kDepthFirst;
+
+        // Parent links of the binary float layout for stackless traversal, also
+        // set before Process. links[i] is (parent of node i + 1) << 3, so roots
+        // keep 0, with the split of node i in the low bits: the axis along which
+        // its children's centers lie farthest apart and, in bit 2, whether the
+        // left child lies above the right one on it. Only nodes reachable from
+        // the TLAS and BLAS roots get links
+        bool parentLinks = false;
+        std::vector<int> links;
+
+        static const char* GetNodeLayoutName(NodeLayout layout);
+
+        // Flatten a standalone tree, such as the one over the scene's lights, in
+        // the binary float layout with the root first. Leaves hold a single
+        // primitive and keep its index in LRLeaf.x
+        static void FlattenPrimitives(const Bvh* bvh, std::vector<Node>& nodes);
+
+        struct QuantizedTexel
+        {
+            unsigned int x, y, z, w;
+        };
+
+        enum QuantizedKind
+        {
+            kQuantizedInternal = 0,
+            kQuantizedBlasLeaf = 1,
+            kQuantizedTlasLeaf = 2
+        };
+
+        // Texels following the header of an internal quantized node
+        int GetQuantizedBodySize() const;
+
         void ProcessBLAS();
         void ProcessTLAS();
         void UpdateTLAS(const Bvh* topLevelBvh, const std::vector<GLSLPT::MeshInstance>& instances);
+        // Rewrite only the flattened nodes of a refitted top level BVH, refitted
+        // holds node indices as returned by Bvh::Refit
+        void RefitTLAS(const std::vector<int>& refitted, const std::vector<GLSLPT::MeshInstance>& instances);
         void Process(const Bvh* topLevelBvh, const std::vector<GLSLPT::Mesh*>& meshes, const std::vector<GLSLPT::MeshInstance>& instances);
         int topLevelIndex = 0;
         std::vector<Node> nodes;
+        std::vector<QuantizedTexel> quantizedNodes;
         int nodeTexWidth;
+        // Sorted indices of flattened nodes changed since the last upload
+        std::vector<int> modifiedNodes;
+
+        // A top level primitive: traversal of the BLAS of instance starts at node,
+        // its root unless the instance was opened by re-braiding. node indexes
+        // the nodes of the mesh BVH and bounds are its object space bounds
+        struct InstanceEntry
+        {
+            int instance;
+            int node;
+            bbox bounds;
+        };
+
+        // Primitives the top level BVH was built over, set before Process and
+        // UpdateTLAS. Left empty, primitive i is the root of instance i
+        std::vector<InstanceEntry> topLevelEntries;
+
+        // Leaf record of top level primitive: traversal index of the BLAS node it
+        // starts at, material and instance. Valid after Process, which is what
+        // lets the TLAS be built elsewhere, see GLSLPT::GpuTlasBuilder
+        void GetTopLevelLeaf(int primitive, int& entryIndex, int& materialID, int& instanceIndex) const;
+
+        // Nodes of the BLAS of a mesh in the binary float layout, its root first.
+        // Lets the BLAS be refitted elsewhere, see GLSLPT::GpuDeformer
+        void GetBLASNodeRange(int mesh, int& first, int& count) const;
+
+        // Children a node of a mesh BVH opens into in the selected layout, as node
+        // indices. Leaves of the TLAS can start a traversal at the root and at
+        // nodes reached this way
+        int GetEntryChildren(const Bvh* bvh, int node, int* children) const;
+
+        // Entries of the buffer to upload for the selected layout, either nodes
+        // or quantizedNodes. modifiedNodes and topLevelIndex index these entries
+        size_t GetNodeSize() const;
+        size_t GetNodeCount() const;
+        const void* GetNodeData(int first) const;
 
     private:
-        int curNode = 0;
-        int curTriIndex = 0;
+        // One tree being flattened. Meshes are flattened in parallel, each into
+        // its own block of wide or quantized nodes that is relocated into place
+        // afterwards, binary BLAS and all TLAS nodes go to nodes directly
+        struct FlattenTarget
+        {
+            const Bvh* bvh;
+            bool topLevel;
+            // First triangle of the mesh in the scene index buffer
+            int triIndex;
+            // Traversal index of every BLAS node, unused for the TLAS
+            std::vector<int>* entryIndices;
+            std::vector<Node>* nodes;
+            std::vector<QuantizedTexel>* quantizedNodes;
+        };
+
+        // A binary node still to be collapsed into a wide or quantized node and
+        // the child slot of its parent that has to point at it
+        struct PendingNode
+        {
+            const Bvh::Node* node;
+            int parent;
+            int slot;
+        };
+
+        // First entry of nodes used by the top level BVH
+        int topLevelStart = 0;
         std::vector<int> bvhRootStartIndices;
-        int ProcessBLASNodes(const Bvh::Node* root);
-        int ProcessTLASNodes(const Bvh::Node* root);
+        // Per mesh, the transform of its first group member. Members of all groups
+        // follow the instance transforms, in mesh order
+        std::vector<int> groupInstanceStarts;
+        // Per mesh, the traversal index of every BLAS node a TLAS leaf can point to
+        std::vector<std::vector<int>> blasEntryIndices;
+        // Traversal index of the BLAS node, material and instance of a top level leaf
+        void GetTLASLeaf(const Bvh::Node* leaf, int& entryIndex, int& materialID, int& instanceIndex) const;
+        // Flattened index of every top level BVH node
+        std::vector<int> tlasNodeIndices;
+        // Flatten the nodes of a mesh in layout order to nodes[rootIndex] onwards
+        void ProcessBLASNodes(int mesh, int rootIndex, int triIndex);
+        // Order in which the nodes of a mesh BVH are stored, the root comes first
+        void OrderNodes(const GLSLPT::Mesh* mesh, std::vector<const Bvh::Node*>& order) const;
+        static void OrderDepthFirst(const Bvh* bvh, bool largerFirst, std::vector<const Bvh::Node*>& order);
+        // Lay out the top levels of the subtree under node, nodes right below them go to frontier
+        static void OrderVanEmdeBoas(const Bvh* bvh, const Bvh::Node* node, int levels, std::vector<const Bvh::Node*>& order, std::vector<const Bvh::Node*>& frontier);
+        static void OrderByFrequency(const Bvh* bvh, const std::vector<int>& visits, std::vector<const Bvh::Node*>& order);
+        void ProcessTLASNodes(const Bvh::Node* root);
+        // Link the nodes of the tree under the flattened node root
+        void ProcessLinks(int root);
+        int GetSplitCode(int node) const;
+        Vec3& WideTexel(std::vector<Node>& wideNodes, int node, int texel) const;
+        int AllocateWideNode(std::vector<Node>& wideNodes) const;
+        // Fill one child slot of a wide node, internal children are queued on pending
+        void ProcessWideChild(const FlattenTarget& target, int node, int slot, const Bvh::Node* child, std::vector<PendingNode>& pending) const;
+        // Returns the traversal index of the root
+        int ProcessWideRoot(const FlattenTarget& target, const Bvh::Node* root) const;
+        // Pick the binary descendants that become the children of a wide node
+        int CollectWideChildren(const Bvh* bvh, const Bvh::Node* root, const Bvh::Node** children) const;
+        int ProcessQuantizedNodes(const FlattenTarget& target, const Bvh::Node* root) const;
+        // Flatten the meshes in parallel in the wide or quantized layout and
+        // move their blocks after each other into nodes or quantizedNodes
+        void ProcessBlockBLAS(const std::vector<int>& triIndices);
         std::vector<GLSLPT::MeshInstance> meshInstances;
         std::vector<GLSLPT::Mesh*> meshes;
         const Bvh* topLevelBvh;
@@ -0,0 +1,305 @@
+/**********************************************************************
+ Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ ********************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#include "lbvh.h"
+
+namespace RadeonRays
+{
+    static inline int CountLeadingZeros(uint64_t x)
+    {
+        if (x == 0)
+            return 64;
+#if defined(_MSC_VER) && !defined(__clang__)
+        unsigned long idx;
+        _BitScanReverse64(&idx, x);
+        return 63 - (int)idx;
+#else
+        return __builtin_clzll(x);
+#endif
+    }
+
+    // Insert two zero bits after each of the lower 10 bits
+    static inline uint64_t ExpandBits10(uint64_t v)
+    {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    // Insert two zero bits after each of the lower 21 bits
+    static inline uint64_t ExpandBits21(uint64_t v)
+    {
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffffull;
+        v = (v | v << 16) & 0x1f0000ff0000ffull;
+        v = (v | v << 8) & 0x100f00f00f00f00full;
+        v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+        v = (v | v << 2) & 0x1249249249249249ull;
+        return v;
+    }
+
+    // Length of the common prefix of codes i and j, equal codes fall back to
+    // the indices so every key is unique. -1 outside the range
+    static inline int Delta(std::vector<uint64_t> const& codes, int i, int j)
+    {
+        if (j < 0 || j >= (int)codes.size())
+            return -1;
+
+        if (codes[i] == codes[j])
+            return 64 + CountLeadingZeros((uint64_t)(uint32_t)(i ^ j)) - 32;
+
+        return CountLeadingZeros(codes[i] ^ codes[j]);
+    }
+
+    void Lbvh::BuildImpl(bbox const* bounds, int numbounds)
+    {
+        InitNodeAllocator(2 * numbounds - 1);
+        m_nodecnt = 2 * numbounds - 1;
+        m_packed_indices.resize(numbounds);
+        m_code_bits = numbounds > kMaxPrimsFor30BitCodes ? 63 : 30;
+
+        // Centroid bounds define the Morton grid
+        bbox centroid_bounds;
+#pragma omp parallel
+        {
+            bbox local;
+#pragma omp for nowait
+            for (int i = 0; i < numbounds; ++i)
+                local.grow(bounds[i].center());
+#pragma omp critical
+            centroid_bounds.grow(local);
+        }
+
+        int const axisbits = m_code_bits / 3;
+        float const gridsize = (float)(1u << axisbits);
+        Vec3 const origin = centroid_bounds.pmin;
+        Vec3 const extents = centroid_bounds.extents();
+        Vec3 const scale(extents.x > 0.f ? gridsize / extents.x : 0.f,
+                         extents.y > 0.f ? gridsize / extents.y : 0.f,
+                         extents.z > 0.f ? gridsize / extents.z : 0.f);
+
+        std::vector<uint64_t> codes(numbounds);
+        std::vector<int> indices(numbounds);
+
+#pragma omp parallel for
+        for (int i = 0; i < numbounds; ++i)
+        {
+            Vec3 c = (bounds[i].center() - origin) * scale;
+            uint64_t q[3];
+            for (int axis = 0; axis < 3; ++axis)
+                q[axis] = (uint64_t)std::min(std::max(c[axis], 0.f), gridsize - 1.f);
+
+            if (m_code_bits == 30)
+                codes[i] = (ExpandBits10(q[0]) << 2) | (ExpandBits10(q[1]) << 1) | ExpandBits10(q[2]);
+            else
+                codes[i] = (ExpandBits21(q[0]) << 2) | (ExpandBits21(q[1]) << 1) | ExpandBits21(q[2]);
+
+            indices[i] = i;
+        }
+
+        SortCodes(codes, indices, m_code_bits);
+
+        // Internal nodes take the first n - 1 slots with the root at 0, leaves follow in code order
+        int const numinternal = numbounds - 1;
+
+#pragma omp parallel for
+        for (int i = 0; i < numbounds; ++i)
+        {
+            Node& leaf = m_nodes[numinternal + i];
+            leaf.bounds = bounds[indices[i]];
+            leaf.type = kLeaf;
+            leaf.startidx = i;
+            leaf.numprims = 1;
+            m_packed_indices[i] = indices[i];
+        }
+
+        std::vector<int> parents(2 * numbounds - 1);
+        parents[0] = -1;
+
+#pragma omp parallel for
+        for (int i = 0; i < numinternal; ++i)
+            BuildInternalNode(codes, i, parents);
+
+        // Bounds and subtree heights bottom-up: the second child to arrive at
+        // a node grows it and moves on, so the root ends up with the tree height
+        // without a serial top-down walk
+        std::unique_ptr<std::atomic<int>[]> visits(new std::atomic<int>[std::max(numinternal, 1)]);
+        std::vector<int> heights(std::max(numinternal, 1));
+#pragma omp parallel for
+        for (int i = 0; i < numinternal; ++i)
+            visits[i].store(0, std::memory_order_relaxed);
+
+        auto height = [&](int node)
+        {
+            return node < numinternal ? heights[node] : 0;
+        };
+
+#pragma omp parallel for
+        for (int i = 0; i < numbounds; ++i)
+        {
+            int node = parents[numinternal + i];
+
+            while (node != -1)
+            {
+                if (visits[node].fetch_add(1, std::memory_order_acq_rel) == 0)
+                    break;
+
+                Node& parent = m_nodes[node];
+                parent.bounds = bboxunion(m_nodes[parent.lc].bounds, m_nodes[parent.rc].bounds);
+                heights[node] = std::max(height(parent.lc), height(parent.rc)) + 1;
+                node = parents[node];
+            }
+        }
+
+        m_root = &m_nodes[0];
+        UpdateHeight(height(0));
+    }
+
+    void Lbvh::BuildInternalNode(std::vector<uint64_t> const& codes, int i, std::vector<int>& parents)
+    {
+        int const numinternal = (int)codes.size() - 1;
+
+        // Direction of the node's range
+        int d = Delta(codes, i, i + 1) - Delta(codes, i, i - 1) >= 0 ? 1 : -1;
+
+        // Upper bound for the range length, then binary search for the other end
+        int dmin = Delta(codes, i, i - d);
+        int lmax = 2;
+        while (Delta(codes, i, i + lmax * d) > dmin)
+            lmax *= 2;
+
+        int l = 0;
+        for (int t = lmax / 2; t >= 1; t /= 2)
+        {
+            if (Delta(codes, i, i + (l + t) * d) > dmin)
+                l += t;
+        }
+
+        int j = i + l * d;
+
+        // Split position: last key sharing more than the range's common prefix with i
+        int dnode = Delta(codes, i, j);
+        int s = 0;
+        int t = l;
+        do
+        {
+            t = (t + 1) >> 1;
+            if (Delta(codes, i, i + (s + t) * d) > dnode)
+                s += t;
+        } while (t > 1);
+
+        int gamma = i + s * d + std::min(d, 0);
+
+        int left = std::min(i, j) == gamma ? numinternal + gamma : gamma;
+        int right = std::max(i, j) == gamma + 1 ? numinternal + gamma + 1 : gamma + 1;
+
+        Node& node = m_nodes[i];
+        node.type = kInternal;
+        node.lc = left;
+        node.rc = right;
+        parents[left] = i;
+        parents[right] = i;
+    }
+
+    void Lbvh::SortCodes(std::vector<uint64_t>& codes, std::vector<int>& indices, int numbits) const
+    {
+        int constexpr kDigitBits = 11;
+        int constexpr kNumBuckets = 1 << kDigitBits;
+
+        int const numcodes = (int)codes.size();
+        std::vector<uint64_t> sortedcodes(numcodes);
+        std::vector<int> sortedindices(numcodes);
+
+#ifdef _OPENMP
+        int const maxthreads = omp_in_parallel() ? 1 : omp_get_max_threads();
+#else
+        int const maxthreads = 1;
+#endif
+        std::vector<int> histograms(maxthreads * kNumBuckets);
+
+        for (int shift = 0; shift < numbits; shift += kDigitBits)
+        {
+#pragma omp parallel num_threads(maxthreads)
+            {
+                int numthreads = 1;
+                int thread = 0;
+#ifdef _OPENMP
+                numthreads = omp_get_num_threads();
+                thread = omp_get_thread_num();
+#endif
+                int begin = (int)((long long)numcodes * thread / numthreads);
+                int end = (int)((long long)numcodes * (thread + 1) / numthreads);
+                int* histogram = &histograms[thread * kNumBuckets];
+
+                std::fill(histogram, histogram + kNumBuckets, 0);
+                for (int i = begin; i < end; ++i)
+                    ++histogram[(codes[i] >> shift) & (kNumBuckets - 1)];
+
+#pragma omp barrier
+#pragma omp single
+                {
+                    // Offsets in digit-major, thread-minor order keep the sort stable
+                    int offset = 0;
+                    for (int digit = 0; digit < kNumBuckets; ++digit)
+                    {
+                        for (int t = 0; t < numthreads; ++t)
+                        {
+                            int count = histograms[t * kNumBuckets + digit];
+                            histograms[t * kNumBuckets + digit] = offset;
+                            offset += count;
+                        }
+                    }
+                }
+
+                for (int i = begin; i < end; ++i)
+                {
+                    int pos = histogram[(codes[i] >> shift) & (kNumBuckets - 1)]++;
+                    sortedcodes[pos] = codes[i];
+                    sortedindices[pos] = indices[i];
+                }
+            }
+
+            codes.swap(sortedcodes);
+            indices.swap(sortedindices);
+        }
+    }
+
+    void Lbvh::PrintStatistics(std::ostream& os) const
+    {
+        os << "Class name: " << "Lbvh\n";
+        os << "Morton code bits: " << m_code_bits << "\n";
+        os << "Number of triangles: " << m_packed_indices.size() << "\n";
+        os << "Number of nodes: " << m_nodecnt << "\n";
+        os << "Tree height: " << GetHeight() << "\n";
+    }
+}
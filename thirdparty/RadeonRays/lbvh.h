@@ -0,0 +1,71 @@
+/**********************************************************************
+ Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ ********************************************************************/
+#pragma once
+
+#ifndef LBVH_H
+#define LBVH_H
+
+#include <cstdint>
+#include "bvh.h"
+
+namespace RadeonRays
+{
+    ///< Linear BVH (Karras 2012): prims are sorted along a Morton curve and the
+    ///< hierarchy is read off the sorted codes. Builds an order of magnitude
+    ///< faster than the SAH builders at the price of tree quality, which makes
+    ///< it a fit for dynamic content and quick previews of large meshes.
+    ///< Output follows the Bvh node contract (one prim per leaf) so
+    ///< BvhTranslator consumes it as is.
+    class Lbvh : public Bvh
+    {
+    public:
+        Lbvh(float traversal_cost)
+            : Bvh(traversal_cost, 64, false)
+        {
+        }
+
+        ~Lbvh() = default;
+
+        // Print BVH statistics
+        void PrintStatistics(std::ostream& os) const override;
+
+    protected:
+        void BuildImpl(bbox const* bounds, int numbounds) override;
+
+    private:
+        // 30 bit codes while they are precise enough, 63 bit ones for large meshes
+        static int constexpr kMaxPrimsFor30BitCodes = 1 << 20;
+
+        // Stable parallel LSD radix sort of codes with their prim indices
+        void SortCodes(std::vector<uint64_t>& codes, std::vector<int>& indices, int numbits) const;
+
+        // Split position of internal node i over the sorted codes, fills its children
+        void BuildInternalNode(std::vector<uint64_t> const& codes, int i, std::vector<int>& parents);
+
+        int m_code_bits = 0;
+
+        Lbvh(Lbvh const&) = delete;
+        Lbvh& operator = (Lbvh const&) = delete;
+    };
+}
+
+#endif // LBVH_H
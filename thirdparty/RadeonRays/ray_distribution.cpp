@@ -0,0 +1,323 @@
+/**********************************************************************
+ Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ ********************************************************************/
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include "ray_distribution.h"
+
+namespace RadeonRays
+{
+    // Share of every weight that does not depend on the sample. Primitives no
+    // sampled ray hit are still reached by deeper bounces and by the rays a
+    // small sample misses, so they keep a part of the plain SAH weight
+    static float const kUniformWeight = 0.5f;
+
+    static bool IntersectBox(bbox const& box, Vec3 const& origin, Vec3 const& invdir, float tmax, float& tnear)
+    {
+        float t0 = 0.f;
+        float t1 = tmax;
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float ta = (box.pmin[axis] - origin[axis]) * invdir[axis];
+            float tb = (box.pmax[axis] - origin[axis]) * invdir[axis];
+            t0 = std::max(t0, std::min(ta, tb));
+            t1 = std::min(t1, std::max(ta, tb));
+        }
+
+        tnear = t0;
+        return t0 <= t1;
+    }
+
+    // Same test as the shaders, t is only shortened by a closer hit
+    static bool IntersectTriangle(Vec3 const& origin, Vec3 const& direction, Vec3 const& v0, Vec3 const& v1, Vec3 const& v2, float& t)
+    {
+        Vec3 e0 = v1 - v0;
+        Vec3 e1 = v2 - v0;
+        Vec3 pv = Vec3::Cross(direction, e1);
+        float det = Vec3::Dot(e0, pv);
+
+        Vec3 tv = origin - v0;
+        Vec3 qv = Vec3::Cross(tv, e0);
+
+        float u = Vec3::Dot(tv, pv) / det;
+        float v = Vec3::Dot(direction, qv) / det;
+        float dist = Vec3::Dot(e1, qv) / det;
+
+        if (u >= 0.f && v >= 0.f && u + v <= 1.f && dist > 0.f && dist < t)
+        {
+            t = dist;
+            return true;
+        }
+        return false;
+    }
+
+    template <typename LeafTest>
+    void RayDistribution::Traverse(Bvh const& bvh, Vec3 const& origin, Vec3 const& direction, float& closest, LeafTest leaf)
+    {
+        Bvh::Node const* root = bvh.GetRoot();
+        if (!root)
+            return;
+
+        Vec3 invdir(1.f / direction.x, 1.f / direction.y, 1.f / direction.z);
+        int const* indices = bvh.GetIndices();
+
+        // Linear BVHs are at most as deep as their code bits plus the bits of the prim count
+        std::pair<Bvh::Node const*, float> stack[256];
+        int ptr = 0;
+
+        float tnear;
+        if (IntersectBox(root->bounds, origin, invdir, closest, tnear))
+            stack[ptr++] = std::make_pair(root, tnear);
+
+        while (ptr > 0)
+        {
+            Bvh::Node const* node = stack[--ptr].first;
+            if (stack[ptr].second > closest)
+                continue;
+
+            if (node->type == Bvh::kLeaf)
+            {
+                for (int i = node->startidx; i < node->startidx + node->numprims; ++i)
+                    leaf(indices[i], closest);
+                continue;
+            }
+
+            Bvh::Node const* left = bvh.GetNode(node->lc);
+            Bvh::Node const* right = bvh.GetNode(node->rc);
+
+            float tl, tr;
+            bool hitl = IntersectBox(left->bounds, origin, invdir, closest, tl);
+            bool hitr = IntersectBox(right->bounds, origin, invdir, closest, tr);
+
+            // Push the far child first so the near one is traversed next
+            if (hitl && hitr && tl < tr)
+            {
+                stack[ptr++] = std::make_pair(right, tr);
+                stack[ptr++] = std::make_pair(left, tl);
+            }
+            else
+            {
+                if (hitl)
+                    stack[ptr++] = std::make_pair(left, tl);
+                if (hitr)
+                    stack[ptr++] = std::make_pair(right, tr);
+            }
+        }
+    }
+
+    RayDistribution::RayDistribution(std::vector<GLSLPT::Mesh*> const& meshes, std::vector<GLSLPT::MeshInstance> const& instances)
+        : m_meshes(meshes)
+        , m_instances(instances)
+        , m_instance_bvh(1.f)
+    {
+        m_mesh_bvhs.resize(meshes.size());
+        m_triangle_hits.resize(meshes.size());
+
+        // Rays only reach meshes through the instances, the others need no tree
+        std::vector<char> instanced(meshes.size(), 0);
+        for (GLSLPT::MeshInstance const& instance : instances)
+            instanced[instance.meshID] = 1;
+
+#pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < (int)meshes.size(); ++i)
+        {
+            m_triangle_hits[i].assign(meshes[i]->verticesUVX.size() / 3, 0);
+            if (m_triangle_hits[i].empty() || !instanced[i])
+                continue;
+
+            std::vector<bbox> bounds;
+            meshes[i]->GetTriangleBounds(bounds);
+            m_mesh_bvhs[i].reset(new Lbvh(1.f));
+            m_mesh_bvhs[i]->Build(&bounds[0], (int)bounds.size());
+        }
+
+        // World bounds of every instance and the inverse of its transform, taken
+        // from the rows of the cofactor matrix
+        std::vector<bbox> bounds(instances.size());
+        m_inverse_transforms.resize(instances.size());
+        m_instance_hits.assign(instances.size(), 0);
+
+        for (int i = 0; i < (int)instances.size(); ++i)
+        {
+            GLSLPT::Mat4 matrix = instances[i].transform;
+            Vec3 rows[3];
+            for (int j = 0; j < 3; ++j)
+                rows[j] = Vec3(matrix[j][0], matrix[j][1], matrix[j][2]);
+            Vec3 translation(matrix[3][0], matrix[3][1], matrix[3][2]);
+
+            Vec3 cofactors[3] = { Vec3::Cross(rows[1], rows[2]), Vec3::Cross(rows[2], rows[0]), Vec3::Cross(rows[0], rows[1]) };
+            float det = Vec3::Dot(rows[0], cofactors[0]);
+            float invdet = det != 0.f ? 1.f / det : 0.f;
+
+            InverseTransform& inverse = m_inverse_transforms[i];
+            for (int j = 0; j < 3; ++j)
+                inverse.columns[j] = cofactors[j] * invdet;
+            inverse.translation = translation;
+
+            Lbvh const* meshbvh = m_mesh_bvhs[instances[i].meshID].get();
+            if (!meshbvh)
+            {
+                // Nothing to hit, a point box keeps the instance out of the way
+                bounds[i].grow(translation);
+                continue;
+            }
+
+            bbox const& local = meshbvh->Bounds();
+            for (int corner = 0; corner < 8; ++corner)
+            {
+                Vec3 p((corner & 1) ? local.pmax.x : local.pmin.x, (corner & 2) ? local.pmax.y : local.pmin.y, (corner & 4) ? local.pmax.z : local.pmin.z);
+                bounds[i].grow(rows[0] * p.x + rows[1] * p.y + rows[2] * p.z + translation);
+            }
+        }
+
+        if (!bounds.empty())
+            m_instance_bvh.Build(&bounds[0], (int)bounds.size());
+    }
+
+    void RayDistribution::TraceInstance(int instance, Vec3 const& origin, Vec3 const& direction, Hit& hit) const
+    {
+        int mesh = m_instances[instance].meshID;
+        Lbvh const* meshbvh = m_mesh_bvhs[mesh].get();
+        if (!meshbvh)
+            return;
+
+        // Object space ray, t is the same in both spaces since the direction is not normalized
+        InverseTransform const& inverse = m_inverse_transforms[instance];
+        Vec3 q = origin - inverse.translation;
+        Vec3 localorigin(Vec3::Dot(q, inverse.columns[0]), Vec3::Dot(q, inverse.columns[1]), Vec3::Dot(q, inverse.columns[2]));
+        Vec3 localdir(Vec3::Dot(direction, inverse.columns[0]), Vec3::Dot(direction, inverse.columns[1]), Vec3::Dot(direction, inverse.columns[2]));
+
+        std::vector<Vec4> const& vertices = m_meshes[mesh]->verticesUVX;
+        Traverse(*meshbvh, localorigin, localdir, hit.t, [&](int triangle, float& closest)
+        {
+            Vec3 v0(vertices[triangle * 3 + 0]);
+            Vec3 v1(vertices[triangle * 3 + 1]);
+            Vec3 v2(vertices[triangle * 3 + 2]);
+
+            if (IntersectTriangle(localorigin, localdir, v0, v1, v2, closest))
+            {
+                // Normals take the inverse transpose
+                Vec3 n = Vec3::Cross(v1 - v0, v2 - v0);
+                hit.instance = instance;
+                hit.triangle = triangle;
+                hit.normal = inverse.columns[0] * n.x + inverse.columns[1] * n.y + inverse.columns[2] * n.z;
+            }
+        });
+    }
+
+    RayDistribution::Hit RayDistribution::Trace(Vec3 const& origin, Vec3 const& direction) const
+    {
+        Hit hit = { -1, -1, std::numeric_limits<float>::max(), Vec3() };
+
+        Traverse(m_instance_bvh, origin, direction, hit.t, [&](int instance, float&)
+        {
+            TraceInstance(instance, origin, direction, hit);
+        });
+
+        return hit;
+    }
+
+    void RayDistribution::Sample(std::vector<Vec3> const& origins, std::vector<Vec3> const& directions)
+    {
+        int numrays = (int)origins.size();
+        if (m_instances.empty() || numrays == 0)
+            return;
+
+        // Primary hit and bounce hit of every ray, counted afterwards so the
+        // result does not depend on the thread count
+        std::vector<Hit> hits(numrays * 2);
+
+#pragma omp parallel for schedule(dynamic, 64)
+        for (int i = 0; i < numrays; ++i)
+        {
+            Hit& primary = hits[i * 2];
+            Hit& bounce = hits[i * 2 + 1];
+            bounce.instance = -1;
+
+            primary = Trace(origins[i], directions[i]);
+            if (primary.instance < 0)
+                continue;
+
+            // Cosine distributed bounce on the side the ray came from, seeded per
+            // ray for the same reason
+            Vec3 normal = Vec3::Normalize(primary.normal);
+            if (Vec3::Dot(normal, directions[i]) > 0.f)
+                normal = normal * -1.f;
+
+            std::mt19937 rng(i);
+            std::uniform_real_distribution<float> uniform(0.f, 1.f);
+            float r = std::sqrt(uniform(rng));
+            float phi = 2.f * 3.14159265f * uniform(rng);
+
+            Vec3 tangent = Vec3::Normalize(Vec3::Cross(std::fabs(normal.x) > 0.5f ? Vec3(0.f, 1.f, 0.f) : Vec3(1.f, 0.f, 0.f), normal));
+            Vec3 bitangent = Vec3::Cross(normal, tangent);
+            Vec3 direction = tangent * (r * std::cos(phi)) + bitangent * (r * std::sin(phi)) + normal * std::sqrt(std::max(0.f, 1.f - r * r));
+
+            Vec3 position = origins[i] + directions[i] * primary.t;
+            float offset = 1e-4f * std::max(1.f, std::max(std::fabs(position.x), std::max(std::fabs(position.y), std::fabs(position.z))));
+            bounce = Trace(position + normal * offset, direction);
+        }
+
+        for (Hit const& hit : hits)
+        {
+            if (hit.instance < 0)
+                continue;
+
+            m_triangle_hits[m_instances[hit.instance].meshID][hit.triangle]++;
+            m_instance_hits[hit.instance]++;
+            m_numhits++;
+        }
+
+        m_numrays += numrays * 2;
+    }
+
+    std::vector<float> RayDistribution::CountsToWeights(std::vector<int> const& counts)
+    {
+        long long total = 0;
+        for (int count : counts)
+            total += count;
+
+        std::vector<float> weights;
+        if (total == 0)
+            return weights;
+
+        // Mean 1 over the primitives, like the plain SAH weight
+        float scale = (1.f - kUniformWeight) * counts.size() / total;
+        weights.resize(counts.size());
+        for (size_t i = 0; i < counts.size(); ++i)
+            weights[i] = kUniformWeight + counts[i] * scale;
+
+        return weights;
+    }
+
+    std::vector<float> RayDistribution::GetTriangleWeights(int mesh) const
+    {
+        return CountsToWeights(m_triangle_hits[mesh]);
+    }
+
+    std::vector<float> RayDistribution::GetInstanceWeights() const
+    {
+        return CountsToWeights(m_instance_hits);
+    }
+}
@@ -0,0 +1,116 @@
+/**********************************************************************
+ Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ ********************************************************************/
+#pragma once
+
+#ifndef RAY_DISTRIBUTION_H
+#define RAY_DISTRIBUTION_H
+
+#include <memory>
+#include <vector>
+#include "lbvh.h"
+#include "Mesh.h"
+
+namespace RadeonRays
+{
+    ///< Input to the ray distribution heuristic (RDH, Bittner and Havran 2009).
+    ///< SAH assumes rays arrive uniformly from all directions, while a render
+    ///< with a fixed camera spends most rays on a few regions. A small sample
+    ///< of primary and first bounce rays is traced against linear BVHs of the
+    ///< two level scene, and the hits of every triangle and every instance
+    ///< become primitive weights of the SAH builders, see
+    ///< Bvh::SetPrimitiveWeights.
+    class RayDistribution
+    {
+    public:
+        // Builds the linear BVHs. meshes and instances are referenced, not
+        // copied, and have to stay unchanged while the object is used
+        RayDistribution(std::vector<GLSLPT::Mesh*> const& meshes, std::vector<GLSLPT::MeshInstance> const& instances);
+
+        // Trace the primary rays and one diffuse bounce off every hit, counting
+        // the hits of every triangle and instance
+        void Sample(std::vector<Vec3> const& origins, std::vector<Vec3> const& directions);
+
+        // Weights for Bvh::SetPrimitiveWeights, one per triangle of the mesh or
+        // per instance. Empty if no sampled ray hit any of them
+        std::vector<float> GetTriangleWeights(int mesh) const;
+        std::vector<float> GetInstanceWeights() const;
+
+        int GetNumRays() const;
+        int GetNumHits() const;
+
+    private:
+        struct Hit
+        {
+            int instance;
+            int triangle;
+            float t;
+            // Geometric normal in world space, not normalized
+            Vec3 normal;
+        };
+
+        // Columns of the inverse of an instance's linear part, and its translation
+        struct InverseTransform
+        {
+            Vec3 columns[3];
+            Vec3 translation;
+        };
+
+        // Closest hit along the ray, instance -1 if there is none
+        Hit Trace(Vec3 const& origin, Vec3 const& direction) const;
+        // Closer hits of an instance's mesh replace hit
+        void TraceInstance(int instance, Vec3 const& origin, Vec3 const& direction, Hit& hit) const;
+
+        // Closest hit traversal, leaf(prim, closest) tests a primitive and shortens closest on a hit
+        template <typename LeafTest>
+        static void Traverse(Bvh const& bvh, Vec3 const& origin, Vec3 const& direction, float& closest, LeafTest leaf);
+
+        // Hits become weights of mean 1, see the definition
+        static std::vector<float> CountsToWeights(std::vector<int> const& counts);
+
+        std::vector<GLSLPT::Mesh*> const& m_meshes;
+        std::vector<GLSLPT::MeshInstance> const& m_instances;
+
+        std::vector<std::unique_ptr<Lbvh>> m_mesh_bvhs;
+        Lbvh m_instance_bvh;
+        std::vector<InverseTransform> m_inverse_transforms;
+
+        std::vector<std::vector<int>> m_triangle_hits;
+        std::vector<int> m_instance_hits;
+        int m_numrays = 0;
+        int m_numhits = 0;
+
+        RayDistribution(RayDistribution const&) = delete;
+        RayDistribution& operator = (RayDistribution const&) = delete;
+    };
+
+    inline int RayDistribution::GetNumRays() const
+    {
+        return m_numrays;
+    }
+
+    inline int RayDistribution::GetNumHits() const
+    {
+        return m_numhits;
+    }
+}
+
+#endif // RAY_DISTRIBUTION_H
@@ -0,0 +1,513 @@
+/**********************************************************************
+ Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ ********************************************************************/
+
+#include <algorithm>
+#include <limits>
+#include "sah_binning.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RR_SAH_SSE 1
+#include <emmintrin.h>
+#endif
+
+#if RR_SAH_SSE && (defined(_MSC_VER) || defined(__GNUC__) || defined(__clang__))
+#define RR_SAH_AVX 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define RR_TARGET_AVX
+#else
+#define RR_TARGET_AVX __attribute__((target("avx")))
+#endif
+#endif
+
+namespace RadeonRays
+{
+    // Per-thread bins, allocated on first use and only grown afterwards
+    struct SahScratch
+    {
+        std::vector<float> bins;
+        std::vector<int> counts;
+        std::vector<float> rightarea;
+        // Sparse path: (bin, prim) pairs of a small node
+        std::vector<std::pair<int, int>> binned;
+    };
+
+    // Node setup shared by all kernels
+    struct SahSetup
+    {
+        float rootmin[4];
+        float invrange[4];
+        bool active[3];
+        float invarea;
+    };
+
+    static SahScratch& GetThreadScratch()
+    {
+        static thread_local SahScratch scratch;
+        return scratch;
+    }
+
+    static SahScratch& GetScratch(int numbins)
+    {
+        SahScratch& scratch = GetThreadScratch();
+
+        size_t numslots = 3 * (size_t)numbins;
+        if (scratch.counts.size() < numslots)
+        {
+            scratch.bins.resize(numslots * 8);
+            scratch.counts.resize(numslots);
+            scratch.rightarea.resize(numbins);
+        }
+
+        std::fill(scratch.bins.begin(), scratch.bins.begin() + numslots * 8, std::numeric_limits<float>::max());
+        std::fill(scratch.counts.begin(), scratch.counts.begin() + numslots, 0);
+        return scratch;
+    }
+
+    // Same formula as bbox::surface_area so every kernel gives bit-identical results
+    static inline float BoxArea(float const* lo, float const* neghi)
+    {
+        float x = -neghi[0] - lo[0];
+        float y = -neghi[1] - lo[1];
+        float z = -neghi[2] - lo[2];
+        return 2.f * (x * y + x * z + y * z);
+    }
+
+    // Candidate i splits between bin i and i + 1, keep it if it beats the best so far
+    static inline void EvaluateSplit(float leftarea, int leftcount, float rightarea, int rightcount, float traversal_cost, float invarea,
+        int axis, int i, float& sah, int& dim, int& binidx)
+    {
+        // An empty side gives no split, the original code rejected it via a NaN SAH
+        if (leftcount == 0 || rightcount == 0)
+            return;
+
+        float sahtmp = traversal_cost + (leftcount * leftarea + rightcount * rightarea) * invarea;
+
+        if (sahtmp < sah)
+        {
+            dim = axis;
+            binidx = i;
+            sah = sahtmp;
+        }
+    }
+
+    // Nodes with fewer prims than bins leave most bins empty. A candidate
+    // plane followed by empty bins has the same SAH as the ones after it and
+    // the dense sweep keeps the first, so only planes right after a non-empty
+    // bin need evaluating. Sorting the prims by bin visits exactly those and
+    // gives the same split as the dense kernels without touching every bin.
+    static void FindSplitSparse(SahSetup const& setup, SahPrimData const& prims, int const* primindices, int startidx, int numprims,
+        int numbins, float traversal_cost, float& sah, int& dim, int& binidx)
+    {
+        SahScratch& scratch = GetThreadScratch();
+        std::vector<std::pair<int, int>>& binned = scratch.binned;
+        binned.resize(numprims);
+        if (scratch.rightarea.size() < (size_t)numprims)
+            scratch.rightarea.resize(numprims);
+
+        float const fnumbins = static_cast<float>(numbins);
+        float const maxbin = static_cast<float>(numbins - 1);
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (!setup.active[axis]) continue;
+
+            for (int i = 0; i < numprims; ++i)
+            {
+                int idx = primindices[startidx + i];
+                float c = prims.m_centroids[idx * 4 + axis];
+                binned[i] = std::make_pair((int)std::min<float>(fnumbins * ((c - setup.rootmin[axis]) * setup.invrange[axis]), maxbin), idx);
+            }
+
+            std::sort(binned.begin(), binned.end());
+
+            // rightarea[i] is the area of everything after the bin of binned[i]
+            float box[8];
+            std::fill(box, box + 8, std::numeric_limits<float>::max());
+            for (int i = numprims - 1; i > 0; --i)
+            {
+                float const* b = &prims.m_bounds[binned[i].second * 8];
+                for (int k = 0; k < 8; ++k)
+                    box[k] = std::min(box[k], b[k]);
+                if (binned[i - 1].first != binned[i].first)
+                    scratch.rightarea[i - 1] = BoxArea(box, box + 4);
+            }
+
+            std::fill(box, box + 8, std::numeric_limits<float>::max());
+            for (int i = 0; i < numprims - 1; ++i)
+            {
+                float const* b = &prims.m_bounds[binned[i].second * 8];
+                for (int k = 0; k < 8; ++k)
+                    box[k] = std::min(box[k], b[k]);
+
+                // Last prim of its bin
+                if (binned[i + 1].first != binned[i].first)
+                    EvaluateSplit(BoxArea(box, box + 4), i + 1, scratch.rightarea[i], numprims - i - 1, traversal_cost, setup.invarea, axis, binned[i].first, sah, dim, binidx);
+            }
+        }
+    }
+
+    static void FindSplitScalar(SahSetup const& setup, SahPrimData const& prims, int const* primindices, int startidx, int numprims,
+        int numbins, float traversal_cost, float& sah, int& dim, int& binidx)
+    {
+        SahScratch& scratch = GetScratch(numbins);
+        float* bins = scratch.bins.data();
+        int* counts = scratch.counts.data();
+        float const fnumbins = static_cast<float>(numbins);
+        float const maxbin = static_cast<float>(numbins - 1);
+
+        for (int i = startidx; i < startidx + numprims; ++i)
+        {
+            int idx = primindices[i];
+            float const* c = &prims.m_centroids[idx * 4];
+            float const* b = &prims.m_bounds[idx * 8];
+
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                int bin = (int)std::min<float>(fnumbins * ((c[axis] - setup.rootmin[axis]) * setup.invrange[axis]), maxbin);
+                float* dst = bins + (axis * numbins + bin) * 8;
+
+                for (int k = 0; k < 8; ++k)
+                    dst[k] = std::min(dst[k], b[k]);
+
+                ++counts[axis * numbins + bin];
+            }
+        }
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (!setup.active[axis]) continue;
+
+            float const* axisbins = bins + axis * numbins * 8;
+            int const* axiscounts = counts + axis * numbins;
+
+            float box[8];
+            std::fill(box, box + 8, std::numeric_limits<float>::max());
+            for (int i = numbins - 1; i > 0; --i)
+            {
+                for (int k = 0; k < 8; ++k)
+                    box[k] = std::min(box[k], axisbins[i * 8 + k]);
+                scratch.rightarea[i - 1] = BoxArea(box, box + 4);
+            }
+
+            std::fill(box, box + 8, std::numeric_limits<float>::max());
+            int leftcount = 0;
+            for (int i = 0; i < numbins - 1; ++i)
+            {
+                for (int k = 0; k < 8; ++k)
+                    box[k] = std::min(box[k], axisbins[i * 8 + k]);
+                leftcount += axiscounts[i];
+                EvaluateSplit(BoxArea(box, box + 4), leftcount, scratch.rightarea[i], numprims - leftcount, traversal_cost, setup.invarea, axis, i, sah, dim, binidx);
+            }
+        }
+    }
+
+#if RR_SAH_SSE
+    static inline float BoxArea(__m128 lo, __m128 neghi)
+    {
+        float l[4], h[4];
+        _mm_storeu_ps(l, lo);
+        _mm_storeu_ps(h, neghi);
+        return BoxArea(l, h);
+    }
+
+    static void FindSplitSse(SahSetup const& setup, SahPrimData const& prims, int const* primindices, int startidx, int numprims,
+        int numbins, float traversal_cost, float& sah, int& dim, int& binidx)
+    {
+        SahScratch& scratch = GetScratch(numbins);
+        float* bins = scratch.bins.data();
+        int* counts = scratch.counts.data();
+
+        __m128 const fnumbins = _mm_set1_ps(static_cast<float>(numbins));
+        __m128 const maxbin = _mm_set1_ps(static_cast<float>(numbins - 1));
+        __m128 const rootmin = _mm_loadu_ps(setup.rootmin);
+        __m128 const invrange = _mm_loadu_ps(setup.invrange);
+        __m128 const zero = _mm_setzero_ps();
+
+        for (int i = startidx; i < startidx + numprims; ++i)
+        {
+            int idx = primindices[i];
+
+            // Bin index for all three axes at once
+            __m128 c = _mm_loadu_ps(&prims.m_centroids[idx * 4]);
+            __m128 f = _mm_mul_ps(fnumbins, _mm_mul_ps(_mm_sub_ps(c, rootmin), invrange));
+            f = _mm_max_ps(_mm_min_ps(f, maxbin), zero);
+            int bin[4];
+            _mm_storeu_si128((__m128i*)bin, _mm_cvttps_epi32(f));
+
+            __m128 lo = _mm_loadu_ps(&prims.m_bounds[idx * 8]);
+            __m128 neghi = _mm_loadu_ps(&prims.m_bounds[idx * 8 + 4]);
+
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                float* dst = bins + (axis * numbins + bin[axis]) * 8;
+                _mm_storeu_ps(dst, _mm_min_ps(_mm_loadu_ps(dst), lo));
+                _mm_storeu_ps(dst + 4, _mm_min_ps(_mm_loadu_ps(dst + 4), neghi));
+                ++counts[axis * numbins + bin[axis]];
+            }
+        }
+
+        __m128 const empty = _mm_set1_ps(std::numeric_limits<float>::max());
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (!setup.active[axis]) continue;
+
+            float const* axisbins = bins + axis * numbins * 8;
+            int const* axiscounts = counts + axis * numbins;
+
+            __m128 lo = empty;
+            __m128 neghi = empty;
+            for (int i = numbins - 1; i > 0; --i)
+            {
+                lo = _mm_min_ps(lo, _mm_loadu_ps(axisbins + i * 8));
+                neghi = _mm_min_ps(neghi, _mm_loadu_ps(axisbins + i * 8 + 4));
+                scratch.rightarea[i - 1] = BoxArea(lo, neghi);
+            }
+
+            lo = neghi = empty;
+            int leftcount = 0;
+            for (int i = 0; i < numbins - 1; ++i)
+            {
+                lo = _mm_min_ps(lo, _mm_loadu_ps(axisbins + i * 8));
+                neghi = _mm_min_ps(neghi, _mm_loadu_ps(axisbins + i * 8 + 4));
+                leftcount += axiscounts[i];
+                EvaluateSplit(BoxArea(lo, neghi), leftcount, scratch.rightarea[i], numprims - leftcount, traversal_cost, setup.invarea, axis, i, sah, dim, binidx);
+            }
+        }
+    }
+#endif
+
+#if RR_SAH_AVX
+    RR_TARGET_AVX static inline float BoxArea(__m256 box)
+    {
+        float b[8];
+        _mm256_storeu_ps(b, box);
+        return BoxArea(b, b + 4);
+    }
+
+    // Same as the SSE kernel but a whole (min, -max) box fits in one register
+    RR_TARGET_AVX static void FindSplitAvx(SahSetup const& setup, SahPrimData const& prims, int const* primindices, int startidx, int numprims,
+        int numbins, float traversal_cost, float& sah, int& dim, int& binidx)
+    {
+        SahScratch& scratch = GetScratch(numbins);
+        float* bins = scratch.bins.data();
+        int* counts = scratch.counts.data();
+
+        __m128 const fnumbins = _mm_set1_ps(static_cast<float>(numbins));
+        __m128 const maxbin = _mm_set1_ps(static_cast<float>(numbins - 1));
+        __m128 const rootmin = _mm_loadu_ps(setup.rootmin);
+        __m128 const invrange = _mm_loadu_ps(setup.invrange);
+        __m128 const zero = _mm_setzero_ps();
+
+        for (int i = startidx; i < startidx + numprims; ++i)
+        {
+            int idx = primindices[i];
+
+            __m128 c = _mm_loadu_ps(&prims.m_centroids[idx * 4]);
+            __m128 f = _mm_mul_ps(fnumbins, _mm_mul_ps(_mm_sub_ps(c, rootmin), invrange));
+            f = _mm_max_ps(_mm_min_ps(f, maxbin), zero);
+            int bin[4];
+            _mm_storeu_si128((__m128i*)bin, _mm_cvttps_epi32(f));
+
+            __m256 box = _mm256_loadu_ps(&prims.m_bounds[idx * 8]);
+
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                float* dst = bins + (axis * numbins + bin[axis]) * 8;
+                _mm256_storeu_ps(dst, _mm256_min_ps(_mm256_loadu_ps(dst), box));
+                ++counts[axis * numbins + bin[axis]];
+            }
+        }
+
+        __m256 const empty = _mm256_set1_ps(std::numeric_limits<float>::max());
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (!setup.active[axis]) continue;
+
+            float const* axisbins = bins + axis * numbins * 8;
+            int const* axiscounts = counts + axis * numbins;
+
+            __m256 box = empty;
+            for (int i = numbins - 1; i > 0; --i)
+            {
+                box = _mm256_min_ps(box, _mm256_loadu_ps(axisbins + i * 8));
+                scratch.rightarea[i - 1] = BoxArea(box);
+            }
+
+            box = empty;
+            int leftcount = 0;
+            for (int i = 0; i < numbins - 1; ++i)
+            {
+                box = _mm256_min_ps(box, _mm256_loadu_ps(axisbins + i * 8));
+                leftcount += axiscounts[i];
+                EvaluateSplit(BoxArea(box), leftcount, scratch.rightarea[i], numprims - leftcount, traversal_cost, setup.invarea, axis, i, sah, dim, binidx);
+            }
+        }
+    }
+
+    static bool CpuSupportsAvx()
+    {
+#if defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 1);
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        bool avx = (info[2] & (1 << 28)) != 0;
+        // The OS has to save the upper halves of the registers too
+        return osxsave && avx && (_xgetbv(0) & 0x6) == 0x6;
+#else
+        return __builtin_cpu_supports("avx") != 0;
+#endif
+    }
+#endif
+
+    bool IsSahKernelSupported(SahKernel kernel)
+    {
+        switch (kernel)
+        {
+        case SahKernel::kLegacy:
+        case SahKernel::kScalar:
+            return true;
+        case SahKernel::kSse:
+#if RR_SAH_SSE
+            return true;
+#else
+            return false;
+#endif
+        case SahKernel::kAvx:
+#if RR_SAH_AVX
+        {
+            static bool const supported = CpuSupportsAvx();
+            return supported;
+        }
+#else
+            return false;
+#endif
+        }
+
+        return false;
+    }
+
+    SahKernel GetBestSahKernel()
+    {
+        if (IsSahKernelSupported(SahKernel::kAvx))
+            return SahKernel::kAvx;
+        if (IsSahKernelSupported(SahKernel::kSse))
+            return SahKernel::kSse;
+        return SahKernel::kScalar;
+    }
+
+    char const* GetSahKernelName(SahKernel kernel)
+    {
+        switch (kernel)
+        {
+        case SahKernel::kLegacy: return "legacy";
+        case SahKernel::kScalar: return "scalar";
+        case SahKernel::kSse: return "sse";
+        case SahKernel::kAvx: return "avx";
+        }
+
+        return "unknown";
+    }
+
+    void SahPrimData::Init(bbox const* bounds, Vec3 const* centroids, int numprims)
+    {
+        m_bounds.resize(numprims * (size_t)8);
+        m_centroids.resize(numprims * (size_t)4);
+
+#pragma omp parallel for
+        for (int i = 0; i < numprims; ++i)
+        {
+            float* b = &m_bounds[i * (size_t)8];
+            b[0] = bounds[i].pmin.x;
+            b[1] = bounds[i].pmin.y;
+            b[2] = bounds[i].pmin.z;
+            b[3] = 0.f;
+            b[4] = -bounds[i].pmax.x;
+            b[5] = -bounds[i].pmax.y;
+            b[6] = -bounds[i].pmax.z;
+            b[7] = 0.f;
+
+            float* c = &m_centroids[i * (size_t)4];
+            c[0] = centroids[i].x;
+            c[1] = centroids[i].y;
+            c[2] = centroids[i].z;
+            c[3] = 0.f;
+        }
+    }
+
+    void SahPrimData::Clear()
+    {
+        std::vector<float>().swap(m_bounds);
+        std::vector<float>().swap(m_centroids);
+    }
+
+    bool FindBinnedSahSplit(SahKernel kernel, SahPrimData const& prims, int const* primindices, int startidx, int numprims,
+        bbox const& bounds, bbox const& centroid_bounds, int numbins, float traversal_cost, int& dim, int& binidx, float& sah)
+    {
+        Vec3 centroid_extents = centroid_bounds.extents();
+        if (Vec3::Dot(centroid_extents, centroid_extents) == 0.f)
+            return false;
+
+        SahSetup setup;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            setup.rootmin[axis] = centroid_bounds.pmin[axis];
+            // Degenerate axes still get binned (into bin 0) but are not evaluated
+            setup.active[axis] = centroid_extents[axis] != 0.f;
+            setup.invrange[axis] = setup.active[axis] ? 1.f / centroid_extents[axis] : 0.f;
+        }
+        setup.rootmin[3] = setup.invrange[3] = 0.f;
+        setup.invarea = 1.f / bounds.surface_area();
+
+        dim = 0;
+        binidx = -1;
+        sah = std::numeric_limits<float>::max();
+
+        if (numprims < numbins)
+        {
+            FindSplitSparse(setup, prims, primindices, startidx, numprims, numbins, traversal_cost, sah, dim, binidx);
+            return binidx != -1;
+        }
+
+        switch (kernel)
+        {
+#if RR_SAH_AVX
+        case SahKernel::kAvx:
+            FindSplitAvx(setup, prims, primindices, startidx, numprims, numbins, traversal_cost, sah, dim, binidx);
+            break;
+#endif
+#if RR_SAH_SSE
+        case SahKernel::kSse:
+            FindSplitSse(setup, prims, primindices, startidx, numprims, numbins, traversal_cost, sah, dim, binidx);
+            break;
+#endif
+        default:
+            FindSplitScalar(setup, prims, primindices, startidx, numprims, numbins, traversal_cost, sah, dim, binidx);
+            break;
+        }
+
+        return binidx != -1;
+    }
+}
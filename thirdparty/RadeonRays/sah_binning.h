@@ -0,0 +1,74 @@
+/**********************************************************************
+ Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ ********************************************************************/
+#pragma once
+
+#ifndef SAH_BINNING_H
+#define SAH_BINNING_H
+
+#include <vector>
+#include "bbox.h"
+
+namespace RadeonRays
+{
+    // Kernels for binned SAH evaluation. kLegacy is the original per-node
+    // allocating path in Bvh::FindSahSplit, the others work on SahPrimData
+    // with per-thread scratch. All of them pick the same split.
+    enum class SahKernel
+    {
+        kLegacy,
+        kScalar,
+        kSse,
+        kAvx
+    };
+
+    // Fastest kernel supported by the CPU we run on
+    SahKernel GetBestSahKernel();
+    bool IsSahKernelSupported(SahKernel kernel);
+    char const* GetSahKernelName(SahKernel kernel);
+
+    // Prim data laid out for binning: 8 floats of bounds per prim
+    // (min xyz, 0, -max xyz, 0) and 4 floats of centroid (xyz, 0).
+    // With the max corner negated a single min grows the whole box.
+    // The layout is array of structures on purpose: nodes reach their prims
+    // through primindices in no particular order, so a prim is fetched as one
+    // box row and one centroid row rather than nine scattered SoA streams,
+    // and each box is scattered into three bins that can't be vectorized
+    // across prims anyway.
+    class SahPrimData
+    {
+    public:
+        void Init(bbox const* bounds, Vec3 const* centroids, int numprims);
+        void Clear();
+
+        std::vector<float> m_bounds;
+        std::vector<float> m_centroids;
+    };
+
+    // Evaluates numbins - 1 candidate planes on every axis of the centroid bounds
+    // for prims primindices[startidx, startidx + numprims). Returns false if
+    // no split was found, otherwise the axis, the last bin on the left side
+    // and the SAH of the split
+    bool FindBinnedSahSplit(SahKernel kernel, SahPrimData const& prims, int const* primindices, int startidx, int numprims,
+        bbox const& bounds, bbox const& centroid_bounds, int numbins, float traversal_cost, int& dim, int& binidx, float& sah);
+}
+
+#endif // SAH_BINNING_H
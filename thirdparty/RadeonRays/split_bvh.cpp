@@ -23,59 +23,86 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "split_bvh.h"
+#include "Simd.h"
 
 using namespace std;
 
 namespace RadeonRays
 {
+    // Subtrees with more refs than this are built as separate tasks
+    static int constexpr kParallelBuildCutoff = 4096;
+    // Object split bins of FindObjectSahSplitSimd live on the stack, more bins take the scalar path
+    static int constexpr kMaxSimdObjectBins = 256;
+
     void SplitBvh::BuildImpl(bbox const* bounds, int numbounds)
     {
+        m_task_storage.clear();
+        m_packed_indices.clear();
+        m_nodecnt = 0;
+
         // Initialize prim refs structures
-        PrimRefArray primrefs(numbounds);
+        TaskStorage* storage = NewTaskStorage();
+        PrimRefArray& primrefs = storage->primrefs;
+        primrefs.resize(numbounds);
 
         // Keep centroids to speed up partitioning
         std::vector<Vec3> centroids(numbounds);
         bbox centroid_bounds;
 
+        centers(bounds, numbounds, &centroids[0], centroid_bounds);
         for (auto i = 0; i < numbounds; ++i)
         {
-            primrefs[i] = PrimRef{ bounds[i], bounds[i].center(), i };
-
-            auto c = bounds[i].center();
-            centroid_bounds.grow(c);
+            primrefs[i] = PrimRef{ bounds[i], centroids[i], i };
         }
 
         m_num_nodes_for_regular = (2 * numbounds - 1);
-        m_num_nodes_required = (int)(m_num_nodes_for_regular * (1.f + m_extra_refs_budget));
-
-        InitNodeAllocator(m_num_nodes_required);
+        int refbudget = (int)(numbounds * m_extra_refs_budget);
 
         SplitRequest init = { 0, numbounds, nullptr, m_bounds, centroid_bounds, 0 };
 
         // Start from the top
-        BuildNode(init, primrefs);
+#ifdef _OPENMP
+        if (!omp_in_parallel() && numbounds > kParallelBuildCutoff)
+        {
+#pragma omp parallel
+#pragma omp single nowait
+            BuildNode(init, refbudget, *storage);
+        }
+        else
+#endif
+        {
+            BuildNode(init, refbudget, *storage);
+        }
+
+        RelocateNodes();
     }
 
-    void SplitBvh::BuildNode(SplitRequest& req, PrimRefArray& primrefs)
+    int SplitBvh::BuildNode(SplitRequest& req, int refbudget, TaskStorage& storage)
     {
+        PrimRefArray& primrefs = storage.primrefs;
+
         // Update current height
-        m_height = std::max(m_height, req.level);
+        UpdateHeight(req.level);
 
         // Allocate new node
-        Node* node = AllocateNode();
+        int nodeidx = (int)storage.nodes.size();
+        Node* node = AllocateTaskNode(storage);
         node->bounds = req.bounds;
 
         // Create leaf node if we have enough prims
         if (req.numprims < 4)
         {
             node->type = kLeaf;
-            node->startidx = (int)m_packed_indices.size();
+            node->startidx = (int)storage.indices.size();
             node->numprims = req.numprims;
 
             for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
             {
-                m_packed_indices.push_back(primrefs[i].idx);
+                storage.indices.push_back(primrefs[i].idx);
             }
         }
         else
@@ -86,7 +113,8 @@ namespace RadeonRays
             int axis = req.centroid_bounds.maxdim();
             float border = req.centroid_bounds.center()[axis];
 
-            SahSplit os = FindObjectSahSplit(req, primrefs);
+            bool simd = m_sah_kernel == SahKernel::kSse || m_sah_kernel == SahKernel::kAvx;
+            SahSplit os = simd ? FindObjectSahSplitSimd(req, primrefs) : FindObjectSahSplit(req, primrefs);
             SahSplit ss;
             auto split_type = SplitType::kObject;
 
@@ -95,10 +123,10 @@ namespace RadeonRays
             // 2. We found spatial split
             // 3. It is better than object split
             // 4. Object split is not good enought (too much overlap)
-            // 5. Our node budget still allows us to split references
-            if (req.level < m_max_split_depth && m_nodecnt < m_num_nodes_required && os.overlap > m_min_overlap)
+            // 5. Our ref budget still allows us to split references
+            if (req.level < m_max_split_depth && refbudget > 0 && os.overlap > m_min_overlap)
             {
-                ss = FindSpatialSahSplit(req, primrefs);
+                ss = simd ? FindSpatialSahSplitSimd(req, primrefs) : FindSpatialSahSplit(req, primrefs);
 
                 if (!isnan(ss.split) &&
                     ss.sah < os.sah)
@@ -120,6 +148,8 @@ namespace RadeonRays
                 int extra_refs = 0;
                 SplitPrimRefs(ss, req, primrefs, extra_refs);
                 req.numprims += extra_refs;
+                // The budget is soft, a single split may overshoot what is left
+                refbudget = std::max(refbudget - extra_refs, 0);
                 border = ss.split;
                 axis = ss.dim;
             }
@@ -197,24 +227,59 @@ namespace RadeonRays
             }
 
             // Left request
-            SplitRequest leftrequest = { req.startidx, splitidx - req.startidx, &node->lc, leftbounds, leftcentroid_bounds, req.level + 1 };
+            SplitRequest leftrequest = { req.startidx, splitidx - req.startidx, nullptr, leftbounds, leftcentroid_bounds, req.level + 1 };
             // Right request
-            SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightcentroid_bounds, req.level + 1 };
+            SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), nullptr, rightbounds, rightcentroid_bounds, req.level + 1 };
 
 
-            // The order is very important here since right node uses the space at the end of the array to partition
+            // Split the remaining budget by ref count, this keeps the result
+            // independent of the order in which subtrees are built
+            int leftbudget = (int)((long long)refbudget * leftrequest.numprims / req.numprims);
+            int rightbudget = refbudget - leftbudget;
+
+            if (req.numprims > kParallelBuildCutoff)
             {
-                BuildNode(rightrequest, primrefs);
-            }
+                // Left refs move to a new task storage so both sides can split
+                // and append refs independently. Partitioning direction depends on
+                // the parity of startidx, keep it so the tree matches a serial build
+                int offset = leftrequest.startidx & 0x1;
+                TaskStorage* leftstorage = NewTaskStorage();
+                leftstorage->primrefs.reserve(offset + leftrequest.numprims * 2);
+                leftstorage->primrefs.resize(offset);
+                leftstorage->primrefs.insert(leftstorage->primrefs.end(), primrefs.begin() + leftrequest.startidx, primrefs.begin() + splitidx);
+                leftrequest.startidx = offset;
+                node->lc = -leftstorage->id - 1;
+
+#pragma omp task firstprivate(leftrequest, leftbudget, leftstorage)
+                {
+                    BuildNode(leftrequest, leftbudget, *leftstorage);
+                    PrimRefArray().swap(leftstorage->primrefs);
+                }
+
+                node->rc = BuildNode(rightrequest, rightbudget, storage);
 
+#pragma omp taskwait
+            }
+            else
             {
-                // Put those to stack
-                BuildNode(leftrequest, primrefs);
+                // The order is very important here since right node uses the space at the end of the array to partition
+                node->rc = BuildNode(rightrequest, rightbudget, storage);
+                node->lc = BuildNode(leftrequest, leftbudget, storage);
             }
         }
 
-        // Set parent ptr if any
-        if (req.ptr) *req.ptr = node;
+        return nodeidx;
+    }
+
+    float SplitBvh::GetRefWeight(SplitRequest const& req, PrimRefArray const& refs) const
+    {
+        if (m_prim_weights.empty())
+            return static_cast<float>(req.numprims);
+
+        float weight = 0.f;
+        for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
+            weight += m_prim_weights[refs[i].idx];
+        return weight;
     }
 
     SplitBvh::SahSplit SplitBvh::FindObjectSahSplit(SplitRequest const& req, PrimRefArray const& refs) const
@@ -240,11 +305,11 @@ namespace RadeonRays
             return split;
         }
 
-        // Bin has bbox and occurence count
+        // Bin has bbox and occurence count, the sum of ref weights
         struct Bin
         {
             bbox bounds;
-            int count;
+            float count;
         };
 
         // Keep bins for each dimension
@@ -253,8 +318,11 @@ namespace RadeonRays
         bins[1].resize(m_num_bins);
         bins[2].resize(m_num_bins);
 
-        // Precompute inverse parent area
+        // Precompute inverse parent area, weights are scaled to average 1 within the node
+        float totalweight = GetRefWeight(req, refs);
         auto invarea = 1.f / req.bounds.surface_area();
+        if (!m_prim_weights.empty() && totalweight > 0.f)
+            invarea *= req.numprims / totalweight;
         // Precompute min point
         auto rootmin = req.centroid_bounds.pmin;
 
@@ -272,7 +340,7 @@ namespace RadeonRays
             // Initialize bins
             for (int i = 0; i < m_num_bins; ++i)
             {
-                bins[axis][i].count = 0;
+                bins[axis][i].count = 0.f;
                 bins[axis][i].bounds = bbox();
             }
 
@@ -282,7 +350,7 @@ namespace RadeonRays
                 auto idx = i;
                 auto binidx = (int)std::min<float>(static_cast<float>(m_num_bins) * ((refs[idx].center[axis] - rootminc) * invcentroid_rng), static_cast<float>(m_num_bins - 1));
 
-                ++bins[axis][binidx].count;
+                bins[axis][binidx].count += GetPrimitiveWeight(refs[idx].idx);
                 bins[axis][binidx].bounds.grow(refs[idx].bounds);
             }
 
@@ -297,8 +365,8 @@ namespace RadeonRays
             }
 
             bbox leftbox = bbox();
-            int  leftcount = 0;
-            int  rightcount = req.numprims;
+            float leftcount = 0.f;
+            float rightcount = totalweight;
 
             // Start best SAH search
             // i is current split candidate (split between i and i + 1)
@@ -352,6 +420,9 @@ namespace RadeonRays
         // Extents
         Vec3 extents = req.bounds.extents();
         auto invarea = 1.f / req.bounds.surface_area();
+        float totalweight = GetRefWeight(req, refs);
+        if (!m_prim_weights.empty() && totalweight > 0.f)
+            invarea *= req.numprims / totalweight;
 
         // If there are too few primitives don't split them
         if (Vec3::Dot(extents, extents) == 0.f)
@@ -359,12 +430,12 @@ namespace RadeonRays
             return split;
         }
 
-        // Bin has start and exit counts + bounds
+        // Bin has start and exit counts + bounds, counts are sums of ref weights
         struct Bin
         {
             bbox bounds;
-            int enter;
-            int exit;
+            float enter;
+            float exit;
         };
 
         Bin bins[3][kNumBins];
@@ -380,8 +451,8 @@ namespace RadeonRays
             for (int i = 0; i < kNumBins; ++i)
             {
                 bins[axis][i].bounds = bbox();
-                bins[axis][i].enter = 0;
-                bins[axis][i].exit = 0;
+                bins[axis][i].enter = 0.f;
+                bins[axis][i].exit = 0.f;
             }
         }
 
@@ -417,8 +488,8 @@ namespace RadeonRays
                 // Add the last piece into the last bin
                 bins[axis][(int)lastbin[axis]].bounds.grow(tempref.bounds);
                 // Adjust enter & exit counters
-                bins[axis][(int)firstbin[axis]].enter++;
-                bins[axis][(int)lastbin[axis]].exit++;
+                bins[axis][(int)firstbin[axis]].enter += GetPrimitiveWeight(primref.idx);
+                bins[axis][(int)lastbin[axis]].exit += GetPrimitiveWeight(primref.idx);
             }
         }
 
@@ -442,8 +513,8 @@ namespace RadeonRays
             }
 
             bbox leftbox = bbox();
-            int  leftcount = 0;
-            int  rightcount = req.numprims;
+            float leftcount = 0.f;
+            float rightcount = totalweight;
 
             // Start moving border to the right
             for (int i = 1; i < kNumBins; ++i)
@@ -455,8 +526,8 @@ namespace RadeonRays
                 // Adjust right box
                 rightcount -= bins[axis][i - 1].exit;
                 // Calc SAH
-                float sah = m_traversal_cost + (leftbox.surface_area() *
-                    +rightbounds[i - 1].surface_area() * rightcount) * invarea;
+                float sah = m_traversal_cost + (leftbox.surface_area() * leftcount +
+                    rightbounds[i - 1].surface_area() * rightcount) * invarea;
 
                 // Update SAH if it is needed
                 if (sah < split.sah)
@@ -474,6 +545,210 @@ namespace RadeonRays
         return split;
     }
 
+    SplitBvh::SahSplit SplitBvh::FindObjectSahSplitSimd(SplitRequest const& req, PrimRefArray const& refs) const
+    {
+        if (m_num_bins > kMaxSimdObjectBins)
+            return FindObjectSahSplit(req, refs);
+
+        int splitidx = -1;
+        auto sah = std::numeric_limits<float>::max();
+        SahSplit split;
+        split.dim = 0;
+        split.split = std::numeric_limits<float>::quiet_NaN();
+        split.sah = sah;
+
+        Vec3 centroid_extents = req.centroid_bounds.extents();
+        if (Vec3::Dot(centroid_extents, centroid_extents) == 0.f)
+        {
+            return split;
+        }
+
+        // Axes are evaluated one after the other, so one set of bins is enough
+        Box4 bins[kMaxSimdObjectBins];
+        float counts[kMaxSimdObjectBins];
+        Box4 rightbounds[kMaxSimdObjectBins - 1];
+
+        float totalweight = GetRefWeight(req, refs);
+        auto invarea = 1.f / req.bounds.surface_area();
+        if (!m_prim_weights.empty() && totalweight > 0.f)
+            invarea *= req.numprims / totalweight;
+        auto rootmin = req.centroid_bounds.pmin;
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float rootminc = rootmin[axis];
+            auto centroid_rng = centroid_extents[axis];
+            auto invcentroid_rng = 1.f / centroid_rng;
+
+            if (centroid_rng == 0.f) continue;
+
+            for (int i = 0; i < m_num_bins; ++i)
+            {
+                counts[i] = 0.f;
+                bins[i] = Box4();
+            }
+
+            for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
+            {
+                auto binidx = (int)std::min<float>(static_cast<float>(m_num_bins) * ((refs[i].center[axis] - rootminc) * invcentroid_rng), static_cast<float>(m_num_bins - 1));
+
+                counts[binidx] += GetPrimitiveWeight(refs[i].idx);
+                bins[binidx].Grow(Box4(&refs[i].bounds.pmin.x));
+            }
+
+            Box4 rightbox;
+            for (int i = m_num_bins - 1; i > 0; --i)
+            {
+                rightbox.Grow(bins[i]);
+                rightbounds[i - 1] = rightbox;
+            }
+
+            Box4 leftbox;
+            float leftcount = 0.f;
+            float rightcount = totalweight;
+
+            for (int i = 0; i < m_num_bins - 1; ++i)
+            {
+                leftbox.Grow(bins[i]);
+                leftcount += counts[i];
+                rightcount -= counts[i];
+
+                float sahtmp = m_traversal_cost + (leftcount * leftbox.SurfaceArea() + rightcount * rightbounds[i].SurfaceArea()) * invarea;
+
+                if (sahtmp < sah)
+                {
+                    split.dim = axis;
+                    splitidx = i;
+                    sah = sahtmp;
+
+                    bbox left, right;
+                    leftbox.Store(left.pmin, left.pmax);
+                    rightbounds[i].Store(right.pmin, right.pmax);
+                    split.overlap = intersection(left, right).surface_area() * invarea;
+                }
+            }
+        }
+
+        if (splitidx != -1)
+        {
+            split.split = rootmin[split.dim] + (splitidx + 1) * (centroid_extents[split.dim] / m_num_bins);
+            split.sah = sah;
+        }
+
+        return split;
+    }
+
+    SplitBvh::SahSplit SplitBvh::FindSpatialSahSplitSimd(SplitRequest const& req, PrimRefArray const& refs) const
+    {
+        int const kNumBins = 128;
+        SahSplit split;
+        split.dim = 0;
+        split.split = std::numeric_limits<float>::quiet_NaN();
+        split.sah = std::numeric_limits<float>::max();
+
+        Vec3 extents = req.bounds.extents();
+        auto invarea = 1.f / req.bounds.surface_area();
+        float totalweight = GetRefWeight(req, refs);
+        if (!m_prim_weights.empty() && totalweight > 0.f)
+            invarea *= req.numprims / totalweight;
+
+        if (Vec3::Dot(extents, extents) == 0.f)
+        {
+            return split;
+        }
+
+        Box4 bins[3][kNumBins];
+        float enter[3][kNumBins] = {};
+        float exit[3][kNumBins] = {};
+
+        Vec3 origin = req.bounds.pmin;
+        Vec3 binsize = req.bounds.extents() * (1.f / kNumBins);
+        Vec3 invbinsize = Vec3(1.f / binsize.x, 1.f / binsize.y, 1.f / binsize.z);
+
+        Float4 origin4(origin);
+        Float4 invbinsize4(invbinsize);
+        Float4 lastbin4 = Float4::Splat(kNumBins - 1);
+
+        for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
+        {
+            PrimRef const& primref(refs[i]);
+            Box4 ref(&primref.bounds.pmin.x);
+            Float4 refmin = ref.pmin;
+            Float4 refmax = ref.pmax;
+            Float4 firstbin = Float4::Min(lastbin4, Float4::Max((refmin - origin4) * invbinsize4, Float4()));
+            Float4 lastbin = Float4::Min(lastbin4, Float4::Max((refmax - origin4) * invbinsize4, firstbin));
+            float weight = GetPrimitiveWeight(primref.idx);
+
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                if (extents[axis] == 0.f) continue;
+
+                int first = (int)firstbin[axis];
+                int last = (int)lastbin[axis];
+
+                // What is left of the ref after cutting off the pieces in the bins
+                // before, only its min corner moves
+                Float4 piecemin = refmin;
+                float piecestart = primref.bounds.pmin[axis];
+                float pieceend = primref.bounds.pmax[axis];
+
+                for (int j = first; j < last; ++j)
+                {
+                    float splitval = origin[axis] + binsize[axis] * (j + 1);
+                    if (splitval > piecestart && splitval < pieceend)
+                    {
+                        bins[axis][j].Grow(piecemin, refmax.Replace(axis, splitval));
+                        piecemin = piecemin.Replace(axis, splitval);
+                        piecestart = splitval;
+                    }
+                }
+
+                bins[axis][last].Grow(piecemin, refmax);
+                enter[axis][first] += weight;
+                exit[axis][last] += weight;
+            }
+        }
+
+        Box4 rightbounds[kNumBins - 1];
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (extents[axis] == 0.f)
+                continue;
+
+            Box4 rightbox;
+            for (int i = kNumBins - 1; i > 0; --i)
+            {
+                rightbox.Grow(bins[axis][i]);
+                rightbounds[i - 1] = rightbox;
+            }
+
+            Box4 leftbox;
+            float leftcount = 0.f;
+            float rightcount = totalweight;
+
+            for (int i = 1; i < kNumBins; ++i)
+            {
+                leftbox.Grow(bins[axis][i - 1]);
+                leftcount += enter[axis][i - 1];
+                rightcount -= exit[axis][i - 1];
+
+                float sah = m_traversal_cost + (leftbox.SurfaceArea() * leftcount +
+                    rightbounds[i - 1].SurfaceArea() * rightcount) * invarea;
+
+                if (sah < split.sah)
+                {
+                    split.sah = sah;
+                    split.dim = axis;
+                    split.split = origin[axis] + binsize[axis] * (float)i;
+                    split.overlap = 0.f;
+                }
+            }
+        }
+
+        return split;
+    }
+
     bool SplitBvh::SplitPrimRef(PrimRef const& ref, int axis, float split, PrimRef& leftref, PrimRef& rightref) const
     {
         // Start with left and right refs equal to original ref
@@ -487,9 +762,13 @@ namespace RadeonRays
             leftref.bounds.pmax[axis] = split;
             // Trim right box on the left
             rightref.bounds.pmin[axis] = split;
+            // Partitioning goes by center, so it has to follow the trimmed boxes
+            leftref.center = leftref.bounds.center();
+            rightref.center = rightref.bounds.center();
             return true;
         }
 
+        leftref.center = rightref.center = ref.center;
         return false;
     }
 
@@ -517,26 +796,78 @@ namespace RadeonRays
         extra_refs = appendprims - req.numprims;
     }
 
-    SplitBvh::Node* SplitBvh::AllocateNode()
+    SplitBvh::TaskStorage* SplitBvh::NewTaskStorage()
     {
-        if (m_nodecnt - m_num_nodes_archived >= m_num_nodes_for_regular)
-        {
-            m_node_archive.push_back(std::move(m_nodes));
-            m_num_nodes_archived += m_num_nodes_for_regular;
-            m_nodes = std::vector<Node>(m_num_nodes_for_regular);
-        }
+        std::lock_guard<std::mutex> lock(m_task_storage_mutex);
 
-        return &m_nodes[m_nodecnt++ - m_num_nodes_archived];
+        // Deque keeps references to existing storages valid
+        m_task_storage.emplace_back();
+        m_task_storage.back().id = (int)m_task_storage.size() - 1;
+        return &m_task_storage.back();
     }
 
-    void SplitBvh::InitNodeAllocator(size_t maxnum)
+    SplitBvh::Node* SplitBvh::AllocateTaskNode(TaskStorage& storage)
     {
-        m_node_archive.clear();
-        m_nodecnt = 0;
-        m_nodes.resize(maxnum);
+        m_nodecnt.fetch_add(1, std::memory_order_relaxed);
+        storage.nodes.emplace_back();
+        return &storage.nodes.back();
+    }
+
+    void SplitBvh::RelocateNodes()
+    {
+        m_nodes.resize(m_nodecnt);
+
+        size_t numindices = 0;
+        for (auto const& storage : m_task_storage)
+            numindices += storage.indices.size();
+        m_packed_indices.reserve(numindices);
+
+        // Storage and task node index of a source node, and the child index of
+        // its relocated parent to fill in
+        struct Pending
+        {
+            int storage;
+            int node;
+            int* parent;
+        };
+
+        std::vector<Pending> stack;
+        stack.push_back({ 0, 0, nullptr });
+        int nodeidx = 0;
+
+        while (!stack.empty())
+        {
+            Pending pending = stack.back();
+            stack.pop_back();
+
+            TaskStorage const& storage = m_task_storage[pending.storage];
+            Node const& src = storage.nodes[pending.node];
+            Node* node = &m_nodes[nodeidx];
+            *node = src;
+            if (pending.parent) *pending.parent = nodeidx;
+            nodeidx++;
+
+            if (src.type == kLeaf)
+            {
+                node->startidx = (int)m_packed_indices.size();
+                m_packed_indices.insert(m_packed_indices.end(), storage.indices.begin() + src.startidx, storage.indices.begin() + src.startidx + src.numprims);
+            }
+            else
+            {
+                // Push right first so the left subtree directly follows its parent
+                for (int* child : { &node->rc, &node->lc })
+                {
+                    int index = *child;
+                    if (index >= 0)
+                        stack.push_back({ pending.storage, index, child });
+                    else
+                        stack.push_back({ -index - 1, 0, child });
+                }
+            }
+        }
 
-        // Set root_ pointer
         m_root = &m_nodes[0];
+        m_task_storage.clear();
     }
 
     void SplitBvh::PrintStatistics(std::ostream& os) const
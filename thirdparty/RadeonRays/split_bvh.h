@@ -21,6 +21,8 @@
  ********************************************************************/
 #pragma once
 
+#include <deque>
+#include <mutex>
 #include "bvh.h"
 
 namespace RadeonRays
@@ -37,18 +39,40 @@ namespace RadeonRays
             , m_max_split_depth(max_split_depth)
             , m_min_overlap(min_overlap)
             , m_extra_refs_budget(extra_refs_budget)
-            , m_num_nodes_required(0)
             , m_num_nodes_for_regular(0)
-            , m_num_nodes_archived(0)
         {
         }
 
         ~SplitBvh() = default;
 
+        // Print BVH statistics
+        void PrintStatistics(std::ostream& os) const override;
+
     protected:
-        struct PrimRef;
+        struct PrimRef
+        {
+            // Prim bounds
+            bbox bounds;
+            Vec3 center;
+            int idx;
+        };
+
         using PrimRefArray = std::vector<PrimRef>;
 
+        // Storage owned by one build task. Every subtree spawned as a task
+        // gets its own prim refs (spatial splits append to the end of them),
+        // nodes and leaf indices, so tasks never grow a shared container.
+        // Children are indices into the same storage's nodes, or -id - 1 for
+        // the root of the task storage id, and leaves keep a local startidx.
+        // RelocateNodes() gathers everything once the build is done
+        struct TaskStorage
+        {
+            int id;
+            PrimRefArray primrefs;
+            std::deque<Node> nodes;
+            std::vector<int> indices;
+        };
+
         enum class SplitType
         {
             kObject,
@@ -57,48 +81,41 @@ namespace RadeonRays
 
         // Build function
         void BuildImpl(bbox const* bounds, int numbounds) override;
-        void BuildNode(SplitRequest& req, PrimRefArray& primrefs);
+        // refbudget is the number of extra refs spatial splits may still add in
+        // this subtree, it is shared among children in proportion to their size
+        // Returns the node's index in the storage's nodes
+        int BuildNode(SplitRequest& req, int refbudget, TaskStorage& storage);
 
+        // Sum of the primitive weights of the request's refs, its ref count without weights
+        float GetRefWeight(SplitRequest const& req, PrimRefArray const& refs) const;
         SahSplit FindObjectSahSplit(SplitRequest const& req, PrimRefArray const& refs) const;
         SahSplit FindSpatialSahSplit(SplitRequest const& req, PrimRefArray const& refs) const;
+        // Same splits with the bins kept in SSE registers, used by the kSse and kAvx SAH kernels
+        SahSplit FindObjectSahSplitSimd(SplitRequest const& req, PrimRefArray const& refs) const;
+        SahSplit FindSpatialSahSplitSimd(SplitRequest const& req, PrimRefArray const& refs) const;
 
         void SplitPrimRefs(SahSplit const& split, SplitRequest const& req, PrimRefArray& refs, int& extra_refs);
         bool SplitPrimRef(PrimRef const& ref, int axis, float split, PrimRef& leftref, PrimRef& rightref) const;
 
-        // Print BVH statistics
-        void PrintStatistics(std::ostream& os) const override;
-
-    protected:
-        Node* AllocateNode() override;
-        void  InitNodeAllocator(size_t maxnum) override;
+        TaskStorage* NewTaskStorage();
+        Node* AllocateTaskNode(TaskStorage& storage);
+        // Copy task nodes into m_nodes in preorder, starting from the first node
+        // of the first storage, and concatenate leaf indices
+        void RelocateNodes();
 
     private:
 
         int m_max_split_depth;
         float m_min_overlap;
         float m_extra_refs_budget;
-        int m_num_nodes_required;
         int m_num_nodes_for_regular;
 
-        // Node archive for memory management
-        // As m_nodes fills up we archive it into m_node_archive
-        // allocate new chunk and work there.
-
-        // How many nodes have been archived so far
-        int m_num_nodes_archived;
-        // Container for archived chunks
-        std::list<std::vector<Node>> m_node_archive;
+        // Per task storage, only alive during the build
+        std::deque<TaskStorage> m_task_storage;
+        std::mutex m_task_storage_mutex;
 
         SplitBvh(SplitBvh const&) = delete;
         SplitBvh& operator = (SplitBvh const&) = delete;
     };
 
-    struct SplitBvh::PrimRef
-    {
-        // Prim bounds
-        bbox bounds;
-        Vec3 center;
-        int idx;
-    };
-
 }
\ No newline at end of file